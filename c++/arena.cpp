@@ -0,0 +1,72 @@
+#include "arena.h"
+
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include <stdlib.h>
+
+namespace {
+std::mutex& pool_mutex() {
+	static std::mutex mutex;
+	return mutex;
+}
+std::vector<BlockArena*>& pool() {
+	static std::vector<BlockArena*> arenas;
+	return arenas;
+}
+}
+
+BlockArena::~BlockArena() {
+	for (const Chunk& c : chunks)
+		free(c.data);
+}
+
+void* BlockArena::allocate(size_t size) {
+	size = (size + BLOCK_ARENA_ALIGN - 1) & ~size_t(BLOCK_ARENA_ALIGN - 1);
+	for (; chunk < chunks.size(); chunk++, used = 0) {
+		if (chunks[chunk].size - used >= size) {
+			void* res = chunks[chunk].data + used;
+			used += size;
+			return res;
+		}
+	}
+
+	// Anything bigger than a chunk gets one of its own
+	Chunk c = { (char*)malloc(std::max(size, size_t(BLOCK_ARENA_CHUNK_SIZE))), std::max(size, size_t(BLOCK_ARENA_CHUNK_SIZE)) };
+	if (!c.data)
+		throw std::bad_alloc();
+	chunks.push_back(c);
+	chunk = chunks.size() - 1;
+	used = size;
+	return c.data;
+}
+
+void BlockArena::reset() {
+	size_t retained = 0, keep = 0;
+	for (; keep < chunks.size() && retained + chunks[keep].size <= BLOCK_ARENA_MAX_RETAINED; keep++)
+		retained += chunks[keep].size;
+	for (size_t i = keep; i < chunks.size(); i++)
+		free(chunks[i].data);
+	chunks.resize(keep);
+	chunk = 0;
+	used = 0;
+}
+
+BlockArena::Scope::Scope() {
+	std::lock_guard<std::mutex> lock(pool_mutex());
+	if (pool().empty())
+		arena = new BlockArena();
+	else {
+		arena = pool().back();
+		pool().pop_back();
+	}
+}
+
+BlockArena::Scope::~Scope() {
+	arena->reset();
+	std::lock_guard<std::mutex> lock(pool_mutex());
+	if (pool().size() < BLOCK_ARENA_POOL_SIZE)
+		pool().push_back(arena);
+	else
+		delete arena;
+}
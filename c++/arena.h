@@ -0,0 +1,71 @@
+#ifndef _RELAY_ARENA_H
+#define _RELAY_ARENA_H
+
+#include <vector>
+#include <memory>
+#include <stddef.h>
+
+/********************
+ **** BlockArena ****
+ ********************/
+// Scratch memory for the buffers which only live as long as one block is being parsed, compressed
+// or decompressed (merkle hash lists, hash batches, the compressed block before it is copied out).
+// Allocation is a pointer bump, nothing is freed until the whole arena is reset, and reset arenas
+// keep (up to BLOCK_ARENA_MAX_RETAINED of) their chunks, so a block in steady state mallocs nothing.
+//
+// Arenas are checked out of a process-wide pool by a Scope rather than being thread_local, as
+// decompression parks its fiber in read_all and may resume on another worker thread.
+#define BLOCK_ARENA_CHUNK_SIZE (1024 * 1024)
+#define BLOCK_ARENA_ALIGN 16
+#define BLOCK_ARENA_MAX_RETAINED (4 * 1024 * 1024)
+#define BLOCK_ARENA_POOL_SIZE 8
+
+class BlockArena {
+private:
+	struct Chunk {
+		char* data;
+		size_t size;
+	};
+	std::vector<Chunk> chunks;
+	size_t chunk, used; // The chunk being allocated from, and how much of it is used
+
+	BlockArena() : chunk(0), used(0) {}
+	~BlockArena();
+	BlockArena(const BlockArena&) = delete;
+
+	void* allocate(size_t size);
+	void reset();
+
+public:
+	// Holds an arena for its lifetime, and resets it and returns it to the pool on destruction.
+	// Scopes are independent, so they may be nested or overlap in any order.
+	class Scope {
+	private:
+		BlockArena* arena;
+	public:
+		Scope();
+		~Scope();
+		Scope(const Scope&) = delete;
+		void* allocate(size_t size) { return arena->allocate(size); }
+	};
+};
+
+// Allocates from a Scope (which frees everything at once when it ends) or, if it has none, the heap
+template<typename T> class ArenaAllocator {
+public:
+	typedef T value_type;
+	BlockArena::Scope* scope;
+
+	ArenaAllocator(BlockArena::Scope* scopeIn=NULL) : scope(scopeIn) {}
+	template<typename U> ArenaAllocator(const ArenaAllocator<U>& o) : scope(o.scope) {}
+
+	T* allocate(size_t n) { return scope ? (T*)scope->allocate(n * sizeof(T)) : std::allocator<T>().allocate(n); }
+	void deallocate(T* p, size_t n) { if (!scope) std::allocator<T>().deallocate(p, n); }
+
+	template<typename U> bool operator==(const ArenaAllocator<U>& o) const { return scope == o.scope; }
+	template<typename U> bool operator!=(const ArenaAllocator<U>& o) const { return scope != o.scope; }
+};
+
+template<typename T> using ArenaVector = std::vector<T, ArenaAllocator<T> >;
+
+#endif
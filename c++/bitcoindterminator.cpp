@@ -33,17 +33,21 @@ private:
 
 	const std::function<void (P2PConnection*, std::shared_ptr<std::vector<unsigned char> >&, struct timeval)> provide_block;
 	const std::function<void (P2PConnection*, std::shared_ptr<std::vector<unsigned char> >&)> provide_transaction;
+	// Called with the (PoW-checked) header of a block as soon as we've read it
+	const std::function<void (P2PConnection*, const std::vector<unsigned char>&, const unsigned char*)> provide_header;
 
 	std::mutex seen_mutex;
-	mruset<std::vector<unsigned char> > txnAlreadySeen;
-	mruset<std::vector<unsigned char> > blocksAlreadySeen;
+	hash_mruset<32> txnAlreadySeen;
+	hash_mruset<32> blocksAlreadySeen;
+	hash_mruset<32> headersAlreadySent;
 
 public:
 	P2PConnection(int sockIn, std::string hostIn,
 				const std::function<void (P2PConnection*, std::shared_ptr<std::vector<unsigned char> >&, struct timeval)>& provide_block_in,
-				const std::function<void (P2PConnection*, std::shared_ptr<std::vector<unsigned char> >&)>& provide_transaction_in)
+				const std::function<void (P2PConnection*, std::shared_ptr<std::vector<unsigned char> >&)>& provide_transaction_in,
+				const std::function<void (P2PConnection*, const std::vector<unsigned char>&, const unsigned char*)>& provide_header_in)
 			: Connection(sockIn, hostIn, NULL), connected(0), provide_block(provide_block_in), provide_transaction(provide_transaction_in),
-			txnAlreadySeen(2000), blocksAlreadySeen(1000)
+			provide_header(provide_header_in), txnAlreadySeen(2000), blocksAlreadySeen(1000), headersAlreadySent(1000)
 		{ construction_done(); }
 
 private:
@@ -64,6 +68,7 @@ private:
 				return disconnect("got message too large");
 
 			auto msg = std::make_shared<std::vector<unsigned char> > (sizeof(struct bitcoin_msg_header) + uint32_t(header.length));
+			const bool is_block = connected == 2 && !strncmp(header.command, "block", strlen("block"));
 			{
 				uint32_t hash[8];
 				double_sha256_init(hash);
@@ -74,6 +79,14 @@ private:
 					if (read_all((char*)writepos, 64) != 64)
 						return disconnect("failed to read message");
 					double_sha256_step(writepos, 64, hash);
+
+					if (is_block && i == 1) {
+						// We have the header, announce it before reading the rest
+						std::vector<unsigned char> blockhash(32);
+						getblockhash(blockhash, *msg, sizeof(struct bitcoin_msg_header));
+						if (check_header_pow(&(*msg)[sizeof(struct bitcoin_msg_header)], &blockhash[0]))
+							provide_header(this, blockhash, &(*msg)[sizeof(struct bitcoin_msg_header)]);
+					}
 				}
 
 				unsigned char* writepos = &((*msg)[sizeof(struct bitcoin_msg_header) + steps*64]);
@@ -146,11 +159,11 @@ private:
 
 						const uint32_t type = (*(it-(1+32)) << 24) | (*(it-(2+32)) << 16) | (*(it-(3+32)) << 8) | *(it-(4+32));
 						if (type == MSG_TX) {
-							if (!txnAlreadySeen.insert(hash).second)
+							if (!txnAlreadySeen.insert(hash))
 								continue;
 							setRequestTxn.insert(hash);
 						} else if (type == MSG_BLOCK) {
-							if (!blocksAlreadySeen.insert(hash).second)
+							if (!blocksAlreadySeen.insert(hash))
 								continue;
 							setRequestBlocks.insert(hash);
 						} else
@@ -220,13 +233,31 @@ public:
 		maybe_send_bytes(tx);
 	}
 
+	void receive_header(const std::vector<unsigned char>& hash, const unsigned char* header) {
+		if (connected != 2)
+			return;
+
+		{
+			std::lock_guard<std::mutex> lock(seen_mutex);
+			if (blocksAlreadySeen.count(hash) || !headersAlreadySent.insert(hash))
+				return;
+		}
+		// A headers message of one header (with its 0 tx count)
+		std::vector<unsigned char> msg(sizeof(struct bitcoin_msg_header) + 1);
+		msg.back() = 1;
+		msg.insert(msg.end(), header, header + 80);
+		msg.push_back(0);
+		prepare_message("headers", &msg[0], msg.size() - sizeof(struct bitcoin_msg_header));
+		do_send_bytes((char*)&msg[0], msg.size());
+	}
+
 	void receive_block(const std::vector<unsigned char> hash, const std::shared_ptr<std::vector<unsigned char> >& block) {
 		if (connected != 2)
 			return;
 
 		{
 			std::lock_guard<std::mutex> lock(seen_mutex);
-			if (!blocksAlreadySeen.insert(hash).second)
+			if (!blocksAlreadySeen.insert(hash))
 				return;
 		}
 		do_send_bytes(block);
@@ -330,6 +361,20 @@ int main(int argc, char** argv) {
 			}
 		};
 
+	std::function<void (P2PConnection*, const std::vector<unsigned char>&, const unsigned char*)> relayHeader =
+		[&](P2PConnection* from, const std::vector<unsigned char>& fullhash, const unsigned char* header) {
+			std::lock_guard<std::mutex> lock(list_mutex);
+			std::set<P2PConnection*> *set;
+			if (localSet.count(from))
+				set = &blockSet;
+			else
+				set = &localSet;
+			for (auto it = set->begin(); it != set->end(); it++) {
+				if (!(*it)->getDisconnectFlags())
+					(*it)->receive_header(fullhash, header);
+			}
+		};
+
 	printf("Awaiting connections\n");
 
 	while (true) {
@@ -358,7 +403,7 @@ int main(int argc, char** argv) {
 				close(new_fd);
 			else {
 				std::lock_guard<std::mutex> lock(list_mutex);
-				P2PConnection *relay = new P2PConnection(new_fd, host, relayBlock, relayTx);
+				P2PConnection *relay = new P2PConnection(new_fd, host, relayBlock, relayTx, relayHeader);
 				if (!host.compare(0, localhost.size(), localhost))
 					localSet.insert(relay);
 				else
@@ -376,7 +421,7 @@ int main(int argc, char** argv) {
 				close(new_fd);
 			else {
 				std::lock_guard<std::mutex> lock(list_mutex);
-				P2PConnection *relay = new P2PConnection(new_fd, host, relayBlock, relayTx);
+				P2PConnection *relay = new P2PConnection(new_fd, host, relayBlock, relayTx, relayHeader);
 				if (!host.compare(0, localhost.size(), localhost))
 					localSet.insert(relay);
 				else {
@@ -1,7 +1,9 @@
 #include <map>
+#include <list>
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <algorithm>
 
 #include <assert.h>
 #include <string.h>
@@ -39,23 +41,43 @@ class RelayNetworkClient : public KeepaliveOutboundPersistentConnection {
 private:
 	RELAY_DECLARE_CLASS_VARS
 
-	const std::function<void (std::vector<unsigned char>&)> provide_block;
+	const std::function<void (std::vector<unsigned char>& block, const std::vector<unsigned char>& hash)> provide_block;
+	const std::function<void (const unsigned char* header)> provide_header; // PoW-checked, ahead of its block
 	const std::function<void (std::shared_ptr<std::vector<unsigned char> >&)> provide_transaction;
 	const std::function<bool ()> bitcoind_connected;
 
 	std::atomic_bool connected;
+	// Set RELAY_CUT_THROUGH to get blocks forwarded by the server before it has all of them, or
+	// RELAY_COMPACT to get them in the (smaller) compact encoding
+	const char* const version_string;
+	// Whether we keep our recv cache across reconnects and ask the server to resync it (cleared if
+	// the server doesn't know how)
+	bool try_resync;
+	// Set by switch_to(), as our recv cache is of the old server's txn
+	std::atomic_bool drop_cache;
 
 	RelayNodeCompressor compressor;
 
 public:
-	RelayNetworkClient(const char* serverHostIn,
-						const std::function<void (std::vector<unsigned char>&)>& provide_block_in,
+	RelayNetworkClient(const std::string& serverHostIn,
+						const std::function<void (std::vector<unsigned char>&, const std::vector<unsigned char>&)>& provide_block_in,
+						const std::function<void (const unsigned char*)>& provide_header_in,
 						const std::function<void (std::shared_ptr<std::vector<unsigned char> >&)>& provide_transaction_in,
 						const std::function<bool ()>& bitcoind_connected_in)
 		// Ping time(out) is 40 seconds (5000000/250*2 msec) - first ping will only happen, at the quickest, at half that
 			: KeepaliveOutboundPersistentConnection(serverHostIn, 8336, MAX_FAS_TOTAL_SIZE / OUTBOUND_THROTTLE_BYTES_PER_MS * 2), RELAY_DECLARE_CONSTRUCTOR_EXTENDS,
-			provide_block(provide_block_in), provide_transaction(provide_transaction_in), bitcoind_connected(bitcoind_connected_in), connected(false), compressor(false) {
-		construction_done();
+			provide_block(provide_block_in), provide_header(provide_header_in), provide_transaction(provide_transaction_in), bitcoind_connected(bitcoind_connected_in), connected(false),
+			version_string(getenv("RELAY_CUT_THROUGH") ? CUT_THROUGH_VERSION_STRING : (getenv("RELAY_COMPACT") ? COMPACT_VERSION_STRING : VERSION_STRING)),
+			try_resync(true), drop_cache(false), compressor(false, version_string == std::string(COMPACT_VERSION_STRING)) {}
+
+	// Call start_snapshots() with compressor() before this, so that our first resync is of what we
+	// had before a restart
+	void start() { construction_done(); }
+	RelayNodeCompressor& get_compressor() { return compressor; }
+
+	void switch_to(const std::string& host) {
+		drop_cache = true;
+		switch_server(host);
 	}
 
 private:
@@ -64,11 +86,28 @@ private:
 	}
 
 	void net_process(const std::function<void(std::string)>& disconnect) {
-		compressor.reset();
+		const bool resync = try_resync && !drop_cache.exchange(false);
+		compressor.reset(resync);
 
-		relay_msg_header version_header = { RELAY_MAGIC_BYTES, VERSION_TYPE, htonl(strlen(VERSION_STRING)) };
+		std::string version(version_string);
+		if (resync)
+			version += RESYNC_VERSION_SUFFIX;
+		relay_msg_header version_header = { RELAY_MAGIC_BYTES, VERSION_TYPE, htonl(version.length()) };
 		maybe_do_send_bytes((char*)&version_header, sizeof(version_header));
-		maybe_do_send_bytes(VERSION_STRING, strlen(VERSION_STRING));
+		maybe_do_send_bytes(version.c_str(), version.length());
+
+		// Until the server replies, our recv cache is as summarized
+		bool awaiting_resync = resync;
+		size_t resync_count = 0;
+		if (resync) {
+			std::vector<unsigned char> summary;
+			compressor.get_resync_summary(summary);
+			resync_count = summary.size() / 8;
+			relay_msg_header resync_header = { RELAY_MAGIC_BYTES, RESYNC_TYPE, htonl(summary.size()) };
+			maybe_do_send_bytes((char*)&resync_header, sizeof(resync_header));
+			if (summary.size())
+				maybe_do_send_bytes((char*)&summary[0], summary.size());
+		}
 
 		connected = true;
 
@@ -86,42 +125,84 @@ private:
 				return disconnect("got message too large");
 
 			if (header.type == VERSION_TYPE) {
-				char data[message_size];
-				if (read_all(data, message_size) < (int64_t)(message_size))
+				std::vector<char> data(message_size);
+				if (read_all(data.data(), message_size) < (int64_t)(message_size))
 					return disconnect("failed to read version message");
 
-				if (strncmp(VERSION_STRING, data, std::min(sizeof(VERSION_STRING), size_t(message_size))))
+				if (strncmp(version.c_str(), data.data(), std::min(version.length() + 1, size_t(message_size))))
 					return disconnect("unknown version string");
 				else {
 					STAMPOUT();
-					printf("Connected to relay node with protocol version %s\n", VERSION_STRING);
+					printf("Connected to relay node %s with protocol version %s\n", serverHost.c_str(), version_string);
 				}
 			} else if (header.type == SPONSOR_TYPE) {
-				char data[message_size];
-				if (read_all(data, message_size) < (int64_t)(message_size))
+				std::vector<char> data(message_size);
+				if (read_all(data.data(), message_size) < (int64_t)(message_size))
 					return disconnect("failed to read sponsor string");
 
-				printf("This node sponsored by: %s\n", asciifyString(std::string(data, data + message_size)).c_str());
+				printf("This node sponsored by: %s\n", asciifyString(std::string(data.begin(), data.end())).c_str());
 			} else if (header.type == MAX_VERSION_TYPE) {
-				char data[message_size];
-				if (read_all(data, message_size) < (int64_t)(message_size))
+				std::vector<char> data(message_size);
+				if (read_all(data.data(), message_size) < (int64_t)(message_size))
 					return disconnect("failed to read max_version string");
 
-				if (strncmp(VERSION_STRING, data, std::min(sizeof(VERSION_STRING), size_t(message_size))))
+				if (awaiting_resync) {
+					// Servers which don't know about resync send this before dropping us
+					try_resync = false;
+					compressor.reset();
+					return disconnect("server does not support resync");
+				}
+				if (strncmp(VERSION_STRING, data.data(), std::min(sizeof(VERSION_STRING), size_t(message_size))))
 					printf("Relay network is using a later version (PLEASE UPGRADE)\n");
 				else
 					return disconnect("got MAX_VERSION of same version as us");
+			} else if (header.type == RESYNC_TYPE) {
+				if (!awaiting_resync)
+					return disconnect("got unexpected resync reply");
+				std::vector<unsigned char> reply(message_size);
+				if (message_size && read_all((char*)&reply[0], message_size) < (int64_t)(message_size))
+					return disconnect("failed to read resync reply");
+
+				const char* err = compressor.apply_resync(reply, resync_count);
+				if (err) {
+					compressor.reset();
+					return disconnect(err);
+				}
+				awaiting_resync = false;
+				unsigned long kept = 0;
+				for (size_t i = 32; i < reply.size(); i++)
+					kept += __builtin_popcount(reply[i]);
+				STAMPOUT();
+				printf("Resynced with relay node, kept %lu of %lu txn\n", kept, (unsigned long)resync_count);
+			} else if (awaiting_resync && (header.type == BLOCK_TYPE || header.type == TRANSACTION_TYPE)) {
+				// These would change our recv cache before the resync is applied
+				compressor.reset();
+				return disconnect("got message before resync reply");
 			} else if (header.type == BLOCK_TYPE) {
 				std::function<ssize_t(char*, size_t)> do_read = [&](char* buf, size_t count) { return this->read_all(buf, count); };
-				auto res = compressor.decompress_relay_block(do_read, message_size, false);
-				if (std::get<2>(res))
+				BlockProgressCallback on_progress = [&](const std::vector<unsigned char>& block, size_t start, size_t len) {
+					// A cut-through server may still abort the block after its header, leaving bitcoind
+					// waiting on a block that never comes, so only announce early for whole blocks
+					if (start != sizeof(struct bitcoin_msg_header) || version_string == std::string(CUT_THROUGH_VERSION_STRING))
+						return;
+					unsigned char hash[32];
+					double_sha256(&block[start], hash, 80);
+					if (check_header_pow(&block[start], hash))
+						provide_header(&block[start]);
+				};
+				auto res = compressor.decompress_relay_block(do_read, message_size, false, on_progress);
+				if (std::get<2>(res) == BLOCK_ABORTED) {
+					STAMPOUT();
+					printf("Relay node aborted an invalid block\n");
+					continue;
+				} else if (std::get<2>(res))
 					return disconnect(std::get<2>(res));
 
-				provide_block(*std::get<1>(res));
-
 				auto fullhash = *std::get<3>(res).get();
+				provide_block(*std::get<1>(res), fullhash);
+
 				STAMPOUT();
-				printf(HASH_FORMAT" recv'd, size %lu with %u bytes on the wire\n", HASH_PRINT(&fullhash[0]), (unsigned long)std::get<1>(res)->size() - sizeof(bitcoin_msg_header), std::get<0>(res));
+				printf(HASH_FORMAT" recv'd from %s, size %lu with %u bytes on the wire\n", HASH_PRINT(&fullhash[0]), serverHost.c_str(), (unsigned long)std::get<1>(res)->size() - sizeof(bitcoin_msg_header), std::get<0>(res));
 			} else if (header.type == END_BLOCK_TYPE) {
 			} else if (header.type == TRANSACTION_TYPE) {
 				if (!compressor.maybe_recv_tx_of_size(message_size, true))
@@ -145,7 +226,7 @@ private:
 
 				relay_msg_header pong_msg_header = { RELAY_MAGIC_BYTES, PONG_TYPE, htonl(8) };
 				memcpy(data, &pong_msg_header, sizeof(pong_msg_header));
-				maybe_do_send_bytes(data, 8 + sizeof(relay_msg_header));
+				maybe_do_send_bytes(data, 8 + sizeof(relay_msg_header), 0, OUTBOUND_PING);
 			} else if (header.type == PONG_TYPE) {
 				uint64_t nonce;
 				if (message_size != 8 || read_all((char*)&nonce, 8) < 8)
@@ -163,7 +244,7 @@ protected:
 		std::vector<unsigned char> *msg = new std::vector<unsigned char>((unsigned char*)&pong_msg_header, ((unsigned char*)&pong_msg_header) + sizeof(pong_msg_header));
 		msg->resize(msg->size() + 8);
 		memcpy(&(*msg)[sizeof(pong_msg_header)], &nonce, 8);
-		maybe_do_send_bytes(std::shared_ptr<std::vector<unsigned char> >(msg));
+		maybe_do_send_bytes(std::shared_ptr<std::vector<unsigned char> >(msg), 0, OUTBOUND_PING);
 	}
 
 public:
@@ -232,8 +313,8 @@ private:
 #define CONNECT_TESTS 20
 std::chrono::milliseconds connect_durations[HOSTNAMES_TO_TEST];
 void test_node(int node) {
-	const char* relay = "public.%02d.relay.mattcorallo.com";
-	char host[strlen(relay)];
+	const char relay[] = "public.%02d.relay.mattcorallo.com";
+	char host[sizeof(relay)];
 	sprintf(host, relay, node);
 	sockaddr_in6 addr;
 	if (!lookup_address(host, &addr) ||
@@ -260,12 +341,113 @@ void test_node(int node) {
 
 
 
+/**************************************
+ **** Ranking of our relay servers ****
+ **************************************/
+// We keep connections to (up to) UPSTREAM_SERVERS relay servers and take each block from whichever
+// gets it to us first. Each server is ranked by how far behind the first copy its copies of blocks
+// arrive (a moving average, with blocks it didn't deliver within MISSED_BLOCK_SECS counting as that
+// late), and every RERANK_INTERVAL_SECS the worst one, if it is lagging by more than
+// RERANK_MIN_LAG_MS, is swapped for the best spare server (which it then goes behind).
+#define UPSTREAM_SERVERS 3
+#define RERANK_INTERVAL_SECS 10
+#define MISSED_BLOCK_SECS 30
+#define RERANK_MIN_BLOCKS 6 // Before we judge a server
+#define RERANK_MIN_LAG_MS 50
+
+class UpstreamSet {
+private:
+	struct Upstream {
+		RelayNetworkClient* client;
+		std::string host;
+		double lag_ms; // Moving average
+		uint32_t blocks;
+	};
+	struct Arrival {
+		std::chrono::steady_clock::time_point first;
+		uint32_t delivered; // Bitmask of upstreams which have delivered the block
+	};
+
+	std::mutex mutex;
+	std::vector<Upstream> upstreams;
+	std::list<std::string> spares; // Best first
+	std::map<std::vector<unsigned char>, Arrival> arrivals;
+
+	void record_lag(Upstream& upstream, double lag_ms) {
+		upstream.lag_ms = upstream.blocks ? (upstream.lag_ms * 3 + lag_ms) / 4 : lag_ms;
+		upstream.blocks++;
+	}
+
+public:
+	UpstreamSet(const std::vector<std::string>& hosts) {
+		for (size_t i = 0; i < hosts.size(); i++) {
+			if (i < UPSTREAM_SERVERS)
+				upstreams.push_back({NULL, hosts[i], 0, 0});
+			else
+				spares.push_back(hosts[i]);
+		}
+	}
+
+	size_t size() const { return upstreams.size(); }
+	const std::string& host(size_t upstream) const { return upstreams[upstream].host; }
+	void set_client(size_t upstream, RelayNetworkClient* client) { upstreams[upstream].client = client; }
+
+	// Returns whether this is the first copy of the block we've seen
+	bool block_arrived(size_t upstream, const std::vector<unsigned char>& hash) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto now = std::chrono::steady_clock::now();
+		auto res = arrivals.insert(std::make_pair(hash, Arrival{now, 0}));
+		Arrival& arrival = res.first->second;
+		if (!(arrival.delivered & (1 << upstream)))
+			record_lag(upstreams[upstream], to_millis_double(now - arrival.first));
+		arrival.delivered |= 1 << upstream;
+		return res.second;
+	}
+
+	void rerank() {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto now = std::chrono::steady_clock::now();
+		for (auto it = arrivals.begin(); it != arrivals.end(); ) {
+			if (now - it->second.first < std::chrono::seconds(MISSED_BLOCK_SECS)) {
+				it++;
+				continue;
+			}
+			for (size_t i = 0; i < upstreams.size(); i++)
+				if (!(it->second.delivered & (1 << i)))
+					record_lag(upstreams[i], MISSED_BLOCK_SECS * 1000);
+			it = arrivals.erase(it);
+		}
+
+		size_t worst = 0;
+		for (size_t i = 1; i < upstreams.size(); i++)
+			if (upstreams[i].blocks >= RERANK_MIN_BLOCKS && (upstreams[worst].blocks < RERANK_MIN_BLOCKS || upstreams[i].lag_ms > upstreams[worst].lag_ms))
+				worst = i;
+		Upstream& upstream = upstreams[worst];
+		if (spares.empty() || upstream.blocks < RERANK_MIN_BLOCKS || upstream.lag_ms <= RERANK_MIN_LAG_MS)
+			return;
+
+		STAMPOUT();
+		printf("Relay server %s has been %.1f ms behind, switching to %s\n", upstream.host.c_str(), upstream.lag_ms, spares.front().c_str());
+		spares.push_back(upstream.host);
+		upstream.host = spares.front();
+		spares.pop_front();
+		upstream.lag_ms = 0;
+		upstream.blocks = 0;
+		for (auto& it : arrivals)
+			it.second.delivered |= 1 << worst; // Don't count blocks from before the switch as missed
+		upstream.client->switch_to(upstream.host);
+	}
+};
+
+
+
 int main(int argc, char** argv) {
 	bool validPort = false;
 	try { std::stoul(argv[2]); validPort = true; } catch (std::exception& e) {}
-	if ((argc != 3 && argc != 4) || !validPort) {
-		printf("USAGE: %s BITCOIND_ADDRESS BITCOIND_PORT [ server ]\n", argv[0]);
-		printf("Relay server is automatically selected by pinging available servers, unless one is specified\n");
+	if (argc < 3 || !validPort) {
+		printf("USAGE: %s BITCOIND_ADDRESS BITCOIND_PORT [ server ]*\n", argv[0]);
+		printf("Relay servers are automatically selected by pinging available servers, unless some are specified\n");
+		printf("Blocks are taken from whichever of the best %d arrives first\n", UPSTREAM_SERVERS);
 		return -1;
 	}
 
@@ -275,8 +457,9 @@ int main(int argc, char** argv) {
 		return -1;
 #endif
 
-	const char* relay = "public.%02d.relay.mattcorallo.com";
-	char host[std::max(argc == 3 ? 0 : strlen(argv[3]), strlen(relay))];
+	const char relay[] = "public.%02d.relay.mattcorallo.com";
+	char host[sizeof(relay)];
+	std::vector<std::string> hosts; // Best first
 	if (argc == 3) {
 		while (true) {
 			std::list<std::thread> threads;
@@ -287,46 +470,76 @@ int main(int argc, char** argv) {
 				threads.pop_front();
 			}
 
-			int min = -1; std::chrono::milliseconds min_duration(std::chrono::milliseconds::max());
+			std::vector<int> responded;
 			for (int i = 0; i < HOSTNAMES_TO_TEST; i++) {
 				if (connect_durations[i] != std::chrono::milliseconds::max()) {
 					std::string aka;
 					sprintf(host, relay, i);
 					printf("Server %d (%s) took %lld ms to respond %d times.\n", i, lookup_cname(host, aka) ? aka.c_str() : "", (long long int)connect_durations[i].count(), CONNECT_TESTS);
-				}
-				if (connect_durations[i] < min_duration) {
-					min_duration = connect_durations[i];
-					min = i;
+					responded.push_back(i);
 				}
 			}
+			std::stable_sort(responded.begin(), responded.end(), [](int a, int b) { return connect_durations[a] < connect_durations[b]; });
 
-			std::this_thread::sleep_for(std::chrono::seconds(10)); // Wait for server to open up our slot again
-			if (min == -1) {
+			std::this_thread::sleep_for(std::chrono::seconds(10)); // Wait for servers to open up our slot again
+			if (responded.empty()) {
 				printf("No servers responded\n");
 				continue;
 			}
 
-			sprintf(host, relay, min);
+			for (int i : responded) {
+				sprintf(host, relay, i);
+				hosts.push_back(host);
+			}
 			break;
 		}
 	} else
-		memcpy(host, argv[3], strlen(argv[3]) + 1);
-	STAMPOUT();
-	printf("Using server %s\n", host);
+		hosts.assign(argv + 3, argv + argc);
 
-	RelayNetworkClient* relayClient;
-	P2PClient p2p(argv[1], std::stoul(argv[2]),
-					[&](std::vector<unsigned char>& bytes, const std::chrono::system_clock::time_point&) { relayClient->receive_block(bytes); },
+	UpstreamSet upstreams(hosts);
+	for (size_t i = 0; i < upstreams.size(); i++) {
+		STAMPOUT();
+		printf("Using server %s\n", upstreams.host(i).c_str());
+	}
+
+	// The relay clients only call into p2p once they're started, after it exists
+	std::vector<RelayNetworkClient*> relayClients;
+	P2PClient* p2p;
+	for (size_t i = 0; i < upstreams.size(); i++) {
+		relayClients.push_back(new RelayNetworkClient(upstreams.host(i),
+										[&, i](std::vector<unsigned char>& bytes, const std::vector<unsigned char>& hash) {
+											// The others' copies still had to be decompressed, to keep their caches in sync
+											if (upstreams.block_arrived(i, hash))
+												p2p->receive_block(bytes);
+										},
+										[&](const unsigned char* header) { p2p->receive_header(header); },
+										[&](std::shared_ptr<std::vector<unsigned char> >& bytes) {
+											p2p->receive_transaction(bytes);
+											for (RelayNetworkClient* relayClient : relayClients)
+												relayClient->receive_transaction(bytes, false);
+										},
+										[&]() { return p2p->is_connected(); }));
+		upstreams.set_client(i, relayClients.back());
+	}
+	p2p = new P2PClient(argv[1], std::stoul(argv[2]),
+					[&](std::vector<unsigned char>& bytes, const std::chrono::system_clock::time_point&) {
+						for (RelayNetworkClient* relayClient : relayClients)
+							relayClient->receive_block(bytes);
+					},
 					[&](std::shared_ptr<std::vector<unsigned char> >& bytes) {
 						//TODO: Re-enable (see issue #11): relayClient->receive_transaction(bytes, true);
 					});
-	relayClient = new RelayNetworkClient(host,
-										[&](std::vector<unsigned char>& bytes) { p2p.receive_block(bytes); },
-										[&](std::shared_ptr<std::vector<unsigned char> >& bytes) {
-											p2p.receive_transaction(bytes);
-											relayClient->receive_transaction(bytes, false);
-										},
-										[&]() { return p2p.is_connected(); });
 
-	while (true) { sleep(1000); }
+	std::vector<RelayNodeCompressor*> compressors;
+	for (RelayNetworkClient* relayClient : relayClients)
+		compressors.push_back(&relayClient->get_compressor());
+	// Before we connect, so that our first resyncs are of what we had before a restart
+	start_snapshots(compressors);
+	for (RelayNetworkClient* relayClient : relayClients)
+		relayClient->start();
+
+	while (true) {
+		std::this_thread::sleep_for(std::chrono::seconds(RERANK_INTERVAL_SECS));
+		upstreams.rerank();
+	}
 }
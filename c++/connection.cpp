@@ -11,36 +11,427 @@
 	#include <netinet/tcp.h>
 	#include <netdb.h>
 	#include <fcntl.h>
+	#include <sys/uio.h>
 #endif // !WIN32
 
+#if defined(__linux__)
+	#include <sys/epoll.h>
+	#define USE_EPOLL
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+	#include <sys/event.h>
+	#define USE_KQUEUE
+#endif
+
+#if defined(USE_EPOLL) || defined(USE_KQUEUE)
+	// epoll/kqueue only tell us about state changes, select (used by the win32 client) gets rescanned
+	#define USE_EVENT_ENGINE
+	#define EDGE_TRIGGERED true
+#else
+	#define EDGE_TRIGGERED false
+#endif
+
+#if defined(__linux__)
+	// Other platforms keep a thread per connection, see FiberPool
+	#include <ucontext.h>
+	#include <sys/mman.h>
+	#define USE_FIBERS
+#endif
+
 #include <unordered_map>
 #include <map>
+#include <deque>
 #include <set>
+#include <stdlib.h>
+#include <algorithm>
+#include <iterator>
 
 #include "connection.h"
 
 #include "utils.h"
+#include "stats.h"
+
+#define OUTBOUND_MAX_IOVS 64
+
+// Bytes per ms each OutboundClass may be written at, 0 for no limit
+static const size_t outbound_class_rate[OUTBOUND_CLASSES] = { 0, 0, 0, 0, OUTBOUND_THROTTLE_BYTES_PER_MS };
 
+static StatHistogram block_write_stat("relay_block_write_seconds", "Time from a block being queued for a peer until its last byte was written");
+
+#ifdef WIN32
+struct iovec {
+	void* iov_base;
+	size_t iov_len;
+};
+#endif
+
+static ssize_t send_iov(int sock, struct iovec* iov, int iovcnt) {
+#ifdef WIN32
+	ssize_t total = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		ssize_t count = send(sock, (char*)iov[i].iov_base, iov[i].iov_len, MSG_NOSIGNAL);
+		if (count <= 0)
+			return total ? total : count;
+		total += count;
+		if (size_t(count) < iov[i].iov_len)
+			break;
+	}
+	return total;
+#else
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	return sendmsg(sock, &msg, MSG_NOSIGNAL);
+#endif
+}
+
+enum IOResult {
+	IO_WOULDBLOCK, // Hit EAGAIN, the backend will tell us when to continue
+	IO_PAUSED, // Stopped for our own reasons (buffers full/empty, throttled), interest needs re-arming
+	IO_FAILED,
+};
+
+// One event loop thread, owning a shard of the connections (and their keepalive timers)
 class GlobalNetProcess {
 public:
 	std::mutex fd_map_mutex;
 	std::unordered_map<int, Connection*> fd_map;
 	std::map<uint64_t, std::function<void (void)> > actions_map;
 #ifndef WIN32
-	int pipe_write;
+	int pipe_read, pipe_write;
+#endif
+#ifdef USE_EVENT_ENGINE
+	int poll_fd;
+	// Connections waiting out a class' rate limit before we ask for writability again
+	// Only touched by the net thread
+	std::map<Connection*, std::chrono::steady_clock::time_point> throttled;
+#endif
+
+	void wakeup() {
+#ifndef WIN32
+		// If the pipe is full the net thread is already going to wake up
+		if (write(pipe_write, "1", 1) != 1) {}
+#endif
+	}
+
+	// Backend registration, all called with conn->interest_mutex held, interest is a mask of InterestFlags
+	void add_fd(Connection* conn, int interest) {
+#if defined(USE_EPOLL)
+		struct epoll_event ev;
+		ev.events = EPOLLET | ((interest & INTEREST_READ) ? EPOLLIN | EPOLLRDHUP : 0) | ((interest & INTEREST_WRITE) ? EPOLLOUT : 0);
+		ev.data.ptr = conn;
+		ALWAYS_ASSERT(!epoll_ctl(poll_fd, EPOLL_CTL_ADD, conn->sock, &ev));
+#elif defined(USE_KQUEUE)
+		struct kevent ev[2];
+		EV_SET(&ev[0], conn->sock, EVFILT_READ, EV_ADD | ((interest & INTEREST_READ) ? EV_ENABLE : EV_DISABLE), 0, 0, conn);
+		EV_SET(&ev[1], conn->sock, EVFILT_WRITE, EV_ADD | ((interest & INTEREST_WRITE) ? EV_ENABLE : EV_DISABLE), 0, 0, conn);
+		ALWAYS_ASSERT(!kevent(poll_fd, ev, 2, NULL, 0, NULL));
+#else
+		wakeup();
 #endif
+	}
 
+	void set_interest(Connection* conn, int interest) {
+#if defined(USE_EPOLL)
+		// Re-arming with EPOLL_CTL_MOD generates an event if the fd is already ready, so we cannot miss an edge
+		struct epoll_event ev;
+		ev.events = EPOLLET | ((interest & INTEREST_READ) ? EPOLLIN | EPOLLRDHUP : 0) | ((interest & INTEREST_WRITE) ? EPOLLOUT : 0);
+		ev.data.ptr = conn;
+		ALWAYS_ASSERT(!epoll_ctl(poll_fd, EPOLL_CTL_MOD, conn->sock, &ev));
+#elif defined(USE_KQUEUE)
+		struct kevent ev[2];
+		EV_SET(&ev[0], conn->sock, EVFILT_READ, (interest & INTEREST_READ) ? EV_ENABLE : EV_DISABLE, 0, 0, conn);
+		EV_SET(&ev[1], conn->sock, EVFILT_WRITE, (interest & INTEREST_WRITE) ? EV_ENABLE : EV_DISABLE, 0, 0, conn);
+		ALWAYS_ASSERT(!kevent(poll_fd, ev, 2, NULL, 0, NULL));
+#else
+		wakeup();
+#endif
+	}
+
+	void remove_fd(Connection* conn) {
+#if defined(USE_EPOLL)
+		struct epoll_event ev;
+		epoll_ctl(poll_fd, EPOLL_CTL_DEL, conn->sock, &ev);
+#elif defined(USE_KQUEUE)
+		struct kevent ev[2];
+		EV_SET(&ev[0], conn->sock, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+		EV_SET(&ev[1], conn->sock, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+		kevent(poll_fd, ev, 2, NULL, 0, NULL);
+#endif
+	}
+
+	// Reads everything available (until the inbound ring is full) straight into the ring
+	IOResult do_read(Connection* conn) {
+		unsigned char discard_buf[4096];
+		do {
+			if (!conn->wants_read())
+				return IO_PAUSED;
+
+			// Once the user thread stops reading we just drain the socket until EOF
+			bool discard = conn->disconnectFlags & DISCONNECT_READS_DONE;
+			size_t start = conn->inbound_writepos;
+			size_t len = discard ? sizeof(discard_buf) : std::min(INBOUND_RING_SIZE - size_t(conn->total_inbound_size), INBOUND_RING_SIZE - start);
+
+			ssize_t count = recv(conn->sock, discard ? (char*)discard_buf : (char*)&conn->inbound_ring[start], len, 0);
+			int recv_errno = errno;
+			if (EDGE_TRIGGERED && count < 0 && (recv_errno == EAGAIN || recv_errno == EWOULDBLOCK))
+				return IO_WOULDBLOCK;
+
+			if (count <= 0) {
+				std::lock_guard<std::mutex> lock(conn->read_mutex);
+				conn->sock_errno = recv_errno;
+				return IO_FAILED;
+			} else if (!discard) {
+				conn->inbound_writepos = (start + count) % INBOUND_RING_SIZE;
+				conn->total_inbound_size += count;
+				std::lock_guard<std::mutex> lock(conn->read_mutex);
+				conn->wake_reader();
+			}
+		} while (EDGE_TRIGGERED);
+		return IO_PAUSED;
+	}
+
+	// Writes until the socket buffer is full (or we are throttled/out of data)
+	IOResult do_write(Connection* conn) {
+		do {
+			if (!conn->wants_write())
+				return IO_PAUSED;
+
+			bool got_send_mutex = conn->send_mutex.try_lock();
+			std::lock_guard<std::mutex> lock(conn->send_bytes_mutex);
+			auto now = std::chrono::steady_clock::now();
+
+			// Gather the rest of a partly-written message (which must go out before anything else),
+			// then whole messages from each class in priority order, into one send. Nothing may be
+			// written in the middle of a message, so we stop at one whose next buffer isn't queued yet.
+			// A block waiting on an ordered message stops its class, and the ordered messages after
+			// that one (see OUTBOUND_ORDERED).
+			struct iovec iov[OUTBOUND_MAX_IOVS];
+			int iov_class[OUTBOUND_MAX_IOVS];
+			int iovcnt = 0;
+			size_t gathered[OUTBOUND_CLASSES] = {};
+			bool stop = false;
+			uint64_t block_waiting_on = 0;
+			auto gather = [&](int cls, bool one_message) {
+				const std::deque<OutboundBuffer>& queue = conn->outbound_queues[cls];
+				size_t bytes = 0, budget = outbound_class_rate[cls] ? outbound_class_rate[cls] * 100 : SIZE_MAX;
+				while (gathered[cls] < queue.size()) {
+					if (iovcnt == OUTBOUND_MAX_IOVS) {
+						stop = true;
+						return;
+					}
+					const OutboundBuffer& buf = queue[gathered[cls]];
+					if (!one_message && cls == OUTBOUND_BLOCK && buf.ordered_index > conn->ordered_written) {
+						block_waiting_on = buf.ordered_index;
+						return;
+					} else if (!one_message && block_waiting_on && buf.ordered_index > block_waiting_on)
+						return;
+					size_t writepos = gathered[cls]++ ? 0 : conn->outbound_writepos[cls];
+					iov[iovcnt].iov_base = (char*)buf.data() + writepos;
+					iov[iovcnt].iov_len = buf.size() - writepos;
+					bytes += iov[iovcnt].iov_len;
+					iov_class[iovcnt++] = cls;
+					if (!buf.more && (one_message || bytes >= budget))
+						return;
+				}
+				if (gathered[cls] && queue[gathered[cls] - 1].more)
+					stop = true;
+			};
+
+			if (conn->outbound_writing_class >= 0) {
+				gather(conn->outbound_writing_class, true);
+				if (!gathered[conn->outbound_writing_class])
+					stop = true; // Its next buffer isn't queued yet
+			}
+			std::chrono::steady_clock::time_point next_write = std::chrono::steady_clock::time_point::max();
+			for (int cls = 0; cls < OUTBOUND_CLASSES && !stop; cls++) {
+				if (outbound_class_rate[cls] && now < conn->class_next_write[cls]) {
+					if (gathered[cls] < conn->outbound_queues[cls].size())
+						next_write = std::min(next_write, conn->class_next_write[cls]);
+					continue;
+				}
+				gather(cls, false);
+			}
+
+			if (!iovcnt) {
+				// Everything left is rate-limited (or the rest of a message is still to come, in which
+				// case whoever queues it will clear write_throttled)
+				if (got_send_mutex)
+					conn->send_mutex.unlock();
+				conn->earliest_next_write = next_write;
+				conn->write_throttled = true;
+#ifdef USE_EVENT_ENGINE
+				if (next_write != std::chrono::steady_clock::time_point::max())
+					throttled[conn] = next_write;
+#endif
+				return IO_PAUSED;
+			}
+
+			ssize_t count = send_iov(conn->sock, iov, iovcnt);
+			int send_errno = errno;
+			if (count <= 0) {
+				if (got_send_mutex)
+					conn->send_mutex.unlock();
+				if (EDGE_TRIGGERED && count < 0 && (send_errno == EAGAIN || send_errno == EWOULDBLOCK))
+					return IO_WOULDBLOCK;
+				conn->sock_errno = send_errno;
+				return IO_FAILED;
+			}
+
+			// Eat what was written off the front of each queue, in the order it was gathered
+			size_t left = count;
+			size_t class_written[OUTBOUND_CLASSES] = {};
+			for (int i = 0; i < iovcnt; i++) {
+				int cls = iov_class[i];
+				std::deque<OutboundBuffer>& queue = conn->outbound_queues[cls];
+				size_t remaining = queue.front().size() - conn->outbound_writepos[cls];
+				if (!left && remaining)
+					break;
+				size_t written = std::min(left, remaining);
+				left -= written;
+				class_written[cls] += written;
+				if (written < remaining) {
+					conn->outbound_writepos[cls] += written;
+					conn->outbound_writing_class = cls;
+				} else {
+					conn->outbound_writepos[cls] = 0;
+					conn->outbound_writing_class = queue.front().more ? cls : -1;
+					if (cls != OUTBOUND_BLOCK && !queue.front().more && queue.front().ordered_index)
+						conn->ordered_written = queue.front().ordered_index;
+					conn->total_waiting_size -= queue.front().size();
+					if (queue.front().queued != std::chrono::steady_clock::time_point::min())
+						block_write_stat.record(now - queue.front().queued);
+					queue.pop_front();
+				}
+			}
+			assert(!left);
+
+			for (int cls = 0; cls < OUTBOUND_CLASSES; cls++)
+				if (outbound_class_rate[cls] && class_written[cls])
+					conn->class_next_write[cls] = now + std::chrono::microseconds(1000 * class_written[cls] / outbound_class_rate[cls]);
+
+			if (got_send_mutex) {
+				if (!conn->total_waiting_size)
+					conn->initial_outbound_throttle = false;
+				conn->send_mutex.unlock();
+			}
+		} while (EDGE_TRIGGERED);
+		return IO_PAUSED;
+	}
+
+	// Called with fd_map_mutex held, conn may be free'd as soon as this returns
+	void remove_connection(Connection* conn) {
+		fd_map.erase(conn->sock);
+		{
+			std::lock_guard<std::mutex> lock(conn->interest_mutex);
+			remove_fd(conn);
+			conn->registered_interest = -1;
+		}
+#ifdef USE_EVENT_ENGINE
+		throttled.erase(conn);
+#endif
+
+		std::lock_guard<std::mutex> lock(conn->read_mutex);
+		conn->inbound_eof = true;
+		conn->wake_reader();
+		if (conn->sock_errno == EAGAIN || conn->sock_errno == EWOULDBLOCK)
+			conn->sock_errno = ENOTCONN;
+		conn->disconnectFlags |= DISCONNECT_GLOBAL_THREAD_DONE;
+	}
+
+	// Called with fd_map_mutex held, returns msec until the next action is due
+	uint64_t run_actions() {
+		uint64_t now = epoch_millis_lu(std::chrono::steady_clock::now());
+		while (actions_map.size() && actions_map.begin()->first < now + 5) {
+			actions_map.begin()->second();
+			actions_map.erase(actions_map.begin());
+		}
+		if (actions_map.size())
+			return actions_map.begin()->first - now;
+		return uint64_t(-1);
+	}
+
+#ifdef USE_EVENT_ENGINE
 	static void do_net_process(GlobalNetProcess* me) {
-		fd_set fd_set_read, fd_set_write;
-		struct timeval timeout;
+#ifdef USE_EPOLL
+		struct epoll_event events[256];
+#else
+		struct kevent events[256];
+#endif
+		uint64_t msec_to_next_action = uint64_t(-1);
 
-#ifndef WIN32
-		int pipefd[2];
-		ALWAYS_ASSERT(!pipe(pipefd));
-		fcntl(pipefd[1], F_SETFL, fcntl(pipefd[1], F_GETFL) | O_NONBLOCK);
-		fcntl(pipefd[0], F_SETFL, fcntl(pipefd[0], F_GETFL) | O_NONBLOCK);
-		me->pipe_write = pipefd[1];
+		while (true) {
+			uint64_t msec_out = msec_to_next_action;
+			auto now = std::chrono::steady_clock::now();
+			for (const auto& e : me->throttled)
+				msec_out = std::min<uint64_t>(msec_out, e.second <= now ? 0 : to_micros_lu(e.second - now) / 1000 + 1);
+
+#ifdef USE_EPOLL
+			int count = epoll_wait(me->poll_fd, events, 256, msec_out == uint64_t(-1) ? -1 : std::min<uint64_t>(msec_out, 86400 * 1000));
+#else
+			struct timespec timeout;
+			timeout.tv_sec = std::min<uint64_t>(msec_out / 1000, 86400);
+			timeout.tv_nsec = (msec_out % 1000) * 1000000;
+			int count = kevent(me->poll_fd, NULL, 0, events, 256, msec_out == uint64_t(-1) ? NULL : &timeout);
+#endif
+			ALWAYS_ASSERT(count >= 0 || errno == EINTR);
+
+			std::set<Connection*> remove_set, rearm_set;
+			for (int i = 0; i < count; i++) {
+#ifdef USE_EPOLL
+				Connection* conn = (Connection*)events[i].data.ptr;
+				bool readable = events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+				bool writable = events[i].events & EPOLLOUT;
+#else
+				Connection* conn = (Connection*)events[i].udata;
+				bool readable = events[i].filter == EVFILT_READ;
+				bool writable = events[i].filter == EVFILT_WRITE;
 #endif
+				if (!conn) {
+					char buf[4096];
+					while (read(me->pipe_read, buf, 4096) > 0);
+					continue;
+				}
+				if (remove_set.count(conn))
+					continue;
+
+				IOResult res = readable ? me->do_read(conn) : IO_WOULDBLOCK;
+				if (res != IO_FAILED && writable) {
+					IOResult write_res = me->do_write(conn);
+					res = write_res == IO_WOULDBLOCK ? res : write_res;
+				}
+				if (res == IO_FAILED)
+					remove_set.insert(conn);
+				else if (res == IO_PAUSED)
+					rearm_set.insert(conn);
+			}
+
+			now = std::chrono::steady_clock::now();
+			for (auto it = me->throttled.begin(); it != me->throttled.end();) {
+				if (it->second <= now && !remove_set.count(it->first)) {
+					it->first->write_throttled = false;
+					rearm_set.insert(it->first);
+					me->throttled.erase(it++);
+				} else
+					it++;
+			}
+
+			// We stopped short of EAGAIN on these, so no new edge is coming unless we re-arm
+			for (Connection* conn : rearm_set)
+				if (!remove_set.count(conn))
+					conn->update_interest(true);
+
+			std::lock_guard<std::mutex> lock(me->fd_map_mutex);
+			for (Connection* conn : remove_set)
+				me->remove_connection(conn);
+
+			msec_to_next_action = me->run_actions();
+		}
+	}
+#else // USE_EVENT_ENGINE
+	static void do_net_process(GlobalNetProcess* me) {
+		fd_set fd_set_read, fd_set_write;
+		struct timeval timeout;
 
 		while (true) {
 #ifndef WIN32
@@ -53,8 +444,8 @@ public:
 
 			FD_ZERO(&fd_set_read); FD_ZERO(&fd_set_write);
 #ifndef WIN32
-			int max = pipefd[0];
-			FD_SET(pipefd[0], &fd_set_read);
+			int max = me->pipe_read;
+			FD_SET(me->pipe_read, &fd_set_read);
 #else
 			int max = -1;
 #endif
@@ -63,10 +454,12 @@ public:
 				std::lock_guard<std::mutex> lock(me->fd_map_mutex);
 				for (const auto& e : me->fd_map) {
 					ALWAYS_ASSERT(e.first < FD_SETSIZE);
-					if (e.second->total_inbound_size < 65536 || e.second->disconnectFlags & DISCONNECT_READS_DONE)
+					if (e.second->wants_read())
 						FD_SET(e.first, &fd_set_read);
+					if (e.second->write_throttled && now >= e.second->earliest_next_write)
+						e.second->write_throttled = false;
 					if (e.second->total_waiting_size > 0) {
-						if (now < e.second->earliest_next_write) {
+						if (e.second->write_throttled) {
 							timeout.tv_sec = 0;
 							timeout.tv_usec = std::min((long unsigned)timeout.tv_usec, to_micros_lu(e.second->earliest_next_write - now));
 						} else
@@ -75,17 +468,10 @@ public:
 					max = std::max(e.first, max);
 				}
 
-				if (me->actions_map.size()) {
-					uint64_t now = epoch_millis_lu(std::chrono::steady_clock::now());
-					while (me->actions_map.size() && me->actions_map.begin()->first < now + 5) {
-						me->actions_map.begin()->second();
-						me->actions_map.erase(me->actions_map.begin());
-					}
-					if (me->actions_map.size()) {
-						uint64_t msec_out = me->actions_map.begin()->first - now;
-						timeout.tv_sec = std::min<long unsigned>(timeout.tv_sec, msec_out / 1000);
-						timeout.tv_usec = std::min<long unsigned>(timeout.tv_usec, (msec_out % 1000) * 1000);
-					}
+				uint64_t msec_out = me->run_actions();
+				if (msec_out != uint64_t(-1)) {
+					timeout.tv_sec = std::min<long unsigned>(timeout.tv_sec, msec_out / 1000);
+					timeout.tv_usec = std::min<long unsigned>(timeout.tv_usec, (msec_out % 1000) * 1000);
 				}
 			}
 
@@ -94,112 +480,538 @@ public:
 			else
 				ALWAYS_ASSERT(select(max + 1, &fd_set_read, &fd_set_write, NULL, &timeout) >= 0);
 
-			now = std::chrono::steady_clock::now();
-			unsigned char buf[4096];
 			{
-				std::set<int> remove_set;
+				std::set<Connection*> remove_set;
 				std::lock_guard<std::mutex> lock(me->fd_map_mutex);
 				for (const auto& e : me->fd_map) {
 					Connection* conn = e.second;
-
-					if (FD_ISSET(e.first, &fd_set_read)) {
-						ssize_t count = recv(conn->sock, (char*)buf, 4096, 0);
-
-						std::lock_guard<std::mutex> lock(conn->read_mutex);
-						if (count <= 0) {
-							remove_set.insert(e.first);
-							conn->sock_errno = errno;
-						} else if (!(conn->disconnectFlags & DISCONNECT_READS_DONE)) {
-							conn->inbound_queue.emplace_back(new std::vector<unsigned char>(buf, buf + count));
-							conn->total_inbound_size += count;
-							conn->read_cv.notify_all();
-						}
-					}
-					if (FD_ISSET(e.first, &fd_set_write)) {
-						if (now < conn->earliest_next_write)
-							continue;
-						bool got_send_mutex = conn->send_mutex.try_lock();
-						std::lock_guard<std::mutex> lock(conn->send_bytes_mutex);
-						size_t message_written_size = 0;
-						if (!conn->secondary_writepos && conn->outbound_primary_queue.size()) {
-							auto& msg = conn->outbound_primary_queue.front();
-							assert(msg->size() - conn->primary_writepos > 0);
-							message_written_size = msg->size();
-							ssize_t count = send(conn->sock, (char*) &(*msg)[conn->primary_writepos], msg->size() - conn->primary_writepos, MSG_NOSIGNAL);
-							if (count <= 0) {
-								remove_set.insert(e.first);
-								conn->sock_errno = errno;
-							} else {
-								conn->primary_writepos += count;
-								if (conn->primary_writepos == msg->size()) {
-									conn->primary_writepos = 0;
-									conn->total_waiting_size -= msg->size();
-									conn->outbound_primary_queue.pop_front();
-								}
-							}
-						} else {
-							assert(conn->outbound_secondary_queue.size() && !conn->primary_writepos);
-							auto& msg = conn->outbound_secondary_queue.front();
-							assert(msg->size() - conn->secondary_writepos > 0);
-							message_written_size = msg->size();
-							ssize_t count = send(conn->sock, (char*) &(*msg)[conn->secondary_writepos], msg->size() - conn->secondary_writepos, MSG_NOSIGNAL);
-							if (count <= 0) {
-								remove_set.insert(e.first);
-								conn->sock_errno = errno;
-							} else {
-								conn->secondary_writepos += count;
-								if (conn->secondary_writepos == msg->size()) {
-									conn->secondary_writepos = 0;
-									conn->total_waiting_size -= msg->size();
-									conn->outbound_secondary_queue.pop_front();
-								}
-							}
-						}
-						if (got_send_mutex) {
-							if (!conn->total_waiting_size)
-								conn->initial_outbound_throttle = false;
-							conn->send_mutex.unlock();
-						}
-						if (!conn->primary_writepos && !conn->secondary_writepos && conn->initial_outbound_throttle)
-							conn->earliest_next_write = std::chrono::steady_clock::now() + std::chrono::microseconds(1000 * message_written_size / OUTBOUND_THROTTLE_BYTES_PER_MS);
-					}
+					if ((FD_ISSET(e.first, &fd_set_read) && me->do_read(conn) == IO_FAILED) ||
+							(FD_ISSET(e.first, &fd_set_write) && me->do_write(conn) == IO_FAILED))
+						remove_set.insert(conn);
 				}
 
-				for (const int fd : remove_set) {
-					Connection* conn = me->fd_map[fd];
-					std::lock_guard<std::mutex> lock(conn->read_mutex);
-					conn->inbound_queue.emplace_back((std::nullptr_t)NULL);
-					conn->read_cv.notify_all();
-					if (conn->sock_errno == EAGAIN || conn->sock_errno == EWOULDBLOCK)
-						conn->sock_errno = ENOTCONN;
-					conn->disconnectFlags |= DISCONNECT_GLOBAL_THREAD_DONE;
-					me->fd_map.erase(fd);
-				}
+				for (Connection* conn : remove_set)
+					me->remove_connection(conn);
 			}
 #ifndef WIN32
-			if (FD_ISSET(pipefd[0], &fd_set_read))
-				while (read(pipefd[0], buf, 4096) > 0);
+			if (FD_ISSET(me->pipe_read, &fd_set_read)) {
+				char buf[4096];
+				while (read(me->pipe_read, buf, 4096) > 0);
+			}
 #endif
 		}
 	}
+#endif // !USE_EVENT_ENGINE
 
 	GlobalNetProcess() {
+#ifndef WIN32
+		int pipefd[2];
+		ALWAYS_ASSERT(!pipe(pipefd));
+		fcntl(pipefd[1], F_SETFL, fcntl(pipefd[1], F_GETFL) | O_NONBLOCK);
+		fcntl(pipefd[0], F_SETFL, fcntl(pipefd[0], F_GETFL) | O_NONBLOCK);
+		pipe_read = pipefd[0];
+		pipe_write = pipefd[1];
+#endif
+
+#if defined(USE_EPOLL)
+		poll_fd = epoll_create1(0);
+		ALWAYS_ASSERT(poll_fd >= 0);
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		ALWAYS_ASSERT(!epoll_ctl(poll_fd, EPOLL_CTL_ADD, pipe_read, &ev));
+#elif defined(USE_KQUEUE)
+		poll_fd = kqueue();
+		ALWAYS_ASSERT(poll_fd >= 0);
+		struct kevent ev;
+		EV_SET(&ev, pipe_read, EVFILT_READ, EV_ADD, 0, 0, NULL);
+		ALWAYS_ASSERT(!kevent(poll_fd, &ev, 1, NULL, 0, NULL));
+#endif
+
 		std::thread(do_net_process, this).detach();
 	}
+
+	// Per-connection queue depths, as gauges
+	static void register_stats(const std::vector<GlobalNetProcess*>& processors) {
+		const auto for_each_connection = [processors](const std::function<void (const Connection*)>& callback) {
+			for (GlobalNetProcess* processor : processors) {
+				std::lock_guard<std::mutex> lock(processor->fd_map_mutex);
+				for (const auto& e : processor->fd_map)
+					callback(e.second); // Can't be free'd while it's in fd_map
+			}
+		};
+		register_stat_gauge("relay_connection_outbound_bytes", "Bytes queued to be written to each peer", [for_each_connection](const std::function<void (const std::string&, int64_t)>& emit) {
+			for_each_connection([&](const Connection* conn) { emit(stat_label("host", conn->host), conn->total_waiting_size); });
+		});
+		register_stat_gauge("relay_connection_inbound_bytes", "Bytes read from each peer which it hasn't processed yet", [for_each_connection](const std::function<void (const std::string&, int64_t)>& emit) {
+			for_each_connection([&](const Connection* conn) { emit(stat_label("host", conn->host), conn->total_inbound_size); });
+		});
+	}
+};
+
+// Number of net threads is RELAY_NET_THREADS, or one per core
+static std::vector<GlobalNetProcess*>& get_net_processors() {
+	static std::vector<GlobalNetProcess*> processors([]() {
+		long count = getenv("RELAY_NET_THREADS") ? strtol(getenv("RELAY_NET_THREADS"), NULL, 10) : std::thread::hardware_concurrency();
+		std::vector<GlobalNetProcess*> res;
+		for (long i = 0; i < std::max(1L, count); i++)
+			res.push_back(new GlobalNetProcess());
+		GlobalNetProcess::register_stats(res);
+		return res;
+	}());
+	return processors;
+}
+
+static GlobalNetProcess* next_net_processor() {
+	static std::atomic<unsigned int> next(0);
+	std::vector<GlobalNetProcess*>& processors = get_net_processors();
+	return processors[next++ % processors.size()];
+}
+
+
+
+#ifdef USE_FIBERS
+// By default net_process runs on a fiber (a ucontext with its own stack, of which only what it has
+// touched is committed) instead of its own thread, and a pool of worker threads runs whichever
+// fibers are ready (ie the net threads have read something for them). A fiber only switches out
+// in wait_read(). Anything else which blocks (eg a mutex held by another fiber which is waiting on
+// its peer) blocks its worker, so if none of the workers have made progress for FIBER_STALL_MS
+// while fibers are ready, we start another. A fiber may resume on another worker, so a std::mutex
+// must never be held across wait_read(): anything which is uses a FiberMutex, whose waiters park
+// too. RELAY_FIBERS=0 gets a thread per connection instead.
+// Stacks are small and end in a guard page, so the Makefile rejects VLAs and frames over 16KB:
+// anything sized by a peer (or just big) has to go on the heap.
+#define FIBER_STACK_SIZE (256 * 1024)
+#define FIBER_GUARD_SIZE 4096
+#define FIBER_STALL_MS 20
+#define MAX_FIBER_WORKERS 1024
+
+struct ConnectionFiber {
+	ucontext_t context;
+	ucontext_t* worker; // The one which is running us, to switch back to
+	unsigned char* stack;
+	bool finished; // Set just before we switch out for the last time
+	// Protected by the connection's read_mutex
+	bool parked; // Switched out in wait_read(), waiting for a wake_reader()
+	bool wake_pending; // wake_reader() was called while we weren't parked
+	bool done; // finished, and the worker is done with us
+	// Protected by FiberPool::timer_mutex
+	bool timer_set;
+	std::multimap<std::chrono::system_clock::time_point, Connection*>::iterator timer;
+};
+
+// The connection whose fiber this (worker) thread is running
+static thread_local Connection* current_fiber_conn = NULL;
+
+class FiberPool {
+private:
+	std::mutex run_mutex;
+	std::condition_variable run_cv;
+	std::deque<Connection*> runnable;
+	size_t workers, idle_workers;
+	uint64_t progress; // Fibers switched to, to spot stalls
+
+	// Lock order is timer_mutex, then a connection's read_mutex, then run_mutex (a FiberMutex
+	// takes a read_mutex with its own state_mutex held, so never unlock one with any of these)
+	std::mutex timer_mutex;
+	std::condition_variable timer_cv;
+	std::multimap<std::chrono::system_clock::time_point, Connection*> timers; // Of wait_read()s with a stop_time
+
+	FiberPool() : workers(std::max(2U, std::thread::hardware_concurrency())), idle_workers(0), progress(0) {
+		for (size_t i = 0; i < workers; i++)
+			std::thread(&FiberPool::work, this).detach();
+		std::thread(&FiberPool::watch, this).detach();
+	}
+
+	static void fiber_main(unsigned int conn_high, unsigned int conn_low) {
+		Connection* conn = (Connection*)((uint64_t(conn_high) << 32) | conn_low);
+		Connection::do_setup_and_read(conn);
+		conn->fiber->finished = true;
+		swapcontext(&conn->fiber->context, conn->fiber->worker);
+	}
+
+	void push(Connection* conn) {
+		std::lock_guard<std::mutex> lock(run_mutex);
+		runnable.push_back(conn);
+		run_cv.notify_one();
+	}
+
+	void work() {
+		ucontext_t context;
+		std::unique_lock<std::mutex> lock(run_mutex);
+		while (true) {
+			idle_workers++;
+			while (runnable.empty())
+				run_cv.wait(lock);
+			idle_workers--;
+			Connection* conn = runnable.front();
+			runnable.pop_front();
+			progress++;
+			lock.unlock();
+
+			ConnectionFiber* fiber = conn->fiber;
+			fiber->worker = &context;
+			current_fiber_conn = conn;
+			ALWAYS_ASSERT(!swapcontext(&context, &fiber->context));
+			current_fiber_conn = NULL;
+
+			if (fiber->finished) {
+				munmap(fiber->stack, FIBER_STACK_SIZE + FIBER_GUARD_SIZE);
+				// conn may be free'd as soon as we unlock
+				std::lock_guard<std::mutex> read_lock(conn->read_mutex);
+				fiber->done = true;
+				conn->read_cv.notify_all();
+			} else {
+				std::lock_guard<std::mutex> read_lock(conn->read_mutex);
+				if (fiber->wake_pending) {
+					fiber->wake_pending = false;
+					push(conn);
+				} else
+					fiber->parked = true;
+			}
+			lock.lock();
+		}
+	}
+
+	// Wakes fibers whose stop_time has passed, and adds a worker when they're all stuck
+	void watch() {
+		uint64_t last_progress = 0;
+		auto next_check = std::chrono::system_clock::now();
+		std::unique_lock<std::mutex> lock(timer_mutex);
+		while (true) {
+			auto wake_time = next_check;
+			if (!timers.empty())
+				wake_time = std::min(wake_time, timers.begin()->first);
+			timer_cv.wait_until(lock, wake_time);
+
+			auto now = std::chrono::system_clock::now();
+			while (!timers.empty() && timers.begin()->first <= now) {
+				Connection* conn = timers.begin()->second;
+				conn->fiber->timer_set = false;
+				timers.erase(timers.begin());
+				std::lock_guard<std::mutex> read_lock(conn->read_mutex);
+				wake(conn);
+			}
+
+			if (now < next_check)
+				continue;
+			next_check = now + std::chrono::milliseconds(FIBER_STALL_MS);
+			std::lock_guard<std::mutex> run_lock(run_mutex);
+			if (!runnable.empty() && !idle_workers && progress == last_progress && workers < MAX_FIBER_WORKERS) {
+				workers++;
+				std::thread(&FiberPool::work, this).detach();
+			}
+			last_progress = progress;
+		}
+	}
+
+public:
+	static bool enabled() {
+		static const bool res = !getenv("RELAY_FIBERS") || strcmp(getenv("RELAY_FIBERS"), "0");
+		return res;
+	}
+
+	static FiberPool& get() {
+		static FiberPool* pool = new FiberPool(); // Never destroyed, as its threads run until exit
+		return *pool;
+	}
+
+	bool start(Connection* conn) {
+		void* stack = mmap(NULL, FIBER_STACK_SIZE + FIBER_GUARD_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+		if (stack == MAP_FAILED)
+			return false;
+		mprotect(stack, FIBER_GUARD_SIZE, PROT_NONE); // Stacks grow down into this
+
+		ConnectionFiber* fiber = new ConnectionFiber();
+		fiber->stack = (unsigned char*)stack;
+		fiber->finished = fiber->parked = fiber->wake_pending = fiber->done = fiber->timer_set = false;
+		ALWAYS_ASSERT(!getcontext(&fiber->context));
+		fiber->context.uc_stack.ss_sp = fiber->stack + FIBER_GUARD_SIZE;
+		fiber->context.uc_stack.ss_size = FIBER_STACK_SIZE;
+		fiber->context.uc_link = NULL;
+		makecontext(&fiber->context, (void (*)(void))fiber_main, 2, (unsigned int)(uint64_t(conn) >> 32), (unsigned int)uint64_t(conn));
+
+		conn->fiber = fiber;
+		push(conn);
+		return true;
+	}
+
+	// From conn's fiber, without its read_mutex
+	void park(Connection* conn, std::chrono::system_clock::time_point stop_time) {
+		ConnectionFiber* fiber = conn->fiber;
+		bool timed = stop_time != std::chrono::system_clock::time_point::max();
+		if (timed) {
+			std::lock_guard<std::mutex> lock(timer_mutex);
+			fiber->timer = timers.insert(std::make_pair(stop_time, conn));
+			fiber->timer_set = true;
+			if (fiber->timer == timers.begin())
+				timer_cv.notify_one();
+		}
+
+		// The worker we switch back to marks us parked (or runnable again, if we've already been woken)
+		ALWAYS_ASSERT(!swapcontext(&fiber->context, fiber->worker));
+
+		if (timed) {
+			std::lock_guard<std::mutex> lock(timer_mutex);
+			if (fiber->timer_set) {
+				timers.erase(fiber->timer);
+				fiber->timer_set = false;
+			}
+		}
+	}
+
+	// With conn's read_mutex
+	void wake(Connection* conn) {
+		ConnectionFiber* fiber = conn->fiber;
+		if (fiber->parked) {
+			fiber->parked = false;
+			push(conn);
+		} else
+			fiber->wake_pending = true;
+	}
+};
+#endif
+
+struct FiberMutex::Waiter {
+	Connection* fiber_conn; // Whose fiber is parked waiting, NULL for a thread waiting on thread_cv
+	bool granted; // unlock() has handed us the mutex
 };
-static GlobalNetProcess processor;
 
+void FiberMutex::lock() {
+	std::unique_lock<std::mutex> lock(state_mutex);
+	if (!locked) {
+		locked = true;
+		return;
+	}
+
+	Waiter waiter = { NULL, false };
+#ifdef USE_FIBERS
+	waiter.fiber_conn = current_fiber_conn;
+#endif
+	waiters.push_back(&waiter);
+	while (!waiter.granted) {
+#ifdef USE_FIBERS
+		if (waiter.fiber_conn) {
+			// Anything else which wakes us (eg more to read) just parks us again
+			lock.unlock();
+			FiberPool::get().park(waiter.fiber_conn, std::chrono::system_clock::time_point::max());
+			lock.lock();
+			continue;
+		}
+#endif
+		thread_cv.wait(lock);
+	}
+}
+
+bool FiberMutex::try_lock() {
+	std::lock_guard<std::mutex> lock(state_mutex);
+	if (locked)
+		return false;
+	locked = true;
+	return true;
+}
+
+void FiberMutex::unlock() {
+	std::lock_guard<std::mutex> lock(state_mutex);
+	assert(locked);
+	if (waiters.empty()) {
+		locked = false;
+		return;
+	}
+
+	// Hand the mutex straight to the first waiter, which can't return until we release state_mutex
+	Waiter* next = waiters.front();
+	waiters.pop_front();
+	next->granted = true;
+#ifdef USE_FIBERS
+	if (next->fiber_conn) {
+		std::lock_guard<std::mutex> read_lock(next->fiber_conn->read_mutex);
+		FiberPool::get().wake(next->fiber_conn);
+		return;
+	}
+#endif
+	thread_cv.notify_all();
+}
+
+void Connection::construction_done() {
+#ifdef USE_FIBERS
+	if (FiberPool::enabled() && FiberPool::get().start(this))
+		return;
+#endif
+	user_thread = new std::thread(do_setup_and_read, this);
+}
 
+bool Connection::in_net_process() {
+#ifdef USE_FIBERS
+	if (fiber)
+		return current_fiber_conn == this;
+#endif
+	return user_thread && std::this_thread::get_id() == user_thread->get_id();
+}
+
+void Connection::wait_read(std::unique_lock<std::mutex>& lock, std::chrono::system_clock::time_point stop_time) {
+#ifdef USE_FIBERS
+	if (fiber) {
+		lock.unlock();
+		FiberPool::get().park(this, stop_time);
+		lock.lock();
+		return;
+	}
+#endif
+	if (stop_time == std::chrono::system_clock::time_point::max())
+		read_cv.wait(lock);
+	else
+		read_cv.wait_until(lock, stop_time);
+}
+
+void Connection::wake_reader() {
+#ifdef USE_FIBERS
+	if (fiber)
+		return FiberPool::get().wake(this);
+#endif
+	read_cv.notify_all();
+}
+
+int Connection::get_interest() {
+	return (wants_read() ? INTEREST_READ : 0) | (wants_write() ? INTEREST_WRITE : 0);
+}
+
+void Connection::update_interest(bool force) {
+	std::lock_guard<std::mutex> lock(interest_mutex);
+	if (registered_interest < 0)
+		return;
+	int interest = get_interest();
+	if (interest != registered_interest || force) {
+		registered_interest = interest;
+		processor->set_interest(this, interest);
+	}
+}
+
+// Inbound rings are big enough that we'd rather not go back to malloc for every connection
+static std::mutex inbound_ring_pool_mutex;
+static std::vector<unsigned char*> inbound_ring_pool;
+
+static unsigned char* get_inbound_ring() {
+	std::lock_guard<std::mutex> lock(inbound_ring_pool_mutex);
+	if (inbound_ring_pool.empty())
+		return new unsigned char[INBOUND_RING_SIZE];
+	unsigned char* res = inbound_ring_pool.back();
+	inbound_ring_pool.pop_back();
+	return res;
+}
+
+static void release_inbound_ring(unsigned char* ring) {
+	std::lock_guard<std::mutex> lock(inbound_ring_pool_mutex);
+	if (inbound_ring_pool.size() < 256)
+		inbound_ring_pool.push_back(ring);
+	else
+		delete[] ring;
+}
 
 Connection::~Connection() {
 	assert(disconnectFlags & DISCONNECT_COMPLETE);
-	user_thread->join();
+	if (user_thread) {
+		user_thread->join();
+		delete user_thread;
+	}
+#ifdef USE_FIBERS
+	if (fiber) {
+		std::unique_lock<std::mutex> lock(read_mutex);
+		while (!fiber->done)
+			read_cv.wait(lock);
+		delete fiber;
+	}
+#endif
 	close(sock);
-	delete user_thread;
+	if (inbound_ring)
+		release_inbound_ring(inbound_ring);
+}
+
+
+void Connection::queue_bytes(OutboundBuffer&& bytes, OutboundClass cls, int flags, uint64_t seq) {
+	int target = cls;
+	if (outbound_open_class >= 0) {
+		target = outbound_open_class;
+		if ((flags & OUTBOUND_ORDERED) && target != OUTBOUND_BLOCK) {
+			bytes.seq = seq;
+			bytes.ordered_index = ordered_queued;
+		}
+	} else if ((flags & OUTBOUND_ORDERED) && cls == OUTBOUND_BLOCK) {
+		// Ordered messages are written in the order they were queued, so we only wait for the last
+		// one we depend on (the last in its queue, as they're queued in seq order, save replays)
+		for (int i = OUTBOUND_BLOCK + 1; i < OUTBOUND_CLASSES; i++) {
+			const std::deque<OutboundBuffer>& queue = outbound_queues[i];
+			for (auto it = queue.rbegin(); it != queue.rend(); it++) {
+				if (it->ordered_index && it->seq <= seq) {
+					bytes.ordered_index = std::max(bytes.ordered_index, it->ordered_index);
+					break;
+				}
+			}
+		}
+	} else if (flags & OUTBOUND_ORDERED) {
+		// Going in the lowest class with anything queued keeps ordered messages' classes in priority
+		// order, so they're written in the order they were queued in
+		for (int i = cls + 1; i < OUTBOUND_CLASSES; i++)
+			if (!outbound_queues[i].empty())
+				target = i;
+		bytes.seq = seq;
+		bytes.ordered_index = ++ordered_queued;
+	}
+
+	// The rest of a message which is being written goes out regardless of its class' rate, and
+	// do_write may be waiting on nothing else
+	bool continues_message = outbound_open_class >= 0 || target == outbound_writing_class;
+	bytes.more = flags & OUTBOUND_MORE;
+	if (flags & OUTBOUND_TIMED)
+		bytes.queued = std::chrono::steady_clock::now();
+	outbound_open_class = bytes.more ? target : -1;
+
+	size_t size = bytes.size();
+	outbound_queues[target].push_back(std::move(bytes));
+	total_waiting_size += size;
+
+	bool unthrottle = write_throttled && (continues_message || !outbound_class_rate[target] || std::chrono::steady_clock::now() >= class_next_write[target]);
+	if (unthrottle)
+		write_throttled = false;
+	if (unthrottle || total_waiting_size == (ssize_t)size)
+		update_interest();
 }
 
+void Connection::ordered_backlog(uint64_t seq, size_t& bytes, size_t& rate_limited_bytes) {
+	std::lock_guard<std::mutex> lock(send_bytes_mutex);
+
+	// As in queue_bytes(), the block would wait for the last ordered message with a seq no greater
+	// than its own, and so for every ordered message queued up to that one
+	uint64_t depends = 0;
+	for (int i = OUTBOUND_BLOCK + 1; i < OUTBOUND_CLASSES; i++) {
+		const std::deque<OutboundBuffer>& queue = outbound_queues[i];
+		for (auto it = queue.rbegin(); it != queue.rend(); it++) {
+			if (it->ordered_index && it->seq <= seq) {
+				depends = std::max(depends, it->ordered_index);
+				break;
+			}
+		}
+	}
+
+	// ...and whatever is ahead of those in their queues
+	bytes = rate_limited_bytes = 0;
+	for (int i = OUTBOUND_BLOCK + 1; i < OUTBOUND_CLASSES; i++) {
+		const std::deque<OutboundBuffer>& queue = outbound_queues[i];
+		size_t class_bytes = 0, waited_bytes = 0;
+		for (size_t j = 0; j < queue.size(); j++) {
+			if (queue[j].ordered_index > depends)
+				break;
+			class_bytes += queue[j].size() - (j ? 0 : outbound_writepos[i]);
+			if (queue[j].ordered_index)
+				waited_bytes = class_bytes;
+		}
+		bytes += waited_bytes;
+		if (outbound_class_rate[i])
+			rate_limited_bytes += waited_bytes;
+	}
+}
 
-void Connection::do_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token) {
+void Connection::do_send_bytes(OutboundBuffer&& bytes, int send_mutex_token, OutboundClass cls, int flags, uint64_t seq) {
 	if (!send_mutex_token)
 		send_mutex.lock();
 	else
@@ -208,7 +1020,7 @@ void Connection::do_send_bytes(const std::shared_ptr<std::vector<unsigned char>
 	std::lock_guard<std::mutex> bytes_lock(send_bytes_mutex);
 
 	if (initial_outbound_throttle && send_mutex_token)
-		initial_outbound_bytes += bytes->size();
+		initial_outbound_bytes += bytes.size();
 
 	if (total_waiting_size - (initial_outbound_throttle ? initial_outbound_bytes : 0) > max_outbound_buffer_size) {
 		if (!send_mutex_token)
@@ -216,12 +1028,7 @@ void Connection::do_send_bytes(const std::shared_ptr<std::vector<unsigned char>
 		return disconnect_from_outside("total_waiting_size blew up :(");
 	}
 
-	outbound_primary_queue.push_back(bytes);
-	total_waiting_size += bytes->size();
-#ifndef WIN32
-	if (total_waiting_size == (ssize_t)bytes->size())
-		ALWAYS_ASSERT(write(processor.pipe_write, "1", 1) == 1);
-#endif
+	queue_bytes(std::move(bytes), cls, flags, seq);
 
 	if (!send_mutex_token)
 		send_mutex.unlock();
@@ -242,12 +1049,7 @@ void Connection::maybe_send_bytes(const std::shared_ptr<std::vector<unsigned cha
 		return disconnect_from_outside("total_waiting_size blew up :(");
 	}
 
-	outbound_secondary_queue.push_back(bytes);
-	total_waiting_size += bytes->size();
-#ifndef WIN32
-	if (total_waiting_size == (ssize_t)bytes->size())
-		ALWAYS_ASSERT(write(processor.pipe_write, "1", 1) == 1);
-#endif
+	queue_bytes(OutboundBuffer(bytes), OUTBOUND_TX, 0);
 
 	if (!send_mutex_token)
 		send_mutex.unlock();
@@ -274,7 +1076,7 @@ void Connection::disconnect_from_outside(const char* reason) {
 }
 
 void Connection::disconnect(std::string reason) {
-	assert(std::this_thread::get_id() == user_thread->get_id());
+	assert(in_net_process());
 
 	if (disconnectFlags.fetch_or(DISCONNECT_STARTED) & DISCONNECT_STARTED)
 		return;
@@ -286,10 +1088,11 @@ void Connection::disconnect(std::string reason) {
 	}
 
 	disconnectFlags |= DISCONNECT_READS_DONE;
+	update_interest(); // Keep reading (and dropping) until we hit EOF
 
 	std::unique_lock<std::mutex> lock(read_mutex);
 	while (!(disconnectFlags & DISCONNECT_GLOBAL_THREAD_DONE))
-		read_cv.wait(lock);
+		wait_read(lock, std::chrono::system_clock::time_point::max());
 
 	disconnectFlags |= DISCONNECT_COMPLETE;
 
@@ -298,6 +1101,7 @@ void Connection::disconnect(std::string reason) {
 }
 
 void Connection::do_setup_and_read(Connection* me) {
+	errno = 0; // On a fiber, errno is whatever our worker last left it as
 	#ifdef WIN32
 		unsigned long nonblocking = 1;
 		ioctlsocket(me->sock, FIONBIO, &nonblocking);
@@ -318,12 +1122,17 @@ void Connection::do_setup_and_read(Connection* me) {
 		return me->disconnect("error during connect");
 	}
 
+	me->inbound_ring = get_inbound_ring();
+
 	{
-		std::lock_guard<std::mutex> lock(processor.fd_map_mutex);
-		processor.fd_map[me->sock] = me;
-#ifndef WIN32
-		ALWAYS_ASSERT(write(processor.pipe_write, "1", 1) == 1);
-#endif
+		GlobalNetProcess* processor = next_net_processor();
+		std::lock_guard<std::mutex> lock(processor->fd_map_mutex);
+		processor->fd_map[me->sock] = me;
+
+		std::lock_guard<std::mutex> lock2(me->interest_mutex);
+		me->processor = processor;
+		me->registered_interest = me->get_interest();
+		processor->add_fd(me, me->registered_interest);
 	}
 
 	try {
@@ -334,7 +1143,7 @@ void Connection::do_setup_and_read(Connection* me) {
 }
 
 ssize_t Connection::read_all(char *buf, size_t nbyte, millis_lu_type max_sleep) {
-	assert(std::this_thread::get_id() == user_thread->get_id());
+	assert(in_net_process());
 
 	size_t total = 0;
 	std::chrono::system_clock::time_point stop_time;
@@ -343,33 +1152,29 @@ ssize_t Connection::read_all(char *buf, size_t nbyte, millis_lu_type max_sleep)
 	else
 		stop_time = std::chrono::system_clock::now() + max_sleep;
 	while (total < nbyte) {
-		std::unique_lock<std::mutex> lock(read_mutex);
-		while (!inbound_queue.size() && std::chrono::system_clock::now() < stop_time)
-			read_cv.wait_until(lock, stop_time);
-
-		if (std::chrono::system_clock::now() >= stop_time)
+		// Only the net thread adds to total_inbound_size, so if it is non-0 we can copy without locking
+		size_t available = total_inbound_size;
+		if (!available) {
+			std::unique_lock<std::mutex> lock(read_mutex);
+			while (!total_inbound_size && !inbound_eof && std::chrono::system_clock::now() < stop_time)
+				wait_read(lock, stop_time);
+
+			if (total_inbound_size)
+				continue;
+			if (inbound_eof)
+				return -1;
 			return total;
+		}
 
-		if (!inbound_queue.front())
-			return -1;
-
-		size_t readamt = std::min(nbyte - total, inbound_queue.front()->size() - readpos);
-		memcpy(buf + total, &(*inbound_queue.front())[readpos], readamt);
-		if (readpos + readamt == inbound_queue.front()->size()) {
-#ifndef WIN32
-			int32_t old_size = total_inbound_size;
-#endif
-			total_inbound_size -= inbound_queue.front()->size();
-#ifndef WIN32
-			// If the old size is >= 64k, we may need to wakeup the select thread to get it to read more
-			if (old_size >= 65536)
-				ALWAYS_ASSERT(write(processor.pipe_write, "1", 1) == 1);
-#endif
+		size_t readamt = std::min(nbyte - total, available);
+		size_t firstamt = std::min(readamt, INBOUND_RING_SIZE - inbound_readpos);
+		memcpy(buf + total, &inbound_ring[inbound_readpos], firstamt);
+		memcpy(buf + total + firstamt, &inbound_ring[0], readamt - firstamt);
+		inbound_readpos = (inbound_readpos + readamt) % INBOUND_RING_SIZE;
 
-			readpos = 0;
-			inbound_queue.pop_front();
-		} else
-			readpos += readamt;
+		// If the ring was full, we may need to wakeup the net thread to get it to read more
+		if (total_inbound_size.fetch_sub(readamt) == int64_t(INBOUND_RING_SIZE))
+			update_interest();
 		total += readamt;
 	}
 	assert(total == nbyte);
@@ -410,7 +1215,23 @@ void OutboundPersistentConnection::reconnect(std::string disconnectReason) {
 	delete old;
 }
 
+void OutboundPersistentConnection::switch_server(const std::string& host) {
+	{
+		std::lock_guard<std::mutex> lock(next_host_mutex);
+		nextServerHost = host;
+	}
+	disconnect_from_outside("switching server");
+}
+
 void OutboundPersistentConnection::do_connect(OutboundPersistentConnection* me) {
+	{
+		std::lock_guard<std::mutex> lock(me->next_host_mutex);
+		if (!me->nextServerHost.empty()) {
+			me->serverHost = me->nextServerHost;
+			me->nextServerHost.clear();
+		}
+	}
+
 	std::string error;
 	int sock = create_connect_socket(me->serverHost, me->serverPort, error);
 	if (sock <= 0)
@@ -429,15 +1250,16 @@ void OutboundPersistentConnection::do_connect(OutboundPersistentConnection* me)
 KeepaliveOutboundPersistentConnection::KeepaliveOutboundPersistentConnection(std::string serverHostIn, uint16_t serverPortIn,
 		uint32_t ping_interval_msec_in, uint32_t max_outbound_buffer_size_in) :
 	OutboundPersistentConnection(serverHostIn, serverPortIn, max_outbound_buffer_size_in),
-	connected(false), next_nonce(0xDEADBEEF), ping_interval_msec(ping_interval_msec_in), scheduled(false) { }
+	connected(false), next_nonce(0xDEADBEEF), ping_interval_msec(ping_interval_msec_in), scheduled(false),
+	keepalive_processor(next_net_processor()) { }
 
 void KeepaliveOutboundPersistentConnection::schedule() {
 	uint64_t time = epoch_millis_lu(std::chrono::steady_clock::now()) + ping_interval_msec;
 
-	while (processor.actions_map.count(time))
+	while (keepalive_processor->actions_map.count(time))
 		time++;
 
-	processor.actions_map[time] = [&]() {
+	keepalive_processor->actions_map[time] = [&]() {
 		schedule();
 
 		{
@@ -456,7 +1278,7 @@ void KeepaliveOutboundPersistentConnection::schedule() {
 }
 
 void KeepaliveOutboundPersistentConnection::on_connect_keepalive() {
-	std::lock_guard<std::mutex> lock(processor.fd_map_mutex); // Needed for schedule(), but locks before ping_mutex
+	std::lock_guard<std::mutex> lock(keepalive_processor->fd_map_mutex); // Needed for schedule(), but locks before ping_mutex
 	std::lock_guard<std::mutex> lock2(ping_mutex);
 	if (scheduled)
 		return;
@@ -466,6 +1288,7 @@ void KeepaliveOutboundPersistentConnection::on_connect_keepalive() {
 	ping_nonces_waiting.clear();
 
 	schedule();
+	keepalive_processor->wakeup(); // Net thread may be sleeping with no timeout
 }
 
 void KeepaliveOutboundPersistentConnection::on_disconnect_keepalive() {
@@ -6,11 +6,16 @@
 #include <condition_variable>
 #include <thread>
 #include <list>
+#include <deque>
 #include <vector>
 #include <set>
+#include <memory>
+#include <functional>
 #include <assert.h>
+#include <string.h>
 
 #include "utils.h"
+#include "fibermutex.h"
 
 enum DisconnectFlags {
 	DISCONNECT_STARTED = 1,
@@ -20,16 +25,88 @@ enum DisconnectFlags {
 	DISCONNECT_COMPLETE = 16,
 };
 
+class GlobalNetProcess;
+struct ConnectionFiber;
+
+#define INBOUND_RING_SIZE size_t(65536)
+
+enum InterestFlags {
+	INTEREST_READ = 1,
+	INTEREST_WRITE = 2,
+};
+
+#define OUTBOUND_INLINE_SIZE 40
+
+// Outbound traffic classes, highest priority first. Each has its own queue and, when the
+// connection is between messages, the net thread writes from the highest class with anything
+// queued which isn't waiting out its rate limit (see outbound_class_rate in connection.cpp).
+enum OutboundClass {
+	OUTBOUND_BLOCK, // Also anything sent without a class
+	// Blocks the peer can decode without its tx cache (eg RelayNodeCompressor::uncached_block_msg()),
+	// so that they needn't wait behind an OUTBOUND_ORDERED block
+	OUTBOUND_UNCACHED_BLOCK,
+	OUTBOUND_PING,
+	OUTBOUND_TX,
+	OUTBOUND_REPLAY, // Eg the tx cache replay when a relay client connects, rate-limited
+	OUTBOUND_CLASSES,
+};
+
+enum OutboundFlags {
+	// The message continues in the next buffer (which must be sent with the same send_mutex hold)
+	OUTBOUND_MORE = 1,
+	// The message may not overtake what it depends on which was queued before it in a lower class
+	// (eg relay messages, as the peer's tx cache depends on their order). Anything but a block waits
+	// its turn in the lowest class with anything queued. A block (an OUTBOUND_BLOCK message) waits
+	// at the front of OUTBOUND_BLOCK until every earlier ordered message whose seq is no greater
+	// than its own has been written, and then goes ahead of the rest. seq 0 is for messages every
+	// later block depends on (eg a tx cache replay).
+	OUTBOUND_ORDERED = 2,
+	// Record how long it was until the last byte of this buffer was written (in relay_block_write_seconds)
+	OUTBOUND_TIMED = 4,
+};
+
+// A queued outbound message: either a shared buffer (which may be queued on many connections at
+// once, eg a compressed block) or a small one (headers, pings, etc) copied inline into the entry
+class OutboundBuffer {
+private:
+	std::shared_ptr<std::vector<unsigned char> > shared;
+	uint8_t inline_size;
+	unsigned char inline_data[OUTBOUND_INLINE_SIZE];
+
+public:
+	bool more; // See OUTBOUND_MORE
+	std::chrono::steady_clock::time_point queued; // If OUTBOUND_TIMED
+	// For OUTBOUND_ORDERED messages outside OUTBOUND_BLOCK, the seq and its place in the order they
+	// were queued in (from 1, the same for each buffer of a message); for blocks, the ordered
+	// message which has to be written first (or 0). 0 for anything else.
+	uint64_t seq, ordered_index;
+
+	OutboundBuffer(const std::shared_ptr<std::vector<unsigned char> >& bytes) : shared(bytes), inline_size(0), more(false), queued(std::chrono::steady_clock::time_point::min()), seq(0), ordered_index(0) {}
+	OutboundBuffer(const char* buf, size_t nbyte) : inline_size(nbyte), more(false), queued(std::chrono::steady_clock::time_point::min()), seq(0), ordered_index(0) {
+		assert(nbyte <= OUTBOUND_INLINE_SIZE);
+		memcpy(inline_data, buf, nbyte);
+	}
+
+	const unsigned char* data() const { return shared ? &(*shared)[0] : inline_data; }
+	size_t size() const { return shared ? shared->size() : inline_size; }
+};
+
 class Connection {
 private:
 	const int sock;
-	std::mutex send_mutex, send_bytes_mutex;
+	FiberMutex send_mutex; // Held across read_all() by eg block streams
+	std::mutex send_bytes_mutex;
 	int outside_send_mutex_token;
 
 	std::function<void(void)> on_disconnect;
 
-	std::list<std::shared_ptr<std::vector<unsigned char> > > outbound_primary_queue, outbound_secondary_queue;
-	size_t primary_writepos, secondary_writepos;
+	// Protected by send_bytes_mutex
+	std::deque<OutboundBuffer> outbound_queues[OUTBOUND_CLASSES];
+	size_t outbound_writepos[OUTBOUND_CLASSES]; // Into the front of each queue
+	int outbound_writing_class; // Whose front message is partly written, -1 if none
+	int outbound_open_class; // Queue of the message still being sent with OUTBOUND_MORE, -1 if none
+	uint64_t ordered_queued, ordered_written; // The last ordered_index queued and fully written
+	std::chrono::steady_clock::time_point class_next_write[OUTBOUND_CLASSES]; // For rate-limited classes
 
 	// During initial_outbound_throttle, total_waiting_size is allowed to exceed the
 	// usual outbound buffer size but only by initial_outbound_bytes
@@ -41,15 +118,30 @@ private:
 	int64_t initial_outbound_bytes;
 	std::atomic<int64_t> total_waiting_size;
 	std::chrono::steady_clock::time_point earliest_next_write;
+	// Set by the net thread when nothing queued can be written (until earliest_next_write, or until
+	// more is queued)
+	std::atomic_bool write_throttled;
 	uint32_t max_outbound_buffer_size;
 
+	// Inbound data is recv()d by the net thread straight into the free part of a (pooled) ring,
+	// from inbound_writepos, and read_all() copies out from inbound_readpos. Each position is only
+	// touched by one thread and total_inbound_size is the only thing shared between them.
 	std::mutex read_mutex;
 	std::condition_variable read_cv;
-	size_t readpos;
+	unsigned char* inbound_ring;
+	size_t inbound_readpos, inbound_writepos;
 	std::atomic<int64_t> total_inbound_size;
-	std::list<std::unique_ptr<std::vector<unsigned char> > > inbound_queue;
+	bool inbound_eof; // Protected by read_mutex
+
+	// What our net thread's poller is currently watching for, -1 if we're not (yet/anymore) registered
+	std::mutex interest_mutex;
+	int registered_interest;
+	GlobalNetProcess* processor;
 
+	// net_process runs on either its own thread or (by default, where we have them) a fiber run by
+	// a shared pool of workers, see connection.cpp
 	std::thread *user_thread;
+	ConnectionFiber *fiber;
 	int sock_errno;
 
 	std::atomic<int> disconnectFlags;
@@ -58,16 +150,21 @@ public:
 
 	Connection(int sockIn, std::string hostIn, std::function<void(void)> on_disconnect_in, uint32_t max_outbound_buffer_size_in=10000000) :
 			sock(sockIn), outside_send_mutex_token(0xdeadbeef * (unsigned long)this), on_disconnect(on_disconnect_in),
-			primary_writepos(0), secondary_writepos(0), initial_outbound_throttle(false), initial_outbound_throttle_done(false),
+			outbound_writing_class(-1), outbound_open_class(-1), ordered_queued(0), ordered_written(0), initial_outbound_throttle(false), initial_outbound_throttle_done(false),
 			initial_outbound_bytes(0), total_waiting_size(0), earliest_next_write(std::chrono::steady_clock::time_point::min()),
-			max_outbound_buffer_size(max_outbound_buffer_size_in), readpos(0), total_inbound_size(0), sock_errno(0),
+			write_throttled(false), max_outbound_buffer_size(max_outbound_buffer_size_in), inbound_ring(NULL), inbound_readpos(0),
+			inbound_writepos(0), total_inbound_size(0), inbound_eof(false),
+			registered_interest(-1), processor(NULL), user_thread(NULL), fiber(NULL), sock_errno(0),
 			disconnectFlags(0), host(hostIn)
-		{}
+		{
+			for (int i = 0; i < OUTBOUND_CLASSES; i++) {
+				outbound_writepos[i] = 0;
+				class_next_write[i] = std::chrono::steady_clock::time_point::min();
+			}
+		}
 
 protected:
-	void construction_done() {
-		user_thread = new std::thread(do_setup_and_read, this);
-	}
+	void construction_done();
 
 public:
 	virtual ~Connection();
@@ -77,12 +174,22 @@ public:
 protected:
 	virtual void net_process(const std::function<void(std::string)>& disconnect)=0;
 	ssize_t read_all(char *buf, size_t nbyte, millis_lu_type max_sleep = millis_lu_type::max()); // Only allowed from within net_process
-
-	void do_send_bytes(const char *buf, size_t nbyte, int send_mutex_token=0) {
-		do_send_bytes(std::make_shared<std::vector<unsigned char> >((unsigned char*)buf, (unsigned char*)buf + nbyte), send_mutex_token);
+	bool read_would_block(size_t nbyte) { return total_inbound_size < int64_t(nbyte); } // Only allowed from within net_process
+	size_t read_available() { return total_inbound_size; } // Bytes read_all() can return without waiting, only allowed from within net_process
+
+	// flags are OutboundFlags, seq is for OUTBOUND_ORDERED
+	void do_send_bytes(const char *buf, size_t nbyte, int send_mutex_token=0, OutboundClass cls=OUTBOUND_BLOCK, int flags=0, uint64_t seq=0) {
+		if (nbyte <= OUTBOUND_INLINE_SIZE)
+			do_send_bytes(OutboundBuffer(buf, nbyte), send_mutex_token, cls, flags, seq);
+		else
+			do_send_bytes(OutboundBuffer(std::make_shared<std::vector<unsigned char> >((unsigned char*)buf, (unsigned char*)buf + nbyte)), send_mutex_token, cls, flags, seq);
 	}
 
-	void do_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token=0);
+	void do_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token=0, OutboundClass cls=OUTBOUND_BLOCK, int flags=0, uint64_t seq=0) { do_send_bytes(OutboundBuffer(bytes), send_mutex_token, cls, flags, seq); }
+	// How many bytes are queued which an OUTBOUND_ORDERED block with the given seq would be written
+	// after, and how many of those are in rate-limited classes
+	void ordered_backlog(uint64_t seq, size_t& bytes, size_t& rate_limited_bytes);
+	// Sends as an OUTBOUND_TX, unless someone else holds our send_mutex
 	void maybe_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token=0);
 
 public:
@@ -96,8 +203,21 @@ public:
 private:
 	void disconnect(std::string reason);
 	static void do_setup_and_read(Connection* me);
+	bool in_net_process();
+	// With read_mutex held (by lock), waits for wake_reader() (or a spurious wakeup), or stop_time
+	void wait_read(std::unique_lock<std::mutex>& lock, std::chrono::system_clock::time_point stop_time);
+	void wake_reader(); // With read_mutex held
+	void do_send_bytes(OutboundBuffer&& bytes, int send_mutex_token, OutboundClass cls, int flags, uint64_t seq);
+	void queue_bytes(OutboundBuffer&& bytes, OutboundClass cls, int flags, uint64_t seq=0); // With send_bytes_mutex
+
+	bool wants_read() { return total_inbound_size < int64_t(INBOUND_RING_SIZE) || disconnectFlags & DISCONNECT_READS_DONE; }
+	bool wants_write() { return total_waiting_size > 0 && !write_throttled; }
+	int get_interest();
+	void update_interest(bool force=false); // Tells the net thread's poller if get_interest() changed
 
 	friend class GlobalNetProcess;
+	friend class FiberPool;
+	friend class FiberMutex;
 };
 
 class OutboundPersistentConnection {
@@ -117,22 +237,30 @@ private:
 			{ }
 
 		ssize_t read_all(char *buf, size_t nbyte, millis_lu_type max_sleep) { return Connection::read_all(buf, nbyte, max_sleep); }
-		void do_send_bytes(const char *buf, size_t nbyte, int send_mutex_token) { return Connection::do_send_bytes(buf, nbyte, send_mutex_token); }
-		void do_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token) { return Connection::do_send_bytes(bytes, send_mutex_token); }
+		size_t read_available() { return Connection::read_available(); }
+		void do_send_bytes(const char *buf, size_t nbyte, int send_mutex_token, OutboundClass cls) { return Connection::do_send_bytes(buf, nbyte, send_mutex_token, cls); }
+		void do_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token, OutboundClass cls) { return Connection::do_send_bytes(bytes, send_mutex_token, cls); }
 		void construction_done() { Connection::construction_done(); }
 	};
 
 	std::atomic<unsigned long> connection;
 	static_assert(sizeof(unsigned long) == sizeof(OutboundConnection*), "unsigned long must be the size of a pointer");
 
+	std::mutex next_host_mutex;
+	std::string nextServerHost; // Set by switch_server(), used from our next connect
+
 public:
-	const std::string serverHost;
+	// Only changes (see switch_server()) while we aren't connected, so is safe to read in net_process
+	std::string serverHost;
 	const uint16_t serverPort;
 
 	OutboundPersistentConnection(std::string serverHostIn, uint16_t serverPortIn, uint32_t max_outbound_buffer_size_in=10000000) :
 			mutex_valid(false), max_outbound_buffer_size(max_outbound_buffer_size_in), connection(0), serverHost(serverHostIn), serverPort(serverPortIn)
 		{}
 
+	// Drops the current connection, reconnecting to host (on serverPort) from then on
+	void switch_server(const std::string& host);
+
 	int get_send_mutex();
 	void release_send_mutex(int token);
 	void do_throttle_outbound(int token) {
@@ -153,19 +281,20 @@ protected:
 	virtual void on_disconnect()=0;
 	virtual void net_process(const std::function<void(std::string)>& disconnect)=0;
 	ssize_t read_all(char *buf, size_t nbyte, millis_lu_type max_sleep = millis_lu_type::max()) { return ((OutboundConnection*)connection.load())->read_all(buf, nbyte, max_sleep); } // Only allowed from within net_process
+	size_t read_available() { return ((OutboundConnection*)connection.load())->read_available(); } // Only allowed from within net_process
 
-	void maybe_do_send_bytes(const char *buf, size_t nbyte, int send_mutex_token=0) {
+	void maybe_do_send_bytes(const char *buf, size_t nbyte, int send_mutex_token=0, OutboundClass cls=OUTBOUND_BLOCK) {
 		OutboundConnection* conn = (OutboundConnection*)connection.load();
 		if (conn) {
 			assert(!mutex_valid || send_mutex_token == mutex_valid);
-			conn->do_send_bytes(buf, nbyte, mutex_valid == send_mutex_token ? send_mutex_token : 0);
+			conn->do_send_bytes(buf, nbyte, mutex_valid == send_mutex_token ? send_mutex_token : 0, cls);
 		}
 	}
-	void maybe_do_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token=0) {
+	void maybe_do_send_bytes(const std::shared_ptr<std::vector<unsigned char> >& bytes, int send_mutex_token=0, OutboundClass cls=OUTBOUND_BLOCK) {
 		OutboundConnection* conn = (OutboundConnection*)connection.load();
 		if (conn) {
 			assert(!mutex_valid || send_mutex_token == mutex_valid);
-			conn->do_send_bytes(bytes, mutex_valid == send_mutex_token ? send_mutex_token : 0);
+			conn->do_send_bytes(bytes, mutex_valid == send_mutex_token ? send_mutex_token : 0, cls);
 		}
 	}
 
@@ -187,6 +316,7 @@ private:
 
 	uint32_t ping_interval_msec;
 	bool scheduled;
+	GlobalNetProcess* keepalive_processor; // Pings are scheduled on one net thread for our lifetime
 
 	void schedule();
 
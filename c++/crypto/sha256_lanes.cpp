@@ -0,0 +1,141 @@
+#include "crypto/sha256_lanes.h"
+#include "crypto/sha2.h"
+#include "crypto/common.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define SHA256_LANES_X86
+	#include <immintrin.h>
+#endif
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void transform_1(uint32_t state[8][SHA256_MAX_LANES], const unsigned char* const blocks[SHA256_MAX_LANES]) {
+	CSHA256 hash;
+	for (uint8_t i = 0; i < 8; i++)
+		hash.s[i] = state[i][0];
+	hash.Write(blocks[0], 64);
+	for (uint8_t i = 0; i < 8; i++)
+		state[i][0] = hash.s[i];
+}
+
+#ifdef SHA256_LANES_X86
+
+// The round function, written once against the vec type and helpers of whichever namespace it is
+// expanded in (so that it is compiled for that namespace's target)
+#define SHA256_LANES_TRANSFORM \
+static void transform(uint32_t state[8][SHA256_MAX_LANES], const unsigned char* const blocks[SHA256_MAX_LANES]) { \
+	vec s[8], w[16]; \
+	for (int i = 0; i < 8; i++) \
+		s[i] = load(state[i]); \
+	vec a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7]; \
+	for (int i = 0; i < 16; i++) \
+		w[i] = read_be(blocks, i); \
+	for (int i = 0; i < 64; i++) { \
+		if (i >= 16) \
+			w[i & 15] = add(add(add(sigma1(w[(i - 2) & 15]), w[(i - 7) & 15]), sigma0(w[(i - 15) & 15])), w[i & 15]); \
+		vec t1 = add(add(add(add(h, Sigma1(e)), Xor(g, And(e, Xor(f, g)))), set1(K[i])), w[i & 15]); \
+		vec t2 = add(Sigma0(a), Or(And(a, b), And(c, Or(a, b)))); \
+		h = g; g = f; f = e; e = add(d, t1); \
+		d = c; c = b; b = a; a = add(t1, t2); \
+	} \
+	store(state[0], add(s[0], a)); store(state[1], add(s[1], b)); \
+	store(state[2], add(s[2], c)); store(state[3], add(s[3], d)); \
+	store(state[4], add(s[4], e)); store(state[5], add(s[5], f)); \
+	store(state[6], add(s[6], g)); store(state[7], add(s[7], h)); \
+}
+
+#define SHA256_LANES_SIGMAS \
+static inline vec Sigma0(vec x) { return Xor(Xor(rotr(x, 2), rotr(x, 13)), rotr(x, 22)); } \
+static inline vec Sigma1(vec x) { return Xor(Xor(rotr(x, 6), rotr(x, 11)), rotr(x, 25)); } \
+static inline vec sigma0(vec x) { return Xor(Xor(rotr(x, 7), rotr(x, 18)), shr(x, 3)); } \
+static inline vec sigma1(vec x) { return Xor(Xor(rotr(x, 17), rotr(x, 19)), shr(x, 10)); }
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+namespace sse2 {
+	typedef __m128i vec;
+	static inline vec add(vec a, vec b) { return _mm_add_epi32(a, b); }
+	static inline vec Xor(vec a, vec b) { return _mm_xor_si128(a, b); }
+	static inline vec And(vec a, vec b) { return _mm_and_si128(a, b); }
+	static inline vec Or(vec a, vec b) { return _mm_or_si128(a, b); }
+	static inline vec shr(vec x, int n) { return _mm_srli_epi32(x, n); }
+	static inline vec rotr(vec x, int n) { return _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n)); }
+	static inline vec set1(uint32_t x) { return _mm_set1_epi32(x); }
+	static inline vec load(const uint32_t* p) { return _mm_loadu_si128((const __m128i*)p); }
+	static inline void store(uint32_t* p, vec v) { _mm_storeu_si128((__m128i*)p, v); }
+	static inline vec read_be(const unsigned char* const blocks[SHA256_MAX_LANES], int i) {
+		return _mm_set_epi32(ReadBE32(blocks[3] + 4*i), ReadBE32(blocks[2] + 4*i), ReadBE32(blocks[1] + 4*i), ReadBE32(blocks[0] + 4*i));
+	}
+	SHA256_LANES_SIGMAS
+	SHA256_LANES_TRANSFORM
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+namespace avx2 {
+	typedef __m256i vec;
+	static inline vec add(vec a, vec b) { return _mm256_add_epi32(a, b); }
+	static inline vec Xor(vec a, vec b) { return _mm256_xor_si256(a, b); }
+	static inline vec And(vec a, vec b) { return _mm256_and_si256(a, b); }
+	static inline vec Or(vec a, vec b) { return _mm256_or_si256(a, b); }
+	static inline vec shr(vec x, int n) { return _mm256_srli_epi32(x, n); }
+	static inline vec rotr(vec x, int n) { return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n)); }
+	static inline vec set1(uint32_t x) { return _mm256_set1_epi32(x); }
+	static inline vec load(const uint32_t* p) { return _mm256_loadu_si256((const __m256i*)p); }
+	static inline void store(uint32_t* p, vec v) { _mm256_storeu_si256((__m256i*)p, v); }
+	static inline vec read_be(const unsigned char* const blocks[SHA256_MAX_LANES], int i) {
+		return _mm256_set_epi32(ReadBE32(blocks[7] + 4*i), ReadBE32(blocks[6] + 4*i), ReadBE32(blocks[5] + 4*i), ReadBE32(blocks[4] + 4*i),
+								ReadBE32(blocks[3] + 4*i), ReadBE32(blocks[2] + 4*i), ReadBE32(blocks[1] + 4*i), ReadBE32(blocks[0] + 4*i));
+	}
+	SHA256_LANES_SIGMAS
+	SHA256_LANES_TRANSFORM
+}
+#pragma GCC pop_options
+
+#endif // SHA256_LANES_X86
+
+struct LanesImpl {
+	size_t lanes;
+	void (*transform)(uint32_t state[8][SHA256_MAX_LANES], const unsigned char* const blocks[SHA256_MAX_LANES]);
+};
+
+static LanesImpl select_impl(size_t max_lanes) {
+#ifdef SHA256_LANES_X86
+	__builtin_cpu_init();
+	if (max_lanes >= 8 && __builtin_cpu_supports("avx2"))
+		return {8, avx2::transform};
+	if (max_lanes >= 4 && __builtin_cpu_supports("sse2"))
+		return {4, sse2::transform};
+#endif
+	(void)max_lanes;
+	return {1, transform_1};
+}
+
+static LanesImpl& impl() {
+	// RELAY_SHA256_LANES can cap the width, eg to compare them
+	static LanesImpl selected = select_impl(getenv("RELAY_SHA256_LANES") ? strtoul(getenv("RELAY_SHA256_LANES"), NULL, 10) : SHA256_MAX_LANES);
+	return selected;
+}
+
+size_t sha256_lanes() {
+	return impl().lanes;
+}
+
+size_t sha256_set_max_lanes(size_t max_lanes) {
+	impl() = select_impl(max_lanes);
+	return impl().lanes;
+}
+
+void sha256_transform_lanes(uint32_t state[8][SHA256_MAX_LANES], const unsigned char* const blocks[SHA256_MAX_LANES]) {
+	impl().transform(state, blocks);
+}
@@ -0,0 +1,22 @@
+#ifndef _RELAY_SHA256_LANES_H
+#define _RELAY_SHA256_LANES_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define SHA256_MAX_LANES 8
+
+// Number of independent SHA-256 states sha256_transform_lanes() advances per call on this CPU
+// (8 with AVX2, 4 with SSE2, otherwise 1). Picked at runtime, the first time it is needed, and
+// capped by RELAY_SHA256_LANES if it is set.
+size_t sha256_lanes();
+
+// Re-picks the implementation as if RELAY_SHA256_LANES were max_lanes, returning the new
+// sha256_lanes(). Only safe while nothing else is hashing, it's for tests to compare widths.
+size_t sha256_set_max_lanes(size_t max_lanes);
+
+// Runs one SHA-256 compression of blocks[i] (64 bytes) into the state for lane i, where the state
+// for lane i is state[0][i]...state[7][i], for each i < sha256_lanes()
+void sha256_transform_lanes(uint32_t state[8][SHA256_MAX_LANES], const unsigned char* const blocks[SHA256_MAX_LANES]);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef _RELAY_FIBERMUTEX_H
+#define _RELAY_FIBERMUTEX_H
+
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+/********************
+ **** FiberMutex ****
+ ********************/
+// For mutexes which are held across read_all() (eg a compressor's while it decompresses a block,
+// or a connection's send_mutex while a block is streamed to it). A fiber may resume on another
+// worker than the one which locked, so this may be unlocked by any thread, and a fiber which has
+// to wait parks (like in read_all()) rather than blocking its worker. Anything else waits on a
+// condition variable. Waiters get the mutex in the order they asked for it.
+// Implemented in connection.cpp, next to the FiberPool.
+class FiberMutex {
+private:
+	struct Waiter;
+	std::mutex state_mutex;
+	std::condition_variable thread_cv;
+	bool locked;
+	std::deque<Waiter*> waiters;
+
+public:
+	FiberMutex() : locked(false) {}
+	FiberMutex(const FiberMutex&) = delete;
+
+	void lock();
+	bool try_lock();
+	void unlock();
+};
+
+#endif
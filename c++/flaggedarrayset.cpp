@@ -1,267 +1,292 @@
 #include "flaggedarrayset.h"
 
-#include <map>
-#include <set>
 #include <vector>
-#include <list>
-#include <thread>
+#include <array>
+#include <unordered_map>
 #include <mutex>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <algorithm>
 
 /******************************
  **** FlaggedArraySet util ****
  ******************************/
-struct PtrPair {
-	std::shared_ptr<std::vector<unsigned char> > elem;
-	std::shared_ptr<std::vector<unsigned char> > elemHash;
-	PtrPair(const std::shared_ptr<std::vector<unsigned char> >& elemIn, const std::shared_ptr<std::vector<unsigned char> >& elemHashIn) :
-		elem(elemIn), elemHash(elemHashIn) {}
-};
-
-struct SharedPtrElem {
-	PtrPair e;
-	bool operator==(const SharedPtrElem& o) const { return *e.elemHash == *o.e.elemHash; }
-	bool operator!=(const SharedPtrElem& o) const { return *e.elemHash != *o.e.elemHash; }
-	bool operator< (const SharedPtrElem& o) const { return *e.elemHash <  *o.e.elemHash; }
-	bool operator<=(const SharedPtrElem& o) const { return *e.elemHash <= *o.e.elemHash; }
-	bool operator> (const SharedPtrElem& o) const { return *e.elemHash >  *o.e.elemHash; }
-	bool operator>=(const SharedPtrElem& o) const { return *e.elemHash >= *o.e.elemHash; }
-	SharedPtrElem(const PtrPair& eIn) : e(eIn) {}
-};
-
-class Deduper {
+// Process-wide store which every FlaggedArraySet interns its elements into on add, so that a tx
+// which is cached for many peers is only kept in memory once
+class TxStore {
 private:
-	std::mutex dedup_mutex;
-	std::set<FlaggedArraySet*> allArraySets;
-	std::thread dedup_thread;
-public:
-	Deduper()
-		: dedup_thread([&]() {
-#ifdef PRECISE_BENCH
-			return;
-#endif
-			while (true) {
-				bool haveMultipleSets = false;
-				{
-					std::lock_guard<std::mutex> lock(dedup_mutex);
-					haveMultipleSets = allArraySets.size() > 1;
-				}
-
-				if (haveMultipleSets) {
-					std::list<PtrPair> ptrlist;
-
-					{
-						std::lock_guard<std::mutex> lock(dedup_mutex);
-						for (FlaggedArraySet* fas : allArraySets) {
-							if (!fas->mutex.try_lock())
-								continue;
-							std::lock_guard<WaitCountMutex> lock(fas->mutex, std::adopt_lock);
-							for (const auto& e : fas->backingMap) {
-								if (fas->mutex.wait_count())
-									break;
-								assert(e.first.elem);
-								ptrlist.push_back(PtrPair(e.first.elem, e.first.elemHash));
-							}
-						}
-					}
-
-					std::set<SharedPtrElem> txset;
-					std::map<std::vector<unsigned char>*, PtrPair> duplicateMap;
-					std::list<PtrPair> deallocList;
-					for (const auto& ptr : ptrlist) {
-						assert(ptr.elemHash);
-						auto res = txset.insert(SharedPtrElem(ptr));
-						if (!res.second && res.first->e.elem != ptr.elem)
-							duplicateMap.insert(std::make_pair(&(*ptr.elem), res.first->e));
-					}
-
-					int dedups = 0;
-					{
-						std::lock_guard<std::mutex> lock(dedup_mutex);
-						for (FlaggedArraySet* fas : allArraySets) {
-							if (!fas->mutex.try_lock())
-								continue;
-							std::lock_guard<WaitCountMutex> lock(fas->mutex, std::adopt_lock);
-							for (auto& e : fas->backingMap) {
-								if (fas->mutex.wait_count())
-									break;
-								assert(e.first.elem);
-								auto it = duplicateMap.find(&(*e.first.elem));
-								if (it != duplicateMap.end()) {
-									assert(*it->second.elem == *e.first.elem);
-									assert(*it->second.elemHash == *e.first.elemHash);
-									deallocList.emplace_back(it->second);
-									const_cast<ElemAndFlag&>(e.first).elem.swap(deallocList.back().elem);
-									const_cast<ElemAndFlag&>(e.first).elemHash.swap(deallocList.back().elemHash);
-									dedups++;
-								}
-							}
-						}
-					}
-#ifdef FOR_TEST
-					if (dedups)
-						printf("Deduped %d txn\n", dedups);
-#endif
-				}
-#ifdef FOR_TEST
-				std::this_thread::sleep_for(std::chrono::milliseconds(5));
-#else
-				std::this_thread::sleep_for(std::chrono::milliseconds(5000));
-#endif
-			}
-		})
-	{}
+	typedef std::array<unsigned char, 32> Txid;
+	struct TxidHash {
+		size_t operator()(const Txid& txid) const {
+			size_t res;
+			memcpy(&res, &txid[8], sizeof(res)); // txid[0] selects the shard
+			return res;
+		}
+	};
+	struct Entry {
+		std::shared_ptr<std::vector<unsigned char> > tx;
+		uint64_t refcount;
+	};
+	struct Shard {
+		std::mutex mutex;
+		std::unordered_map<Txid, Entry, TxidHash> map;
+	};
+
+	static const size_t SHARD_COUNT = 16;
+	Shard shards[SHARD_COUNT];
 
-	~Deduper() {
-		//TODO: close thread
+public:
+	std::shared_ptr<std::vector<unsigned char> > intern(const unsigned char* txid, const std::shared_ptr<std::vector<unsigned char> >& tx) {
+		Txid key;
+		memcpy(&key[0], txid, 32);
+		Shard& shard = shards[txid[0] % SHARD_COUNT];
+
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		Entry& e = shard.map.insert(std::make_pair(key, Entry{tx, 0})).first->second;
+		e.refcount++;
+		return e.tx;
 	}
 
-	void addFAS(FlaggedArraySet* fas) {
-		std::lock_guard<std::mutex> lock(dedup_mutex);
-		allArraySets.insert(fas);
-	}
+	void release(const unsigned char* txid) {
+		Txid key;
+		memcpy(&key[0], txid, 32);
+		Shard& shard = shards[txid[0] % SHARD_COUNT];
 
-	void removeFAS(FlaggedArraySet* fas) {
-		std::lock_guard<std::mutex> lock(dedup_mutex);
-		allArraySets.erase(fas);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.map.find(key);
+		assert(it != shard.map.end() && it->second.refcount);
+		if (!--it->second.refcount)
+			shard.map.erase(it);
 	}
 };
 
-static Deduper* deduper;
+static TxStore& tx_store() {
+	static TxStore* store = new TxStore(); // Never free'd, FlaggedArraySets may be destroyed at exit
+	return *store;
+}
 
-FlaggedArraySet::FlaggedArraySet(uint64_t maxSizeIn, uint64_t maxFlagCountIn) :
-		maxSize(maxSizeIn), maxFlagCount(maxFlagCountIn), backingMap(maxSize) {
+FlaggedArraySet::FlaggedArraySet(uint64_t maxSizeIn, uint64_t maxFlagCountIn, bool concurrentIn) :
+		maxSize(maxSizeIn), maxFlagCount(maxFlagCountIn), adds(0), last_evicting(0), concurrent(concurrentIn) {
 	clear();
-	if (!deduper)
-		deduper = new Deduper();
-	deduper->addFAS(this);
 }
 
 FlaggedArraySet::~FlaggedArraySet() {
-	deduper->removeFAS(this);
 	assert(sanity_check());
+	clear();
 }
 
 
-ElemAndFlag::ElemAndFlag(const std::shared_ptr<std::vector<unsigned char> >& elemIn, uint32_t flagIn, bool setHash) :
-	flag(flagIn), elem(elemIn)
-{
-	if (setHash) {
-		elemHash = std::make_shared<std::vector<unsigned char> >(32);
-		double_sha256(&(*elem)[0], &(*elemHash)[0], elem->size());
+bool FlaggedArraySet::sanity_check() const {
+	size_t capacity = slotTree.size() - 1;
+	assert(slots.size() <= capacity);
+	assert(this->size() == live - to_be_removed.size());
+	assert(!concurrent || concurrentHashes.size() == this->size());
+
+	uint64_t expected_flag_count = 0, expected_live = 0;
+	std::vector<uint32_t> expected_tree(capacity + 1);
+	for (uint64_t i = 0; i < slots.size(); i++) {
+		if (!slots[i].elem)
+			continue;
+		expected_flag_count += slots[i].flag;
+		expected_tree[i + 1]++;
+		expected_live++;
+
+#ifndef NDEBUG
+		size_t pos;
+		assert(find_hash(slots[i].elemHash, pos) && hashTable[pos] == i + 1);
+		assert(find_elem(&(*slots[i].elem)[0], slots[i].elem->size(), pos) && elemTable[pos] == i + 1);
+#endif
 	}
+	for (size_t i = 1; i <= capacity; i++)
+		if (i + (i & -i) <= capacity)
+			expected_tree[i + (i & -i)] += expected_tree[i];
+	assert(expected_tree == slotTree);
+	assert(expected_live == live);
+	assert(expected_flag_count == flag_count);
+	assert(hashTable.size() == 2 * capacity && elemTable.size() == 2 * capacity);
+	assert(size_t(std::count_if(hashTable.begin(), hashTable.end(), [](uint32_t e) { return e != 0; })) == live);
+	assert(size_t(std::count_if(elemTable.begin(), elemTable.end(), [](uint32_t e) { return e != 0; })) == live);
+
+	uint64_t expected_flags_removed = 0;
+	for (size_t i = 0; i < to_be_removed.size(); i++)
+		expected_flags_removed += slots.at(slot_of(to_be_removed[i] + i)).flag;
+	assert(expected_flags_removed == flags_to_remove);
+
+	assert(this->size() <= maxSize);
+	assert(flagCount() <= maxFlagCount);
+
+	return expected_flags_removed == flags_to_remove && expected_flag_count == flag_count;
 }
-ElemAndFlag::ElemAndFlag(const std::shared_ptr<std::vector<unsigned char> >& elemHashIn, std::nullptr_t) :
-	elemHash(elemHashIn) {}
-ElemAndFlag::ElemAndFlag(const std::vector<unsigned char>::const_iterator& elemBeginIn, const std::vector<unsigned char>::const_iterator& elemEndIn, uint32_t flagIn) :
-	flag(flagIn), elemBegin(elemBeginIn), elemEnd(elemEndIn) {}
-
-bool ElemAndFlag::operator == (const ElemAndFlag& o) const {
-	if ((elem && o.elem) || (elemHash && o.elemHash)) {
-		bool hashSet = o.elemHash && elemHash;
-		return o.elem == elem ||
-			(hashSet && *o.elemHash == *elemHash) ||
-			(!hashSet && *o.elem == *elem);
-	} else {
-		std::vector<unsigned char>::const_iterator o_begin, o_end, e_begin, e_end;
-		if (elem) {
-			e_begin = elem->begin();
-			e_end = elem->end();
-		} else {
-			e_begin = elemBegin;
-			e_end = elemEnd;
-		}
-		if (o.elem) {
-			o_begin = o.elem->begin();
-			o_end = o.elem->end();
-		} else {
-			o_begin = o.elemBegin;
-			o_end = o.elemEnd;
+
+// Finds the slot of the index'th live element by descending slotTree
+size_t FlaggedArraySet::slot_of(size_t index) const {
+	size_t capacity = slotTree.size() - 1, pos = 0;
+	uint32_t remaining = index + 1;
+	for (size_t step = capacity; step; step >>= 1) {
+		if (pos + step <= capacity && slotTree[pos + step] < remaining) {
+			pos += step;
+			remaining -= slotTree[pos];
 		}
-		return o_end - o_begin == e_end - e_begin && !memcmp(&(*o_begin), &(*e_begin), o_end - o_begin);
 	}
+	assert(pos < slots.size() && slots[pos].elem);
+	return pos;
 }
 
-size_t std::hash<ElemAndFlag>::operator()(const ElemAndFlag& e) const {
-	std::vector<unsigned char>::const_iterator it, end;
-	if (e.elem) {
-		it = e.elem->begin();
-		end = e.elem->end();
-	} else {
-		it = e.elemBegin;
-		end = e.elemEnd;
+size_t FlaggedArraySet::index_of(size_t slot) const {
+	size_t res = 0;
+	for (size_t i = slot + 1; i; i -= i & -i)
+		res += slotTree[i];
+	return res - 1;
+}
+
+void FlaggedArraySet::tree_add(size_t slot, int32_t delta) {
+	for (size_t i = slot + 1; i < slotTree.size(); i += i & -i)
+		slotTree[i] += delta;
+}
+
+// (Re)builds slots/slotTree with no tombstones and room for capacity (a power of 2) slots
+void FlaggedArraySet::compact(size_t capacity) {
+	assert(!(capacity & (capacity - 1)) && capacity >= live);
+	size_t new_slot = 0;
+	for (size_t i = 0; i < slots.size(); i++) {
+		if (!slots[i].elem)
+			continue;
+		if (new_slot != i)
+			slots[new_slot] = std::move(slots[i]);
+		new_slot++;
 	}
+	slots.resize(live);
+	slots.reserve(capacity);
+
+	slotTree.assign(capacity + 1, 0);
+	for (size_t i = 1; i <= live; i++)
+		slotTree[i] = 1;
+	for (size_t i = 1; i <= capacity; i++)
+		if (i + (i & -i) <= capacity)
+			slotTree[i + (i & -i)] += slotTree[i];
+
+	tables_rebuild();
+}
 
-	if (end - it < 5 + 32 + 4) {
+void FlaggedArraySet::add_slot(ElemAndFlag&& e) {
+	size_t capacity = slotTree.size() - 1;
+	if (slots.size() == capacity) {
+		// Only grow if we're more than half full of live entries, so compaction is amortized O(1)
+		while (capacity < live * 2)
+			capacity *= 2;
+		compact(capacity);
+	}
+	size_t slot = slots.size();
+	flag_count += e.flag;
+	e.elem = tx_store().intern(e.elemHash, e.elem);
+	if (concurrent)
+		concurrentHashes.insert(e.elemHash);
+	slots.emplace_back(std::move(e));
+	tree_add(slot, 1);
+	table_insert(hashTable, slot);
+	table_insert(elemTable, slot);
+	live++;
+}
+
+// late is set when finishing a remove which was put in to_be_removed (and already removed from
+// concurrentHashes)
+void FlaggedArraySet::remove_slot(size_t slot, bool late) {
+	ElemAndFlag& rm = slots[slot];
+	assert(slot < slots.size() && rm.elem);
+	flag_count -= rm.flag;
+	if (concurrent && !late)
+		concurrentHashes.erase(rm.elemHash);
+
+	tree_add(slot, -1);
+	table_remove(hashTable, slot);
+	table_remove(elemTable, slot);
+	tx_store().release(rm.elemHash);
+	rm.elem.reset();
+	live--;
+}
+
+static inline uint64_t elem_key(const unsigned char* elem, size_t elemSize) {
+	// For txn, these are bytes out of the first input's prevout hash, so should be plenty random
+	if (elemSize < 5 + 32 + 4) {
 		assert(0);
 		return 42; // WAT?
 	}
-	it += 5 + 32 + 4 - 8;
-	size_t res = 0;
-	static_assert(sizeof(size_t) == 4 || sizeof(size_t) == 8, "Your size_t is neither 32-bit nor 64-bit?");
-	for (unsigned int i = 0; i < 8; i += sizeof(size_t)) {
-		for (unsigned int j = 0; j < sizeof(size_t); j++)
-			res ^= *(it + i + j) << 8*j;
-	}
-	return res;
+	uint64_t key;
+	memcpy(&key, elem + 5 + 32 + 4 - 8, sizeof(key));
+	return key;
 }
 
+static inline uint64_t hash_key(const unsigned char* elemHash) {
+	uint64_t key;
+	memcpy(&key, elemHash, sizeof(key));
+	return key;
+}
 
-bool FlaggedArraySet::sanity_check() const {
-	size_t size = indexMap.size();
-	assert(backingMap.size() == size);
-	assert(this->size() == size - to_be_removed.size());
-
-	uint64_t expected_flag_count = 0;
-	for (uint64_t i = 0; i < size; i++) {
-		std::unordered_map<ElemAndFlag, uint64_t>::iterator it = indexMap.at(i);
-		assert(it != backingMap.end());
-		assert(it->second == i + offset);
-		assert(backingMap.find(it->first) == it);
-		assert(&backingMap.find(it->first)->first == &it->first);
-		expected_flag_count += it->first.flag;
-	}
-	assert(expected_flag_count == flag_count);
+uint64_t FlaggedArraySet::table_key(const std::vector<uint32_t>& table, size_t slot) const {
+	if (&table == &hashTable)
+		return hash_key(slots[slot].elemHash);
+	return elem_key(&(*slots[slot].elem)[0], slots[slot].elem->size());
+}
 
-	uint64_t expected_flags_removed = 0;
-	for (size_t i = 0; i < to_be_removed.size(); i++) {
-		std::unordered_map<ElemAndFlag, uint64_t>::iterator it = indexMap.at(to_be_removed[i] + i);
-		expected_flags_removed += it->first.flag;
+bool FlaggedArraySet::find_hash(const unsigned char* elemHash, size_t& pos) const {
+	size_t mask = hashTable.size() - 1;
+	for (pos = hash_key(elemHash) & mask; hashTable[pos]; pos = (pos + 1) & mask)
+		if (!memcmp(slots[hashTable[pos] - 1].elemHash, elemHash, 32))
+			return true;
+	return false;
+}
+
+bool FlaggedArraySet::find_elem(const unsigned char* elem, size_t elemSize, size_t& pos) const {
+	size_t mask = elemTable.size() - 1;
+	for (pos = elem_key(elem, elemSize) & mask; elemTable[pos]; pos = (pos + 1) & mask) {
+		const std::vector<unsigned char>& e = *slots[elemTable[pos] - 1].elem;
+		if (e.size() == elemSize && !memcmp(&e[0], elem, elemSize))
+			return true;
 	}
-	assert(expected_flags_removed == flags_to_remove);
+	return false;
+}
 
-	assert(this->size() <= maxSize);
-	assert(flagCount() <= maxFlagCount);
+void FlaggedArraySet::table_insert(std::vector<uint32_t>& table, size_t slot) {
+	size_t mask = table.size() - 1, pos;
+	for (pos = table_key(table, slot) & mask; table[pos]; pos = (pos + 1) & mask)
+		assert(table[pos] != slot + 1);
+	table[pos] = slot + 1;
+}
 
-	return expected_flags_removed == flags_to_remove && expected_flag_count == flag_count;
+void FlaggedArraySet::table_remove(std::vector<uint32_t>& table, size_t slot) {
+	size_t mask = table.size() - 1, pos;
+	for (pos = table_key(table, slot) & mask; table[pos] != slot + 1; pos = (pos + 1) & mask)
+		assert(table[pos]);
+
+	// Backward-shift deletion: pull up anything later in the probe run which could live at pos
+	for (size_t next = (pos + 1) & mask; table[next]; next = (next + 1) & mask) {
+		size_t ideal = table_key(table, table[next] - 1) & mask;
+		if (((next - ideal) & mask) >= ((next - pos) & mask)) {
+			table[pos] = table[next];
+			pos = next;
+		}
+	}
+	table[pos] = 0;
 }
 
-void FlaggedArraySet::remove_(size_t index) {
-	auto& rm = indexMap[index];
-	assert(index < indexMap.size());
-	flag_count -= rm->first.flag;
-
-	size_t size = backingMap.size();
-
-	if (index < size/2) {
-		for (uint64_t i = 0; i < index; i++)
-			indexMap[i]->second++;
-		offset++;
-	} else
-		for (uint64_t i = index + 1; i < size; i++)
-			indexMap[i]->second--;
-	backingMap.erase(rm);
-	indexMap.erase(indexMap.begin() + index);
+void FlaggedArraySet::tables_rebuild() {
+	hashTable.assign(2 * (slotTree.size() - 1), 0);
+	elemTable.assign(2 * (slotTree.size() - 1), 0);
+	for (size_t i = 0; i < slots.size(); i++) {
+		if (slots[i].elem) {
+			table_insert(hashTable, i);
+			table_insert(elemTable, i);
+		}
+	}
 }
 
 void FlaggedArraySet::cleanup_late_remove() const {
 	assert(sanity_check());
 	if (to_be_removed.size()) {
 		for (unsigned int i = 0; i < to_be_removed.size(); i++) {
-			assert((unsigned int)to_be_removed[i] < indexMap.size());
-			const_cast<FlaggedArraySet*>(this)->remove_(to_be_removed[i]);
+			assert((unsigned int)to_be_removed[i] < live);
+			const_cast<FlaggedArraySet*>(this)->remove_(to_be_removed[i], true);
 		}
 		to_be_removed.clear();
 		flags_to_remove = 0;
@@ -271,74 +296,105 @@ void FlaggedArraySet::cleanup_late_remove() const {
 }
 
 bool FlaggedArraySet::contains(const std::shared_ptr<std::vector<unsigned char> >& e) const {
-	std::lock_guard<WaitCountMutex> lock(mutex);
 	cleanup_late_remove();
-	return backingMap.count(ElemAndFlag(e, 0, false));
+	size_t pos;
+	return find_elem(&(*e)[0], e->size(), pos);
 }
 
 bool FlaggedArraySet::contains(const unsigned char* elemHash) const {
-	//TODO: Come up with a cheap way to optimize this?
-	std::lock_guard<WaitCountMutex> lock(mutex);
 	cleanup_late_remove();
-	ElemAndFlag e(std::make_shared<std::vector<unsigned char> >(elemHash, elemHash + 32), NULL);
-	for (const std::unordered_map<ElemAndFlag, uint64_t>::iterator& it : indexMap)
-		if (it->first == e)
-			return true;
-	return false;
+	size_t pos;
+	return find_hash(elemHash, pos);
+}
+
+bool FlaggedArraySet::contains_concurrent(const unsigned char* elemHash) const {
+	assert(concurrent);
+	return concurrentHashes.contains(elemHash);
 }
 
 void FlaggedArraySet::add(const std::shared_ptr<std::vector<unsigned char> >& e, uint32_t flag) {
-	ElemAndFlag elem(e, flag, true);
+	ElemAndFlag elem;
+	elem.elem = e;
+	elem.flag = flag;
+	double_sha256(&(*e)[0], elem.elemHash, e->size());
 
-	std::lock_guard<WaitCountMutex> lock(mutex);
 	cleanup_late_remove();
 
-	auto res = backingMap.insert(std::make_pair(elem, size() + offset));
-	if (!res.second)
+	size_t pos;
+	if (find_hash(elem.elemHash, pos))
 		return;
 
-	indexMap.push_back(res.first);
-	flag_count += flag;
+	elem.seq = ++adds;
+	add_slot(std::move(elem));
 
 	assert(size() <= maxSize + 1);
 	assert(flagCount() <= maxFlagCount + flag);
-	while (size() > maxSize || flagCount() > maxFlagCount)
+	while (size() > maxSize || flagCount() > maxFlagCount) {
 		remove_(0);
+		last_evicting = adds;
+	}
 
 	assert(sanity_check());
 }
 
-int FlaggedArraySet::remove(const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end) {
-	std::lock_guard<WaitCountMutex> lock(mutex);
+int FlaggedArraySet::remove(const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end, uint64_t* seq) {
 	cleanup_late_remove();
 
-	auto it = backingMap.find(ElemAndFlag(start, end, 0));
-	if (it == backingMap.end())
+	size_t pos;
+	if (start == end || !find_elem(&(*start), end - start, pos))
 		return -1;
 
-	int res = it->second - offset;
-	remove_(res);
+	size_t slot = elemTable[pos] - 1;
+	int res = index_of(slot);
+	if (seq)
+		*seq = slots[slot].seq;
+	remove_slot(slot);
+
+	assert(sanity_check());
+	return res;
+}
+
+int FlaggedArraySet::remove(const unsigned char* elemHash, uint64_t* seq) {
+	cleanup_late_remove();
+
+	size_t pos;
+	if (!find_hash(elemHash, pos))
+		return -1;
+
+	size_t slot = hashTable[pos] - 1;
+	int res = index_of(slot);
+	if (seq)
+		*seq = slots[slot].seq;
+	remove_slot(slot);
 
 	assert(sanity_check());
 	return res;
 }
 
 bool FlaggedArraySet::remove(unsigned int index, std::vector<unsigned char>& elemRes, unsigned char* elemHashRes) {
-	std::lock_guard<WaitCountMutex> lock(mutex);
+	std::shared_ptr<std::vector<unsigned char> > e;
+	if (!remove(index, e, elemHashRes))
+		return false;
+	elemRes = *e;
+	return true;
+}
 
+bool FlaggedArraySet::remove(unsigned int index, std::shared_ptr<std::vector<unsigned char> >& elemRes, unsigned char* elemHashRes) {
 	if (index < max_remove)
 		cleanup_late_remove();
 	int lookup_index = index + to_be_removed.size();
 
-	if ((unsigned int)lookup_index >= indexMap.size())
+	if ((unsigned int)lookup_index >= live)
 		return false;
 
-	const ElemAndFlag& e = indexMap[lookup_index]->first;
-	assert(e.elem && e.elemHash);
-	memcpy(elemHashRes, &(*e.elemHash)[0], 32);
-	elemRes = *e.elem;
+	const ElemAndFlag& e = slots[slot_of(lookup_index)];
+	assert(e.elem);
+	memcpy(elemHashRes, e.elemHash, 32);
+	elemRes = e.elem;
 
 	if (index >= max_remove) {
+		if (concurrent)
+			concurrentHashes.erase(e.elemHash);
 		to_be_removed.push_back(index);
 		max_remove = index;
 		flags_to_remove += e.flag;
@@ -352,20 +408,49 @@ bool FlaggedArraySet::remove(unsigned int index, std::vector<unsigned char>& ele
 }
 
 void FlaggedArraySet::clear() {
-	std::lock_guard<WaitCountMutex> lock(mutex);
-	if (!indexMap.empty() && !backingMap.empty())
+	if (!slotTree.empty() && live)
 		assert(sanity_check());
 
-	flag_count = 0; offset = 0;
+	for (const ElemAndFlag& e : slots)
+		if (e.elem)
+			tx_store().release(e.elemHash);
+
+	flag_count = 0; live = 0;
 	flags_to_remove = 0; max_remove = 0;
-	backingMap.clear(); indexMap.clear(); to_be_removed.clear();
+	slots.clear(); to_be_removed.clear();
+	concurrentHashes.clear();
+	slotTree.assign(1024 + 1, 0);
+	hashTable.assign(2 * 1024, 0);
+	elemTable.assign(2 * 1024, 0);
+}
+
+FlaggedArraySet& FlaggedArraySet::operator=(const FlaggedArraySet& o) {
+	o.cleanup_late_remove();
+	clear();
+
+	maxSize = o.maxSize;
+	maxFlagCount = o.maxFlagCount;
+	adds = o.adds;
+	last_evicting = o.last_evicting;
+	concurrent = o.concurrent;
+	for (const ElemAndFlag& e : o.slots)
+		if (e.elem)
+			add_slot(ElemAndFlag(e));
+
+	assert(sanity_check());
+	return *this;
 }
 
 void FlaggedArraySet::for_all_txn(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&)> callback) const {
-	std::lock_guard<WaitCountMutex> lock(mutex);
 	cleanup_late_remove();
-	for (const auto& e : indexMap) {
-		assert(e->first.elem);
-		callback(e->first.elem);
-	}
+	for (const ElemAndFlag& e : slots)
+		if (e.elem)
+			callback(e.elem);
+}
+
+void FlaggedArraySet::for_all_txn_hashes(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&, const unsigned char* elemHash)> callback) const {
+	cleanup_late_remove();
+	for (const ElemAndFlag& e : slots)
+		if (e.elem)
+			callback(e.elem, e.elemHash);
 }
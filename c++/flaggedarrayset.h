@@ -5,42 +5,44 @@
 #include <thread>
 #include <map>
 #include <unordered_map>
+#include <memory>
+#include <functional>
 #include <cstddef>
 
 #include "utils.h"
+#include "seqlockhashset.h"
 
 /******************************
  **** FlaggedArraySet util ****
  ******************************/
+// FlaggedArraySet is not thread-safe, except for contains_concurrent(). elem is interned in a process-wide store, so any identical
+// tx held in other FlaggedArraySets shares the same buffer.
 struct ElemAndFlag {
+	std::shared_ptr<std::vector<unsigned char> > elem; // NULL if this slot has been removed
 	uint32_t flag;
-	std::shared_ptr<std::vector<unsigned char> > elem, elemHash;
-	std::vector<unsigned char>::const_iterator elemBegin, elemEnd;
-	ElemAndFlag(const std::shared_ptr<std::vector<unsigned char> >& elemIn, uint32_t flagIn, bool setHash);
-	ElemAndFlag(const std::shared_ptr<std::vector<unsigned char> >& elemHashIn, std::nullptr_t);
-	ElemAndFlag(const std::vector<unsigned char>::const_iterator& elemBegin, const std::vector<unsigned char>::const_iterator& elemEnd, uint32_t flagIn);
-	bool operator == (const ElemAndFlag& o) const;
+	uint64_t seq; // See FlaggedArraySet::last_seq()
+	unsigned char elemHash[32];
 };
-namespace std {
-	template <> struct hash<ElemAndFlag> {
-		size_t operator()(const ElemAndFlag& e) const;
-	};
-}
-
 
 
 class FlaggedArraySet {
 private:
 	uint64_t maxSize, maxFlagCount, flag_count;
-	size_t offset;
-	std::unordered_map<ElemAndFlag, uint64_t> backingMap;
-	std::vector<std::unordered_map<ElemAndFlag, uint64_t>::iterator> indexMap;
-
-	// The mutex is only used by memory deduper, FlaggedArraySet is not thread-safe
-	// It is taken by changes to backingMap, any touches to backingMap in the deduper thread, or any touches to elem
-	friend class Deduper;
-	friend class FASLockHint;
-	mutable WaitCountMutex mutex;
+	size_t live;
+	uint64_t adds, last_evicting; // See last_seq() and evicting_seq()
+	// Elements are stored by slot, in insertion order, with removed elements left as tombstones
+	// until the next compact().
+	// slotTree is a Fenwick tree over slots (1 per live slot) so that we can go between slot and
+	// (wire-visible) index in O(log n) instead of shifting everything after each remove
+	std::vector<ElemAndFlag> slots;
+	std::vector<uint32_t> slotTree;
+	// Open-addressed (linear probing) tables of slot + 1 (0 is empty). hashTable is keyed on the
+	// first 8 bytes of elemHash, elemTable on 8 bytes from the middle of the first input's prevout
+	// hash, so lookups by tx data need no hashing. Both are twice the size of slotTree and rebuilt with it.
+	std::vector<uint32_t> hashTable, elemTable;
+	// If enabled, a copy of the elemHashes, for contains_concurrent()
+	bool concurrent;
+	SeqlockHashSet concurrentHashes;
 
 	mutable std::vector<int> to_be_removed;
 	mutable uint32_t max_remove;
@@ -48,46 +50,55 @@ private:
 
 public:
 	void clear();
-	FlaggedArraySet(uint64_t maxSizeIn, uint64_t maxFlagCountIn);
+	FlaggedArraySet(uint64_t maxSizeIn, uint64_t maxFlagCountIn, bool concurrentIn=false);
 	~FlaggedArraySet();
 
-	size_t size() const { return backingMap.size() - to_be_removed.size(); }
+	size_t size() const { return live - to_be_removed.size(); }
 	uint64_t flagCount() const { return flag_count - flags_to_remove; }
 	bool contains(const std::shared_ptr<std::vector<unsigned char> >& e) const;
 	bool contains(const unsigned char* elemHash) const;
+	// May be called while another thread is modifying us, if we were constructed with concurrentIn.
+	// (May give false positives, see SeqlockHashSet)
+	bool contains_concurrent(const unsigned char* elemHash) const;
 
-	FlaggedArraySet& operator=(const FlaggedArraySet& o) {
-		o.cleanup_late_remove();
-		clear();
+	// Each element add()ed gets the next seq (from 1, never reused, even across clear()s). A peer
+	// mirroring us by index needs to have seen every add up to the seq of each element it looks
+	// up, and up to evicting_seq(), the last add which pushed the oldest elements out (as that
+	// shifts every index).
+	uint64_t last_seq() const { return adds; }
+	uint64_t evicting_seq() const { return last_evicting; }
 
-		maxSize = o.maxSize;
-		maxFlagCount = o.maxFlagCount;
-		flag_count = o.flag_count;
-		offset = o.offset;
-		backingMap = o.backingMap;
-		indexMap = o.indexMap;
-		return *this;
-	}
+	FlaggedArraySet& operator=(const FlaggedArraySet& o);
 
 private:
 	bool sanity_check() const;
-	void remove_(size_t index);
+	size_t slot_of(size_t index) const;
+	size_t index_of(size_t slot) const;
+	void tree_add(size_t slot, int32_t delta);
+	void compact(size_t capacity);
+	void add_slot(ElemAndFlag&& e);
+	void remove_slot(size_t slot, bool late=false);
+	void remove_(size_t index, bool late=false) { remove_slot(slot_of(index), late); }
+
+	uint64_t table_key(const std::vector<uint32_t>& table, size_t slot) const;
+	bool find_hash(const unsigned char* elemHash, size_t& pos) const;
+	bool find_elem(const unsigned char* elem, size_t elemSize, size_t& pos) const;
+	void table_insert(std::vector<uint32_t>& table, size_t slot);
+	void table_remove(std::vector<uint32_t>& table, size_t slot);
+	void tables_rebuild();
+
 	void cleanup_late_remove() const;
 
 public:
 	void add(const std::shared_ptr<std::vector<unsigned char> >& e, uint32_t flag);
-	int remove(const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end);
+	// Return the index the element had (and set *seq to its seq, if given), or -1 if we didn't have it
+	int remove(const std::vector<unsigned char>::const_iterator& start, const std::vector<unsigned char>::const_iterator& end, uint64_t* seq=NULL);
+	int remove(const unsigned char* elemHash, uint64_t* seq=NULL);
 	bool remove(unsigned int index, std::vector<unsigned char>& elemRes, unsigned char* elemHashRes);
+	bool remove(unsigned int index, std::shared_ptr<std::vector<unsigned char> >& elemRes, unsigned char* elemHashRes); // Doesn't copy the tx
 
 	void for_all_txn(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&)> callback) const;
-};
-
-class FASLockHint {
-private:
-	WaitCountHint* hint;
-public:
-	FASLockHint(FlaggedArraySet& fas) : hint(new WaitCountHint(fas.mutex)) {}
-	~FASLockHint() { delete hint; }
+	void for_all_txn_hashes(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&, const unsigned char* elemHash)> callback) const;
 };
 
 #endif
@@ -19,21 +19,29 @@
 
 
 class MempoolClient : public Connection {
+private:
+	// Called with the client's first record, or NULL if it didn't send one promptly (as old clients
+	// don't), to send it what it is missing of our mempool and start sending it new txn
+	const std::function<void (MempoolClient*, const char*)> sync;
+
 public:
-	MempoolClient(int fd_in, std::string hostIn) : Connection(fd_in, hostIn, NULL) { construction_done(); }
-	void send_pool(std::set<std::vector<unsigned char> >::const_iterator mempool_begin, const std::set<std::vector<unsigned char> >::const_iterator mempool_end, int send_mutex=0) {
-		while (mempool_begin != mempool_end) {
-			assert(mempool_begin->size() == 32);
-			do_send_bytes((const char*) &(*mempool_begin)[0], 32, send_mutex);
-			mempool_begin++;
-		}
+	MempoolClient(int fd_in, std::string hostIn, const std::function<void (MempoolClient*, const char*)>& sync_in)
+		: Connection(fd_in, hostIn, NULL), sync(sync_in) { construction_done(); }
+	// Hashes, and/or the 32-byte MEMPOOL_SYNC_MAGIC record
+	void send_hashes(const std::shared_ptr<std::vector<unsigned char> >& hashes) {
+		assert(hashes->size() % 32 == 0);
+		if (!hashes->empty())
+			do_send_bytes(hashes);
 	}
 private:
 	void net_process(const std::function<void(std::string)>& disconnect) {
-		char buf[42];
+		char buf[MEMPOOL_RECORD_SIZE];
+		ssize_t res = read_all(buf, MEMPOOL_RECORD_SIZE, std::chrono::seconds(1));
+		if (res < 0)
+			return disconnect("Socket error reading bytes from mempool client");
+		sync(this, res == MEMPOOL_RECORD_SIZE ? buf : NULL);
 		while (true) {
-			ssize_t res = read_all(buf, 42);
-			if (res != 42)
+			if (read_all(buf, MEMPOOL_RECORD_SIZE) != MEMPOOL_RECORD_SIZE)
 				return disconnect("Socket error reading bytes from mempool client");
 		}
 	}
@@ -69,9 +77,46 @@ int main(int argc, char** argv) {
 	std::mutex map_mutex;
 	std::map<std::string, MempoolClient*> clientMap;
 
+	// Clients are only sent new txn once they have been synced, and both happen under mempool_mutex,
+	// so each client gets our txn in mempool order, and a resuming one can say where it got up to by
+	// counting them. Positions are only meaningful along with our epoch.
 	std::mutex mempool_mutex;
 	std::chrono::steady_clock::time_point last_mempool_request(std::chrono::steady_clock::time_point::min());
-	vectormruset mempool(MAX_FAS_TOTAL_SIZE);
+	hash_mruset<32> mempool(MAX_FAS_TOTAL_SIZE / 32);
+	uint64_t mempool_position = 0; // How many txn have ever been added to mempool
+	std::set<MempoolClient*> synced_clients;
+	const uint64_t epoch = std::chrono::system_clock::now().time_since_epoch().count() | 1;
+
+	const std::function<void (MempoolClient*, const char*)> sync = [&](MempoolClient* client, const char* record) {
+		std::lock_guard<std::mutex> lock(mempool_mutex);
+		uint64_t first_position = mempool_position - mempool.size();
+		auto hashes = std::make_shared<std::vector<unsigned char> >();
+		if (record && !memcmp(record, MEMPOOL_RESUME_MAGIC, 8)) {
+			uint64_t client_epoch, client_position;
+			memcpy(&client_epoch, record + 8, 8);
+			memcpy(&client_position, record + 16, 8);
+			if (le64toh(client_epoch) == epoch && le64toh(client_position) >= first_position && le64toh(client_position) <= mempool_position)
+				first_position = le64toh(client_position);
+
+			hashes->resize(32);
+			uint64_t le_epoch = htole64(epoch), le_position = htole64(first_position);
+			memcpy(&(*hashes)[0], MEMPOOL_SYNC_MAGIC, 8);
+			memcpy(&(*hashes)[8], &le_epoch, 8);
+			memcpy(&(*hashes)[16], &le_position, 8);
+		}
+
+		hashes->reserve(hashes->size() + (mempool_position - first_position) * 32);
+		uint64_t skip = first_position - (mempool_position - mempool.size());
+		mempool.for_each([&](const unsigned char* hash) {
+			if (skip)
+				skip--;
+			else
+				hashes->insert(hashes->end(), hash, hash + 32);
+		});
+		client->send_hashes(hashes);
+		fprintf(stderr, "%lld: Sent %s %lu of our %lu txn\n", (long long) time(NULL), client->host.c_str(), (unsigned long)(mempool_position - first_position), (unsigned long)mempool.size());
+		synced_clients.insert(client);
+	};
 
 	uint8_t i = 0;
 	uint64_t bytes_sent = 0;
@@ -79,24 +124,23 @@ int main(int argc, char** argv) {
 	std::chrono::steady_clock::time_point last_mempool_print(std::chrono::steady_clock::now());
 	RPCClient rpcTrustedP2P("127.0.0.1", std::stoul(argv[2]),
 					[&](std::vector<std::pair<std::vector<unsigned char>, size_t> >& txn_list, size_t total_mempool_size) {
-						std::set<std::vector<unsigned char> > new_txn;
-						{
-							std::lock_guard<std::mutex> lock(mempool_mutex);
-
-							// 62500 bytes per sec == 500Kbps
-							uint64_t size_gathered = 0, size_to_gather = 62500*to_millis_lu(std::chrono::steady_clock::now() - last_mempool_request)/1000;
-							last_mempool_request = std::chrono::steady_clock::now();
-
-							for (const auto& txn : txn_list) {
-								if (mempool.insert(txn.first).second) {
-									new_txn.insert(txn.first);
-									size_gathered += txn.second;
-									bytes_sent += txn.second;
-									txn_sent++;
-								}
-								if (size_gathered >= size_to_gather)
-									break;
+						std::lock_guard<std::mutex> lock(mempool_mutex);
+
+						// 62500 bytes per sec == 500Kbps
+						uint64_t size_gathered = 0, size_to_gather = 62500*to_millis_lu(std::chrono::steady_clock::now() - last_mempool_request)/1000;
+						last_mempool_request = std::chrono::steady_clock::now();
+
+						auto new_txn = std::make_shared<std::vector<unsigned char> >();
+						for (const auto& txn : txn_list) {
+							if (mempool.insert(txn.first)) {
+								mempool_position++;
+								new_txn->insert(new_txn->end(), txn.first.begin(), txn.first.end());
+								size_gathered += txn.second;
+								bytes_sent += txn.second;
+								txn_sent++;
 							}
+							if (size_gathered >= size_to_gather)
+								break;
 						}
 
 						if (++i == 0) {
@@ -106,10 +150,9 @@ int main(int argc, char** argv) {
 							txn_sent = 0;
 						}
 
-						std::lock_guard<std::mutex> lock(map_mutex);
-						for (auto it = clientMap.begin(); it != clientMap.end(); it++) {
-							if (!it->second->getDisconnectFlags())
-								it->second->send_pool(new_txn.begin(), new_txn.end());
+						for (MempoolClient* client : synced_clients) {
+							if (!client->getDisconnectFlags())
+								client->send_hashes(new_txn);
 						}
 					});
 
@@ -121,6 +164,10 @@ int main(int argc, char** argv) {
 				for (auto it = clientMap.begin(); it != clientMap.end();) {
 					if (it->second->getDisconnectFlags() & DISCONNECT_COMPLETE) {
 						fprintf(stderr, "%lld: Culled %s, have %lu relay clients\n", (long long) time(NULL), it->first.c_str(), clientMap.size() - 1);
+						{
+							std::lock_guard<std::mutex> lock(mempool_mutex);
+							synced_clients.erase(it->second);
+						}
 						delete it->second;
 						clientMap.erase(it++);
 					} else
@@ -157,16 +204,10 @@ int main(int argc, char** argv) {
 				host += ":" + std::to_string(addr.sin6_port);
 			assert(clientMap.count(host) == 0);
 
-			MempoolClient* client = new MempoolClient(new_fd, host);
+			// It's sent our mempool once it tells us what it already has, see sync
+			MempoolClient* client = new MempoolClient(new_fd, host, sync);
 			clientMap[host] = client;
 			fprintf(stderr, "%lld: New connection from %s, have %lu relay clients\n", (long long) time(NULL), host.c_str(), clientMap.size());
-
-			int send_mutex = client->get_send_mutex();
-			{
-				std::lock_guard<std::mutex> lock(mempool_mutex);
-				client->send_pool(mempool.begin(), mempool.end(), send_mutex);
-			}
-			client->release_send_mutex(send_mutex);
 		}
 	}
 }
@@ -0,0 +1,317 @@
+// Microbenchmarks of the per-tx hot paths: the FlaggedArraySet tx caches, the mrusets, double_sha256
+// on tx-sized inputs and merkle root checks (with and without a BlockArena). Each case reports ns/op
+// and heap allocations/op (counted by the operator new below). SHA-256 implementations can be
+// compared by running with RELAY_SHA256_IMPL and/or RELAY_SHA256_LANES set (see utils.h and
+// crypto/sha256_lanes.h).
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <atomic>
+#include <random>
+#include <memory>
+#include <new>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "utils.h"
+#include "flaggedarrayset.h"
+#include "mruset.h"
+#include "relayprocess.h"
+#include "crypto/sha256_lanes.h"
+
+static std::atomic<uint64_t> allocations(0);
+
+void* operator new(size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	void* res = malloc(size ? size : 1);
+	if (!res)
+		throw std::bad_alloc();
+	return res;
+}
+void operator delete(void* ptr) noexcept {
+	free(ptr);
+}
+
+// Keeps results alive so that the work producing them isn't optimized out
+static volatile size_t sink;
+
+static int filter_count;
+static const char** filters;
+
+#define MIN_RUN std::chrono::milliseconds(250)
+
+// Runs batches of op(i) (with i counting up across batches) of doubling size, up to max_batch (if
+// non-0), until they've taken MIN_RUN in total. reset() is called, untimed, before each batch.
+template<typename Op, typename Reset>
+static void bench(const std::string& name, size_t max_batch, Op op, Reset reset) {
+	bool selected = !filter_count;
+	for (int i = 0; i < filter_count; i++)
+		selected |= name.find(filters[i]) != std::string::npos;
+	if (!selected)
+		return;
+
+	std::chrono::nanoseconds elapsed(0);
+	uint64_t ops = 0, allocs = 0;
+	for (size_t batch = 1; elapsed < MIN_RUN; batch = max_batch ? std::min(batch * 2, max_batch) : batch * 2) {
+		reset();
+		uint64_t start_allocs = allocations.load(std::memory_order_relaxed);
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < batch; i++)
+			op(ops + i);
+		elapsed += std::chrono::steady_clock::now() - start;
+		allocs += allocations.load(std::memory_order_relaxed) - start_allocs;
+		ops += batch;
+	}
+	printf("%-52s %12.1f ns/op %8.2f allocs/op\n", name.c_str(), double(elapsed.count()) / ops, double(allocs) / ops);
+	fflush(stdout);
+}
+
+template<typename Op>
+static void bench(const std::string& name, Op op) {
+	bench(name, 0, op, []() {});
+}
+
+/***************
+ *** Inputs ***
+ ***************/
+static std::mt19937_64 rng(42);
+
+// Tx sizes: "small" is typical of a one-in two-out tx, "mixed" has a tail of larger ones, roughly
+// as seen in the mempool
+static size_t tx_size(const std::string& dist) {
+	if (dist == "small")
+		return 200 + rng() % 100;
+	uint64_t r = rng() % 100;
+	if (r < 70)
+		return 200 + rng() % 200;
+	if (r < 95)
+		return 400 + rng() % 1600;
+	return 2000 + rng() % 18000;
+}
+
+static std::vector<std::shared_ptr<std::vector<unsigned char> > > make_txn(size_t count, const std::string& dist) {
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > txn(count);
+	for (auto& tx : txn) {
+		tx = std::make_shared<std::vector<unsigned char> >(tx_size(dist));
+		for (unsigned char& c : *tx)
+			c = rng();
+	}
+	return txn;
+}
+
+static std::vector<bool> make_hits(double hit_ratio) {
+	std::vector<bool> hits(4096);
+	std::bernoulli_distribution hit(hit_ratio);
+	for (size_t i = 0; i < hits.size(); i++)
+		hits[i] = hit(rng);
+	return hits;
+}
+
+static std::string param(double val) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%g", val);
+	return buf;
+}
+
+/***********************
+ *** FlaggedArraySet ***
+ ***********************/
+static void bench_fas(size_t cache_size, const std::string& dist) {
+	std::string params = "/cache=" + std::to_string(cache_size) + "/txsize=" + dist;
+
+	// Twice as many txn as fit, cycled through, so that every add is of one which has been evicted
+	auto txn = make_txn(cache_size * 2, dist);
+	FlaggedArraySet fas(cache_size, MAX_FAS_TOTAL_SIZE);
+	for (size_t i = 0; i < cache_size; i++)
+		fas.add(txn[i], txn[i]->size());
+
+	bench("fas_add" + params, [&](size_t i) {
+		auto& tx = txn[(cache_size + i) % txn.size()];
+		fas.add(tx, tx->size());
+	});
+
+	std::vector<unsigned char> present;
+	fas.for_all_txn_hashes([&](const std::shared_ptr<std::vector<unsigned char> >&, const unsigned char* hash) {
+		present.insert(present.end(), hash, hash + 32);
+	});
+	std::vector<unsigned char> absent(32 * 4096);
+	for (unsigned char& c : absent)
+		c = rng();
+	for (double hit_ratio : {0.1, 0.5, 0.9}) {
+		std::vector<bool> hits = make_hits(hit_ratio);
+		std::vector<const unsigned char*> queries(hits.size());
+		for (size_t i = 0; i < hits.size(); i++)
+			queries[i] = hits[i] ? &present[32 * (rng() % (present.size() / 32))] : &absent[32 * i];
+		bench("fas_contains" + params + "/hit=" + param(hit_ratio), [&](size_t i) {
+			sink += fas.contains(queries[i % queries.size()]);
+		});
+	}
+
+	// As decompression does, by (random) index, then add back what was removed between batches
+	std::vector<uint32_t> indexes(4096);
+	for (uint32_t& index : indexes)
+		index = rng();
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > removed(fas.size() / 2);
+	size_t removed_count = 0;
+	unsigned char hash[32];
+	bench("fas_remove" + params, removed.size(), [&](size_t i) {
+		fas.remove(indexes[i % indexes.size()] % fas.size(), removed[removed_count++], hash);
+	}, [&]() {
+		for (size_t i = 0; i < removed_count; i++)
+			fas.add(removed[i], removed[i]->size());
+		removed_count = 0;
+	});
+}
+
+static void bench_fas_concurrent(size_t cache_size, const std::string& dist) {
+	std::string params = "/cache=" + std::to_string(cache_size) + "/txsize=" + dist;
+
+	auto txn = make_txn(cache_size, dist);
+	FlaggedArraySet fas(cache_size, MAX_FAS_TOTAL_SIZE, true);
+	for (auto& tx : txn)
+		fas.add(tx, tx->size());
+
+	std::vector<unsigned char> present;
+	fas.for_all_txn_hashes([&](const std::shared_ptr<std::vector<unsigned char> >&, const unsigned char* hash) {
+		present.insert(present.end(), hash, hash + 32);
+	});
+	std::vector<unsigned char> absent(32 * 4096);
+	for (unsigned char& c : absent)
+		c = rng();
+	std::vector<bool> hits = make_hits(0.5);
+	std::vector<const unsigned char*> queries(hits.size());
+	for (size_t i = 0; i < hits.size(); i++)
+		queries[i] = hits[i] ? &present[32 * (rng() % (present.size() / 32))] : &absent[32 * i];
+	bench("fas_contains_concurrent" + params + "/hit=0.5", [&](size_t i) {
+		sink += fas.contains_concurrent(queries[i % queries.size()]);
+	});
+}
+
+/**************
+ *** mruset ***
+ **************/
+// The n'th distinct hash, spread out over the first 8 bytes (which hash_mruset keys on)
+static void nth_hash(uint64_t n, unsigned char* res) {
+	uint64_t key = (n + 1) * 0x9e3779b97f4a7c15ull;
+	key ^= key >> 31;
+	memset(res, 0, 32);
+	memcpy(res, &key, 8);
+	memcpy(res + 8, &n, 8);
+}
+
+// Inserts new hashes or, hit_ratio of the time, one of the last size/2 inserted (which is present)
+template<typename Set, typename Insert>
+static void bench_mruset_insert(const std::string& name, size_t size, double hit_ratio, Insert insert) {
+	Set set(size);
+	uint64_t inserted = 0;
+	unsigned char hash[32];
+	for (; inserted < size; inserted++) {
+		nth_hash(inserted, hash);
+		insert(set, hash);
+	}
+
+	std::vector<bool> hits = make_hits(hit_ratio);
+	bench(name + "/size=" + std::to_string(size) + "/hit=" + param(hit_ratio), [&](size_t i) {
+		if (hits[i % hits.size()])
+			nth_hash(inserted - 1 - i % (size / 2), hash);
+		else
+			nth_hash(inserted++, hash);
+		sink += insert(set, hash);
+	});
+}
+
+static void bench_mrusets(size_t size, double hit_ratio) {
+	bench_mruset_insert<hash_mruset<32> >("hash_mruset_insert", size, hit_ratio, [](hash_mruset<32>& set, const unsigned char* hash) {
+		return set.insert(hash);
+	});
+	std::vector<unsigned char> elem(32);
+	bench_mruset_insert<concurrentmruset>("concurrentmruset_insert", size, hit_ratio, [&](concurrentmruset& set, const unsigned char* hash) {
+		memcpy(&elem[0], hash, 32);
+		return set.insert(elem);
+	});
+	bench_mruset_insert<mruset<std::vector<unsigned char> > >("mruset_insert", size, hit_ratio, [&](mruset<std::vector<unsigned char> >& set, const unsigned char* hash) {
+		memcpy(&elem[0], hash, 32);
+		return set.insert(elem).second;
+	});
+}
+
+/**************
+ *** SHA256 ***
+ **************/
+static void bench_sha256(const std::string& dist) {
+	auto txn = make_txn(1024, dist);
+	unsigned char hash[32];
+	bench("double_sha256/txsize=" + dist, [&](size_t i) {
+		auto& tx = txn[i % txn.size()];
+		double_sha256(&(*tx)[0], hash, tx->size());
+		sink += hash[0];
+	});
+
+	// Each op hashes as many txn at once as we have SIMD lanes
+	const size_t batch = sha256_lanes();
+	std::vector<const unsigned char*> inputs(txn.size());
+	std::vector<uint64_t> sizes(txn.size());
+	std::vector<unsigned char> results(32 * SHA256_MAX_LANES);
+	std::vector<unsigned char*> result_ptrs(txn.size());
+	for (size_t i = 0; i < txn.size(); i++) {
+		inputs[i] = &(*txn[i])[0];
+		sizes[i] = txn[i]->size();
+		result_ptrs[i] = &results[32 * (i % SHA256_MAX_LANES)];
+	}
+	bench("double_sha256_batch/txsize=" + dist + "/lanes=" + std::to_string(batch), [&](size_t i) {
+		size_t start = (i * batch) % txn.size();
+		double_sha256_batch(&inputs[start], &sizes[start], &result_ptrs[start], batch);
+		sink += results[0];
+	});
+}
+
+static void bench_merkle(size_t tx_count) {
+	std::vector<unsigned char> txids(32 * tx_count);
+	for (unsigned char& c : txids)
+		c = rng();
+	unsigned char root[32];
+	MerkleTreeBuilder first(txids);
+	first.merkleRootMatches(root);
+	memcpy(root, first.getTxHashLoc(0), 32);
+
+	bench("merkle_root/txn=" + std::to_string(tx_count), [&](size_t) {
+		MerkleTreeBuilder builder(txids);
+		sink += builder.merkleRootMatches(root);
+	});
+
+	// As parse_block does, with the hash list in a pooled (so, after the first, already-mapped) arena
+	bench("merkle_root_arena/txn=" + std::to_string(tx_count), [&](size_t) {
+		BlockArena::Scope arena;
+		MerkleTreeBuilder builder(txids, &arena);
+		sink += builder.merkleRootMatches(root);
+	});
+}
+
+int main(int argc, const char** argv) {
+	filter_count = argc - 1;
+	filters = argv + 1;
+
+	printf("SHA-256: %s, %lu lanes%s\n", sha256_impl(), (unsigned long)sha256_lanes(), filter_count ? "" : " (pass substrings of case names to only run some)");
+
+	for (size_t cache_size : {size_t(OLD_MAX_TXN_IN_FAS), size_t(65000)}) {
+		for (const char* dist : {"small", "mixed"}) {
+			bench_fas(cache_size, dist);
+			bench_fas_concurrent(cache_size, dist);
+		}
+	}
+
+	for (size_t size : {size_t(1000), size_t(1000000)})
+		for (double hit_ratio : {0.0, 0.9})
+			bench_mrusets(size, hit_ratio);
+
+	for (const char* dist : {"small", "mixed"})
+		bench_sha256(dist);
+
+	for (size_t tx_count : {1, 500, 2000, 5000})
+		bench_merkle(tx_count);
+
+	return 0;
+}
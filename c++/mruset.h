@@ -8,6 +8,13 @@
 #include <deque>
 #include <set>
 #include <utility>
+#include <vector>
+#include <array>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "seqlockhashset.h"
 
 /** STL-like set container that only keeps the most recent N elements. */
 template <typename T> class mruset
@@ -107,4 +114,179 @@ public:
     }
 };
 
+/** mruset of N-byte hashes (N >= 8), stored flat: a circular array of the last nMaxSize hashes
+ *  inserted, in insertion order, and an open-addressed table (keyed on their first 8 bytes) of
+ *  positions in it. Once full, each insert overwrites the oldest entry. erase()d entries keep
+ *  their place in the array until overwritten, so after an erase slightly fewer than nMaxSize
+ *  hashes may be kept. */
+template <size_t N> class hash_mruset
+{
+public:
+    typedef size_t size_type;
+
+private:
+    std::vector<std::array<unsigned char, N> > ring;
+    size_type next; // Oldest entry in ring (the next to be overwritten) once it is full
+    std::vector<uint32_t> table; // ring index + 1, 0 is empty
+    size_type live;
+    size_type nMaxSize;
+
+    static inline uint64_t key(const unsigned char* elem)
+    {
+        uint64_t k;
+        memcpy(&k, elem, sizeof(k));
+        return k;
+    }
+    bool find_pos(const unsigned char* elem, size_type& pos) const
+    {
+        size_type mask = table.size() - 1;
+        for (pos = key(elem) & mask; table[pos]; pos = (pos + 1) & mask)
+            if (!memcmp(&ring[table[pos] - 1][0], elem, N))
+                return true;
+        return false;
+    }
+    void table_insert(size_type index)
+    {
+        size_type mask = table.size() - 1, pos;
+        for (pos = key(&ring[index][0]) & mask; table[pos]; pos = (pos + 1) & mask) ;
+        table[pos] = index + 1;
+    }
+    void table_remove(size_type pos)
+    {
+        // Backward-shift deletion: pull up anything later in the probe run which could live at pos
+        size_type mask = table.size() - 1;
+        for (size_type next_pos = (pos + 1) & mask; table[next_pos]; next_pos = (next_pos + 1) & mask) {
+            size_type ideal = key(&ring[table[next_pos] - 1][0]) & mask;
+            if (((next_pos - ideal) & mask) >= ((next_pos - pos) & mask)) {
+                table[pos] = table[next_pos];
+                pos = next_pos;
+            }
+        }
+        table[pos] = 0;
+        live--;
+    }
+    // If ring[index] hasn't been erase()d, the position in table which refers to it
+    bool find_index(size_type index, size_type& pos) const
+    {
+        return find_pos(&ring[index][0], pos) && table[pos] == index + 1;
+    }
+
+    void rehash(size_type size)
+    {
+        std::vector<uint32_t> old(size, 0);
+        old.swap(table);
+        for (uint32_t index : old)
+            if (index)
+                table_insert(index - 1);
+    }
+
+public:
+    hash_mruset(size_type nMaxSizeIn) : nMaxSize(nMaxSizeIn) { assert(nMaxSize && nMaxSize < uint32_t(-1)); clear(); }
+
+    size_type size() const { return live; }
+    bool empty() const { return !live; }
+    size_type max_size() const { return nMaxSize; }
+    void clear() { ring.clear(); next = 0; table.assign(1024, 0); live = 0; }
+
+    size_type count(const unsigned char* elem) const { size_type pos; return find_pos(elem, pos); }
+    size_type count(const std::vector<unsigned char>& elem) const { assert(elem.size() == N); return count(&elem[0]); }
+
+    // The hash which the next insert() of a new hash will push out, if any
+    const unsigned char* next_evicted() const
+    {
+        size_type pos;
+        if (ring.size() < nMaxSize || !find_index(next, pos))
+            return NULL;
+        return &ring[next][0];
+    }
+
+    // Returns true if elem wasn't already present
+    bool insert(const unsigned char* elem)
+    {
+        size_type pos;
+        if (find_pos(elem, pos))
+            return false;
+
+        size_type index;
+        if (ring.size() < nMaxSize) {
+            if ((ring.size() + 1) * 2 > table.size())
+                rehash(table.size() * 2);
+            index = ring.size();
+            ring.emplace_back();
+        } else {
+            index = next;
+            next = (next + 1) % nMaxSize;
+            if (find_index(index, pos))
+                table_remove(pos);
+        }
+        memcpy(&ring[index][0], elem, N);
+        table_insert(index);
+        live++;
+        return true;
+    }
+    bool insert(const std::vector<unsigned char>& elem) { assert(elem.size() == N); return insert(&elem[0]); }
+
+    size_type erase(const unsigned char* elem)
+    {
+        size_type pos;
+        if (!find_pos(elem, pos))
+            return 0;
+        table_remove(pos);
+        return 1;
+    }
+    size_type erase(const std::vector<unsigned char>& elem) { assert(elem.size() == N); return erase(&elem[0]); }
+
+    // Calls f on each hash in the set, oldest first
+    template <typename F> void for_each(F f) const
+    {
+        size_type start = ring.size() < nMaxSize ? 0 : next, pos;
+        for (size_type i = 0; i < ring.size(); i++) {
+            size_type index = (start + i) % ring.size();
+            if (find_index(index, pos))
+                f(&ring[index][0]);
+        }
+    }
+};
+
+// A hash_mruset of 32-byte hashes which also supports contains_concurrent() (and concurrent_size())
+// from any thread while another is modifying it
+class concurrentmruset
+{
+public:
+    typedef hash_mruset<32>::size_type size_type;
+
+private:
+    hash_mruset<32> set;
+    SeqlockHashSet hashes;
+
+public:
+    concurrentmruset(size_type nMaxSizeIn) : set(nMaxSizeIn) {}
+
+    bool contains_concurrent(const std::vector<unsigned char>& elem) const { return hashes.contains(&elem[0]); }
+    size_type concurrent_size() const { return hashes.size(); }
+
+    size_type size() const { return set.size(); }
+    size_type count(const std::vector<unsigned char>& elem) const { return set.count(elem); }
+    void clear() { set.clear(); hashes.clear(); }
+    size_type erase(const std::vector<unsigned char>& elem)
+    {
+        size_type ret = set.erase(elem);
+        if (ret)
+            hashes.erase(&elem[0]);
+        return ret;
+    }
+    bool insert(const std::vector<unsigned char>& elem)
+    {
+        if (set.count(elem))
+            return false;
+        const unsigned char* evicted = set.next_evicted();
+        if (evicted)
+            hashes.erase(evicted);
+        set.insert(elem);
+        hashes.insert(&elem[0]);
+        return true;
+    }
+    template <typename F> void for_each(F f) const { set.for_each(f); }
+};
+
 #endif // BITCOIN_MRUSET_H
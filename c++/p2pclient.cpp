@@ -3,11 +3,13 @@
 #include "crypto/sha2.h"
 
 #include <thread>
+#include <algorithm>
 #include <chrono>
 #include <string.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #ifdef WIN32
 	#include <winsock2.h>
@@ -20,9 +22,34 @@
 	#include <fcntl.h>
 #endif // !WIN32
 
+static void capture_message(CaptureType type, const unsigned char* data, uint32_t length) {
+	static FILE* capture_file = getenv("RELAY_CAPTURE_FILE") ? fopen(getenv("RELAY_CAPTURE_FILE"), "ab") : NULL;
+	static std::mutex capture_mutex;
+	if (!capture_file)
+		return;
+
+	struct capture_record_header header;
+	header.type = type;
+	header.time_micros = htole64(to_micros_lu(std::chrono::system_clock::now().time_since_epoch()));
+	header.length = htole32(length);
+
+	std::lock_guard<std::mutex> lock(capture_mutex);
+	if (fwrite(&header, sizeof(header), 1, capture_file) != 1 || fwrite(data, 1, length, capture_file) != length || fflush(capture_file)) {
+		printf("Failed to write to RELAY_CAPTURE_FILE, no longer capturing\n");
+		fclose(capture_file);
+		capture_file = NULL;
+	}
+}
+
 void P2PRelayer::send_message(const char* command, unsigned char* headerAndData, size_t datalen) {
 	prepare_message(command, headerAndData, datalen);
-	maybe_do_send_bytes((char*)headerAndData, sizeof(struct bitcoin_msg_header) + datalen);
+	// bitcoind doesn't care what order txn and pings arrive in relative to blocks
+	OutboundClass cls = OUTBOUND_BLOCK;
+	if (!strcmp(command, "tx"))
+		cls = OUTBOUND_TX;
+	else if (!strcmp(command, "ping") || !strcmp(command, "pong"))
+		cls = OUTBOUND_PING;
+	maybe_do_send_bytes((char*)headerAndData, sizeof(struct bitcoin_msg_header) + datalen, 0, cls);
 }
 
 void P2PRelayer::on_disconnect() {
@@ -37,6 +64,11 @@ void P2PRelayer::net_process(const std::function<void(std::string)>& disconnect)
 		send_message("version", &version_msg[0], version_msg.size() - sizeof(struct bitcoin_msg_header));
 	}
 
+	// Everything but txn (which are handed off, and usually kept in caches) is read into msgbuf,
+	// which is reused across messages
+	std::vector<unsigned char> msgbuf;
+	std::vector<unsigned char> inv_blocks, inv_txn;
+
 	while (true) {
 		struct bitcoin_msg_header header;
 		if (read_all((char*)&header, sizeof(header)) != sizeof(header))
@@ -53,28 +85,37 @@ void P2PRelayer::net_process(const std::function<void(std::string)>& disconnect)
 
 		std::chrono::system_clock::time_point read_start(std::chrono::system_clock::now());
 
-		auto msg = std::make_shared<std::vector<unsigned char> > (prependedHeaderSize + uint32_t(header.length));
+		std::shared_ptr<std::vector<unsigned char> > txmsg;
+		if (!strncmp(header.command, "tx", strlen("tx"))) {
+			txmsg = std::make_shared<std::vector<unsigned char> > (prependedHeaderSize + uint32_t(header.length));
+		} else
+			msgbuf.resize(prependedHeaderSize + uint32_t(header.length));
+		std::vector<unsigned char>& msg = txmsg ? *txmsg : msgbuf;
+
 		if (check_block_msghash && strncmp(header.command, "block", strlen("block"))) {
 			uint32_t hash[8];
 			double_sha256_init(hash);
 
-			uint32_t steps = header.length / 64;
-			for (uint32_t i = 0; i < steps; i++) {
-				unsigned char* writepos = &((*msg)[prependedHeaderSize + i*64]);
-				if (read_all((char*)writepos, 64) != 64)
+			// Hash whatever has already arrived in one go, only waiting on the network 64 bytes at a time
+			uint32_t hashed = 0, full_length = header.length & ~63;
+			while (hashed < full_length) {
+				uint32_t chunk = std::min(full_length - hashed, std::max(uint32_t(64), uint32_t(std::min(read_available(), size_t(full_length))) & ~63));
+				unsigned char* writepos = &msg[prependedHeaderSize + hashed];
+				if (read_all((char*)writepos, chunk) != ssize_t(chunk))
 					return disconnect("failed to read message");
-				double_sha256_step(writepos, 64, hash);
+				double_sha256_step(writepos, chunk, hash);
+				hashed += chunk;
 			}
 
-			unsigned char* writepos = &((*msg)[prependedHeaderSize + steps*64]);
-			if (read_all((char*)writepos, header.length - steps*64) != ssize_t(header.length - steps*64))
+			unsigned char* writepos = &msg[prependedHeaderSize + full_length];
+			if (read_all((char*)writepos, header.length - full_length) != ssize_t(header.length - full_length))
 				return disconnect("failed to read message");
-			double_sha256_done(writepos, header.length - steps*64, header.length, hash);
+			double_sha256_done(writepos, header.length - full_length, header.length, hash);
 
 			if (memcmp((char*)hash, header.checksum, sizeof(header.checksum)))
 				return disconnect("got invalid message checksum");
 		} else
-			if (read_all((char*)&(*msg)[prependedHeaderSize], header.length) != ssize_t(header.length))
+			if (read_all((char*)&msg[prependedHeaderSize], header.length) != ssize_t(header.length))
 				return disconnect("failed to read message");
 
 		if (!strncmp(header.command, "version", strlen("version"))) {
@@ -84,7 +125,7 @@ void P2PRelayer::net_process(const std::function<void(std::string)>& disconnect)
 
 			if (header.length < sizeof(struct bitcoin_version_start))
 				return disconnect("got short version");
-			struct bitcoin_version_start *their_version = (struct bitcoin_version_start*) &(*msg)[0];
+			struct bitcoin_version_start *their_version = (struct bitcoin_version_start*) &msg[0];
 
 			struct bitcoin_msg_header new_header;
 			send_message("verack", (unsigned char*)&new_header, 0);
@@ -115,17 +156,17 @@ void P2PRelayer::net_process(const std::function<void(std::string)>& disconnect)
 
 		if (!strncmp(header.command, "ping", strlen("ping"))) {
 			std::vector<unsigned char> resp(sizeof(struct bitcoin_msg_header) + header.length);
-			resp.insert(resp.begin() + sizeof(struct bitcoin_msg_header), msg->begin(), msg->end());
+			resp.insert(resp.begin() + sizeof(struct bitcoin_msg_header), msg.begin(), msg.end());
 			send_message("pong", &resp[0], header.length);
 		} else if (!strncmp(header.command, "pong", strlen("pong"))) {
 			uint64_t nonce;
-			if (msg->size() != 8)
+			if (msg.size() != 8)
 				return disconnect("got pong without nonce");
-			memcpy(&nonce, &(*msg)[0], 8);
+			memcpy(&nonce, &msg[0], 8);
 			pong_received(nonce);
 		} else if (!strncmp(header.command, "inv", strlen("inv"))) {
-			std::vector<unsigned char>::const_iterator it = msg->begin();
-			const std::vector<unsigned char>::const_iterator end = msg->end();
+			std::vector<unsigned char>::const_iterator it = msg.begin();
+			const std::vector<unsigned char>::const_iterator end = msg.end();
 			uint64_t inv_count = read_varint(it, end);
 			if (inv_count > 50001)
 				return disconnect("got invalid inv message");
@@ -133,7 +174,9 @@ void P2PRelayer::net_process(const std::function<void(std::string)>& disconnect)
 			static const uint32_t MSG_TX = htole32(1);
 			static const uint32_t MSG_BLOCK = htole32(2);
 
-			std::vector<unsigned char> resp(sizeof(struct bitcoin_msg_header));
+			// Blocks are requested first (in reverse inv order, as before)
+			inv_blocks.clear();
+			inv_txn.clear();
 			{
 				std::lock_guard<std::mutex> lock(seen_mutex);
 				for (uint64_t i = 0; i < inv_count; i++) {
@@ -141,38 +184,48 @@ void P2PRelayer::net_process(const std::function<void(std::string)>& disconnect)
 					uint32_t type;
 					memcpy(&type, &(*(it-36)), 4);
 
-					if (type == MSG_TX && txnAlreadySeen.insert(std::vector<unsigned char>(it-32, it)).second)
-						resp.insert(resp.end(), it-36, it);
-					else if (type == MSG_BLOCK && blocksAlreadySeen.insert(std::vector<unsigned char>(it-32, it)).second)
-						resp.insert(resp.begin() + sizeof(struct bitcoin_msg_header), it-36, it);
+					if (type == MSG_TX && txnAlreadySeen.insert(&(*(it-32))))
+						inv_txn.insert(inv_txn.end(), it-36, it);
+					else if (type == MSG_BLOCK && blocksAlreadySeen.insert(&(*(it-32))))
+						inv_blocks.insert(inv_blocks.end(), it-36, it);
 					else if (type != MSG_TX && type != MSG_BLOCK)
 						return disconnect("got unexpected inv type");
 				}
 			}
-			assert((resp.size() - sizeof(struct bitcoin_msg_header)) % 36 == 0);
-			std::vector<unsigned char> v = varint((resp.size() - sizeof(struct bitcoin_msg_header)) / 36);
-			resp.insert(resp.begin() + sizeof(struct bitcoin_msg_header), v.begin(), v.end());
+			std::vector<unsigned char> v = varint((inv_blocks.size() + inv_txn.size()) / 36);
+			std::vector<unsigned char> resp;
+			resp.reserve(sizeof(struct bitcoin_msg_header) + v.size() + inv_blocks.size() + inv_txn.size());
+			resp.resize(sizeof(struct bitcoin_msg_header));
+			resp.insert(resp.end(), v.begin(), v.end());
+			for (size_t i = inv_blocks.size(); i > 0; i -= 36)
+				resp.insert(resp.end(), inv_blocks.begin() + i - 36, inv_blocks.begin() + i);
+			resp.insert(resp.end(), inv_txn.begin(), inv_txn.end());
 			send_message("getdata", &resp[0], resp.size() - sizeof(struct bitcoin_msg_header));
 		} else if (!strncmp(header.command, "block", strlen("block"))) {
-			provide_block(*msg, read_start);
+			capture_message(CAPTURE_BLOCK, msg.data() + prependedHeaderSize, header.length);
+			provide_block(msg, read_start);
 		} else if (!strncmp(header.command, "tx", strlen("tx"))) {
-			provide_transaction(msg);
+			capture_message(CAPTURE_TX, msg.data(), header.length);
+			provide_transaction(txmsg);
 		} else if (!strncmp(header.command, "headers", strlen("headers"))) {
-			if (msg->size() <= 1 + 82 || !provide_headers)
+			if (msg.size() <= 1 + 82 || !provide_headers)
 				continue; // Probably last one
-			provide_headers(*msg);
 
+			// Ask for the next batch before handing this one off, so that bitcoind is working on it
+			// while we are
 			std::vector<unsigned char> req(sizeof(struct bitcoin_msg_header));
 			struct bitcoin_version_start sent_version;
 			req.insert(req.end(), (unsigned char*)&sent_version.protocol_version, ((unsigned char*)&sent_version.protocol_version) + sizeof(sent_version.protocol_version));
 			req.insert(req.end(), 1, 1);
 
 			std::vector<unsigned char> fullhash(32);
-			getblockhash(fullhash, *msg, msg->size() - 81);
+			getblockhash(fullhash, msg, msg.size() - 81);
 			req.insert(req.end(), fullhash.begin(), fullhash.end());
 			req.insert(req.end(), 32, 0);
 
 			send_message("getheaders", &req[0], req.size() - sizeof(struct bitcoin_msg_header));
+
+			provide_headers(msg);
 		}
 	}
 }
@@ -183,10 +236,10 @@ void P2PRelayer::receive_transaction(const std::shared_ptr<std::vector<unsigned
 
 	bool seen;
 	{
+		unsigned char hash[32];
+		double_sha256(&(*tx)[0], hash, tx->size());
 		std::lock_guard<std::mutex> lock(seen_mutex);
-		std::vector<unsigned char> hash(32);
-		double_sha256(&(*tx)[0], &hash[0], tx->size());
-		seen = !txnAlreadySeen.insert(hash).second;
+		seen = !txnAlreadySeen.insert(hash);
 	}
 	if (!seen) {
 		auto msg = std::vector<unsigned char>(sizeof(struct bitcoin_msg_header));
@@ -203,12 +256,30 @@ void P2PRelayer::receive_block(std::vector<unsigned char>& block) {
 		std::lock_guard<std::mutex> lock(seen_mutex);
 		std::vector<unsigned char> hash(32);
 		getblockhash(hash, block, sizeof(bitcoin_msg_header));
-		seen = !blocksAlreadySeen.insert(hash).second;
+		seen = !blocksAlreadySeen.insert(hash);
 	}
 	if (!seen)
 		send_message("block", &block[0], block.size() - sizeof(bitcoin_msg_header));
 }
 
+void P2PRelayer::receive_header(const unsigned char* header) {
+	if (connected != 2)
+		return;
+	{
+		unsigned char hash[32];
+		double_sha256(header, hash, 80);
+		std::lock_guard<std::mutex> lock(seen_mutex);
+		if (blocksAlreadySeen.count(hash) || !headersAlreadySent.insert(hash))
+			return;
+	}
+	// A headers message of one header (with its 0 tx count)
+	std::vector<unsigned char> msg(sizeof(struct bitcoin_msg_header) + 1);
+	msg.back() = 1;
+	msg.insert(msg.end(), header, header + 80);
+	msg.push_back(0);
+	send_message("headers", &msg[0], msg.size() - sizeof(struct bitcoin_msg_header));
+}
+
 void P2PRelayer::request_transaction(const std::vector<unsigned char>& tx_hash) {
 	if (connected != 2)
 		return;
@@ -12,6 +12,19 @@
 #include "mruset.h"
 #include "connection.h"
 
+// If RELAY_CAPTURE_FILE is set, every block and tx any P2PRelayer is sent is appended to it, for
+// relaynetworkbench to replay. Each record is a capture_record_header (little-endian) followed by
+// the message itself (without its bitcoin_msg_header).
+enum CaptureType {
+	CAPTURE_TX = 1,
+	CAPTURE_BLOCK = 2,
+};
+struct __attribute__((packed)) capture_record_header {
+	uint8_t type;
+	uint64_t time_micros; // Since the epoch
+	uint32_t length;
+};
+static_assert(sizeof(struct capture_record_header) == 1 + 8 + 4, "__attribute__((packed)) must work");
 
 class P2PRelayer : public KeepaliveOutboundPersistentConnection {
 private:
@@ -23,8 +36,9 @@ private:
 	std::atomic<uint8_t> connected;
 
 	std::mutex seen_mutex;
-	mruset<std::vector<unsigned char> > txnAlreadySeen;
-	mruset<std::vector<unsigned char> > blocksAlreadySeen;
+	hash_mruset<32> txnAlreadySeen;
+	hash_mruset<32> blocksAlreadySeen;
+	hash_mruset<32> headersAlreadySent;
 
 	const bool check_block_msghash;
 
@@ -36,7 +50,7 @@ public:
 				bool check_block_msghash_in=true)
 			: KeepaliveOutboundPersistentConnection(serverHostIn, serverPortIn, ping_time_nonce),
 			provide_block(provide_block_in), provide_transaction(provide_transaction_in), provide_headers(provide_headers_in),
-			connected(0), txnAlreadySeen(2000), blocksAlreadySeen(100), check_block_msghash(check_block_msghash_in)
+			connected(0), txnAlreadySeen(2000), blocksAlreadySeen(100), headersAlreadySent(100), check_block_msghash(check_block_msghash_in)
 	{}
 
 protected:
@@ -51,6 +65,9 @@ protected:
 public:
 	void receive_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx);
 	void receive_block(std::vector<unsigned char>& block);
+	// Announces a block (by its 80-byte header, which the caller has checked the PoW of) ahead of
+	// receive_block(), so that bitcoind can start on it while we're still reading the rest
+	void receive_header(const unsigned char* header);
 	void request_transaction(const std::vector<unsigned char>& txhash);
 
 	bool is_connected() const;
@@ -0,0 +1,642 @@
+// Replays captured blocks and txn (see RELAY_CAPTURE_FILE in p2pclient.h, or a block.txt, with
+// most of each block's txn sent ahead of it) through a real relaynetworkserver to N loopback relay
+// clients. We play the server's bitcoinds (trusted and local p2p peers, and the mempool hash feed)
+// ourselves, and report block propagation latency, bytes on the wire, and the server's CPU time per
+// block and RSS for each client count.
+
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <algorithm>
+#include <unordered_map>
+#include <condition_variable>
+
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define BITCOIN_UA_LENGTH 24
+#define BITCOIN_UA {'/', 'R', 'e', 'l', 'a', 'y', 'N', 'e', 't', 'w', 'o', 'r', 'k', 'B', 'e', 'n', 'c', 'h', 'm', 'a', 'r', 'k', ':', '/'}
+
+#include "utils.h"
+#include "relayprocess.h"
+#include "p2pclient.h"
+#include "connection.h"
+
+#define BENCH_TRUSTED_PORT 18444
+#define BENCH_MEMPOOL_PORT 18445
+#define LOCAL_P2P_PORT 8335 // Where relaynetworkserver expects its local bitcoind
+#define RELAY_PORT 8336
+
+// How long the server has to be quiet (no txn served or relayed) before we send it the next block,
+// so that each block sees the mempool overlap the capture had
+#define QUIESCE_MILLIS 250
+#define WAIT_SECONDS 30
+
+static std::atomic<uint64_t> last_activity(0); // Micros since the epoch of steady_clock
+static uint64_t now_micros() { return to_micros_lu(std::chrono::steady_clock::now().time_since_epoch()); }
+
+/*********************
+ **** The replay ****
+ *********************/
+
+// All messages are kept with room for (and, once loaded, a prepared) bitcoin_msg_header in front
+struct ReplayItem {
+	bool is_block;
+	std::shared_ptr<std::vector<unsigned char> > msg;
+	std::vector<unsigned char> hash;
+};
+static std::vector<ReplayItem> replay;
+static std::unordered_map<std::string, std::shared_ptr<std::vector<unsigned char> > > txn_by_hash;
+static size_t replay_blocks = 0;
+
+static void add_replay_item(bool is_block, const unsigned char* data, size_t length) {
+	auto msg = std::make_shared<std::vector<unsigned char> >(sizeof(struct bitcoin_msg_header));
+	msg->insert(msg->end(), data, data + length);
+	std::vector<unsigned char> hash(32);
+	if (is_block) {
+		if (length < 80)
+			return;
+		getblockhash(hash, *msg, sizeof(struct bitcoin_msg_header));
+	} else
+		double_sha256(data, &hash[0], length);
+
+	// Captures from a server have blocks (and maybe txn) from both of its bitcoinds
+	static std::set<std::vector<unsigned char> > seen;
+	if (!seen.insert(hash).second)
+		return;
+
+	prepare_message(is_block ? "block" : "tx", &(*msg)[0], length);
+	if (!is_block)
+		txn_by_hash[std::string(hash.begin(), hash.end())] = msg;
+	else
+		replay_blocks++;
+	replay.push_back({is_block, msg, hash});
+}
+
+static bool load_capture(const char* path) {
+	FILE* f = fopen(path, "rb");
+	if (!f)
+		return false;
+	struct capture_record_header header;
+	std::vector<unsigned char> data;
+	while (fread(&header, sizeof(header), 1, f) == 1) {
+		data.resize(le32toh(header.length));
+		if (fread(data.data(), 1, data.size(), f) != data.size())
+			break;
+		add_replay_item(header.type == CAPTURE_BLOCK, data.data(), data.size());
+	}
+	fclose(f);
+	return true;
+}
+
+// Each line is a hex block, and 90% of each block's txn (chosen deterministically) go ahead of it.
+// As block.txt's blocks are old, the server has to be built with TEST_DATA (eg variant=bench).
+static bool load_block_txt(const char* path) {
+	FILE* f = fopen(path, "r");
+	if (!f)
+		return false;
+	std::mt19937 rand(42);
+	std::vector<unsigned char> block(sizeof(struct bitcoin_msg_header));
+	while (true) {
+		int c = fgetc(f), c2 = c == '\n' || c == EOF ? 0 : fgetc(f);
+		if (c == '\n' || c == EOF || c2 == EOF) {
+			if (block.size() > sizeof(struct bitcoin_msg_header) + 80) {
+				try {
+					std::vector<unsigned char>::const_iterator it = block.begin() + sizeof(struct bitcoin_msg_header) + 80;
+					uint64_t txcount = read_varint(it, block.end());
+					const unsigned char *tx = &*it, *end = block.data() + block.size();
+					for (uint64_t i = 0; i < txcount && tx; i++) {
+						const unsigned char* next = tx_end(tx, end);
+						if (next && i && rand() % 10)
+							add_replay_item(false, tx, next - tx);
+						tx = next;
+					}
+					add_replay_item(true, &block[sizeof(struct bitcoin_msg_header)], block.size() - sizeof(struct bitcoin_msg_header));
+				} catch (const read_exception&) { }
+			}
+			block.resize(sizeof(struct bitcoin_msg_header));
+			if (c == EOF || c2 == EOF)
+				break;
+			continue;
+		}
+		if (c >= 'a')
+			c -= 'a' - '9' - 1;
+		if (c2 >= 'a')
+			c2 -= 'a' - '9' - 1;
+		block.push_back((c - '0') << 4 | (c2 - '0'));
+	}
+	fclose(f);
+	return true;
+}
+
+/*************************************
+ **** Our side of the server's bitcoinds ****
+ *************************************/
+
+static int listen_on(uint16_t port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	int reuse = 1;
+	if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) ||
+			bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, 3) < 0) {
+		printf("Failed to bind %u: %s\n", port, strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+// One of the server's P2P bitcoind peers. Answers the handshake, pings and getdatas for txn in
+// txn_by_hash, and ignores everything else. As the server reconnects each run, a new peer simply
+// replaces the old one.
+class FakeBitcoind {
+private:
+	std::mutex mutex; // For peer_fd and sends to it
+	int peer_fd;
+	std::atomic<bool> ready;
+
+	void send_prepared(int fd, const std::vector<unsigned char>& msg) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (fd == peer_fd)
+			send_all(fd, (const char*)&msg[0], msg.size());
+	}
+
+	void send_message(int fd, const char* command, std::vector<unsigned char>& msg) {
+		prepare_message(command, &msg[0], msg.size() - sizeof(struct bitcoin_msg_header));
+		send_prepared(fd, msg);
+	}
+
+	void handle_peer(int fd) {
+		struct bitcoin_version_with_header version_msg;
+		version_msg.version.start.timestamp = htole64(time(0));
+		version_msg.version.start.user_agent_length = BITCOIN_UA_LENGTH;
+		std::vector<unsigned char> version((unsigned char*)&version_msg, (unsigned char*)&version_msg + sizeof(version_msg));
+		send_message(fd, "version", version);
+		std::vector<unsigned char> verack(sizeof(struct bitcoin_msg_header));
+		send_message(fd, "verack", verack);
+
+		std::vector<unsigned char> msg;
+		while (true) {
+			struct bitcoin_msg_header header;
+			if (read_all(fd, (char*)&header, sizeof(header)) != sizeof(header))
+				break;
+			msg.resize(le32toh(header.length));
+			if (msg.size() && read_all(fd, (char*)&msg[0], msg.size()) != ssize_t(msg.size()))
+				break;
+
+			if (!strncmp(header.command, "verack", sizeof(header.command)))
+				ready = true;
+			else if (!strncmp(header.command, "ping", sizeof(header.command))) {
+				std::vector<unsigned char> pong(sizeof(struct bitcoin_msg_header));
+				pong.insert(pong.end(), msg.begin(), msg.end());
+				send_message(fd, "pong", pong);
+			} else if (!strncmp(header.command, "getdata", sizeof(header.command))) {
+				try {
+					std::vector<unsigned char>::const_iterator it = msg.begin();
+					uint64_t count = read_varint(it, msg.end());
+					for (uint64_t i = 0; i < count; i++) {
+						move_forward(it, 36, msg.end());
+						auto tx = txn_by_hash.find(std::string(it - 32, it));
+						if (*(it - 36) == 1 && tx != txn_by_hash.end()) {
+							send_prepared(fd, *tx->second);
+							last_activity = now_micros();
+						}
+					}
+				} catch (const read_exception&) { }
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (peer_fd == fd) {
+			peer_fd = -1;
+			ready = false;
+		}
+		close(fd);
+	}
+
+public:
+	FakeBitcoind(uint16_t port) : peer_fd(-1), ready(false) {
+		int listen_fd = listen_on(port);
+		std::thread([this, listen_fd](void) {
+			while (true) {
+				int fd = accept(listen_fd, NULL, NULL);
+				if (fd < 0)
+					continue;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					ready = false;
+					peer_fd = fd;
+				}
+				std::thread(&FakeBitcoind::handle_peer, this, fd).detach();
+			}
+		}).detach();
+	}
+
+	bool is_ready() { return ready; }
+
+	void send_block(const std::vector<unsigned char>& msg) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (peer_fd >= 0)
+			send_all(peer_fd, (const char*)&msg[0], msg.size());
+	}
+};
+
+// The server's mempool feed, which just gets sent the hash of each tx for the server to getdata
+class FakeMempool {
+private:
+	std::mutex mutex;
+	int peer_fd;
+
+public:
+	FakeMempool(uint16_t port) : peer_fd(-1) {
+		int listen_fd = listen_on(port);
+		std::thread([this, listen_fd](void) {
+			while (true) {
+				int fd = accept(listen_fd, NULL, NULL);
+				if (fd < 0)
+					continue;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					peer_fd = fd;
+				}
+				// It only ever sends us keepalive bytes
+				std::thread([this, fd](void) {
+					char buf[64];
+					while (recv(fd, buf, sizeof(buf), 0) > 0);
+					std::lock_guard<std::mutex> lock(mutex);
+					if (peer_fd == fd)
+						peer_fd = -1;
+					close(fd);
+				}).detach();
+			}
+		}).detach();
+	}
+
+	bool is_ready() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return peer_fd >= 0;
+	}
+
+	void send_hash(const std::vector<unsigned char>& hash) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (peer_fd >= 0)
+			send_all(peer_fd, (const char*)&hash[0], 32);
+		last_activity = now_micros();
+	}
+};
+
+/*****************************
+ **** Relay network clients ****
+ *****************************/
+
+// The block we're waiting for every client to get, and what they've told us about it
+struct BlockWait {
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::vector<unsigned char> hash;
+	std::chrono::steady_clock::time_point sent;
+	std::vector<double> latencies; // ms
+	uint64_t bytes = 0;
+};
+static BlockWait block_wait;
+
+// Only reads the relay protocol's framing (decompressing the same blocks in 1000 clients would
+// just benchmark us), noting when each block's END_BLOCK arrives
+class BenchClient : public Connection {
+	RELAY_DECLARE_CLASS_VARS
+
+private:
+	std::vector<unsigned char> block_hash;
+	uint64_t block_bytes;
+	// A block may come twice (uncached, and then ordered), only the first counts
+	std::vector<unsigned char> last_ended_hash;
+
+public:
+	std::atomic<bool> connected;
+	std::atomic<uint64_t> bytes_received;
+
+	BenchClient(int sock) : Connection(sock, "relaynetworkserver", [](void) {}), RELAY_DECLARE_CONSTRUCTOR_EXTENDS,
+			block_hash(32), block_bytes(0), connected(false), bytes_received(0) { construction_done(); }
+
+private:
+	bool skip(size_t count) {
+		std::vector<char> buf(std::min(count, size_t(65536)));
+		while (count) {
+			size_t chunk = std::min(count, buf.size());
+			if (read_all(&buf[0], chunk) != ssize_t(chunk))
+				return false;
+			count -= chunk;
+		}
+		return true;
+	}
+
+	void net_process(const std::function<void(std::string)>& disconnect) {
+		const char* version = getenv("RELAY_BENCH_VERSION") ? getenv("RELAY_BENCH_VERSION") : VERSION_STRING;
+		relay_msg_header version_header = { RELAY_MAGIC_BYTES, VERSION_TYPE, htonl(strlen(version)) };
+		do_send_bytes((char*)&version_header, sizeof(version_header));
+		do_send_bytes(version, strlen(version));
+		const bool compact = !strcmp(version, COMPACT_VERSION_STRING);
+
+		while (true) {
+			relay_msg_header header;
+			if (read_all((char*)&header, sizeof(header)) != sizeof(header))
+				return disconnect("failed to read message header");
+			if (header.magic != RELAY_MAGIC_BYTES)
+				return disconnect("invalid magic bytes");
+			uint32_t message_size = ntohl(header.length);
+			bytes_received += sizeof(header);
+
+			if (header.type == BLOCK_TYPE) {
+				std::vector<unsigned char> block(sizeof(struct bitcoin_msg_header) + 80);
+				if (read_all((char*)&block[sizeof(struct bitcoin_msg_header)], 80) != 80)
+					return disconnect("failed to read block header");
+				getblockhash(block_hash, block, sizeof(struct bitcoin_msg_header));
+				block_bytes = sizeof(header) + 80;
+
+				for (uint32_t i = 0; i < message_size; i++) {
+					uint64_t tx_size = 0; // Of the tx, if it was sent inline
+					if (compact) {
+						// A varint code, see RelayNodeCompressor::encode_tx()
+						uint64_t code = 0;
+						unsigned char c = 0x80;
+						for (int shift = 0; c & 0x80; shift += 7) {
+							if (shift > 28 || read_all((char*)&c, 1) != 1)
+								return disconnect("failed to read tx index");
+							code |= uint64_t(c & 0x7f) << shift;
+							block_bytes++;
+						}
+						if (code == 1)
+							break;
+						if (code & 1)
+							tx_size = code >> 1;
+					} else {
+						uint16_t index;
+						if (read_all((char*)&index, 2) != 2)
+							return disconnect("failed to read tx index");
+						block_bytes += 2;
+						if (ntohs(index) == ABORT_BLOCK_INDEX)
+							break;
+						if (ntohs(index) == 0xffff) {
+							unsigned char size[3];
+							if (read_all((char*)size, 3) != 3)
+								return disconnect("failed to read tx length");
+							tx_size = (size[0] << 16) | (size[1] << 8) | size[2];
+							block_bytes += 3;
+						}
+					}
+					if (tx_size && !skip(tx_size))
+						return disconnect("failed to read tx");
+					block_bytes += tx_size;
+				}
+				bytes_received += block_bytes - sizeof(header);
+			} else if (header.type == END_BLOCK_TYPE) {
+				auto now = std::chrono::steady_clock::now();
+				std::lock_guard<std::mutex> lock(block_wait.mutex);
+				if (block_hash == block_wait.hash && block_hash != last_ended_hash) {
+					last_ended_hash = block_hash;
+					block_wait.latencies.push_back(to_millis_double(now - block_wait.sent));
+					block_wait.bytes += block_bytes + sizeof(header);
+					block_wait.cv.notify_all();
+				}
+			} else if (header.type == PING_TYPE) {
+				char data[8 + sizeof(relay_msg_header)];
+				if (message_size != 8 || read_all(&data[sizeof(relay_msg_header)], 8) != 8)
+					return disconnect("failed to read ping");
+				relay_msg_header pong_header = { RELAY_MAGIC_BYTES, PONG_TYPE, htonl(8) };
+				memcpy(data, &pong_header, sizeof(pong_header));
+				do_send_bytes(data, sizeof(data));
+				bytes_received += 8;
+			} else if (header.type == MAX_VERSION_TYPE) {
+				return disconnect("server doesn't speak our version");
+			} else {
+				if (message_size > 10000000 || !skip(message_size))
+					return disconnect("failed to read message");
+				bytes_received += message_size;
+				if (header.type == VERSION_TYPE)
+					connected = true;
+				else if (header.type == TRANSACTION_TYPE || header.type == OOB_TRANSACTION_TYPE)
+					last_activity = now_micros();
+			}
+		}
+	}
+};
+
+/**********************
+ **** The benchmark ****
+ **********************/
+
+// Server CPU time and current/peak RSS, false if we can't read them
+static bool read_proc_stats(pid_t pid, double& cpu_ms, unsigned long& rss_kb, unsigned long& peak_kb) {
+#ifdef __linux__
+	// /proc/pid/stat only has clock ticks (usually 10ms, about what a block takes), but each
+	// thread's schedstat has its time on the CPU in ns
+	char path[64], buf[4096];
+	snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+	DIR* tasks = opendir(path);
+	if (!tasks)
+		return false;
+	cpu_ms = 0;
+	while (struct dirent* task = readdir(tasks)) {
+		if (task->d_name[0] == '.')
+			continue;
+		snprintf(buf, sizeof(buf), "%s/%s/schedstat", path, task->d_name);
+		FILE* f = fopen(buf, "r");
+		unsigned long long ns;
+		if (f && fscanf(f, "%llu", &ns) == 1)
+			cpu_ms += ns / 1000000.0;
+		if (f)
+			fclose(f);
+	}
+	closedir(tasks);
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	FILE* f = fopen(path, "r");
+	if (!f)
+		return false;
+	rss_kb = peak_kb = 0;
+	while (fgets(buf, sizeof(buf), f)) {
+		sscanf(buf, "VmRSS: %lu", &rss_kb);
+		sscanf(buf, "VmHWM: %lu", &peak_kb);
+	}
+	fclose(f);
+	return true;
+#else
+	return false;
+#endif
+}
+
+template<typename F> static bool wait_for(F condition, int seconds=WAIT_SECONDS) {
+	auto end = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+	while (!condition()) {
+		if (std::chrono::steady_clock::now() > end)
+			return false;
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return true;
+}
+
+static void wait_quiet() {
+	wait_for([](void) { return now_micros() - last_activity > QUIESCE_MILLIS * 1000; });
+}
+
+static void run(const char* server, unsigned client_count, FakeBitcoind& trusted, FakeBitcoind& local, FakeMempool& mempool) {
+	pid_t pid = fork();
+	if (!pid) {
+		const char* log = getenv("RELAY_BENCH_SERVER_LOG") ? getenv("RELAY_BENCH_SERVER_LOG") : "/dev/null";
+		int fd = open(log, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		dup2(fd, 1);
+		dup2(fd, 2);
+		execl(server, server, "127.0.0.1", std::to_string(BENCH_TRUSTED_PORT).c_str(), std::to_string(BENCH_MEMPOOL_PORT).c_str(),
+				"relaynetworkbench", "::ffff:127.0.0.1", (char*)NULL);
+		_exit(1);
+	}
+
+	std::vector<BenchClient*> clients;
+	const auto cleanup = [&](void) {
+		for (BenchClient* client : clients)
+			client->disconnect_from_outside("bench done");
+		for (BenchClient* client : clients) {
+			while (!(client->getDisconnectFlags() & DISCONNECT_COMPLETE))
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			delete client;
+		}
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+	};
+
+	// Our bitcoinds may still be holding the last server's (dead) connections for a moment
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	if (!wait_for([&](void) { return trusted.is_ready() && local.is_ready() && mempool.is_ready(); })) {
+		printf("%u clients: server never connected to our bitcoinds\n", client_count);
+		return cleanup();
+	}
+
+	for (unsigned i = 0; i < client_count; i++) {
+		int sock = -1;
+		wait_for([&](void) {
+			std::string error;
+			sock = create_connect_socket("127.0.0.1", RELAY_PORT, error);
+			return sock >= 0;
+		});
+		if (sock < 0) {
+			printf("%u clients: failed to connect to the server\n", client_count);
+			return cleanup();
+		}
+		clients.push_back(new BenchClient(sock));
+	}
+	if (!wait_for([&](void) { return std::all_of(clients.begin(), clients.end(), [](BenchClient* c) { return c->connected.load(); }); })) {
+		printf("%u clients: not every client connected\n", client_count);
+		return cleanup();
+	}
+
+	std::vector<double> latencies;
+	uint64_t block_bytes = 0;
+	double block_cpu_ms = 0;
+	bool have_proc_stats = true;
+	unsigned long rss_kb = 0, peak_kb = 0;
+	for (const ReplayItem& item : replay) {
+		if (!item.is_block) {
+			mempool.send_hash(item.hash);
+			continue;
+		}
+
+		wait_quiet();
+		double cpu_start, cpu_end;
+		have_proc_stats &= read_proc_stats(pid, cpu_start, rss_kb, peak_kb);
+		{
+			std::lock_guard<std::mutex> lock(block_wait.mutex);
+			block_wait.hash = item.hash;
+			block_wait.latencies.clear();
+			block_wait.bytes = 0;
+			block_wait.sent = std::chrono::steady_clock::now();
+		}
+		trusted.send_block(*item.msg);
+		{
+			std::unique_lock<std::mutex> lock(block_wait.mutex);
+			block_wait.cv.wait_for(lock, std::chrono::seconds(WAIT_SECONDS), [&](void) { return block_wait.latencies.size() == client_count; });
+			latencies.insert(latencies.end(), block_wait.latencies.begin(), block_wait.latencies.end());
+			block_bytes += block_wait.bytes;
+			block_wait.hash.clear();
+		}
+		have_proc_stats &= read_proc_stats(pid, cpu_end, rss_kb, peak_kb);
+		block_cpu_ms += cpu_end - cpu_start;
+	}
+
+	uint64_t total_bytes = 0;
+	for (BenchClient* client : clients)
+		total_bytes += client->bytes_received;
+
+	std::sort(latencies.begin(), latencies.end());
+	const auto percentile = [&](double p) { return latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1, size_t(latencies.size() * p))]; };
+	printf("%u clients: %lu blocks, latency p50 %lf ms p99 %lf ms max %lf ms (%lu of %lu never arrived), %lu block bytes/client/block, %lu total bytes/client",
+			client_count, (unsigned long)replay_blocks, percentile(0.5), percentile(0.99), latencies.empty() ? 0 : latencies.back(),
+			(unsigned long)(replay_blocks * client_count - latencies.size()), (unsigned long)(replay_blocks * client_count),
+			(unsigned long)(latencies.empty() ? 0 : block_bytes / latencies.size()), (unsigned long)(total_bytes / client_count));
+	if (have_proc_stats)
+		printf(", server CPU %lf ms/block, RSS %lu KB (peak %lu KB)\n", replay_blocks ? block_cpu_ms / replay_blocks : 0, rss_kb, peak_kb);
+	else
+		printf("\n");
+	fflush(stdout);
+
+	cleanup();
+}
+
+int main(int argc, const char** argv) {
+	if (argc < 3) {
+		printf("USAGE: %s capture_file|block.txt path/to/relaynetworkserver [client counts, default 1 10 100]\n", argv[0]);
+		printf("capture_file is written by any P2PRelayer when RELAY_CAPTURE_FILE is set\n");
+		printf("The server needs ports %u and %u (and we take %u, %u and %u), its output goes to RELAY_BENCH_SERVER_LOG\n",
+				RELAY_PORT, LOCAL_P2P_PORT, LOCAL_P2P_PORT, BENCH_TRUSTED_PORT, BENCH_MEMPOOL_PORT);
+		return -1;
+	}
+
+	size_t path_len = strlen(argv[1]);
+	if (!(path_len > 4 && !strcmp(argv[1] + path_len - 4, ".txt") ? load_block_txt(argv[1]) : load_capture(argv[1]))) {
+		printf("Failed to read %s\n", argv[1]);
+		return -1;
+	}
+	printf("Replaying %lu blocks and %lu txn\n", (unsigned long)replay_blocks, (unsigned long)(replay.size() - replay_blocks));
+
+	std::vector<unsigned> client_counts;
+	for (int i = 3; i < argc; i++)
+		client_counts.push_back(strtoul(argv[i], NULL, 10));
+	if (client_counts.empty())
+		client_counts = {1, 10, 100};
+
+	// Each client is a socket here and one in the server (which inherits our limit)
+	struct rlimit limit;
+	if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	FakeBitcoind trusted(BENCH_TRUSTED_PORT), local(LOCAL_P2P_PORT);
+	FakeMempool mempool(BENCH_MEMPOOL_PORT);
+	for (unsigned client_count : client_counts)
+		run(argv[2], client_count, trusted, local, mempool);
+
+	// Our bitcoinds' threads are still using our globals
+	fflush(stdout);
+	_exit(0);
+}
@@ -1,11 +1,28 @@
 #include "relayprocess.h"
 
 #include "crypto/sha2.h"
+#include "crypto/sha256_lanes.h"
+#include "stats.h"
 
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <algorithm>
+#include <unordered_map>
+
+#ifndef WIN32
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+// Hashing txids and building the merkle root, when we check it
+static StatHistogram merkle_parse_stat("relay_block_merkle_seconds", "Time spent checking blocks' merkle roots", "path=\"parse\"");
+static StatHistogram merkle_decompress_stat("relay_block_merkle_seconds", "Time spent checking blocks' merkle roots", "path=\"decompress\"");
 
-std::shared_ptr<std::vector<unsigned char> > RelayNodeCompressor::get_relay_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx) {
-	std::lock_guard<std::mutex> lock(mutex);
+std::shared_ptr<std::vector<unsigned char> > RelayNodeCompressor::get_relay_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx, uint64_t* seq, uint64_t* position) {
+	std::lock_guard<FiberMutex> lock(mutex);
 
 	if (send_tx_cache.contains(tx))
 		return std::shared_ptr<std::vector<unsigned char> >();
@@ -24,13 +41,19 @@ std::shared_ptr<std::vector<unsigned char> > RelayNodeCompressor::get_relay_tran
 		send_tx_cache.add(tx, tx->size() > OLD_MAX_RELAY_TRANSACTION_BYTES);
 	}
 
+	sent_position++;
+	if (seq)
+		*seq = send_tx_cache.last_seq();
+	if (position)
+		*position = sent_position;
 	return tx_to_msg(tx);
 }
 
-void RelayNodeCompressor::reset() {
-	std::lock_guard<std::mutex> lock(mutex);
+void RelayNodeCompressor::reset(bool keepRecvCache) {
+	std::lock_guard<FiberMutex> lock(mutex);
 
-	recv_tx_cache.clear();
+	if (!keepRecvCache)
+		recv_tx_cache.clear();
 	send_tx_cache.clear();
 }
 
@@ -40,7 +63,7 @@ bool RelayNodeCompressor::check_recv_tx(uint32_t tx_size) {
 }
 
 bool RelayNodeCompressor::maybe_recv_tx_of_size(uint32_t tx_size, bool debug_print) {
-	std::lock_guard<std::mutex> lock(mutex);
+	std::lock_guard<FiberMutex> lock(mutex);
 
 	if (!check_recv_tx(tx_size)) {
 		if (debug_print)
@@ -51,187 +74,487 @@ bool RelayNodeCompressor::maybe_recv_tx_of_size(uint32_t tx_size, bool debug_pri
 }
 
 void RelayNodeCompressor::recv_tx(std::shared_ptr<std::vector<unsigned char > > tx) {
-	std::lock_guard<std::mutex> lock(mutex);
+	std::lock_guard<FiberMutex> lock(mutex);
 
 	uint32_t tx_size = tx.get()->size();
 	assert(check_recv_tx(tx_size));
-	recv_tx_cache.add(tx, useOldFlags ? tx_size > OLD_MAX_RELAY_TRANSACTION_BYTES : tx_size);
+	recv_tx_cache.add(tx, tx_flag(tx_size));
 }
 
-void RelayNodeCompressor::for_each_sent_tx(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&)> callback) {
-	std::lock_guard<std::mutex> lock(mutex);
+uint64_t RelayNodeCompressor::for_each_sent_tx(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&)> callback) {
+	std::lock_guard<FiberMutex> lock(mutex);
 	send_tx_cache.for_all_txn(callback);
+	return sent_position;
+}
+
+void RelayNodeCompressor::get_resync_summary(std::vector<unsigned char>& summary) {
+	std::lock_guard<FiberMutex> lock(mutex);
+	summary.clear();
+	summary.reserve(recv_tx_cache.size() * 8);
+	recv_tx_cache.for_all_txn_hashes([&](const std::shared_ptr<std::vector<unsigned char> >&, const unsigned char* hash) {
+		summary.insert(summary.end(), hash, hash + 8);
+	});
+}
+
+uint64_t RelayNodeCompressor::resync_sent_txn(const std::vector<unsigned char>& summary, std::vector<unsigned char>& reply, std::vector<std::shared_ptr<std::vector<unsigned char> > >& missing) {
+	assert(summary.size() % 8 == 0);
+	size_t count = summary.size() / 8;
+
+	// Position of each of the peer's txn, or -1 for ones it has more than one of
+	std::unordered_map<uint64_t, ssize_t> positions(count);
+	for (size_t i = 0; i < count; i++) {
+		uint64_t key;
+		memcpy(&key, &summary[i * 8], 8);
+		auto res = positions.insert(std::make_pair(key, ssize_t(i)));
+		if (!res.second)
+			res.first->second = -1;
+	}
+
+	reply.assign(32 + (count + 7) / 8, 0);
+	CSHA256 kept;
+	ssize_t last_kept = -1;
+	bool keeping = true;
+
+	std::lock_guard<FiberMutex> lock(mutex);
+	send_tx_cache.for_all_txn_hashes([&](const std::shared_ptr<std::vector<unsigned char> >& tx, const unsigned char* hash) {
+		if (keeping) {
+			uint64_t key;
+			memcpy(&key, hash, 8);
+			auto it = positions.find(key);
+			// The peer can only drop txn, so what it keeps must be in our order
+			if (it != positions.end() && it->second > last_kept) {
+				last_kept = it->second;
+				reply[32 + last_kept / 8] |= 1 << (last_kept % 8);
+				kept.Write(hash, 32);
+				return;
+			}
+			keeping = false;
+		}
+		missing.push_back(tx);
+	});
+	kept.Finalize(&reply[0]);
+	return sent_position;
+}
+
+const char* RelayNodeCompressor::apply_resync(const std::vector<unsigned char>& reply, size_t summary_count) {
+	if (reply.size() != 32 + (summary_count + 7) / 8)
+		return "got resync reply of the wrong size";
+
+	std::lock_guard<FiberMutex> lock(mutex);
+	if (recv_tx_cache.size() != summary_count)
+		return "recv cache changed between resync request and reply";
+
+	size_t removed = 0;
+	for (size_t i = 0; i < summary_count; i++) {
+		if (!(reply[32 + i / 8] & (1 << (i % 8)))) {
+			std::shared_ptr<std::vector<unsigned char> > tx;
+			unsigned char hash[32];
+			ALWAYS_ASSERT(recv_tx_cache.remove(i - removed, tx, hash));
+			removed++;
+		}
+	}
+
+	CSHA256 kept;
+	recv_tx_cache.for_all_txn_hashes([&](const std::shared_ptr<std::vector<unsigned char> >&, const unsigned char* hash) {
+		kept.Write(hash, 32);
+	});
+	unsigned char digest[32];
+	kept.Finalize(digest);
+	if (memcmp(digest, &reply[0], 32))
+		return "txn kept by resync did not match the server's";
+	return NULL;
+}
+
+static void write_le32(std::vector<unsigned char>& out, uint32_t val) {
+	for (int i = 0; i < 4; i++)
+		out.push_back(val >> (8 * i));
+}
+
+static bool read_le32(const unsigned char*& it, const unsigned char* end, uint32_t& res) {
+	if (end - it < 4)
+		return false;
+	res = 0;
+	for (int i = 3; i >= 0; i--)
+		res = (res << 8) | it[i];
+	it += 4;
+	return true;
+}
+
+// useOldFlags, then the send and recv caches, each as a tx count and each tx's (le32) length and
+// data, in order, then the number of blocksAlreadySeen and their hashes, oldest first
+void RelayNodeCompressor::write_snapshot(std::vector<unsigned char>& out) {
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > txn[2];
+	std::vector<unsigned char> seen;
+	{
+		std::lock_guard<FiberMutex> lock(mutex);
+		send_tx_cache.for_all_txn([&](const std::shared_ptr<std::vector<unsigned char> >& tx) { txn[0].push_back(tx); });
+		recv_tx_cache.for_all_txn([&](const std::shared_ptr<std::vector<unsigned char> >& tx) { txn[1].push_back(tx); });
+		blocksAlreadySeen.for_each([&](const unsigned char* hash) { seen.insert(seen.end(), hash, hash + 32); });
+	}
+
+	// The txn themselves are never modified, so they can be copied out without the lock
+	out.push_back(useOldFlags);
+	for (const auto& list : txn) {
+		write_le32(out, list.size());
+		for (const auto& tx : list) {
+			write_le32(out, tx->size());
+			out.insert(out.end(), tx->begin(), tx->end());
+		}
+	}
+	write_le32(out, seen.size() / 32);
+	out.insert(out.end(), seen.begin(), seen.end());
+}
+
+const char* RelayNodeCompressor::read_snapshot(const unsigned char*& it, const unsigned char* end) {
+	if (it == end)
+		return "snapshot truncated";
+	bool snapshotOldFlags = *(it++);
+
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > txn[2];
+	for (auto& list : txn) {
+		uint32_t count, size;
+		if (!read_le32(it, end, count))
+			return "snapshot truncated";
+		for (uint32_t i = 0; i < count; i++) {
+			if (!read_le32(it, end, size) || uint64_t(end - it) < size)
+				return "snapshot truncated";
+			list.push_back(std::make_shared<std::vector<unsigned char> >(it, it + size));
+			it += size;
+		}
+	}
+	uint32_t seen_count;
+	if (!read_le32(it, end, seen_count) || uint64_t(end - it) / 32 < seen_count)
+		return "snapshot truncated";
+	const unsigned char* seen = it;
+	it += 32 * seen_count;
+
+	if (snapshotOldFlags != useOldFlags)
+		return "snapshot is of a compressor with different flags";
+
+	// Adding them back in order, with the same limits, leaves the caches as they were when written
+	std::lock_guard<FiberMutex> lock(mutex);
+	send_tx_cache.clear();
+	recv_tx_cache.clear();
+	blocksAlreadySeen.clear();
+	for (const auto& tx : txn[0])
+		send_tx_cache.add(tx, tx_flag(tx->size()));
+	for (const auto& tx : txn[1])
+		recv_tx_cache.add(tx, tx_flag(tx->size()));
+	std::vector<unsigned char> hash(32);
+	for (uint32_t i = 0; i < seen_count; i++) {
+		memcpy(&hash[0], seen + 32 * i, 32);
+		blocksAlreadySeen.insert(hash);
+	}
+	return NULL;
 }
 
 bool RelayNodeCompressor::block_sent(std::vector<unsigned char>& hash) {
-	std::lock_guard<std::mutex> lock(mutex);
-	return blocksAlreadySeen.insert(hash).second;
+	std::lock_guard<FiberMutex> lock(mutex);
+	return blocksAlreadySeen.insert(hash);
+}
+
+bool RelayNodeCompressor::was_block_seen(const std::vector<unsigned char>& hash) {
+	return blocksAlreadySeen.contains_concurrent(hash);
 }
 
 uint32_t RelayNodeCompressor::blocks_sent() {
-	std::lock_guard<std::mutex> lock(mutex);
-	return blocksAlreadySeen.size();
+	return blocksAlreadySeen.concurrent_size();
 }
 
 bool RelayNodeCompressor::was_tx_sent(const unsigned char* txhash) {
-	std::lock_guard<std::mutex> lock(mutex);
-	return send_tx_cache.contains(txhash);
-}
-
-class MerkleTreeBuilder {
-private:
-	std::vector<unsigned char> hashlist;
-public:
-	MerkleTreeBuilder(uint32_t tx_count) : hashlist(tx_count * 32) {}
-	inline unsigned char* getTxHashLoc(uint32_t tx) { return &hashlist[tx * 32]; }
-	bool merkleRootMatches(const unsigned char* match) {
-		uint32_t txcount = hashlist.size() / 32;
-		uint32_t stepCount = 1, lastMax = txcount - 1;
-		for (uint32_t rowSize = txcount; rowSize > 1; rowSize = (rowSize + 1) / 2) {
-			if (!memcmp(&hashlist[32 * (lastMax - stepCount)], &hashlist[32 * lastMax], 32))
-				return false;
-
-			for (uint32_t i = 0; i < rowSize; i += 2) {
-				assert(i*stepCount < txcount && lastMax < txcount);
-				double_sha256_two_32_inputs(&hashlist[32 * i*stepCount], &hashlist[32 * std::min((i + 1)*stepCount, lastMax)], &hashlist[32 * i*stepCount]);
-			}
-			lastMax = ((rowSize - 1) & 0xfffffffe) * stepCount;
-			stepCount *= 2;
-		}
-		return !memcmp(match, &hashlist[0], 32);
+	return send_tx_cache.contains_concurrent(txhash);
+}
+
+// Unlike the std::vector version in utils, reports running off the end by returning false
+static inline bool read_varint(const unsigned char*& it, const unsigned char* end, uint64_t& res) {
+	if (it == end)
+		return false;
+	uint8_t first = *(it++);
+	if (first < 0xfd) {
+		res = first;
+		return true;
 	}
-};
+	size_t len = first == 0xfd ? 2 : (first == 0xfe ? 4 : 8);
+	if (size_t(end - it) < len)
+		return false;
+	res = 0;
+	for (size_t i = len; i > 0; i--)
+		res = (res << 8) | it[i - 1];
+	it += len;
+	return true;
+}
+
+// Skips len bytes, if there are that many before end
+static inline bool skip(const unsigned char*& it, const unsigned char* end, uint64_t len) {
+	if (uint64_t(end - it) < len)
+		return false;
+	it += len;
+	return true;
+}
 
-std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> RelayNodeCompressor::maybe_compress_block(const std::vector<unsigned char>& hash, const std::vector<unsigned char>& block, bool check_merkle) {
-	std::lock_guard<std::mutex> lock(mutex);
-	FASLockHint faslock(send_tx_cache);
+const unsigned char* tx_end(const unsigned char* it, const unsigned char* end) {
+	uint64_t count, len;
+	if (!skip(it, end, 4) || !read_varint(it, end, count))
+		return NULL;
+	for (uint64_t i = 0; i < count; i++)
+		if (!skip(it, end, 36) || !read_varint(it, end, len) || !skip(it, end, len) || !skip(it, end, 4))
+			return NULL;
+
+	if (!read_varint(it, end, count))
+		return NULL;
+	for (uint64_t i = 0; i < count; i++)
+		if (!skip(it, end, 8) || !read_varint(it, end, len) || !skip(it, end, len))
+			return NULL;
+
+	if (!skip(it, end, 4))
+		return NULL;
+	return it;
+}
 
+const char* parse_block(const std::vector<unsigned char>& hash, const std::vector<unsigned char>& block, bool check_merkle, ParsedBlock& parsed) {
 	if (check_merkle && (hash[31] != 0 || hash[30] != 0 || hash[29] != 0 || hash[28] != 0 || hash[27] != 0 || hash[26] != 0 || hash[25] != 0))
-		return std::make_tuple(std::shared_ptr<std::vector<unsigned char> >(), "BAD_WORK");
+		return "BAD_WORK";
 
-	if (blocksAlreadySeen.count(hash))
-		return std::make_tuple(std::shared_ptr<std::vector<unsigned char> >(), "SEEN");
-
-	auto compressed_block = std::make_shared<std::vector<unsigned char> >();
-	compressed_block->reserve(1100000);
-	struct relay_msg_header header;
+	parsed.txn.clear();
+	parsed.txids.clear();
 
-	try {
-		std::vector<unsigned char>::const_iterator readit = block.begin();
-		move_forward(readit, sizeof(struct bitcoin_msg_header), block.end());
-		move_forward(readit, 4, block.end());
+	const unsigned char *readit = block.data(), *end = block.data() + block.size();
+	if (!skip(readit, end, sizeof(struct bitcoin_msg_header) + 80))
+		return "INVALID_SIZE";
 #ifndef TEST_DATA
-		int32_t block_version = ((*(readit-1) << 24) | (*(readit-2) << 16) | (*(readit-3) << 8) | *(readit-4));
-		if (block_version < 4)
-			return std::make_tuple(std::make_shared<std::vector<unsigned char> >(), "SMALL_VERSION");
+	int32_t block_version = ((*(readit-80+3) << 24) | (*(readit-80+2) << 16) | (*(readit-80+1) << 8) | *(readit-80));
+	if (block_version < 4)
+		return "SMALL_VERSION";
 #endif
+	const unsigned char* merkle_hash_it = readit - 80 + 4 + 32;
 
-		move_forward(readit, 32, block.end());
-		auto merkle_hash_it = readit;
-		move_forward(readit, 80 - (4 + 32), block.end());
-
-		uint64_t txcount = read_varint(readit, block.end());
-		if (txcount < 1 || txcount > 100000)
-			return std::make_tuple(std::make_shared<std::vector<unsigned char> >(), "TXCOUNT_RANGE");
+	uint64_t txcount;
+	if (!read_varint(readit, end, txcount))
+		return "INVALID_SIZE";
+	if (txcount < 1 || txcount > 100000)
+		return "TXCOUNT_RANGE";
 
-		header.magic = RELAY_MAGIC_BYTES;
-		header.type = BLOCK_TYPE;
-		header.length = htonl(txcount);
-		compressed_block->insert(compressed_block->end(), (unsigned char*)&header, ((unsigned char*)&header) + sizeof(header));
-		compressed_block->insert(compressed_block->end(), block.begin() + sizeof(struct bitcoin_msg_header), block.begin() + 80 + sizeof(struct bitcoin_msg_header));
+	parsed.txn.reserve(txcount);
+	if (check_merkle)
+		parsed.txids.resize(txcount * 32);
 
-		MerkleTreeBuilder merkleTree(check_merkle ? txcount : 0);
+	for (uint32_t i = 0; i < txcount; i++) {
+#ifdef __GNUC__
+		__builtin_prefetch(readit + 512);
+#endif
+		const unsigned char* txend = tx_end(readit, end);
+		if (!txend)
+			return "INVALID_SIZE";
+		parsed.txn.emplace_back(readit - block.data(), txend - readit);
+		readit = txend;
+	}
 
+	if (check_merkle) {
+		auto merkle_start = std::chrono::steady_clock::now();
+		BlockArena::Scope arena;
+		ArenaVector<const unsigned char*> inputs(txcount, NULL, &arena);
+		ArenaVector<uint64_t> byte_counts(txcount, 0, &arena);
+		ArenaVector<unsigned char*> results(txcount, NULL, &arena);
 		for (uint32_t i = 0; i < txcount; i++) {
-			std::vector<unsigned char>::const_iterator txstart = readit;
+			inputs[i] = &block[parsed.txn[i].first];
+			byte_counts[i] = parsed.txn[i].second;
+			results[i] = &parsed.txids[i * 32];
+		}
+		double_sha256_batch(&inputs[0], &byte_counts[0], &results[0], txcount);
 
-			move_forward(readit, 4, block.end());
+		bool matches = MerkleTreeBuilder(parsed.txids, &arena).merkleRootMatches(merkle_hash_it);
+		merkle_parse_stat.record(std::chrono::steady_clock::now() - merkle_start);
+		if (!matches)
+			return "INVALID_MERKLE";
+	}
 
-			uint64_t txins = read_varint(readit, block.end());
-			for (uint64_t j = 0; j < txins; j++) {
-				move_forward(readit, 36, block.end());
-				move_forward(readit, read_varint(readit, block.end()) + 4, block.end());
-			}
+	return NULL;
+}
 
-			uint64_t txouts = read_varint(readit, block.end());
-			for (uint64_t j = 0; j < txouts; j++) {
-				move_forward(readit, 8, block.end());
-				move_forward(readit, read_varint(readit, block.end()), block.end());
-			}
+// Compact blocks replace each tx's 2-byte index (or 0xffff and a 3-byte length, for txn sent
+// inline) with one varint code (7 bits per byte, low bits first, the top bit set on all but the
+// last byte). Cached txn are (zigzag(index - last_index) << 1), so as a block's txn are mostly
+// removed from the cache in about the order they were added they usually take 1 byte. Inline txn
+// are (length << 1) | 1, with a 0 length (COMPACT_ABORT_CODE) ending an aborted block.
+#define COMPACT_ABORT_CODE 1
+#define COMPACT_MAX_CODE_BYTES 5
+
+template<typename Vector>
+static inline void write_code(Vector& out, uint64_t code) {
+	while (code >= 0x80) {
+		out.push_back((code & 0x7f) | 0x80);
+		code >>= 7;
+	}
+	out.push_back(code);
+}
+
+static inline bool read_code(std::function<ssize_t(char*, size_t)>& read_all, uint64_t& code, uint32_t& wire_bytes) {
+	code = 0;
+	for (int i = 0; i < COMPACT_MAX_CODE_BYTES; i++) {
+		unsigned char c;
+		if (read_all((char*)&c, 1) != 1)
+			return false;
+		wire_bytes++;
+		code |= uint64_t(c & 0x7f) << (7 * i);
+		if (!(c & 0x80))
+			return true;
+	}
+	return false;
+}
 
-			move_forward(readit, 4, block.end());
+template<typename Vector>
+void RelayNodeCompressor::encode_tx(Vector& out, int index, const unsigned char* tx, uint32_t len, int& last_index) const {
+	if (compact) {
+		if (index < 0) {
+			write_code(out, (uint64_t(len) << 1) | 1);
+			out.insert(out.end(), tx, tx + len);
+		} else {
+			int64_t delta = int64_t(index) - last_index;
+			write_code(out, ((uint64_t(delta) << 1) ^ uint64_t(delta >> 63)) << 1);
+			last_index = index;
+		}
+	} else if (index < 0) {
+		out.push_back(0xff);
+		out.push_back(0xff);
+		out.push_back((len >> 16) & 0xff);
+		out.push_back((len >>  8) & 0xff);
+		out.push_back((len      ) & 0xff);
+		out.insert(out.end(), tx, tx + len);
+	} else {
+		out.push_back((index >> 8) & 0xff);
+		out.push_back((index     ) & 0xff);
+	}
+}
 
-			int index = send_tx_cache.remove(txstart, readit);
+std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> RelayNodeCompressor::maybe_compress_block(const std::vector<unsigned char>& hash, const std::vector<unsigned char>& block, bool check_merkle, uint64_t* depends_seq, uint64_t* position) {
+	if (was_block_seen(hash))
+		return std::make_tuple(std::shared_ptr<std::vector<unsigned char> >(), "SEEN");
 
-			__builtin_prefetch(&(*readit), 0);
-			__builtin_prefetch(&(*readit) + 64, 0);
-			__builtin_prefetch(&(*readit) + 128, 0);
-			__builtin_prefetch(&(*readit) + 196, 0);
-			__builtin_prefetch(&(*readit) + 256, 0);
+	ParsedBlock parsed;
+	const char* err = parse_block(hash, block, check_merkle, parsed);
+	if (err)
+		return std::make_tuple(std::make_shared<std::vector<unsigned char> >(), err);
 
-			if (check_merkle)
-				double_sha256(&(*txstart), merkleTree.getTxHashLoc(i), readit - txstart);
+	return maybe_compress_block(hash, block, parsed, depends_seq, position);
+}
 
-			if (index < 0) {
-				compressed_block->push_back(0xff);
-				compressed_block->push_back(0xff);
+std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> RelayNodeCompressor::maybe_compress_block(const std::vector<unsigned char>& hash, const std::vector<unsigned char>& block, const ParsedBlock& parsed, uint64_t* depends_seq, uint64_t* position) {
+	std::lock_guard<FiberMutex> lock(mutex);
 
-				uint32_t txlen = readit - txstart;
-				compressed_block->push_back((txlen >> 16) & 0xff);
-				compressed_block->push_back((txlen >>  8) & 0xff);
-				compressed_block->push_back((txlen      ) & 0xff);
+	if (blocksAlreadySeen.count(hash))
+		return std::make_tuple(std::shared_ptr<std::vector<unsigned char> >(), "SEEN");
 
-				compressed_block->insert(compressed_block->end(), txstart, readit);
-			} else {
-				compressed_block->push_back((index >> 8) & 0xff);
-				compressed_block->push_back((index     ) & 0xff);
-			}
-		}
+	// Built in arena scratch space big enough for every tx to be sent inline, and then copied out at
+	// its actual size, which is usually a small fraction of that
+	BlockArena::Scope arena;
+	ArenaVector<unsigned char> compressed(&arena);
+	compressed.reserve(sizeof(struct relay_msg_header) + block.size() + parsed.txn.size() * COMPACT_MAX_CODE_BYTES);
 
-		if (check_merkle && !merkleTree.merkleRootMatches(&(*merkle_hash_it)))
-			return std::make_tuple(std::make_shared<std::vector<unsigned char> >(), "INVALID_MERKLE");
-	} catch(read_exception) {
-		return std::make_tuple(std::make_shared<std::vector<unsigned char> >(), "INVALID_SIZE");
+	struct relay_msg_header header;
+	header.magic = RELAY_MAGIC_BYTES;
+	header.type = BLOCK_TYPE;
+	header.length = htonl(parsed.txn.size());
+	compressed.insert(compressed.end(), (unsigned char*)&header, ((unsigned char*)&header) + sizeof(header));
+	compressed.insert(compressed.end(), block.begin() + sizeof(struct bitcoin_msg_header), block.begin() + 80 + sizeof(struct bitcoin_msg_header));
+
+	int last_index = 0;
+	uint64_t depends = send_tx_cache.evicting_seq();
+	for (uint32_t i = 0; i < parsed.txn.size(); i++) {
+		std::vector<unsigned char>::const_iterator txstart = block.begin() + parsed.txn[i].first;
+		std::vector<unsigned char>::const_iterator txend = txstart + parsed.txn[i].second;
+
+		uint64_t seq = 0;
+		int index = parsed.txids.empty() ? send_tx_cache.remove(txstart, txend, &seq) : send_tx_cache.remove(&parsed.txids[i * 32], &seq);
+		depends = std::max(depends, seq);
+
+		__builtin_prefetch(&(*txend), 0);
+		__builtin_prefetch(&(*txend) + 64, 0);
+		__builtin_prefetch(&(*txend) + 128, 0);
+		__builtin_prefetch(&(*txend) + 196, 0);
+		__builtin_prefetch(&(*txend) + 256, 0);
+
+		encode_tx(compressed, index, &(*txstart), parsed.txn[i].second, last_index);
 	}
 
-	if (!blocksAlreadySeen.insert(hash).second)
+	if (!blocksAlreadySeen.insert(hash))
 		return std::make_tuple(std::shared_ptr<std::vector<unsigned char> >(), "MUTEX_BROKEN???");
+	sent_position++;
+	if (depends_seq)
+		*depends_seq = depends;
+	if (position)
+		*position = sent_position;
 
-	return std::make_tuple(compressed_block, (const char*)NULL);
+	return std::make_tuple(std::make_shared<std::vector<unsigned char> >(compressed.begin(), compressed.end()), (const char*)NULL);
 }
 
-struct IndexVector {
-	uint16_t index;
-	std::vector<unsigned char> data;
-};
-struct IndexPtr {
-	uint16_t index;
-	size_t pos;
-	IndexPtr(uint16_t index_in, size_t pos_in) : index(index_in), pos(pos_in) {}
-	bool operator< (const IndexPtr& o) const { return index < o.index; }
-};
-
-void tweak_sort(std::vector<IndexPtr>& ptrs, size_t start, size_t end) {
-	if (start + 1 >= end)
-		return;
-	size_t split = (end - start) / 2 + start;
-	tweak_sort(ptrs, start, split);
-	tweak_sort(ptrs, split, end);
-
-	size_t j = 0, k = split;
-	std::vector<IndexPtr> left(ptrs.begin() + start, ptrs.begin() + split);
-	for (size_t i = start; i < end; i++) {
-		if (j < left.size() && (k >= end || left[j].index - (k - split) <= ptrs[k].index)) {
-			ptrs[i] = left[j++];
-			ptrs[i].index -= (k - split);
-		} else
-			ptrs[i] = ptrs[k++];
+std::shared_ptr<std::vector<unsigned char> > RelayNodeCompressor::uncached_block_msg(const std::vector<unsigned char>& block, const ParsedBlock& parsed) const {
+	auto msg = std::make_shared<std::vector<unsigned char> >();
+	msg->reserve(sizeof(struct relay_msg_header) + block.size() + parsed.txn.size() * COMPACT_MAX_CODE_BYTES);
+
+	struct relay_msg_header header;
+	header.magic = RELAY_MAGIC_BYTES;
+	header.type = BLOCK_TYPE;
+	header.length = htonl(parsed.txn.size());
+	msg->insert(msg->end(), (unsigned char*)&header, ((unsigned char*)&header) + sizeof(header));
+	msg->insert(msg->end(), block.begin() + sizeof(struct bitcoin_msg_header), block.begin() + 80 + sizeof(struct bitcoin_msg_header));
+
+	int last_index = 0;
+	for (const auto& tx : parsed.txn)
+		encode_tx(*msg, -1, &block[tx.first], tx.second, last_index);
+	return msg;
+}
+
+const char* const BLOCK_ABORTED = "block aborted by sender";
+
+const char* RelayNodeCompressor::BlockEncoder::begin(const std::vector<unsigned char>& hashIn, const unsigned char* header, uint32_t tx_count, std::vector<unsigned char>& out) {
+	assert(!lock.owns_lock());
+	lock.lock();
+
+	if (compressor.blocksAlreadySeen.count(hashIn)) {
+		lock.unlock();
+		return "SEEN";
 	}
+	compressor.blocksAlreadySeen.insert(hashIn);
+	hash = hashIn;
+	last_index = 0;
+	begin_seq = compressor.send_tx_cache.last_seq();
+	compressor.sent_position++;
+
+	struct relay_msg_header msg_header;
+	msg_header.magic = RELAY_MAGIC_BYTES;
+	msg_header.type = compressor.BLOCK_TYPE;
+	msg_header.length = htonl(tx_count);
+	out.insert(out.end(), (unsigned char*)&msg_header, ((unsigned char*)&msg_header) + sizeof(msg_header));
+	out.insert(out.end(), header, header + 80);
+	return NULL;
 }
 
-std::tuple<uint32_t, std::shared_ptr<std::vector<unsigned char> >, const char*, std::shared_ptr<std::vector<unsigned char> > > RelayNodeCompressor::decompress_relay_block(std::function<ssize_t(char*, size_t)>& read_all, uint32_t message_size, bool check_merkle) {
-	std::lock_guard<std::mutex> lock(mutex);
-	FASLockHint faslock(recv_tx_cache);
+void RelayNodeCompressor::BlockEncoder::add_tx(const std::vector<unsigned char>& block, size_t start, size_t len, std::vector<unsigned char>& out) {
+	assert(lock.owns_lock());
+	int index = compressor.send_tx_cache.remove(block.begin() + start, block.begin() + start + len);
+	compressor.encode_tx(out, index, &block[start], len, last_index);
+}
+
+void RelayNodeCompressor::BlockEncoder::abort(std::vector<unsigned char>& out) {
+	assert(lock.owns_lock());
+	// Peers removed the same txn from their caches as we did, so all they have to do is drop the block
+	if (compressor.compact)
+		write_code(out, COMPACT_ABORT_CODE);
+	else {
+		out.push_back((ABORT_BLOCK_INDEX >> 8) & 0xff);
+		out.push_back((ABORT_BLOCK_INDEX     ) & 0xff);
+	}
+	compressor.blocksAlreadySeen.erase(hash);
+	lock.unlock();
+}
+
+void RelayNodeCompressor::BlockEncoder::done() {
+	assert(lock.owns_lock());
+	lock.unlock();
+}
+
+std::tuple<uint32_t, std::shared_ptr<std::vector<unsigned char> >, const char*, std::shared_ptr<std::vector<unsigned char> > > RelayNodeCompressor::decompress_relay_block(std::function<ssize_t(char*, size_t)>& read_all, uint32_t message_size, bool check_merkle, const BlockProgressCallback& on_progress, ParsedBlock* parsed) {
+	std::lock_guard<FiberMutex> lock(mutex);
 
 	if (message_size > 100000)
 		return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "got a BLOCK message with far too many transactions", std::shared_ptr<std::vector<unsigned char> >(NULL));
@@ -254,68 +577,296 @@ std::tuple<uint32_t, std::shared_ptr<std::vector<unsigned char> >, const char*,
 	getblockhash(*fullhashptr.get(), *block, sizeof(struct bitcoin_msg_header));
 	blocksAlreadySeen.insert(*fullhashptr.get());
 
-	if (check_merkle && ((*fullhashptr)[31] != 0 || (*fullhashptr)[30] != 0 || (*fullhashptr)[29] != 0 || (*fullhashptr)[28] != 0 || (*fullhashptr)[27] != 0 || (*fullhashptr)[26] != 0 || (*fullhashptr)[25] != 0))
+	if (check_merkle && !check_header_pow(&(*block)[sizeof(struct bitcoin_msg_header)], &(*fullhashptr)[0]))
 		return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "block hash did not meet minimum difficulty target", std::shared_ptr<std::vector<unsigned char> >(NULL));
 
 	auto vartxcount = varint(message_size);
 	block->insert(block->end(), vartxcount.begin(), vartxcount.end());
 
-	MerkleTreeBuilder merkleTree(check_merkle ? message_size : 1);
+	if (on_progress)
+		on_progress(*block, sizeof(bitcoin_msg_header), 80);
 
-	std::vector<IndexVector> txn_data(message_size);
-	std::vector<IndexPtr> txn_ptrs;
-	txn_ptrs.reserve(message_size);
-	for (uint32_t i = 0; i < message_size; i++) {
-		uint16_t index;
-		if (read_all((char*)&index, 2) != 2)
-			return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read tx index", std::shared_ptr<std::vector<unsigned char> >(NULL));
-		index = ntohs(index);
-		wire_bytes += 2;
+	BlockArena::Scope arena;
+	MerkleTreeBuilder merkleTree(check_merkle ? message_size : 1, &arena);
 
-		txn_data[i].index = index;
+	// If the caller wants the block already parsed, every tx has to be checked to parse, as they
+	// would have been by parse_block()
+	if (parsed) {
+		parsed->txn.clear();
+		parsed->txn.reserve(message_size);
+		parsed->txids.clear();
+	}
 
-		if (index == 0xffff) {
-			union intbyte {
-				uint32_t i;
-				char c[4];
-			} tx_size {0};
+	// Txn are written straight into block as they arrive (or are pulled from recv_tx_cache, which
+	// has to happen in wire order anyway, as each index is relative to the previous removals).
+	// Txn which came over the wire are hashed a full set of SIMD lanes at a time.
+	const size_t hash_batch = sha256_lanes();
+	ArenaVector<size_t> hash_offsets(&arena);
+	ArenaVector<uint64_t> hash_sizes(&arena);
+	ArenaVector<unsigned char*> hash_results(&arena);
+	ArenaVector<const unsigned char*> hash_inputs(&arena);
+	hash_offsets.reserve(hash_batch); hash_sizes.reserve(hash_batch);
+	hash_results.reserve(hash_batch); hash_inputs.reserve(hash_batch);
+	std::chrono::steady_clock::duration merkle_time(0);
+	const auto hash_pending = [&]() {
+		if (hash_offsets.empty())
+			return;
+		auto start = std::chrono::steady_clock::now();
+		hash_inputs.resize(hash_offsets.size());
+		for (size_t i = 0; i < hash_offsets.size(); i++)
+			hash_inputs[i] = &(*block)[hash_offsets[i]];
+		double_sha256_batch(&hash_inputs[0], &hash_sizes[0], &hash_results[0], hash_inputs.size());
+		hash_offsets.clear(); hash_sizes.clear(); hash_results.clear();
+		merkle_time += std::chrono::steady_clock::now() - start;
+	};
+
+	std::shared_ptr<std::vector<unsigned char> > cached_tx;
+	int64_t last_index = 0;
+	for (uint32_t i = 0; i < message_size; i++) {
+		bool aborted = false, send_inline = false;
+		uint32_t index = 0, tx_size = 0;
+		if (compact) {
+			uint64_t code;
+			if (!read_code(read_all, code, wire_bytes))
+				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read tx index", std::shared_ptr<std::vector<unsigned char> >(NULL));
+			aborted = code == COMPACT_ABORT_CODE;
+			send_inline = code & 1;
+			if (send_inline)
+				tx_size = std::min(code >> 1, uint64_t(1000001));
+			else {
+				int64_t delta = int64_t((code >> 2) ^ -((code >> 1) & 1));
+				last_index += delta;
+				if (last_index < 0 || last_index > 0xffff)
+					return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to find referenced transaction", std::shared_ptr<std::vector<unsigned char> >(NULL));
+				index = last_index;
+			}
+		} else {
+			uint16_t short_index;
+			if (read_all((char*)&short_index, 2) != 2)
+				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read tx index", std::shared_ptr<std::vector<unsigned char> >(NULL));
+			index = ntohs(short_index);
+			wire_bytes += 2;
+
+			aborted = index == ABORT_BLOCK_INDEX;
+			send_inline = index == 0xffff;
+			if (send_inline) {
+				union intbyte {
+					uint32_t i;
+					char c[4];
+				} size_bytes {0};
+
+				if (read_all(size_bytes.c + 1, 3) != 3)
+					return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read tx length", std::shared_ptr<std::vector<unsigned char> >(NULL));
+				tx_size = ntohl(size_bytes.i);
+				wire_bytes += 3;
+			}
+		}
 
-			if (read_all(tx_size.c + 1, 3) != 3)
-				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read tx length", std::shared_ptr<std::vector<unsigned char> >(NULL));
-			tx_size.i = ntohl(tx_size.i);
+		if (aborted) {
+			blocksAlreadySeen.erase(*fullhashptr);
+			return std::make_tuple(wire_bytes, std::shared_ptr<std::vector<unsigned char> >(NULL), BLOCK_ABORTED, fullhashptr);
+		}
 
-			if (tx_size.i > 1000000)
+		size_t txstart = block->size();
+		if (send_inline) {
+			if (tx_size > 1000000)
 				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "got unreasonably large tx", std::shared_ptr<std::vector<unsigned char> >(NULL));
 
-			txn_data[i].data.resize(tx_size.i);
-			if (read_all((char*)&(txn_data[i].data[0]), tx_size.i) != int64_t(tx_size.i))
+			block->resize(txstart + tx_size);
+			if (read_all((char*)&(*block)[txstart], tx_size) != int64_t(tx_size))
 				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to read transaction data", std::shared_ptr<std::vector<unsigned char> >(NULL));
-			wire_bytes += 3 + tx_size.i;
+			wire_bytes += tx_size;
+
+			if (check_merkle) {
+				hash_offsets.push_back(txstart);
+				hash_sizes.push_back(tx_size);
+				hash_results.push_back(merkleTree.getTxHashLoc(i));
+				if (hash_offsets.size() >= hash_batch)
+					hash_pending();
+			}
+		} else {
+			if (!recv_tx_cache.remove(index, cached_tx, merkleTree.getTxHashLoc(check_merkle ? i : 0)))
+				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to find referenced transaction", std::shared_ptr<std::vector<unsigned char> >(NULL));
+			block->insert(block->end(), cached_tx->begin(), cached_tx->end());
+		}
 
-			if (check_merkle)
-				double_sha256(&(txn_data[i].data[0]), merkleTree.getTxHashLoc(i), tx_size.i);
-		} else
-			txn_ptrs.emplace_back(index, i);
+		if (parsed) {
+			if (tx_end(&(*block)[txstart], block->data() + block->size()) != block->data() + block->size())
+				return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "got a transaction which did not parse", std::shared_ptr<std::vector<unsigned char> >(NULL));
+			parsed->txn.emplace_back(txstart, block->size() - txstart);
+		}
+
+		if (on_progress)
+			on_progress(*block, txstart, block->size() - txstart);
 	}
+	hash_pending();
 
-	tweak_sort(txn_ptrs, 0, txn_ptrs.size());
-#ifndef NDEBUG
-	int32_t last = -1;
-#endif
-	for (size_t i = 0; i < txn_ptrs.size(); i++) {
-		const IndexPtr& ptr = txn_ptrs[i];
-		assert(last <= int(ptr.index) && (last = ptr.index) != -1);
+	if (parsed && check_merkle)
+		parsed->txids.assign(merkleTree.getTxHashLoc(0), merkleTree.getTxHashLoc(0) + 32 * message_size);
 
-		if (!recv_tx_cache.remove(ptr.index, txn_data[ptr.pos].data, merkleTree.getTxHashLoc(check_merkle ? ptr.pos : 0)))
-			return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "failed to find referenced transaction", std::shared_ptr<std::vector<unsigned char> >(NULL));
+	if (check_merkle) {
+		auto root_start = std::chrono::steady_clock::now();
+		bool matches = merkleTree.merkleRootMatches(&(*block)[4 + 32 + sizeof(bitcoin_msg_header)]);
+		merkle_decompress_stat.record(merkle_time + (std::chrono::steady_clock::now() - root_start));
+		if (!matches)
+			return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "merkle tree root did not match", std::shared_ptr<std::vector<unsigned char> >(NULL));
 	}
 
-	for (uint32_t i = 0; i < message_size; i++)
-		block->insert(block->end(), txn_data[i].data.begin(), txn_data[i].data.end());
+	return std::make_tuple(wire_bytes, block, (const char*) NULL, fullhashptr);
+}
+
 
-	if (check_merkle && !merkleTree.merkleRootMatches(&(*block)[4 + 32 + sizeof(bitcoin_msg_header)]))
-		return std::make_tuple(0, std::shared_ptr<std::vector<unsigned char> >(NULL), "merkle tree root did not match", std::shared_ptr<std::vector<unsigned char> >(NULL));
 
-	return std::make_tuple(wire_bytes, block, (const char*) NULL, fullhashptr);
+/*****************
+ *** Snapshots ***
+ *****************/
+// A snapshot file is SNAPSHOT_MAGIC, the format version and compressor count (le32s), the payload
+// size (le64) and its double-SHA256, followed by the payload: each compressor's write_snapshot()
+#define SNAPSHOT_MAGIC "RELAYSNP"
+#define SNAPSHOT_FORMAT 1
+#define SNAPSHOT_HEADER_SIZE (8 + 4 + 4 + 8 + 32)
+
+const char* save_snapshot(const char* path, const std::vector<RelayNodeCompressor*>& compressors) {
+	std::vector<unsigned char> data(SNAPSHOT_HEADER_SIZE);
+	for (RelayNodeCompressor* compressor : compressors)
+		compressor->write_snapshot(data);
+
+	uint64_t payload_size = data.size() - SNAPSHOT_HEADER_SIZE;
+	std::vector<unsigned char> header(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC + 8);
+	write_le32(header, SNAPSHOT_FORMAT);
+	write_le32(header, compressors.size());
+	write_le32(header, payload_size);
+	write_le32(header, payload_size >> 32);
+	header.resize(SNAPSHOT_HEADER_SIZE);
+	double_sha256(data.data() + SNAPSHOT_HEADER_SIZE, &header[SNAPSHOT_HEADER_SIZE - 32], payload_size);
+	std::copy(header.begin(), header.end(), data.begin());
+
+	// Written aside and renamed over the old one, so that we never leave a partial snapshot
+	std::string tmp_path = std::string(path) + ".tmp";
+	FILE* f = fopen(tmp_path.c_str(), "wb");
+	if (!f)
+		return "failed to open snapshot file";
+	bool written = fwrite(&data[0], 1, data.size(), f) == data.size() && !fflush(f);
+#ifndef WIN32
+	written = written && !fsync(fileno(f));
+#endif
+	written = !fclose(f) && written;
+	if (!written) {
+		remove(tmp_path.c_str());
+		return "failed to write snapshot file";
+	}
+#ifdef WIN32
+	remove(path);
+#endif
+	if (rename(tmp_path.c_str(), path))
+		return "failed to move snapshot file into place";
+	return NULL;
+}
+
+static const char* load_snapshot_data(const unsigned char* data, size_t size, const std::vector<RelayNodeCompressor*>& compressors) {
+	if (size < SNAPSHOT_HEADER_SIZE || memcmp(data, SNAPSHOT_MAGIC, 8))
+		return "not a snapshot file";
+
+	const unsigned char* it = data + 8;
+	const unsigned char* end = data + size;
+	uint32_t format, count, size_low, size_high;
+	read_le32(it, end, format);
+	read_le32(it, end, count);
+	read_le32(it, end, size_low);
+	read_le32(it, end, size_high);
+	if (format != SNAPSHOT_FORMAT)
+		return "snapshot is of an unknown format";
+	if (count != compressors.size())
+		return "snapshot has a different number of compressors";
+	uint64_t payload_size = (uint64_t(size_high) << 32) | size_low;
+	if (payload_size != size - SNAPSHOT_HEADER_SIZE)
+		return "snapshot is the wrong size";
+
+	unsigned char hash[32];
+	double_sha256(data + SNAPSHOT_HEADER_SIZE, hash, payload_size);
+	if (memcmp(hash, it, 32))
+		return "snapshot checksum mismatch";
+
+	it = data + SNAPSHOT_HEADER_SIZE;
+	const char* first_err = NULL;
+	for (RelayNodeCompressor* compressor : compressors) {
+		const char* err = compressor->read_snapshot(it, end);
+		if (err && !first_err)
+			first_err = err;
+	}
+	return first_err;
+}
+
+const char* load_snapshot(const char* path, const std::vector<RelayNodeCompressor*>& compressors) {
+#ifndef WIN32
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return "failed to open snapshot file";
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < SNAPSHOT_HEADER_SIZE) {
+		close(fd);
+		return "not a snapshot file";
+	}
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return "failed to map snapshot file";
+	const char* err = load_snapshot_data((const unsigned char*)map, st.st_size, compressors);
+	munmap(map, st.st_size);
+	return err;
+#else
+	FILE* f = fopen(path, "rb");
+	if (!f)
+		return "failed to open snapshot file";
+	std::vector<unsigned char> data;
+	size_t count;
+	do {
+		size_t pos = data.size();
+		data.resize(pos + 65536);
+		count = fread(&data[pos], 1, 65536, f);
+		data.resize(pos + count);
+	} while (count > 0);
+	fclose(f);
+	return load_snapshot_data(data.data(), data.size(), compressors);
+#endif
+}
+
+static volatile sig_atomic_t snapshot_exit_signal = 0;
+static void snapshot_on_signal(int sig) {
+	snapshot_exit_signal = sig;
 }
 
+void start_snapshots(const std::vector<RelayNodeCompressor*>& compressors) {
+	const char* path_env = getenv("RELAY_SNAPSHOT_FILE");
+	if (!path_env || !*path_env)
+		return;
+	std::string path(path_env);
+
+	const char* err = load_snapshot(path.c_str(), compressors);
+	if (err)
+		printf("Not restoring from snapshot %s: %s\n", path.c_str(), err);
+	else
+		printf("Restored tx caches from snapshot %s\n", path.c_str());
+
+	signal(SIGINT, snapshot_on_signal);
+	signal(SIGTERM, snapshot_on_signal);
+	std::thread([compressors, path](void) {
+		auto next_save = std::chrono::steady_clock::now() + std::chrono::seconds(SNAPSHOT_INTERVAL_SECS);
+		while (true) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			int sig = snapshot_exit_signal;
+			if (!sig && std::chrono::steady_clock::now() < next_save)
+				continue;
+
+			const char* err = save_snapshot(path.c_str(), compressors);
+			if (err)
+				printf("Failed to save snapshot %s: %s\n", path.c_str(), err);
+			if (sig) {
+				printf("Exiting on signal %d\n", sig);
+				fflush(stdout);
+				_exit(0);
+			}
+			next_save = std::chrono::steady_clock::now() + std::chrono::seconds(SNAPSHOT_INTERVAL_SECS);
+		}
+	}).detach();
+}
@@ -5,10 +5,13 @@
 #include <tuple>
 #include <thread>
 #include <mutex>
+#include <functional>
 
 #include "mruset.h"
 #include "flaggedarrayset.h"
 #include "utils.h"
+#include "arena.h"
+#include "fibermutex.h"
 
 #ifdef WIN32
 	#include <winsock.h>
@@ -19,35 +22,92 @@
 #define RELAY_DECLARE_CLASS_VARS \
 private: \
 	const uint32_t VERSION_TYPE, BLOCK_TYPE, TRANSACTION_TYPE, END_BLOCK_TYPE, MAX_VERSION_TYPE, \
-					OOB_TRANSACTION_TYPE, SPONSOR_TYPE, PING_TYPE, PONG_TYPE;
+					OOB_TRANSACTION_TYPE, SPONSOR_TYPE, PING_TYPE, PONG_TYPE, RESYNC_TYPE;
 
 #define RELAY_DECLARE_CONSTRUCTOR_EXTENDS \
 	VERSION_TYPE(htonl(0)), BLOCK_TYPE(htonl(1)), TRANSACTION_TYPE(htonl(2)), END_BLOCK_TYPE(htonl(3)), \
-	MAX_VERSION_TYPE(htonl(4)), OOB_TRANSACTION_TYPE(htonl(5)), SPONSOR_TYPE(htonl(6)), PING_TYPE(htonl(7)), PONG_TYPE(htonl(8))
+	MAX_VERSION_TYPE(htonl(4)), OOB_TRANSACTION_TYPE(htonl(5)), SPONSOR_TYPE(htonl(6)), PING_TYPE(htonl(7)), PONG_TYPE(htonl(8)), \
+	RESYNC_TYPE(htonl(9))
+
+// Computes a merkle root from txids, checking for the duplicated-tx malleability (CVE-2012-2459)
+class MerkleTreeBuilder {
+private:
+	ArenaVector<unsigned char> hashlist;
+public:
+	// Each row is hashed in place, packed at the start of hashlist, so there is room for one extra
+	// hash after the txids to duplicate the last one into. hashlist comes from arena, if one is given.
+	MerkleTreeBuilder(uint32_t tx_count, BlockArena::Scope* arena=NULL) : hashlist((tx_count + 1) * 32, 0, ArenaAllocator<unsigned char>(arena)) {}
+	MerkleTreeBuilder(const std::vector<unsigned char>& txids, BlockArena::Scope* arena=NULL) : hashlist(ArenaAllocator<unsigned char>(arena)) {
+		hashlist.reserve(txids.size() + 32);
+		hashlist.assign(txids.begin(), txids.end());
+		hashlist.resize(txids.size() + 32);
+	}
+	inline unsigned char* getTxHashLoc(uint32_t tx) { return &hashlist[tx * 32]; }
+	bool merkleRootMatches(const unsigned char* match) {
+		uint32_t txcount = hashlist.size() / 32 - 1;
+		for (uint32_t rowSize = txcount; rowSize > 1; rowSize = (rowSize + 1) / 2) {
+			if (!memcmp(&hashlist[32 * (rowSize - 2)], &hashlist[32 * (rowSize - 1)], 32))
+				return false;
+
+			if (rowSize & 1)
+				memcpy(&hashlist[32 * rowSize], &hashlist[32 * (rowSize - 1)], 32);
+			double_sha256_64byte_batch(&hashlist[0], &hashlist[0], (rowSize + 1) / 2);
+		}
+		return !memcmp(match, &hashlist[0], 32);
+	}
+};
+
+// A block's tx boundaries (and txids, if they were needed to check the merkle root), parsed once so
+// that it can be compressed for any number of protocol versions/peers without re-parsing
+struct ParsedBlock {
+	std::vector<std::pair<uint32_t, uint32_t> > txn; // Offset in the block and length of each tx
+	std::vector<unsigned char> txids; // 32 bytes per tx, empty if the merkle root wasn't checked
+};
+const char* parse_block(const std::vector<unsigned char>& hash, const std::vector<unsigned char>& block, bool check_merkle, ParsedBlock& parsed);
+
+// Returns the end of the tx which starts at it, or NULL if it runs past end
+const unsigned char* tx_end(const unsigned char* it, const unsigned char* end);
+
+// Sent in place of a tx index by cut-through senders when the block they were forwarding turned out
+// to be invalid, ending the BLOCK message early. decompress_relay_block then fails with BLOCK_ABORTED.
+#define ABORT_BLOCK_INDEX 0xfffe
+extern const char* const BLOCK_ABORTED;
+
+// Called by decompress_relay_block with the block so far, first for the 80-byte header (once the
+// tx count follows it), then for each tx as it is added
+typedef std::function<void (const std::vector<unsigned char>& block, size_t start, size_t len)> BlockProgressCallback;
 
 class RelayNodeCompressor {
 	RELAY_DECLARE_CLASS_VARS
 
 private:
 	bool useOldFlags;
+	bool compact; // Blocks are sent in the COMPACT_VERSION_STRING encoding, see encode_tx()
 	FlaggedArraySet send_tx_cache, recv_tx_cache;
-	mruset<std::vector<unsigned char> > blocksAlreadySeen;
-	std::mutex mutex;
+	concurrentmruset blocksAlreadySeen;
+	// Held for every call which isn't documented as not needing it (as blocks can take a few ms to
+	// compress, queries which are done often are answered without it)
+	FiberMutex mutex;
+	// Counts the txn and blocks we've given out to be sent with send_tx_cache, so that a peer which
+	// is sent our cache knows which of them it already reflects (see for_each_sent_tx())
+	uint64_t sent_position;
 
 public:
-	RelayNodeCompressor(bool useOldFlagsIn)
-		: RELAY_DECLARE_CONSTRUCTOR_EXTENDS, useOldFlags(useOldFlagsIn),
-		  send_tx_cache(useOldFlagsIn ? OLD_MAX_TXN_IN_FAS : 65000, useOldFlagsIn ? uint32_t(-1) : MAX_FAS_TOTAL_SIZE),
+	RelayNodeCompressor(bool useOldFlagsIn, bool compactIn=false)
+		: RELAY_DECLARE_CONSTRUCTOR_EXTENDS, useOldFlags(useOldFlagsIn), compact(compactIn),
+		  send_tx_cache(useOldFlagsIn ? OLD_MAX_TXN_IN_FAS : 65000, useOldFlagsIn ? uint32_t(-1) : MAX_FAS_TOTAL_SIZE, true),
 		  recv_tx_cache(useOldFlagsIn ? OLD_MAX_TXN_IN_FAS : 65000, useOldFlagsIn ? uint32_t(-1) : MAX_FAS_TOTAL_SIZE),
-		  blocksAlreadySeen(1000000) {}
+		  blocksAlreadySeen(1000000), sent_position(0) {}
 	RelayNodeCompressor& operator=(const RelayNodeCompressor& c) {
 		useOldFlags = c.useOldFlags;
+		compact = c.compact;
 		send_tx_cache = c.send_tx_cache;
 		recv_tx_cache = c.recv_tx_cache;
 		blocksAlreadySeen = c.blocksAlreadySeen;
+		sent_position = c.sent_position;
 		return *this;
 	}
-	void reset();
+	void reset(bool keepRecvCache=false);
 
 	inline std::shared_ptr<std::vector<unsigned char> > tx_to_msg(const std::shared_ptr<std::vector<unsigned char> >& tx, bool send_oob=false, bool include_data=true) const {
 		auto msg = std::make_shared<std::vector<unsigned char> > (sizeof(struct relay_msg_header));
@@ -62,25 +122,87 @@ public:
 			msg->insert(msg->end(), tx->begin(), tx->end());
 		return msg;
 	}
-	std::shared_ptr<std::vector<unsigned char> > get_relay_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx);
+	// seqs are of send_tx_cache (see FlaggedArraySet::last_seq()): a tx's tells peers' outbound
+	// queues where it is in the order the cache was built, and a block's depends_seq is the last one
+	// it refers to (so it can go out ahead of any txn after that, see OUTBOUND_ORDERED). position is
+	// the tx's (or block's) sent_position.
+	std::shared_ptr<std::vector<unsigned char> > get_relay_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx, uint64_t* seq=NULL, uint64_t* position=NULL);
 
 	bool maybe_recv_tx_of_size(uint32_t tx_size, bool debug_print);
 	void recv_tx(std::shared_ptr<std::vector<unsigned char > > tx);
 
-	void for_each_sent_tx(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&)> callback);
-
-	std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> maybe_compress_block(const std::vector<unsigned char>& hash, const std::vector<unsigned char>& block, bool check_merkle);
-	std::tuple<uint32_t, std::shared_ptr<std::vector<unsigned char> >, const char*, std::shared_ptr<std::vector<unsigned char> > > decompress_relay_block(std::function<ssize_t(char*, size_t)>& read_all, uint32_t message_size, bool check_merkle);
+	// Returns the sent_position of the last tx or block which the cache (as passed to callback)
+	// reflects: a peer sent it must skip anything from us with a position no greater than that
+	uint64_t for_each_sent_tx(const std::function<void (const std::shared_ptr<std::vector<unsigned char> >&)> callback);
+
+	// Resync of a peer which kept its recv_tx_cache across a reconnect (see RESYNC_VERSION_SUFFIX):
+	// it sends get_resync_summary() (8 bytes of each txid, in order), we reply with which of those
+	// it should keep (the longest run of our send_tx_cache it already has) and send the rest
+	// (missing) as usual, and it calls apply_resync() with our reply, which checks that the kept
+	// txn are exactly ours. resync_sent_txn() returns a sent_position, as for_each_sent_tx() does.
+	void get_resync_summary(std::vector<unsigned char>& summary);
+	uint64_t resync_sent_txn(const std::vector<unsigned char>& summary, std::vector<unsigned char>& reply, std::vector<std::shared_ptr<std::vector<unsigned char> > >& missing);
+	const char* apply_resync(const std::vector<unsigned char>& reply, size_t summary_count);
+
+	std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> maybe_compress_block(const std::vector<unsigned char>& hash, const std::vector<unsigned char>& block, bool check_merkle, uint64_t* depends_seq=NULL, uint64_t* position=NULL);
+	std::tuple<std::shared_ptr<std::vector<unsigned char> >, const char*> maybe_compress_block(const std::vector<unsigned char>& hash, const std::vector<unsigned char>& block, const ParsedBlock& parsed, uint64_t* depends_seq=NULL, uint64_t* position=NULL);
+	// The block with every tx sent inline, which a peer decodes without touching its tx cache, and so
+	// can be sent to it ahead of whatever is queued for its cache. Doesn't take our mutex.
+	std::shared_ptr<std::vector<unsigned char> > uncached_block_msg(const std::vector<unsigned char>& block, const ParsedBlock& parsed) const;
+	std::tuple<uint32_t, std::shared_ptr<std::vector<unsigned char> >, const char*, std::shared_ptr<std::vector<unsigned char> > > decompress_relay_block(std::function<ssize_t(char*, size_t)>& read_all, uint32_t message_size, bool check_merkle, const BlockProgressCallback& on_progress=BlockProgressCallback(), ParsedBlock* parsed=NULL);
+
+	// Encodes a block for our peers a tx at a time, eg while it is still being received. Holds our
+	// mutex from a successful begin() until abort() or done(), and each call appends what should
+	// be sent to out. As the start is sent before we know which txn it refers to, depends_seq() is
+	// that of every tx sent before begin().
+	class BlockEncoder {
+	private:
+		RelayNodeCompressor& compressor;
+		std::unique_lock<FiberMutex> lock;
+		std::vector<unsigned char> hash;
+		int last_index;
+		uint64_t begin_seq;
+	public:
+		BlockEncoder(RelayNodeCompressor& compressorIn) : compressor(compressorIn), lock(compressorIn.mutex, std::defer_lock), last_index(0), begin_seq(0) {}
+		const char* begin(const std::vector<unsigned char>& hash, const unsigned char* header, uint32_t tx_count, std::vector<unsigned char>& out);
+		void add_tx(const std::vector<unsigned char>& block, size_t start, size_t len, std::vector<unsigned char>& out);
+		void abort(std::vector<unsigned char>& out);
+		void done();
+		bool active() const { return lock.owns_lock(); }
+		uint64_t depends_seq() const { return begin_seq; }
+	};
+
+	// Our tx caches and blocksAlreadySeen, so that a restarted node can pick up where it left off
+	// (see start_snapshots()). read_snapshot() replaces them only if it returns NULL.
+	void write_snapshot(std::vector<unsigned char>& out);
+	const char* read_snapshot(const unsigned char*& it, const unsigned char* end);
 
 	bool block_sent(std::vector<unsigned char>& hash);
+	// These three don't take our mutex, and may give (very rare) false positives
+	bool was_block_seen(const std::vector<unsigned char>& hash);
 	uint32_t blocks_sent();
-
 	bool was_tx_sent(const unsigned char* txhash);
 
 private:
 	bool check_recv_tx(uint32_t tx_size);
 
+	uint32_t tx_flag(size_t tx_size) const { return useOldFlags ? tx_size > OLD_MAX_RELAY_TRANSACTION_BYTES : tx_size; }
+	// Appends a block's tx to out, as its index in send_tx_cache (or -1 if it has to be sent
+	// inline). last_index is the previous tx's index, starting at 0 for each block.
+	template<typename Vector> void encode_tx(Vector& out, int index, const unsigned char* tx, uint32_t len, int& last_index) const;
+
 	friend void test_compress_block(std::vector<unsigned char>&, std::vector<std::shared_ptr<std::vector<unsigned char> > >);
 };
 
+// Snapshots of several compressors to one file, written atomically (via path.tmp) and checksummed.
+// load_snapshot() leaves any compressor it can't restore as it was, and returns the first error.
+const char* save_snapshot(const char* path, const std::vector<RelayNodeCompressor*>& compressors);
+const char* load_snapshot(const char* path, const std::vector<RelayNodeCompressor*>& compressors);
+
+// If RELAY_SNAPSHOT_FILE is set, loads compressors from it (if it exists), and saves them to it every
+// SNAPSHOT_INTERVAL_SECS and on SIGINT/SIGTERM (after which we exit). Reconnecting peers then resync
+// (see RESYNC_VERSION_SUFFIX) against the loaded caches instead of starting over.
+#define SNAPSHOT_INTERVAL_SECS 60
+void start_snapshots(const std::vector<RelayNodeCompressor*>& compressors);
+
 #endif
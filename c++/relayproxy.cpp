@@ -95,8 +95,8 @@ private:
 		if (message_size > 1000000)
 			return reconnect("got message too large");
 
-		char msg[message_size];
-		if (read_all(sock, (char*)msg, message_size) < (int64_t)(message_size))
+		std::vector<char> msg(message_size);
+		if (read_all(sock, msg.data(), message_size) < (int64_t)(message_size))
 			return reconnect("failed to read message data");
 
 		struct sockaddr_in6 addr;
@@ -115,11 +115,11 @@ private:
 public:
 	void receive_sock(int recv_sock) {
 		std::lock_guard<std::mutex> lock(send_mutex);
-		char buff[0xffff];
+		std::vector<char> buff(0xffff);
 		while (true) {
-			ssize_t res = recv(recv_sock, buff, sizeof(buff), 0);
+			ssize_t res = recv(recv_sock, &buff[0], buff.size(), 0);
 			if (res <= 0) { printf("Error reading from recv_sock %d: %ld (%s)\n", recv_sock, res, strerror(errno)); return; }
-			res = send_all(sock, buff, res);
+			res = send_all(sock, &buff[0], res);
 			if (res <= 0) { printf("Error sending to sock %d: %ld (%s)\n", sock, res, strerror(errno)); return; }
 		}
 	}
@@ -2,9 +2,12 @@
 
 #include <sstream>
 #include <string.h>
+#include <stdlib.h>
 #include <unordered_map>
 #include <unordered_set>
 #include <algorithm>
+#include <array>
+#include <set>
 
 #include "utils.h"
 
@@ -13,18 +16,446 @@ void RPCClient::on_disconnect() {
 	awaiting_response = false;
 }
 
-struct CTxMemPoolEntry {
-	uint64_t feePerKb;
-	uint32_t size;
-	double prio;
-	uint32_t reqCount;
-	std::vector<unsigned char> hash;
-	std::unordered_set<CTxMemPoolEntry*> setDeps;
-	CTxMemPoolEntry(uint64_t feeIn, uint32_t sizeIn, double prioIn, std::vector<unsigned char> hashIn, uint32_t reqCountIn) : feePerKb(feeIn * 1000 / sizeIn), size(sizeIn), prio(prioIn), reqCount(reqCountIn), hash(hashIn) {
-		//TODO: Parse hash?
+static bool entry_better(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) {
+	if (a->feePerKb != b->feePerKb)
+		return a->feePerKb > b->feePerKb;
+	if (a->prio != b->prio)
+		return a->prio > b->prio;
+	return a < b;
+}
+bool EntryBetter::operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const { return entry_better(a, b); }
+
+void RPCMempool::link(CTxMemPoolEntry* parent, CTxMemPoolEntry* child) {
+	if (!parent->setDeps.insert(child).second)
+		return;
+	if (child->parents.empty())
+		ready.erase(child);
+	child->parents.push_back(parent);
+}
+
+void RPCMempool::remove(std::unordered_map<TxHash, CTxMemPoolEntry, TxHashHasher>::iterator it) {
+	CTxMemPoolEntry* e = &it->second;
+	if (e->parents.empty())
+		ready.erase(e);
+	for (CTxMemPoolEntry* parent : e->parents)
+		parent->setDeps.erase(e);
+	for (CTxMemPoolEntry* child : e->setDeps) {
+		child->parents.erase(std::find(child->parents.begin(), child->parents.end(), e));
+		if (child->parents.empty())
+			ready.insert(child);
+	}
+	entries.erase(it);
+}
+
+void RPCMempool::clear() {
+	entries.clear();
+	ready.clear();
+	txnWaitingOnDeps.clear();
+}
+
+void RPCMempool::begin_snapshot() {
+	snapshot++;
+	txnWaitingOnDeps.clear();
+}
+
+const char* RPCMempool::add(const TxHash& hash, long size, uint64_t fee, double prio, const std::vector<TxHash>& deps) {
+	auto res = entries.emplace(std::piecewise_construct, std::forward_as_tuple(hash),
+			std::forward_as_tuple(fee, size, std::vector<unsigned char>(hash.begin(), hash.end())));
+	CTxMemPoolEntry* e = &res.first->second;
+	if (e->snapshot == snapshot)
+		return "Duplicate transaction";
+	e->snapshot = snapshot;
+
+	if (!res.second) {
+		if (e->prio != prio) {
+			bool isReady = e->parents.empty() && ready.erase(e);
+			e->prio = prio;
+			if (isReady)
+				ready.insert(e);
+		}
+	} else {
+		e->prio = prio;
+		ready.insert(e);
+	}
+
+	// Deps of txn we already had are usually linked already (and link() ignores them), but a reorg
+	// can put a parent back into the mempool
+	for (const TxHash& dep : deps) {
+		auto depIt = entries.find(dep);
+		if (depIt == entries.end())
+			txnWaitingOnDeps.insert(std::make_pair(dep, e));
+		else
+			link(&depIt->second, e);
+	}
+
+	auto waitingIts = txnWaitingOnDeps.equal_range(hash);
+	for (auto waitingIt = waitingIts.first; waitingIt != waitingIts.second; waitingIt++)
+		link(e, waitingIt->second);
+	txnWaitingOnDeps.erase(hash);
+	return NULL;
+}
+
+const char* RPCMempool::end_snapshot() {
+	if (!txnWaitingOnDeps.empty())
+		return "Tx depended on another one which did not exist";
+	for (auto it = entries.begin(); it != entries.end();) {
+		if (it->second.snapshot != snapshot)
+			remove(it++);
+		else
+			it++;
+	}
+	return NULL;
+}
+
+void RPCMempool::select(std::vector<std::pair<std::vector<unsigned char>, size_t> >& txn_selected, uint8_t count) {
+	selection++;
+	// Txn whose deps were all selected, merged with ready
+	std::vector<CTxMemPoolEntry*> heap;
+	auto comp = [](const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) { return entry_better(b, a); };
+	auto readyIt = ready.begin();
+	auto next = [&]() -> CTxMemPoolEntry* {
+		if (!heap.empty() && (readyIt == ready.end() || entry_better(heap.front(), *readyIt))) {
+			std::pop_heap(heap.begin(), heap.end(), comp);
+			CTxMemPoolEntry* e = heap.back();
+			heap.pop_back();
+			return e;
+		}
+		return readyIt == ready.end() ? NULL : *(readyIt++);
+	};
+
+	uint64_t minFeePerKbSelected = 4000000000;
+	unsigned minFeePerKbTxnCount = 0;
+	uint64_t totalSizeSelected = 0;
+	CTxMemPoolEntry* e;
+	while (totalSizeSelected < 9*MAX_FAS_TOTAL_SIZE/10 && (e = next())) {
+		if (e->size <= MAX_RELAY_TRANSACTION_BYTES) {
+			for (CTxMemPoolEntry* dep : e->setDeps) {
+				if (dep->selection != selection) {
+					dep->selection = selection;
+					dep->reqCount = dep->parents.size();
+				}
+				if ((--dep->reqCount) == 0) {
+					heap.push_back(dep);
+					std::push_heap(heap.begin(), heap.end(), comp);
+				}
+			}
+			txn_selected.push_back(std::make_pair(e->hash, e->size));
+			totalSizeSelected += e->size;
+			if (e->feePerKb == minFeePerKbSelected)
+				minFeePerKbTxnCount++;
+			else if (e->feePerKb < minFeePerKbSelected) {
+				minFeePerKbSelected = e->feePerKb;
+				minFeePerKbTxnCount = 1;
+			}
+		}
+	}
+
+	unsigned minFeePerKbTxnSkipped = 0;
+	while ((e = next()) && e->feePerKb == minFeePerKbSelected)
+		minFeePerKbTxnSkipped++;
+
+	if (count == 0 && minFeePerKbTxnSkipped > 1 && minFeePerKbTxnCount > 1)
+		printf("WARNING: Skipped %u txn while accepting %u identical-fee txn\n", minFeePerKbTxnSkipped, minFeePerKbTxnCount);
+}
+
+static inline int hex_value(int c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+// Parses a JSON body of known length straight out of a fixed buffer as it is read, so nothing (other
+// than our results and the buffer, which is on the heap as we run on a fiber's stack) is allocated
+// and memory use doesn't depend on the size of the response.
+// Just enough JSON for bitcoind's responses: strings we care about must be hex and unescaped.
+class JSONStream {
+private:
+	const std::function<ssize_t(char*, size_t)>& read;
+	size_t remaining; // Bytes of the body which have not been read into buf
+	std::vector<char> buf;
+	size_t pos, len;
+	bool failed;
+
+	bool fill() {
+		if (!remaining || failed)
+			return false;
+		ssize_t res = read(&buf[0], std::min(remaining, buf.size()));
+		if (res <= 0) {
+			failed = true;
+			return false;
+		}
+		pos = 0;
+		len = res;
+		remaining -= res;
+		return true;
+	}
+
+	int peek() {
+		if (pos == len && !fill())
+			return -1;
+		return (unsigned char)buf[pos];
+	}
+	int get() {
+		int c = peek();
+		if (c >= 0)
+			pos++;
+		return c;
+	}
+
+	void skip_ws() {
+		int c;
+		while ((c = peek()) == ' ' || c == '\n' || c == '\r' || c == '\t')
+			pos++;
+	}
+
+	// Reads a number (or literal) into tok, which is nul-terminated
+	bool read_token(char* tok, size_t max) {
+		skip_ws();
+		size_t i = 0;
+		int c;
+		while ((c = peek()) >= 0 && ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '.' || c == '-' || c == '+' || c == 'E')) {
+			if (i == max - 1)
+				return false;
+			tok[i++] = c;
+			pos++;
+		}
+		tok[i] = 0;
+		return i != 0;
+	}
+
+	static bool read_double_token(const char* tok, double& res) {
+		char* end;
+		res = strtod(tok, &end);
+		return *end == 0;
+	}
+
+	bool skip_string() {
+		int c;
+		while ((c = get()) != '"') {
+			if (c < 0 || (c == '\\' && get() < 0))
+				return false;
+		}
+		return true;
+	}
+
+public:
+	JSONStream(const std::function<ssize_t(char*, size_t)>& readIn, size_t length) : read(readIn), remaining(length), buf(65536), pos(0), len(0), failed(false) {}
+
+	bool read_failed() const { return failed; }
+	bool at_end() { skip_ws(); return peek() < 0 && !failed; }
+
+	bool next_is(char c) {
+		skip_ws();
+		if (peek() != (unsigned char)c)
+			return false;
+		pos++;
+		return true;
+	}
+
+	// Exact match (after any whitespace)
+	bool expect(const char* str) {
+		skip_ws();
+		for (; *str; str++)
+			if (get() != (unsigned char)*str)
+				return false;
+		return true;
+	}
+
+	// A string of 64 hex chars, as a hash in internal (reversed) byte order
+	bool read_hash(std::array<unsigned char, 32>& hash) {
+		if (!next_is('"'))
+			return false;
+		for (int i = 31; i >= 0; i--) {
+			int hi = hex_value(get()), lo = hex_value(get());
+			if (hi < 0 || lo < 0)
+				return false;
+			hash[i] = (hi << 4) | lo;
+		}
+		return get() == '"';
+	}
+
+	// Keys which don't fit in max are read as "", ie ignored
+	bool read_key(char* key, size_t max) {
+		if (!next_is('"'))
+			return false;
+		size_t i = 0;
+		int c;
+		while ((c = get()) != '"') {
+			if (c < 0 || c == '\\')
+				return false;
+			if (i < max)
+				key[i++] = c;
+		}
+		if (i == max)
+			i = 0;
+		key[i] = 0;
+		return true;
+	}
+
+	bool read_size(long& res) {
+		char tok[32];
+		if (!read_token(tok, sizeof(tok)))
+			return false;
+		res = 0;
+		for (char* c = tok; *c; c++) {
+			if (*c < '0' || *c > '9' || res > 100000000)
+				return false;
+			res = res * 10 + (*c - '0');
+		}
+		return true;
+	}
+
+	// A BTC value, in satoshis
+	bool read_amount(uint64_t& res) {
+		char tok[64];
+		if (!read_token(tok, sizeof(tok)))
+			return false;
+		// Exact for the usual fixed-point form, anything else goes through strtod as before
+		uint64_t whole = 0, frac = 0;
+		int frac_digits = -1;
+		char* c = tok;
+		for (; *c; c++) {
+			if (*c == '.' && frac_digits < 0)
+				frac_digits = 0;
+			else if (*c < '0' || *c > '9' || frac_digits == 8 || whole > 21000000)
+				break;
+			else if (frac_digits < 0)
+				whole = whole * 10 + (*c - '0');
+			else {
+				frac = frac * 10 + (*c - '0');
+				frac_digits++;
+			}
+		}
+		if (!*c && c != tok && frac_digits != 0) {
+			for (frac_digits = std::max(frac_digits, 0); frac_digits < 8; frac_digits++)
+				frac *= 10;
+			res = whole * 100000000 + frac;
+			return true;
+		}
+		double d;
+		if (!read_double_token(tok, d) || d < 0)
+			return false;
+		res = uint64_t(d * 100000000);
+		return true;
+	}
+
+	bool read_double(double& res) {
+		char tok[64];
+		return read_token(tok, sizeof(tok)) && read_double_token(tok, res);
+	}
+
+	// Skips any value, eg fields we don't care about
+	bool skip_value() {
+		skip_ws();
+		int c = peek();
+		if (c == '"') {
+			pos++;
+			return skip_string();
+		} else if (c == '[' || c == '{') {
+			size_t depth = 0;
+			do {
+				c = get();
+				if (c < 0 || (c == '"' && !skip_string()))
+					return false;
+				else if (c == '[' || c == '{')
+					depth++;
+				else if (c == ']' || c == '}')
+					depth--;
+			} while (depth);
+			return true;
+		} else {
+			char tok[64];
+			return read_token(tok, sizeof(tok));
+		}
 	}
 };
 
+const char* RPCMempool::read_response(const std::function<ssize_t(char*, size_t)>& read, size_t length) {
+	JSONStream json(read, length);
+	auto fail = [&](const char* reason) -> const char* { clear(); return json.read_failed() ? "Failed to read response" : reason; };
+
+	if (!json.expect("{\"result\":{"))
+		return fail("Got result which was not an object");
+
+	begin_snapshot();
+	std::vector<TxHash> depHashes;
+	if (!json.next_is('}')) {
+		do {
+			TxHash hash;
+			if (!json.read_hash(hash))
+				return fail("got bad hash");
+			if (!json.next_is(':') || !json.next_is('{'))
+				return fail("Got transaction which was not an object");
+
+			long tx_size = -1; uint64_t tx_fee = -1; double tx_prio = -1;
+			depHashes.clear();
+			do {
+				char field[32];
+				if (!json.read_key(field, sizeof(field)) || !json.next_is(':'))
+					return fail("Got bad field name");
+				if (!strcmp(field, "size")) {
+					if (!json.read_size(tx_size))
+						return fail("transaction size could not be parsed");
+				} else if (!strcmp(field, "fee")) {
+					if (!json.read_amount(tx_fee))
+						return fail("transaction value could not be parsed");
+				} else if (!strcmp(field, "currentpriority")) {
+					if (!json.read_double(tx_prio))
+						return fail("transaction prio could not be parsed");
+				} else if (!strcmp(field, "depends")) {
+					if (!json.next_is('['))
+						return fail("depends was not an array");
+					if (!json.next_is(']')) {
+						do {
+							depHashes.emplace_back();
+							if (!json.read_hash(depHashes.back()))
+								return fail("got bad dependency hash");
+						} while (json.next_is(','));
+						if (!json.next_is(']'))
+							return fail("Missing array end character (])");
+					}
+				} else if (!json.skip_value())
+					return fail("Got bad field value");
+			} while (json.next_is(','));
+			if (!json.next_is('}'))
+				return fail("Got unexpected character in transaction");
+
+			if (tx_size <= 0)
+				return fail("Did not get transaction size");
+			else if (tx_fee == uint64_t(-1))
+				return fail("Did not get transaction fee");
+			else if (tx_prio < 0)
+				return fail("Did not get transaction prio");
+
+			const char* err = add(hash, tx_size, tx_fee, tx_prio, depHashes);
+			if (err)
+				return fail(err);
+		} while (json.next_is(','));
+		if (!json.next_is('}'))
+			return fail("Got unexpected character between transactions");
+	}
+
+	if (!json.expect(",\"error\":null,\"id\":1}") || !json.at_end())
+		return fail("JSON object was not closed at the end");
+
+	const char* err = end_snapshot();
+	if (err)
+		return fail(err);
+	return NULL;
+}
+
+RPCClient::RPCClient(std::string hostIn, int16_t portIn, const std::function<void (std::vector<std::pair<std::vector<unsigned char>, size_t> >& txhashes, size_t total_mempool_size)>& txn_for_block_func_in)
+	: OutboundPersistentConnection(hostIn, portIn), txn_for_block_func(txn_for_block_func_in), mempool(new RPCMempool) {
+	on_disconnect();
+	construction_done();
+}
+
+RPCClient::~RPCClient() {}
+
 void RPCClient::net_process(const std::function<void(std::string)>& disconnect) {
 	connected = true;
 
@@ -84,237 +515,22 @@ void RPCClient::net_process(const std::function<void(std::string)>& disconnect)
 				break;
 		}
 
-		if (content_length < 0 || content_length > 1024*1024*100)
+		if (content_length < 0 || content_length > 1024*1024*1024)
 			return disconnect("Got unreasonably large response size");
 
-		//Dumb JSON parser that mostly assumes valid (minimal-size) JSON...
-		static const std::string expected_start("{\"result\":{");
-		{
-			char resp[expected_start.length()];
-			if (read_all(resp, expected_start.length()) != (ssize_t)expected_start.length())
-				return disconnect("Failed to read response");
-			if (memcmp(resp, &expected_start[0], expected_start.length()) != 0)
-				return disconnect("Got result which was not an object");
-		}
-
-		std::vector<unsigned char> resp(content_length - expected_start.length());
-		if (read_all((char*)&resp[0], content_length - expected_start.length()) != content_length - (ssize_t)expected_start.length())
-			return disconnect("Failed to read response");
-		auto it = resp.begin();
-
-		//These do not move
-		std::list<CTxMemPoolEntry> txn;
-		//These index into txn
-		std::vector<CTxMemPoolEntry*> vectorToSort;
-		std::unordered_map<std::string, CTxMemPoolEntry*> hashToEntry;
-		std::unordered_multimap<std::string, CTxMemPoolEntry*> txnWaitingOnDeps;
-
-		// These are values/flags about the current status of the parser
-		int32_t stringStart = -1, fieldValueStart = -1;
-		std::string txHash, fieldString;
-		long tx_size = -1; uint64_t tx_fee = -1; double tx_prio = -1;
-		bool inTx = false, inFieldString = false, inFieldValue = false;
-		std::unordered_set<std::string> txDeps;
-
-		static const std::string expected_end("},\"error\":null,\"id\":1}\n");
-		while (it < resp.end() - expected_end.length()) {
-			while ((*it == ' ') && it < resp.end() - 1) it++;
-			switch(*it) {
-			case '"':
-				if (stringStart != -1) {
-					if (!inTx)
-						txHash = std::string(resp.begin() + stringStart, it);
-					else if (inFieldString)
-						fieldString = std::string(resp.begin() + stringStart, it);
-					else if (inFieldValue)
-						return disconnect("got string as a field value");
-					stringStart = -1;
-				} else
-					stringStart = it - resp.begin() + 1;
-				break;
-			case ':':
-				if (stringStart != -1)
-					return disconnect("Got : in a string (all strings should have been hex");
-				if (inFieldString) {
-					inFieldValue = true;
-					inFieldString = false;
-					fieldValueStart = it - resp.begin() + 1;
-				} else if (inFieldValue)
-					return disconnect("Got : in an unexpected place");
-				break;
-			case ',':
-				if (stringStart != -1)
-					return disconnect("Got , in a string (all strings should have been hex");
-				if (inFieldValue) {
-					inFieldValue = false;
-					inFieldString = true;
-					if (fieldString == "size") {
-						try {
-							tx_size = std::stol(std::string(resp.begin() + fieldValueStart, it));
-						} catch (std::exception& e) {
-							return disconnect("transaction size could not be parsed");
-						}
-					} else if (fieldString == "fee") {
-						try {
-							tx_fee = uint64_t(std::stod(std::string(resp.begin() + fieldValueStart, it)) * 100000000);
-						} catch (std::exception& e) {
-							return disconnect("transaction value could not be parsed");
-						}
-					} else if (fieldString == "currentpriority") {
-						try {
-							tx_prio = std::stod(std::string(resp.begin() + fieldValueStart, it));
-						} catch (std::exception& e) {
-							return disconnect("transaction prio could not be parsed");
-						}
-					}
-				} else if (inTx)
-					return disconnect("Got unexpected ,");
-				break;
-			case '[':
-			{
-				it++;
-				int32_t depStringStart = -1;
-				while (*it != ']' && it < resp.end() - 1) {
-					if (*it == '"') {
-						if (depStringStart != -1) {
-							txDeps.insert(std::string(resp.begin() + depStringStart, it));
-							depStringStart = -1;
-						} else
-							depStringStart = it - resp.begin() + 1;
-					}
-					it++;
-				}
-				if (*it != ']' || depStringStart != -1)
-					return disconnect("Missing array end character (])");
-				break;
-			}
-			case '{':
-				if (stringStart != -1)
-					return disconnect("Got { in a string (all strings should have been hex");
-				else if (!inTx) {
-					inTx = true;
-					inFieldString = true;
-				} else
-					return disconnect("Got JSON object start when we weren't expecting one");
-				break;
-			case '}':
-				if (inTx) {
-					if (inFieldValue) {
-						inFieldValue = false;
-						if (fieldString == "size") {
-							try {
-								tx_size = std::stol(std::string(resp.begin() + fieldValueStart, it));
-							} catch (std::exception& e) {
-								return disconnect("transaction size could not be parsed");
-							}
-						} else if (fieldString == "fee") {
-							try {
-								tx_fee = uint64_t(std::stod(std::string(resp.begin() + fieldValueStart, it)) * 100000000);
-							} catch (std::exception& e) {
-								return disconnect("transaction value could not be parsed");
-							}
-						} else if (fieldString == "currentpriority") {
-							try {
-								tx_prio = std::stod(std::string(resp.begin() + fieldValueStart, it));
-							} catch (std::exception& e) {
-								return disconnect("transaction prio could not be parsed");
-							}
-						}
-					} else
-						return disconnect("Got unepxecpted }");
-
-					if (tx_size < 0)
-						return disconnect("Did not get transaction size");
-					else if (tx_fee < 0)
-						return disconnect("Did not get transaction fee");
-					else if (tx_prio < 0)
-						return disconnect("Did not get transaction prio");
-
-					std::vector<unsigned char> hash;
-					if (!hex_str_to_reverse_vector(txHash, hash) || hash.size() != 32)
-						return disconnect("got bad hash");
-
-					txn.emplace_back(tx_fee, tx_size, tx_prio, hash, txDeps.size());
-					if (!hashToEntry.insert(std::make_pair(txHash, &txn.back())).second)
-						return disconnect("Duplicate transaction");
-
-					if (txDeps.empty())
-						vectorToSort.push_back(&txn.back());
-					else {
-						for (const std::string& dep : txDeps) {
-							auto depIt = hashToEntry.find(dep);
-							if (depIt == hashToEntry.end())
-								txnWaitingOnDeps.insert(std::make_pair(dep, &txn.back()));
-							else
-								depIt->second->setDeps.insert(&txn.back());
-						}
-					}
-
-					auto waitingIts = txnWaitingOnDeps.equal_range(txHash);
-					for (auto waitingIt = waitingIts.first; waitingIt != waitingIts.second; waitingIt++)
-						txn.back().setDeps.insert(waitingIt->second);
-					txnWaitingOnDeps.erase(txHash);
-
-					inTx = false;
-					tx_size = -1;
-					tx_fee = -1;
-					txDeps.clear();
-				} else
-					return disconnect("Global JSON object closed before the end");
-				break;
-			}
-			it++;
-		}
-		if (it != resp.end() - expected_end.length() || memcmp(&(*it), &expected_end[0], expected_end.length()) != 0)
-			return disconnect("JSON object was not closed at the end");
-
-		if (!txnWaitingOnDeps.empty())
-			return disconnect("Tx depended on another one which did not exist");
-
-		std::vector<std::pair<std::vector<unsigned char>, size_t> > txn_selected;
-		std::function<bool (const CTxMemPoolEntry* a, const CTxMemPoolEntry* b)> comp = [](const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) {
-			return a->feePerKb < b->feePerKb || (a->feePerKb == b->feePerKb && a->prio < b->prio);
+		std::function<ssize_t(char*, size_t)> read_body = [&](char* buf, size_t max) -> ssize_t {
+			// Parse whatever has arrived, waiting for at least a byte
+			size_t len = std::min(max, std::max(read_available(), size_t(1)));
+			return read_all(buf, len) == (ssize_t)len ? len : -1;
 		};
-		std::make_heap(vectorToSort.begin(), vectorToSort.end(), comp);
-
-		uint64_t minFeePerKbSelected = 4000000000;
-		unsigned minFeePerKbTxnCount = 0;
-		uint64_t totalSizeSelected = 0;
-		while (totalSizeSelected < 9*MAX_FAS_TOTAL_SIZE/10 && vectorToSort.size()) {
-			std::pop_heap(vectorToSort.begin(), vectorToSort.end(), comp);
-			CTxMemPoolEntry* e = vectorToSort.back();
-			vectorToSort.pop_back();
-			if (e->size <= MAX_RELAY_TRANSACTION_BYTES) {
-				for (CTxMemPoolEntry* dep : e->setDeps)
-					if ((--dep->reqCount) == 0) {
-						vectorToSort.push_back(dep);
-						std::push_heap(vectorToSort.begin(), vectorToSort.end(), comp);
-					}
-				txn_selected.push_back(std::make_pair(e->hash, e->size));
-				totalSizeSelected += e->size;
-				if (e->feePerKb == minFeePerKbSelected)
-					minFeePerKbTxnCount++;
-				else if (e->feePerKb < minFeePerKbSelected) {
-					minFeePerKbSelected = e->feePerKb;
-					minFeePerKbTxnCount = 1;
-				}
-			}
-		}
+		const char* err = mempool->read_response(read_body, content_length);
+		if (err)
+			return disconnect(err);
 
-		unsigned minFeePerKbTxnSkipped = 0;
-		while (vectorToSort.size()) {
-			std::pop_heap(vectorToSort.begin(), vectorToSort.end(), comp);
-			CTxMemPoolEntry* e = vectorToSort.back();
-			vectorToSort.pop_back();
-			if (e->feePerKb != minFeePerKbSelected)
-				break;
-			minFeePerKbTxnSkipped++;
-		}
-
-		if (++count == 0 && minFeePerKbTxnSkipped > 1 && minFeePerKbTxnCount > 1)
-			printf("WARNING: Skipped %u txn while accepting %u identical-fee txn\n", minFeePerKbTxnSkipped, minFeePerKbTxnCount);
+		std::vector<std::pair<std::vector<unsigned char>, size_t> > txn_selected;
+		mempool->select(txn_selected, ++count);
 
-		txn_for_block_func(txn_selected, txn.size());
+		txn_for_block_func(txn_selected, mempool->size());
 		awaiting_response = false;
 
 		if (close_after_read)
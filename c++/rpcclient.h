@@ -4,10 +4,76 @@
 #include <vector>
 #include <utility>
 #include <string>
+#include <memory>
+#include <array>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <stdint.h>
+#include <string.h>
 
 #include "connection.h"
 
+typedef std::array<unsigned char, 32> TxHash;
+struct TxHashHasher {
+	size_t operator()(const TxHash& hash) const {
+		size_t res;
+		memcpy(&res, &hash[0], sizeof(res));
+		return res;
+	}
+};
+
+struct CTxMemPoolEntry {
+	uint64_t feePerKb;
+	uint32_t size;
+	double prio;
+	std::vector<unsigned char> hash;
+	std::vector<CTxMemPoolEntry*> parents; // In-mempool txn we depend on
+	std::unordered_set<CTxMemPoolEntry*> setDeps; // In-mempool txn which depend on us
+	uint64_t snapshot; // Last snapshot we were in
+	uint64_t selection; uint32_t reqCount; // reqCount is only valid if selection is the current one
+	CTxMemPoolEntry(uint64_t feeIn, uint32_t sizeIn, std::vector<unsigned char> hashIn) : feePerKb(feeIn * 1000 / sizeIn), size(sizeIn), prio(-1), hash(hashIn), snapshot(0), selection(0), reqCount(0) {}
+};
+
+
+struct EntryBetter {
+	bool operator()(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b) const;
+};
+
+// Our copy of bitcoind's mempool, kept across getrawmempool responses. Each response is applied as a
+// diff (only new txn are allocated and only new deps are linked, only txn which are gone are unlinked)
+// and txn with no in-mempool deps are kept in fee order, so selection only visits what it selects.
+class RPCMempool {
+private:
+	// unordered_map nodes do not move, so we keep pointers to entries
+	std::unordered_map<TxHash, CTxMemPoolEntry, TxHashHasher> entries;
+	std::set<CTxMemPoolEntry*, EntryBetter> ready;
+	std::unordered_multimap<TxHash, CTxMemPoolEntry*, TxHashHasher> txnWaitingOnDeps;
+	uint64_t snapshot, selection;
+
+	void link(CTxMemPoolEntry* parent, CTxMemPoolEntry* child);
+	void remove(std::unordered_map<TxHash, CTxMemPoolEntry, TxHashHasher>::iterator it);
+
+	void begin_snapshot();
+	// Returns an error string on failure, after which the model must be clear()ed
+	const char* add(const TxHash& hash, long size, uint64_t fee, double prio, const std::vector<TxHash>& deps);
+	// Drops everything which was not in the snapshot
+	const char* end_snapshot();
+
+public:
+	RPCMempool() : snapshot(0), selection(0) {}
+
+	size_t size() const { return entries.size(); }
+	void clear();
+
+	// Applies a getrawmempool response body of length bytes, parsed as it is pulled from read, as our
+	// next snapshot. Returns an error, after which we've been clear()ed, or NULL.
+	const char* read_response(const std::function<ssize_t(char*, size_t)>& read, size_t length);
+	// The txn we expect in the next block, best first. count counts selections (wrapping), we only
+	// warn about txn skipped at the fee cutoff when it's 0.
+	void select(std::vector<std::pair<std::vector<unsigned char>, size_t> >& txn_selected, uint8_t count);
+};
+
 class RPCClient : public OutboundPersistentConnection {
 private:
 	const std::function<void (std::vector<std::pair<std::vector<unsigned char>, size_t> >&, size_t)> txn_for_block_func;
@@ -15,9 +81,11 @@ private:
 	std::atomic_bool connected;
 	std::atomic_bool awaiting_response;
 
+	std::unique_ptr<RPCMempool> mempool; // Only touched by net_process
+
 public:
-	RPCClient(std::string hostIn, int16_t portIn, const std::function<void (std::vector<std::pair<std::vector<unsigned char>, size_t> >& txhashes, size_t total_mempool_size)>& txn_for_block_func_in)
-		: OutboundPersistentConnection(hostIn, portIn), txn_for_block_func(txn_for_block_func_in) { on_disconnect(); construction_done(); }
+	RPCClient(std::string hostIn, int16_t portIn, const std::function<void (std::vector<std::pair<std::vector<unsigned char>, size_t> >& txhashes, size_t total_mempool_size)>& txn_for_block_func_in);
+	~RPCClient();
 	void maybe_get_txn_for_block();
 
 private:
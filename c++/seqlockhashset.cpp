@@ -0,0 +1,170 @@
+#include "seqlockhashset.h"
+
+#include <thread>
+#include <string.h>
+#include <assert.h>
+
+static inline uint64_t to_key(const unsigned char* hash) {
+	uint64_t key;
+	memcpy(&key, hash, sizeof(key));
+	return key < 2 ? key + 2 : key;
+}
+
+SeqlockHashSet::Table::Table(size_t size) : mask(size - 1), keys(new std::atomic<uint64_t>[size]) {
+	assert(!(size & (size - 1)));
+	for (size_t i = 0; i < size; i++)
+		keys[i].store(0, std::memory_order_relaxed);
+}
+
+SeqlockHashSet::SeqlockHashSet() : seq(0), table(NULL), count(0), removed(0) {}
+
+SeqlockHashSet& SeqlockHashSet::operator=(const SeqlockHashSet& o) {
+	clear();
+	const Table* t = o.table.load(std::memory_order_relaxed);
+	if (t)
+		for (size_t i = 0; i <= t->mask; i++) {
+			uint64_t key = t->keys[i].load(std::memory_order_relaxed);
+			if (key > 1)
+				add_key(key);
+		}
+	return *this;
+}
+
+void SeqlockHashSet::write_begin() {
+	seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+}
+
+void SeqlockHashSet::write_end() {
+	seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+bool SeqlockHashSet::contains(const unsigned char* hash) const {
+	uint64_t key = to_key(hash);
+	while (true) {
+		uint32_t start = seq.load(std::memory_order_acquire);
+		if (start & 1) {
+			std::this_thread::yield();
+			continue;
+		}
+
+		bool found = false;
+		const Table* t = table.load(std::memory_order_acquire);
+		// Bounded, as a concurrent write may leave us looking at a table with no empty entries
+		if (t)
+			for (size_t pos = key & t->mask, probes = 0; probes <= t->mask; pos = (pos + 1) & t->mask, probes++) {
+				uint64_t k = t->keys[pos].load(std::memory_order_relaxed);
+				if (k == key) {
+					found = true;
+					break;
+				} else if (!k)
+					break;
+			}
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (seq.load(std::memory_order_relaxed) == start)
+			return found;
+	}
+}
+
+// Returns true if key took the place of a removed entry. If t is visible to readers this must be
+// within write_begin()/write_end().
+static bool insert_key(std::atomic<uint64_t>* keys, size_t mask, uint64_t key) {
+	size_t pos = key & mask;
+	while (keys[pos].load(std::memory_order_relaxed) > 1)
+		pos = (pos + 1) & mask;
+	bool was_removed = keys[pos].load(std::memory_order_relaxed) == 1;
+	keys[pos].store(key, std::memory_order_relaxed);
+	return was_removed;
+}
+
+// Keeps the table under 3/4 full (counting removed entries), rehashing it if needed. Tables are
+// only replaced when they need to grow, so old ones take at most as much memory as the current one.
+void SeqlockHashSet::grow() {
+	Table* old = table.load(std::memory_order_relaxed);
+	size_t live = count.load(std::memory_order_relaxed);
+	if (old && (live + removed + 1) * 4 <= (old->mask + 1) * 3)
+		return;
+
+	size_t size = old ? old->mask + 1 : 1024;
+	while ((live + 1) * 2 > size)
+		size *= 2;
+
+	std::vector<uint64_t> keys;
+	keys.reserve(live);
+	if (old)
+		for (size_t i = 0; i <= old->mask; i++) {
+			uint64_t key = old->keys[i].load(std::memory_order_relaxed);
+			if (key > 1)
+				keys.push_back(key);
+		}
+	removed = 0;
+
+	if (old && size == old->mask + 1) {
+		// Just too many removed entries, rebuild in place
+		write_begin();
+		for (size_t i = 0; i <= old->mask; i++)
+			old->keys[i].store(0, std::memory_order_relaxed);
+		for (uint64_t key : keys)
+			insert_key(old->keys.get(), old->mask, key);
+		write_end();
+		return;
+	}
+
+	tables.emplace_back(new Table(size));
+	Table* t = tables.back().get();
+	for (uint64_t key : keys)
+		insert_key(t->keys.get(), t->mask, key);
+
+	// Readers still holding old see it unchanged, later writes only touch t
+	write_begin();
+	table.store(t, std::memory_order_release);
+	write_end();
+}
+
+void SeqlockHashSet::add_key(uint64_t key) {
+	grow();
+	Table* t = table.load(std::memory_order_relaxed);
+	write_begin();
+	if (insert_key(t->keys.get(), t->mask, key))
+		removed--;
+	count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	write_end();
+}
+
+void SeqlockHashSet::insert(const unsigned char* hash) {
+	add_key(to_key(hash));
+}
+
+bool SeqlockHashSet::erase(const unsigned char* hash) {
+	Table* t = table.load(std::memory_order_relaxed);
+	if (!t)
+		return false;
+
+	uint64_t key = to_key(hash);
+	for (size_t pos = key & t->mask; ; pos = (pos + 1) & t->mask) {
+		uint64_t k = t->keys[pos].load(std::memory_order_relaxed);
+		if (!k)
+			return false;
+		if (k == key) {
+			write_begin();
+			t->keys[pos].store(1, std::memory_order_relaxed);
+			count.store(count.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+			removed++;
+			write_end();
+			return true;
+		}
+	}
+}
+
+void SeqlockHashSet::clear() {
+	Table* t = table.load(std::memory_order_relaxed);
+	if (!t)
+		return;
+	write_begin();
+	for (size_t i = 0; i <= t->mask; i++)
+		t->keys[i].store(0, std::memory_order_relaxed);
+	count.store(0, std::memory_order_relaxed);
+	removed = 0;
+	write_end();
+}
@@ -0,0 +1,47 @@
+#ifndef _RELAY_SEQLOCKHASHSET_H
+#define _RELAY_SEQLOCKHASHSET_H
+
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+#include <stdlib.h>
+
+// A (multi)set of 32-byte hashes which any number of threads may query with contains() without
+// taking a lock, while writes (which must be serialized by the caller, eg under the same mutex
+// as whatever it mirrors) are going on. Readers retry if a write happened while they were looking.
+// Only the first 8 bytes of each hash are kept, so contains() may give false positives if two
+// hashes share them (not a concern for txids/block hashes).
+class SeqlockHashSet {
+private:
+	struct Table {
+		size_t mask;
+		std::unique_ptr<std::atomic<uint64_t>[]> keys; // 0 is empty, 1 is a removed entry
+		Table(size_t size);
+	};
+
+	std::atomic<uint32_t> seq; // Odd while a write is in progress
+	std::atomic<Table*> table;
+	// The current table and every one it replaced, as readers may still be looking at old ones
+	std::vector<std::unique_ptr<Table> > tables;
+	std::atomic<size_t> count;
+	size_t removed;
+
+	void write_begin();
+	void write_end();
+	void grow();
+	void add_key(uint64_t key);
+
+public:
+	SeqlockHashSet();
+	SeqlockHashSet& operator=(const SeqlockHashSet& o);
+
+	bool contains(const unsigned char* hash) const;
+	size_t size() const { return count.load(std::memory_order_relaxed); }
+
+	void insert(const unsigned char* hash);
+	bool erase(const unsigned char* hash); // Removes one copy of hash
+	void clear();
+};
+
+#endif
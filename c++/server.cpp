@@ -3,6 +3,9 @@
 #include <thread>
 #include <chrono>
 #include <mutex>
+#include <deque>
+#include <algorithm>
+#include <condition_variable>
 
 #include <assert.h>
 #include <string.h>
@@ -22,14 +25,50 @@
 #include "p2pclient.h"
 #include "connection.h"
 #include "rpcclient.h"
+#include "stats.h"
 
 
 
 
 static const char* HOST_SPONSOR;
 
+// Per-stage block timings, see start_stats_server()
+static StatHistogram header_stat("relay_block_header_seconds", "Time from a relay peer starting a block until we had its header");
+static StatHistogram decompress_stat("relay_block_decompress_seconds", "Time to read and decompress a block from a relay peer");
+static StatHistogram relay_stats[3] = {
+	{"relay_block_relay_seconds", "Time from having a whole block until it was compressed and handed to the fanouts and p2p peers", "source=\"relay\""},
+	{"relay_block_relay_seconds", "Time from having a whole block until it was compressed and handed to the fanouts and p2p peers", "source=\"trustedp2p\""},
+	{"relay_block_relay_seconds", "Time from having a whole block until it was compressed and handed to the fanouts and p2p peers", "source=\"localp2p\""},
+};
+
+
+// CUT_THROUGH_VERSION_STRING peers speak VERSION_STRING, but get blocks from other relay peers
+// forwarded while they are still being received (see CutThroughStream), so get their own compressor
+#define CUT_THROUGH_COMPRESSOR 2
+// COMPACT_VERSION_STRING peers get the same txn as VERSION_STRING ones, but blocks encoded differently
+#define COMPACT_COMPRESSOR 3
+static const std::map<std::string, int16_t> compressor_types = {{std::string("sponsor printer"), 1}, {std::string("spammy memeater"), 0}, {std::string("the blocksize"), 1},
+																{std::string(CUT_THROUGH_VERSION_STRING), CUT_THROUGH_COMPRESSOR}, {std::string(COMPACT_VERSION_STRING), COMPACT_COMPRESSOR}};
 
-static const std::map<std::string, int16_t> compressor_types = {{std::string("sponsor printer"), 1}, {std::string("spammy memeater"), 0}, {std::string("the blocksize"), 1}};
+// Something which wants to see (eg to forward) a block from a relay peer while it is being read
+class BlockStream {
+public:
+	virtual ~BlockStream() {}
+	virtual void on_progress(const std::vector<unsigned char>& block, size_t start, size_t len)=0;
+	virtual void on_read_blocked()=0; // We're about to wait for more of the block
+	// How long we may wait for more of the block before on_read_timeout(), max() for ever. After a
+	// timeout we keep reading the block, but without the stream.
+	virtual millis_lu_type max_read_wait()=0;
+	virtual void on_read_timeout()=0;
+	// err is NULL if the block was fully read and valid, in which case block and parsed are set
+	virtual void on_done(const char* err, const std::shared_ptr<std::vector<unsigned char> >& block, const ParsedBlock* parsed)=0;
+};
+
+// Builds (the first time it's called) the uncached encoding of a block, see RelayNetworkClient::receive_block()
+typedef std::function<std::shared_ptr<std::vector<unsigned char> > (void)> UncachedBlockFn;
+
+// See RelayNetworkClient::wants_uncached_block()
+#define UNCACHED_BLOCK_MAX_REPLAY_MS 100
 
 
 /***********************************************
@@ -38,12 +77,18 @@ static const std::map<std::string, int16_t> compressor_types = {{std::string("sp
 class RelayNetworkClient : public Connection {
 private:
 	std::atomic_int connected;
+	std::atomic_bool replayed; // connected_callback has returned, see CutThroughStream
+	// The compressor's sent_position which our replay reflected, if connected == 2. Both are only
+	// set with our send_mutex held, under which anything from the compressor's fanout is checked
+	// against it, as the fanout may have been handed things before our replay which it reflects.
+	uint64_t replay_position;
 	bool sendSponsor = false;
 	uint8_t tx_sent = 0;
 
-	const std::function<size_t (RelayNetworkClient*, std::shared_ptr<std::vector<unsigned char> >&, const std::vector<unsigned char>&)> provide_block;
+	const std::function<size_t (RelayNetworkClient*, std::shared_ptr<std::vector<unsigned char> >&, const std::vector<unsigned char>&, const ParsedBlock&)> provide_block;
 	const std::function<void (RelayNetworkClient*, std::shared_ptr<std::vector<unsigned char> >&)> provide_transaction;
-	const std::function<void (RelayNetworkClient*, int)> connected_callback;
+	const std::function<uint64_t (RelayNetworkClient*, int, const std::vector<unsigned char>*)> connected_callback;
+	const std::function<std::unique_ptr<BlockStream> (void)> start_block_stream;
 
 	RELAY_DECLARE_CLASS_VARS
 
@@ -53,12 +98,16 @@ public:
 	time_t lastDupConnect = 0;
 	std::atomic<int16_t> compressor_type;
 
+	bool is_replayed() { return replayed; }
+
 	RelayNetworkClient(int sockIn, std::string hostIn,
-						const std::function<size_t (RelayNetworkClient*, std::shared_ptr<std::vector<unsigned char> >&, const std::vector<unsigned char>&)>& provide_block_in,
+						const std::function<size_t (RelayNetworkClient*, std::shared_ptr<std::vector<unsigned char> >&, const std::vector<unsigned char>&, const ParsedBlock&)>& provide_block_in,
 						const std::function<void (RelayNetworkClient*, std::shared_ptr<std::vector<unsigned char> >&)>& provide_transaction_in,
-						const std::function<void (RelayNetworkClient*, int)>& connected_callback_in)
-			: Connection(sockIn, hostIn, NULL), connected(0),
+						const std::function<uint64_t (RelayNetworkClient*, int, const std::vector<unsigned char>*)>& connected_callback_in,
+						const std::function<std::unique_ptr<BlockStream> (void)>& start_block_stream_in)
+			: Connection(sockIn, hostIn, NULL), connected(0), replayed(false), replay_position(0),
 			provide_block(provide_block_in), provide_transaction(provide_transaction_in), connected_callback(connected_callback_in),
+			start_block_stream(start_block_stream_in),
 			RELAY_DECLARE_CONSTRUCTOR_EXTENDS, compressor(false), compressor_type(-1) // compressor is always replaced in VERSION_TYPE recv
 	{ construction_done(); }
 
@@ -88,8 +137,8 @@ private:
 				return disconnect("got message too large");
 
 			if (header.type == VERSION_TYPE) {
-				char data[message_size + 1];
-				if (read_all(data, message_size) < (int64_t)(message_size))
+				std::vector<char> data(message_size + 1);
+				if (read_all(data.data(), message_size) < (int64_t)(message_size))
 					return disconnect("failed to read version message");
 
 				for (uint32_t i = 0; i < message_size; i++)
@@ -97,9 +146,13 @@ private:
 						return disconnect("bogus version string");
 				data[message_size] = 0;
 
-				std::string their_version(data);
+				std::string their_version(data.data());
+				bool resync = their_version.length() > strlen(RESYNC_VERSION_SUFFIX) &&
+						!their_version.compare(their_version.length() - strlen(RESYNC_VERSION_SUFFIX), std::string::npos, RESYNC_VERSION_SUFFIX);
+				if (resync)
+					their_version.resize(their_version.length() - strlen(RESYNC_VERSION_SUFFIX));
 
-				if (their_version != VERSION_STRING) {
+				if (their_version != VERSION_STRING && their_version != CUT_THROUGH_VERSION_STRING && their_version != COMPACT_VERSION_STRING) {
 					relay_msg_header version_header = { RELAY_MAGIC_BYTES, MAX_VERSION_TYPE, htonl(strlen(VERSION_STRING)) };
 					do_send_bytes((char*)&version_header, sizeof(version_header));
 					do_send_bytes(VERSION_STRING, strlen(VERSION_STRING));
@@ -111,7 +164,9 @@ private:
 
 				compressor_type = it->second;
 
-				if (their_version == "spammy memeater")
+				if (their_version == COMPACT_VERSION_STRING)
+					compressor = RelayNodeCompressor(false, true);
+				else if (their_version == "spammy memeater" || their_version == CUT_THROUGH_VERSION_STRING)
 					compressor = RelayNodeCompressor(false);
 				else
 					compressor = RelayNodeCompressor(true);
@@ -121,40 +176,91 @@ private:
 
 				relay_msg_header version_header = { RELAY_MAGIC_BYTES, VERSION_TYPE, htonl(message_size) };
 				do_send_bytes((char*)&version_header, sizeof(version_header));
-				do_send_bytes(data, message_size);
+				do_send_bytes(data.data(), message_size);
+
+				printf("%s Connected to relay node with protocol version %s\n", host.c_str(), data.data());
+				if (resync) {
+					connected = 1; // Their RESYNC follows
+					continue;
+				}
+				int token = get_send_mutex();
+				connected = 2;
+				do_throttle_outbound();
+				replay_position = connected_callback(this, token, NULL); // Called with send_mutex!
+				replayed = true;
+				release_send_mutex(token);
+			} else if (connected == 1 && header.type == RESYNC_TYPE) {
+				if (message_size % 8)
+					return disconnect("got resync summary of bad size");
+				std::vector<unsigned char> summary(message_size);
+				if (message_size && read_all((char*)&summary[0], message_size) < (int64_t)(message_size))
+					return disconnect("failed to read resync summary");
 
-				printf("%s Connected to relay node with protocol version %s\n", host.c_str(), data);
 				int token = get_send_mutex();
 				connected = 2;
 				do_throttle_outbound();
-				connected_callback(this, token); // Called with send_mutex!
+				replay_position = connected_callback(this, token, &summary); // Called with send_mutex!
+				replayed = true;
 				release_send_mutex(token);
 			} else if (connected != 2) {
 				return disconnect("got non-version before version");
 			} else if (header.type == MAX_VERSION_TYPE) {
-				char data[message_size];
-				if (read_all(data, message_size) < (int64_t)(message_size))
+				std::vector<char> data(message_size);
+				if (read_all(data.data(), message_size) < (int64_t)(message_size))
 					return disconnect("failed to read max_version string");
 
-				if (strncmp(VERSION_STRING, data, std::min(sizeof(VERSION_STRING), size_t(message_size))))
+				if (strncmp(VERSION_STRING, data.data(), std::min(sizeof(VERSION_STRING), size_t(message_size))))
 					printf("%s peer sent us a MAX_VERSION message\n", host.c_str());
 				else
 					return disconnect("got MAX_VERSION of same version as us");
 			} else if (header.type == SPONSOR_TYPE) {
-				char data[message_size];
-				if (read_all(data, message_size) < (int64_t)(message_size))
+				std::vector<char> data(message_size);
+				if (read_all(data.data(), message_size) < (int64_t)(message_size))
 					return disconnect("failed to read sponsor string");
 			} else if (header.type == BLOCK_TYPE) {
 				std::chrono::system_clock::time_point read_start(std::chrono::system_clock::now());
-				std::function<ssize_t(char*, size_t)> do_read = [&](char* buf, size_t count) { return read_all(buf, count); };
-				auto res = compressor.decompress_relay_block(do_read, message_size, true);
-				if (std::get<2>(res))
+				std::unique_ptr<BlockStream> stream = start_block_stream();
+				std::function<ssize_t(char*, size_t)> do_read = [&](char* buf, size_t count) {
+					if (!stream)
+						return read_all(buf, count);
+					if (read_would_block(count))
+						stream->on_read_blocked();
+					millis_lu_type max_wait = stream->max_read_wait();
+					if (max_wait == millis_lu_type::max())
+						return read_all(buf, count);
+					ssize_t res = read_all(buf, count, max_wait);
+					if (res < 0 || size_t(res) == count)
+						return res;
+					stream->on_read_timeout();
+					ssize_t rest = read_all(buf + res, count - res);
+					return rest < 0 ? rest : res + rest;
+				};
+				bool got_header = false;
+				BlockProgressCallback on_progress = [&](const std::vector<unsigned char>& block, size_t start, size_t len) {
+					if (!got_header) {
+						header_stat.record(std::chrono::system_clock::now() - read_start);
+						got_header = true;
+					}
+					if (stream)
+						stream->on_progress(block, start, len);
+				};
+
+				ParsedBlock parsed;
+				auto res = compressor.decompress_relay_block(do_read, message_size, true, on_progress, &parsed);
+				if (stream)
+					stream->on_done(std::get<2>(res), std::get<1>(res), &parsed);
+				if (std::get<2>(res) == BLOCK_ABORTED) {
+					printf("%s aborted a block\n", host.c_str());
+					continue;
+				} else if (std::get<2>(res))
 					return disconnect(std::get<2>(res));
 				std::chrono::system_clock::time_point read_finish(std::chrono::system_clock::now());
+				decompress_stat.record(read_finish - read_start);
 
 				const std::vector<unsigned char>& fullhash = *std::get<3>(res).get();
-				size_t bytes_sent = provide_block(this, std::get<1>(res), fullhash);
+				size_t bytes_sent = provide_block(this, std::get<1>(res), fullhash, parsed);
 				std::chrono::system_clock::time_point send_queued(std::chrono::system_clock::now());
+				relay_stats[0].record(send_queued - read_finish);
 
 				if (bytes_sent) {
 					printf(HASH_FORMAT" BLOCK %lu %s UNTRUSTEDRELAY %u / %lu / %u TIMES: %lf %lf\n", HASH_PRINT(&fullhash[0]),
@@ -190,8 +296,8 @@ private:
 				relay_msg_header pong_msg_header = { RELAY_MAGIC_BYTES, PONG_TYPE, htonl(8) };
 
 				int token = get_send_mutex();
-				do_send_bytes((char*)&pong_msg_header, sizeof(pong_msg_header), token);
-				do_send_bytes(data, 8, token);
+				do_send_bytes((char*)&pong_msg_header, sizeof(pong_msg_header), token, OUTBOUND_PING, OUTBOUND_MORE);
+				do_send_bytes(data, 8, token, OUTBOUND_PING);
 				release_send_mutex(token);
 			} else
 				return disconnect("got unknown message type");
@@ -199,24 +305,95 @@ private:
 	}
 
 public:
-	void receive_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx, int token=0) {
+	// Everything which touches the client's tx cache is sent OUTBOUND_ORDERED, with the compressor's
+	// seqs, so a block only waits for the txn it refers to (or, while the client is still being sent
+	// our cache, all of it, at the OUTBOUND_REPLAY rate, unless it's sent uncached, see
+	// wants_uncached_block()) and goes ahead of any others. position is
+	// the compressor's sent_position for the tx/block (see replay_position).
+	void receive_transaction(const std::shared_ptr<std::vector<unsigned char> >& tx, uint64_t seq, uint64_t position) {
 		if (connected != 2)
 			return;
 
-		do_send_bytes(tx, token);
-		tx_sent++;
-		if (!token)
+		int token = get_send_mutex();
+		if (position > replay_position) {
+			do_send_bytes(tx, token, OUTBOUND_TX, OUTBOUND_ORDERED, seq);
+			tx_sent++;
 			send_sponsor(token);
+		}
+		release_send_mutex(token);
+	}
+
+	// A tx from our cache, as part of the replay when the client connects
+	void receive_replay_transaction(const std::shared_ptr<std::vector<unsigned char> >& header, const std::shared_ptr<std::vector<unsigned char> >& tx, int token) {
+		do_send_bytes(header, token, OUTBOUND_REPLAY, OUTBOUND_ORDERED | OUTBOUND_MORE);
+		do_send_bytes(tx, token, OUTBOUND_REPLAY, OUTBOUND_ORDERED);
+		tx_sent++;
+	}
+
+	// The client must get this before any block (even an uncached one, see below) or tx, so it goes
+	// ahead of everything else we queue, in OUTBOUND_BLOCK
+	void send_resync_reply(const std::vector<unsigned char>& reply, int token) {
+		relay_msg_header header = { RELAY_MAGIC_BYTES, RESYNC_TYPE, htonl(reply.size()) };
+		do_send_bytes((char*)&header, sizeof(header), token, OUTBOUND_BLOCK, OUTBOUND_MORE);
+		do_send_bytes((const char*)&reply[0], reply.size(), token, OUTBOUND_BLOCK);
+	}
+
+private:
+	// A block which would be written behind more of our queue than the whole block (or behind more
+	// than UNCACHED_BLOCK_MAX_REPLAY_MS of the rate-limited replay of our cache, which every block
+	// waits for) is first sent uncached, ie with every tx inline in OUTBOUND_UNCACHED_BLOCK, ahead
+	// of all of it. The ordered copy still follows, to take the block's txn out of the client's cache
+	// as they were taken out of ours. block_size is 0 if there's no uncached copy to send.
+	bool wants_uncached_block(uint64_t depends_seq, size_t ordered_size, size_t block_size) {
+		if (!block_size)
+			return false;
+		size_t backlog, replay_backlog;
+		ordered_backlog(depends_seq, backlog, replay_backlog);
+		return backlog + ordered_size > block_size || replay_backlog > UNCACHED_BLOCK_MAX_REPLAY_MS * OUTBOUND_THROTTLE_BYTES_PER_MS;
 	}
 
-	void receive_block(const std::shared_ptr<std::vector<unsigned char> >& block) {
+	void send_uncached_block(const std::shared_ptr<std::vector<unsigned char> >& block, int token) {
+		do_send_bytes(block, token, OUTBOUND_UNCACHED_BLOCK);
+		struct relay_msg_header header = { RELAY_MAGIC_BYTES, END_BLOCK_TYPE, 0 };
+		do_send_bytes((char*)&header, sizeof(header), token, OUTBOUND_UNCACHED_BLOCK, OUTBOUND_TIMED);
+	}
+
+public:
+	void receive_block(const std::shared_ptr<std::vector<unsigned char> >& block, uint64_t depends_seq, uint64_t position, size_t block_size, const UncachedBlockFn& uncached) {
 		if (connected != 2)
 			return;
 
 		int token = get_send_mutex();
-		do_send_bytes(block, token);
+		if (position > replay_position) {
+			bool send_uncached = wants_uncached_block(depends_seq, block->size(), block_size);
+			if (send_uncached)
+				send_uncached_block(uncached(), token);
+			do_send_bytes(block, token, OUTBOUND_BLOCK, OUTBOUND_ORDERED, depends_seq);
+			struct relay_msg_header header = { RELAY_MAGIC_BYTES, END_BLOCK_TYPE, 0 };
+			do_send_bytes((char*)&header, sizeof(header), token, OUTBOUND_BLOCK, send_uncached ? 0 : OUTBOUND_TIMED);
+		}
+		release_send_mutex(token);
+	}
+
+	// A block sent in pieces, holding our send_mutex throughout. Returns 0 if we aren't connected.
+	int begin_block_stream() {
+		if (connected != 2)
+			return 0;
+		return get_send_mutex();
+	}
+
+	// depends_seq is only used for the first piece
+	void send_block_stream(const std::shared_ptr<std::vector<unsigned char> >& bytes, int token, uint64_t depends_seq=0) {
+		do_send_bytes(bytes, token, OUTBOUND_BLOCK, OUTBOUND_ORDERED | OUTBOUND_MORE, depends_seq);
+	}
+
+	// block_size and uncached as for receive_block(), once the whole block has been read
+	void end_block_stream(int token, uint64_t depends_seq, size_t block_size, const UncachedBlockFn& uncached) {
+		bool send_uncached = wants_uncached_block(depends_seq, 0, block_size);
 		struct relay_msg_header header = { RELAY_MAGIC_BYTES, END_BLOCK_TYPE, 0 };
-		do_send_bytes((char*)&header, sizeof(header), token);
+		do_send_bytes((char*)&header, sizeof(header), token, OUTBOUND_BLOCK, send_uncached ? 0 : OUTBOUND_TIMED);
+		if (send_uncached)
+			send_uncached_block(uncached(), token);
 		release_send_mutex(token);
 	}
 };
@@ -244,42 +421,326 @@ private:
 class RelayNetworkCompressor : public RelayNodeCompressor {
 public:
 	RelayNetworkCompressor() : RelayNodeCompressor(false) {}
-	RelayNetworkCompressor(bool useFlagsAndSmallerMax) : RelayNodeCompressor(useFlagsAndSmallerMax) {}
+	RelayNetworkCompressor(bool useFlagsAndSmallerMax, bool compact=false) : RelayNodeCompressor(useFlagsAndSmallerMax, compact) {}
+
+	// summary is the client's resync summary, if it sent one (otherwise it starts empty). Returns
+	// the sent_position the client's cache now reflects.
+	uint64_t relay_node_connected(RelayNetworkClient* client, int token, const std::vector<unsigned char>* summary) {
+		if (!summary) {
+			return for_each_sent_tx([&] (const std::shared_ptr<std::vector<unsigned char> >& tx) {
+				client->receive_replay_transaction(tx_to_msg(tx, false, false), tx, token);
+			});
+		}
 
-	void relay_node_connected(RelayNetworkClient* client, int token) {
-		for_each_sent_tx([&] (const std::shared_ptr<std::vector<unsigned char> >& tx) {
-			client->receive_transaction(tx_to_msg(tx, false, false), token);
-			client->receive_transaction(tx, token);
-		});
+		std::vector<unsigned char> reply;
+		std::vector<std::shared_ptr<std::vector<unsigned char> > > missing;
+		uint64_t position = resync_sent_txn(*summary, reply, missing);
+		client->send_resync_reply(reply, token);
+		for (const auto& tx : missing)
+			client->receive_replay_transaction(tx_to_msg(tx, false, false), tx, token);
+		printf("%s resynced its %lu txn, sending %lu more\n", client->host.c_str(), (unsigned long)(summary->size() / 8), (unsigned long)missing.size());
+		return position;
 	}
 };
 
-#define COMPRESSOR_TYPES 2
+#define COMPRESSOR_TYPES 4
 static RelayNetworkCompressor compressors[COMPRESSOR_TYPES];
 class CompressorInit {
 public:
 	CompressorInit() {
 		compressors[0] = RelayNetworkCompressor(false);
 		compressors[1] = RelayNetworkCompressor(true);
+		compressors[CUT_THROUGH_COMPRESSOR] = RelayNetworkCompressor(false);
+		compressors[COMPACT_COMPRESSOR] = RelayNetworkCompressor(false, true);
 	}
 };
 static CompressorInit init;
 
+static StatHistogram compress_stats[COMPRESSOR_TYPES] = {
+	{"relay_block_compress_seconds", "Time to compress a block for each compressor's peers", "compressor=\"0\""},
+	{"relay_block_compress_seconds", "Time to compress a block for each compressor's peers", "compressor=\"1\""},
+	{"relay_block_compress_seconds", "Time to compress a block for each compressor's peers", "compressor=\"2\""},
+	{"relay_block_compress_seconds", "Time to compress a block for each compressor's peers", "compressor=\"3\""},
+};
+static StatHistogram fanout_stats[COMPRESSOR_TYPES] = {
+	{"relay_block_fanout_seconds", "Time from a compressed block being handed to the fanout until it was queued for every peer", "compressor=\"0\""},
+	{"relay_block_fanout_seconds", "Time from a compressed block being handed to the fanout until it was queued for every peer", "compressor=\"1\""},
+	{"relay_block_fanout_seconds", "Time from a compressed block being handed to the fanout until it was queued for every peer", "compressor=\"2\""},
+	{"relay_block_fanout_seconds", "Time from a compressed block being handed to the fanout until it was queued for every peer", "compressor=\"3\""},
+};
+
+typedef std::vector<std::shared_ptr<RelayNetworkClient> > RelayClientList;
+
+// Hands compressed blocks/txn to every client of one compressor type on its own thread, in the
+// order they were compressed (which the clients' decompressors rely on), so that whoever is
+// compressing (under map_mutex) never has to walk the client list itself. A client may be sent
+// the compressor's cache while something compressed before that is still queued here, so
+// blocks/txn carry their sent_position for the client to skip those its cache already reflects.
+class RelayFanout {
+public:
+	enum ItemType {
+		FANOUT_BLOCK,
+		FANOUT_TRANSACTION,
+		// A block sent in pieces: START (with the first piece) and DATA pieces, then END
+		FANOUT_STREAM_START,
+		FANOUT_STREAM_DATA,
+		FANOUT_STREAM_END,
+	};
+
+private:
+	struct Item {
+		std::shared_ptr<std::vector<unsigned char> > msg;
+		ItemType type;
+		std::shared_ptr<const RelayClientList> clients;
+		std::chrono::steady_clock::time_point pushed;
+		uint64_t seq, position;
+		// The block itself, for FANOUT_BLOCK and FANOUT_STREAM_END, if clients may be sent it uncached
+		std::shared_ptr<const std::vector<unsigned char> > block;
+		std::shared_ptr<const ParsedBlock> parsed;
+	};
+
+	const int16_t compressor_type;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<Item> queue;
+
+	// Clients (and their send_mutex tokens) getting the current stream, only touched in drain()
+	std::vector<std::pair<std::shared_ptr<RelayNetworkClient>, int> > streaming;
+
+	void drain() {
+		while (true) {
+			Item item;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				while (queue.empty())
+					cv.wait(lock);
+				item = std::move(queue.front());
+				queue.pop_front();
+			}
+
+			std::shared_ptr<std::vector<unsigned char> > uncached;
+			const size_t block_size = item.block ? item.block->size() : 0;
+			const UncachedBlockFn get_uncached = [&]() {
+				if (!uncached)
+					uncached = compressors[compressor_type].uncached_block_msg(*item.block, *item.parsed);
+				return uncached;
+			};
+
+			if (item.type == FANOUT_STREAM_DATA || item.type == FANOUT_STREAM_END) {
+				for (const auto& client : streaming) {
+					if (item.type == FANOUT_STREAM_DATA)
+						client.first->send_block_stream(item.msg, client.second);
+					else
+						client.first->end_block_stream(client.second, item.seq, block_size, get_uncached);
+				}
+				if (item.type == FANOUT_STREAM_END)
+					streaming.clear();
+				continue;
+			}
+
+			for (const auto& client : *item.clients) {
+				if (client->getDisconnectFlags() || client->compressor_type != compressor_type)
+					continue;
+				if (item.type == FANOUT_BLOCK)
+					client->receive_block(item.msg, item.seq, item.position, block_size, get_uncached);
+				else if (item.type == FANOUT_TRANSACTION)
+					client->receive_transaction(item.msg, item.seq, item.position);
+				else {
+					int token = client->begin_block_stream();
+					if (token) {
+						client->send_block_stream(item.msg, token, item.seq);
+						streaming.emplace_back(client, token);
+					}
+				}
+			}
+			if (item.type == FANOUT_BLOCK)
+				fanout_stats[compressor_type].record(std::chrono::steady_clock::now() - item.pushed);
+		}
+	}
+
+public:
+	RelayFanout(int16_t compressor_type_in) : compressor_type(compressor_type_in) {
+		std::thread(&RelayFanout::drain, this).detach();
+	}
+
+	// Must be called in the same order as the compressor produced msgs
+	// seq is the tx's, or the block's depends_seq, and position its sent_position, in the compressor
+	// (see get_relay_transaction()). Streams go only to clients whose replay is done, and ignore it.
+	// block and parsed are the block a FANOUT_BLOCK or FANOUT_STREAM_END is of, see Item.
+	void push(const std::shared_ptr<std::vector<unsigned char> >& msg, ItemType type, const std::shared_ptr<const RelayClientList>& clients, uint64_t seq=0, uint64_t position=0,
+			const std::shared_ptr<const std::vector<unsigned char> >& block=std::shared_ptr<const std::vector<unsigned char> >(),
+			const std::shared_ptr<const ParsedBlock>& parsed=std::shared_ptr<const ParsedBlock>()) {
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.push_back({msg, type, clients, std::chrono::steady_clock::now(), seq, position, block, parsed});
+		cv.notify_one();
+	}
+};
+
+// While a block is being cut-through, the CUT_THROUGH_COMPRESSOR is locked and its peers are
+// mid-BLOCK message, so anything else for them (done under map_mutex) is deferred until it's done
+struct CutThroughState {
+	bool active = false;
+	std::vector<std::function<void (void)> > deferred;
+
+	void run_or_defer(const std::function<void (void)>& f) {
+		if (active)
+			deferred.push_back(f);
+		else
+			f();
+	}
+};
+
+// Re-encodes a block for CUT_THROUGH_COMPRESSOR peers as it is read from a relay peer, forwarding
+// each piece as soon as we'd otherwise wait on the network. If the block turns out to be invalid
+// the peers are sent an ABORT_BLOCK_INDEX instead of the rest of it.
+//
+// As the whole CUT_THROUGH_COMPRESSOR waits on the relay peer until we're done, we only start for
+// a block which builds on the last one we relayed or our bitcoinds told us about (as any old header
+// has valid pow), and the same ABORT_BLOCK_INDEX goes out if the rest of the block takes longer than
+// CUT_THROUGH_MAX_READ_MS.
+#define CUT_THROUGH_MAX_READ_MS 2000
+class CutThroughStream : public BlockStream {
+private:
+	std::mutex& map_mutex;
+	CutThroughState& state;
+	const std::shared_ptr<const RelayClientList>& clientList;
+	const std::vector<unsigned char>& tip; // Protected by map_mutex
+	RelayFanout& fanout;
+	RelayNodeCompressor::BlockEncoder encoder;
+
+	bool started = false;
+	std::chrono::system_clock::time_point deadline;
+	std::shared_ptr<std::vector<unsigned char> > pending;
+	std::shared_ptr<RelayClientList> peers; // Who gets START
+
+	void flush(RelayFanout::ItemType type, const std::shared_ptr<const std::vector<unsigned char> >& block=std::shared_ptr<const std::vector<unsigned char> >(),
+			const std::shared_ptr<const ParsedBlock>& parsed=std::shared_ptr<const ParsedBlock>()) {
+		if (type == RelayFanout::FANOUT_STREAM_DATA && pending->empty())
+			return;
+		// DATA and END go to whoever got START
+		fanout.push(pending, type, type == RelayFanout::FANOUT_STREAM_START ? peers : std::shared_ptr<const RelayClientList>(), encoder.depends_seq(), 0, block, parsed);
+		pending = std::make_shared<std::vector<unsigned char> >();
+	}
+
+public:
+	CutThroughStream(std::mutex& map_mutex_in, CutThroughState& state_in, const std::shared_ptr<const RelayClientList>& clientList_in,
+			const std::vector<unsigned char>& tip_in, RelayFanout& fanout_in)
+		: map_mutex(map_mutex_in), state(state_in), clientList(clientList_in), tip(tip_in), fanout(fanout_in),
+		encoder(compressors[CUT_THROUGH_COMPRESSOR]), pending(std::make_shared<std::vector<unsigned char> >()) {}
+
+	void on_progress(const std::vector<unsigned char>& block, size_t start, size_t len) {
+		if (!started) {
+			started = true;
+			assert(start == sizeof(struct bitcoin_msg_header) && len == 80);
+
+			std::vector<unsigned char> fullhash(32);
+			getblockhash(fullhash, block, sizeof(struct bitcoin_msg_header));
+			std::vector<unsigned char>::const_iterator txcountit = block.begin() + sizeof(struct bitcoin_msg_header) + 80;
+			uint32_t tx_count = read_varint(txcountit, block.end());
+
+			std::lock_guard<std::mutex> lock(map_mutex);
+			if (tip.empty() || memcmp(&block[sizeof(struct bitcoin_msg_header) + 4], &tip[0], 32))
+				return;
+			// Only peers whose tx cache replay is done (and so comes before our encoder in the
+			// compressor): a later one would get a block encoded against the cache it's yet to be sent
+			peers = std::make_shared<RelayClientList>();
+			for (const auto& client : *clientList)
+				if (client->compressor_type == CUT_THROUGH_COMPRESSOR && client->is_replayed())
+					peers->push_back(client);
+			// Only one block at a time, and the compressor mutex could only be held elsewhere briefly
+			if (peers->empty() || state.active || encoder.begin(fullhash, &block[sizeof(struct bitcoin_msg_header)], tx_count, *pending))
+				return;
+			state.active = true;
+			deadline = std::chrono::system_clock::now() + std::chrono::milliseconds(CUT_THROUGH_MAX_READ_MS);
+			flush(RelayFanout::FANOUT_STREAM_START);
+		} else if (encoder.active()) {
+			encoder.add_tx(block, start, len, *pending);
+			if (pending->size() >= 65536)
+				flush(RelayFanout::FANOUT_STREAM_DATA);
+		}
+	}
+
+	void on_read_blocked() {
+		if (encoder.active())
+			flush(RelayFanout::FANOUT_STREAM_DATA);
+	}
+
+	millis_lu_type max_read_wait() {
+		if (!encoder.active())
+			return millis_lu_type::max();
+		auto now = std::chrono::system_clock::now();
+		return now < deadline ? std::chrono::duration_cast<millis_lu_type>(deadline - now) : millis_lu_type(0);
+	}
+
+	void on_read_timeout() {
+		on_done("block took too long to cut through", NULL, NULL);
+	}
+
+	void on_done(const char* err, const std::shared_ptr<std::vector<unsigned char> >& block, const ParsedBlock* parsed) {
+		if (!encoder.active())
+			return;
+
+		std::lock_guard<std::mutex> lock(map_mutex);
+		if (err)
+			encoder.abort(*pending);
+		else
+			encoder.done();
+		flush(RelayFanout::FANOUT_STREAM_DATA);
+		// Peers which are still waiting on their replay of the cache before they can decode the
+		// stream are sent the block uncached (see RelayNetworkClient::end_block_stream())
+		if (err)
+			flush(RelayFanout::FANOUT_STREAM_END);
+		else
+			flush(RelayFanout::FANOUT_STREAM_END, block, std::make_shared<ParsedBlock>(*parsed));
+
+		state.active = false;
+		for (const auto& f : state.deferred)
+			f();
+		state.deferred.clear();
+	}
+
+	~CutThroughStream() {
+		if (encoder.active())
+			on_done("stream dropped", NULL, NULL);
+	}
+};
+
 
 class MempoolClient : public OutboundPersistentConnection {
 private:
 	std::function<void(std::vector<unsigned char>)> on_hash;
+	// Where we got up to in the server's stream of txids, so that on reconnect it only has to send
+	// what we missed (see MEMPOOL_RESUME_MAGIC). epoch is 0 if the server didn't tell us.
+	uint64_t epoch, position;
 public:
 	MempoolClient(std::string serverHostIn, uint16_t serverPortIn, std::function<void(std::vector<unsigned char>)> on_hash_in)
-		: OutboundPersistentConnection(serverHostIn, serverPortIn), on_hash(on_hash_in) { construction_done(); }
+		: OutboundPersistentConnection(serverHostIn, serverPortIn), on_hash(on_hash_in), epoch(0), position(0) { construction_done(); }
 
 	void on_disconnect() {}
 
 	void net_process(const std::function<void(std::string)>& disconnect) {
-		while (true) {
+		char resume[MEMPOOL_RECORD_SIZE] = {0};
+		uint64_t le_epoch = htole64(epoch), le_position = htole64(position);
+		memcpy(resume, MEMPOOL_RESUME_MAGIC, 8);
+		memcpy(resume + 8, &le_epoch, 8);
+		memcpy(resume + 16, &le_position, 8);
+		maybe_do_send_bytes(resume, sizeof(resume));
+
+		for (bool first = true; ; first = false) {
 			std::vector<unsigned char> hash(32);
 			if (read_all((char*)&hash[0], 32, std::chrono::seconds(10)) != 32)
 				return disconnect("Failed to read next hash");
+			if (first) {
+				if (!memcmp(&hash[0], MEMPOOL_SYNC_MAGIC, 8)) {
+					memcpy(&le_epoch, &hash[8], 8);
+					memcpy(&le_position, &hash[16], 8);
+					epoch = le64toh(le_epoch);
+					position = le64toh(le_position);
+					continue;
+				}
+				epoch = 0; // An old server, which just sends everything
+			}
+			position++;
 			on_hash(hash);
 		}
 	}
@@ -291,6 +752,70 @@ public:
 };
 
 
+// Admission control for new connections: up to burst at once, refilled at rate per second
+class ConnectBucket {
+private:
+	const double burst, rate;
+	double tokens;
+	std::chrono::steady_clock::time_point last;
+public:
+	ConnectBucket(double burstIn, double rateIn) : burst(burstIn), rate(rateIn), tokens(burstIn), last(std::chrono::steady_clock::now()) {}
+	bool take() {
+		auto now = std::chrono::steady_clock::now();
+		tokens = std::min(burst, tokens + rate * std::chrono::duration_cast<std::chrono::duration<double> >(now - last).count());
+		last = now;
+		if (tokens < 1)
+			return false;
+		tokens -= 1;
+		return true;
+	}
+};
+// Each whitelisted prefix (whose hosts may have any number of connections) gets its own bucket, so a
+// reconnect loop there can't flood us, and everyone else shares one (sized for all our clients
+// reconnecting at once, eg after we restart)
+#define WHITELIST_CONNECT_BURST 1000
+#define WHITELIST_CONNECT_RATE 50
+#define CONNECT_BURST 1000
+#define CONNECT_RATE 100
+
+// Accepted sockets waiting on a reverse DNS lookup, which ACCEPT_THREADS do in parallel so that a slow
+// lookup holds up neither accept() nor map_mutex. Beyond MAX_PENDING_ACCEPTS new sockets are closed.
+#define ACCEPT_THREADS 8
+#define MAX_PENDING_ACCEPTS 256
+class AcceptQueue {
+public:
+	struct Accepted {
+		int fd;
+		struct sockaddr_in6 addr;
+		bool whitelist;
+	};
+
+private:
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<Accepted> queue;
+
+public:
+	bool push(const Accepted& accepted) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (queue.size() >= MAX_PENDING_ACCEPTS)
+			return false;
+		queue.push_back(accepted);
+		cv.notify_one();
+		return true;
+	}
+
+	Accepted pop() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (queue.empty())
+			cv.wait(lock);
+		Accepted res = queue.front();
+		queue.pop_front();
+		return res;
+	}
+};
+
+
 
 
 
@@ -302,6 +827,11 @@ int main(const int argc, const char** argv) {
 
 	HOST_SPONSOR = argv[4];
 
+	std::vector<RelayNodeCompressor*> snapshot_compressors;
+	for (int16_t i = 0; i < COMPRESSOR_TYPES; i++)
+		snapshot_compressors.push_back(&compressors[i]);
+	start_snapshots(snapshot_compressors);
+
 	int listen_fd;
 	struct sockaddr_in6 addr;
 
@@ -323,8 +853,30 @@ int main(const int argc, const char** argv) {
 		return -1;
 	}
 
+	start_stats_server();
+
 	std::mutex map_mutex;
-	std::map<std::string, RelayNetworkClient*> clientMap;
+	std::map<std::string, std::shared_ptr<RelayNetworkClient> > clientMap;
+	// Immutable copy of clientMap's values for the fanout threads, replaced (under map_mutex) whenever clientMap changes
+	std::shared_ptr<const RelayClientList> clientList = std::make_shared<RelayClientList>();
+	const auto update_client_list = [&](void) {
+		auto list = std::make_shared<RelayClientList>();
+		list->reserve(clientMap.size());
+		for (const auto& client : clientMap)
+			list->push_back(client.second);
+		clientList = list;
+	};
+	RelayFanout* fanouts[COMPRESSOR_TYPES];
+	for (int16_t i = 0; i < COMPRESSOR_TYPES; i++)
+		fanouts[i] = new RelayFanout(i);
+	CutThroughState cut_through; // Protected by map_mutex
+	// Hash of the last block from (or announced by) our bitcoinds or relayed from a relay peer (which
+	// our bitcoinds won't announce back to us), protected by map_mutex
+	std::vector<unsigned char> tip;
+	const auto set_tip = [&](const std::vector<unsigned char>& hash) {
+		std::lock_guard<std::mutex> lock(map_mutex);
+		tip = hash;
+	};
 	P2PClient *trustedP2P, *localP2P;
 
 	// You'll notice in the below callbacks that we have to do some header adding/removing
@@ -332,21 +884,54 @@ int main(const int argc, const char** argv) {
 	// the client and because that is the case we want to optimize for)
 
 	std::mutex txn_mutex;
-	vectormruset txnWaitingToBroadcast(MAX_FAS_TOTAL_SIZE);
+	hash_mruset<32> txnWaitingToBroadcast(MAX_FAS_TOTAL_SIZE / 32);
+
+	const std::function<std::pair<const char*, size_t> (const std::vector<unsigned char>&, const std::vector<unsigned char>&, bool, const ParsedBlock*)> do_relay =
+		[&](const std::vector<unsigned char>& fullhash, const std::vector<unsigned char>& bytes, bool checkMerkle, const ParsedBlock* already_parsed) {
+			// Parse (and check the merkle root of) the block once, outside of map_mutex, and build
+			// each compressor's encoding from that. Blocks from relay peers were already parsed
+			// (and checked) as they were decompressed.
+			bool all_seen = true;
+			for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++)
+				all_seen &= compressors[i].was_block_seen(fullhash);
+			if (all_seen)
+				return std::make_pair("SEEN", (size_t)0);
+
+			ParsedBlock parsed_here;
+			const char* insane = NULL;
+			if (!already_parsed || already_parsed->txn.empty())
+				insane = parse_block(fullhash, bytes, checkMerkle, parsed_here);
+			if (insane)
+				return std::make_pair(insane, (size_t)0);
+			const ParsedBlock& parsed = parsed_here.txn.empty() ? *already_parsed : parsed_here;
+
+			// Kept by the fanouts for any clients which have to be sent the block uncached, and by
+			// CUT_THROUGH_COMPRESSOR, which may compress it after we return
+			std::shared_ptr<const std::vector<unsigned char> > bytes_copy = std::make_shared<std::vector<unsigned char> >(bytes);
+			std::shared_ptr<const ParsedBlock> parsed_copy = std::make_shared<ParsedBlock>(parsed);
 
-	const std::function<std::pair<const char*, size_t> (const std::vector<unsigned char>&, const std::vector<unsigned char>&, bool)> do_relay =
-		[&](const std::vector<unsigned char>& fullhash, const std::vector<unsigned char>& bytes, bool checkMerkle) {
 			std::lock_guard<std::mutex> lock(map_mutex);
 			size_t ret;
 			for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
-				auto tuple = compressors[i].maybe_compress_block(fullhash, bytes, checkMerkle);
-				const char* insane = std::get<1>(tuple);
+				if (i == CUT_THROUGH_COMPRESSOR) {
+					cut_through.run_or_defer([=, &clientList](void) {
+						auto compress_start = std::chrono::steady_clock::now();
+						uint64_t depends_seq, position;
+						auto tuple = compressors[CUT_THROUGH_COMPRESSOR].maybe_compress_block(fullhash, *bytes_copy, *parsed_copy, &depends_seq, &position);
+						compress_stats[CUT_THROUGH_COMPRESSOR].record(std::chrono::steady_clock::now() - compress_start);
+						if (!std::get<1>(tuple))
+							fanouts[CUT_THROUGH_COMPRESSOR]->push(std::get<0>(tuple), RelayFanout::FANOUT_BLOCK, clientList, depends_seq, position, bytes_copy, parsed_copy);
+					});
+					continue;
+				}
+				auto compress_start = std::chrono::steady_clock::now();
+				uint64_t depends_seq, position;
+				auto tuple = compressors[i].maybe_compress_block(fullhash, bytes, parsed, &depends_seq, &position);
+				compress_stats[i].record(std::chrono::steady_clock::now() - compress_start);
+				insane = std::get<1>(tuple);
 				if (!insane) {
 					auto block = std::get<0>(tuple);
-					for (const auto& client : clientMap) {
-						if (!client.second->getDisconnectFlags() && client.second->compressor_type == i)
-							client.second->receive_block(block);
-					}
+					fanouts[i]->push(block, RelayFanout::FANOUT_BLOCK, clientList, depends_seq, position, bytes_copy, parsed_copy);
 					if (i == 0)
 						ret = block->size();
 				} else
@@ -365,14 +950,19 @@ int main(const int argc, const char** argv) {
 						std::vector<unsigned char> fullhash(32);
 						getblockhash(fullhash, bytes, sizeof(struct bitcoin_msg_header));
 
-						std::pair<const char*, size_t> relay_res = do_relay(fullhash, bytes, false);
+						std::pair<const char*, size_t> relay_res = do_relay(fullhash, bytes, false, NULL);
 						if (relay_res.first) {
+							// Most likely a relay peer gave it to us first
+							if (!strcmp(relay_res.first, "SEEN"))
+								set_tip(fullhash);
 							printf(HASH_FORMAT" INSANE %s TRUSTEDP2P\n", HASH_PRINT(&fullhash[0]), relay_res.first);
 							return;
 						} else
 							localP2P->receive_block(bytes);
+						set_tip(fullhash);
 
 						std::chrono::system_clock::time_point send_end(std::chrono::system_clock::now());
+						relay_stats[1].record(send_end - send_start);
 						printf(HASH_FORMAT" BLOCK %lu %s TRUSTEDP2P %lu / %lu / %lu TIMES: %lf %lf\n", HASH_PRINT(&fullhash[0]), epoch_millis_lu(send_start), argv[1],
 														bytes.size(), relay_res.second, bytes.size(),
 														to_millis_double(send_start - read_start), to_millis_double(send_end - send_start));
@@ -382,18 +972,25 @@ int main(const int argc, const char** argv) {
 						double_sha256(&(*bytes)[0], &hash[0], bytes->size());
 						{
 							std::lock_guard<std::mutex> lock(txn_mutex);
-							if (txnWaitingToBroadcast.find(hash) == txnWaitingToBroadcast.end())
+							if (!txnWaitingToBroadcast.count(hash))
 								return;
 						}
 						std::lock_guard<std::mutex> lock(map_mutex);
 						bool sentToLocal = false;
+						std::shared_ptr<std::vector<unsigned char> > txbytes = bytes;
+						cut_through.run_or_defer([=, &clientList](void) {
+							uint64_t seq, position;
+							auto tx = compressors[CUT_THROUGH_COMPRESSOR].get_relay_transaction(txbytes, &seq, &position);
+							if (tx.use_count())
+								fanouts[CUT_THROUGH_COMPRESSOR]->push(tx, RelayFanout::FANOUT_TRANSACTION, clientList, seq, position);
+						});
 						for (uint16_t i = 0; i < COMPRESSOR_TYPES; i++) {
-							auto tx = compressors[i].get_relay_transaction(bytes);
+							if (i == CUT_THROUGH_COMPRESSOR)
+								continue;
+							uint64_t seq, position;
+							auto tx = compressors[i].get_relay_transaction(bytes, &seq, &position);
 							if (tx.use_count()) {
-								for (const auto& client : clientMap) {
-									if (!client.second->getDisconnectFlags() && client.second->compressor_type == i)
-										client.second->receive_transaction(tx);
-								}
+								fanouts[i]->push(tx, RelayFanout::FANOUT_TRANSACTION, clientList, seq, position);
 								if (!sentToLocal) {
 									localP2P->receive_transaction(bytes);
 									sentToLocal = true;
@@ -415,6 +1012,8 @@ int main(const int argc, const char** argv) {
 								std::vector<unsigned char> fullhash(32);
 								getblockhash(fullhash, headers, it - 81 - headers.begin());
 								compressors[0].block_sent(fullhash);
+								if (i == count - 1)
+									set_tip(fullhash);
 							}
 
 							printf("Added headers from trusted peers, seen %u blocks\n", compressors[0].blocks_sent());
@@ -441,16 +1040,21 @@ int main(const int argc, const char** argv) {
 						std::vector<unsigned char> fullhash(32);
 						getblockhash(fullhash, bytes, sizeof(struct bitcoin_msg_header));
 
-						std::pair<const char*, size_t> relay_res = do_relay(fullhash, bytes, true);
+						std::pair<const char*, size_t> relay_res = do_relay(fullhash, bytes, true, NULL);
 						if (relay_res.first) {
+							// Most likely a relay peer gave it to us first
+							if (!strcmp(relay_res.first, "SEEN"))
+								set_tip(fullhash);
 							printf(HASH_FORMAT" INSANE %s LOCALP2P\n", HASH_PRINT(&fullhash[0]), relay_res.first);
 							return;
 						} else
 							localP2P->receive_block(bytes);
+						set_tip(fullhash);
 
 						trustedP2P->receive_block(bytes);
 
 						std::chrono::system_clock::time_point send_end(std::chrono::system_clock::now());
+						relay_stats[2].record(send_end - send_start);
 						printf(HASH_FORMAT" BLOCK %lu %s LOCALP2P %lu / %lu / %lu TIMES: %lf %lf\n", HASH_PRINT(&fullhash[0]),
 														epoch_millis_lu(send_start), "127.0.0.1",
 														bytes.size(), relay_res.second, bytes.size(),
@@ -460,17 +1064,18 @@ int main(const int argc, const char** argv) {
 						trustedP2P->receive_transaction(bytes);
 					}, NULL, false);
 
-	std::function<size_t (RelayNetworkClient*, std::shared_ptr<std::vector<unsigned char> >&, const std::vector<unsigned char>&)> relayBlock =
-		[&](RelayNetworkClient* from, std::shared_ptr<std::vector<unsigned char>> & bytes, const std::vector<unsigned char>& fullhash) {
+	std::function<size_t (RelayNetworkClient*, std::shared_ptr<std::vector<unsigned char> >&, const std::vector<unsigned char>&, const ParsedBlock&)> relayBlock =
+		[&](RelayNetworkClient* from, std::shared_ptr<std::vector<unsigned char>> & bytes, const std::vector<unsigned char>& fullhash, const ParsedBlock& parsed) {
 			if (bytes->size() < sizeof(struct bitcoin_msg_header) + 80)
 				return (size_t)0;
 
-			std::pair<const char*, size_t> relay_res = do_relay(fullhash, *bytes, false);
+			std::pair<const char*, size_t> relay_res = do_relay(fullhash, *bytes, false, &parsed);
 			if (relay_res.first) {
 				printf(HASH_FORMAT" INSANE %s UNTRUSTEDRELAY %s\n", HASH_PRINT(&fullhash[0]), relay_res.first, from->host.c_str());
 				return relay_res.second;
 			} else
 				localP2P->receive_block(*bytes);
+			set_tip(fullhash);
 
 			trustedP2P->receive_block(*bytes);
 
@@ -482,27 +1087,36 @@ int main(const int argc, const char** argv) {
 			trustedP2P->receive_transaction(bytes);
 		};
 
-	std::function<void (RelayNetworkClient*, int token)> connected =
-		[&](RelayNetworkClient* client, int token) {
+	std::function<uint64_t (RelayNetworkClient*, int token, const std::vector<unsigned char>* summary)> connected =
+		[&](RelayNetworkClient* client, int token, const std::vector<unsigned char>* summary) {
 			assert(client->compressor_type >= 0 && client->compressor_type < COMPRESSOR_TYPES);
-			compressors[client->compressor_type].relay_node_connected(client, token);
+			return compressors[client->compressor_type].relay_node_connected(client, token, summary);
+		};
+
+	std::function<std::unique_ptr<BlockStream> (void)> startBlockStream =
+		[&](void) {
+			return std::unique_ptr<BlockStream>(new CutThroughStream(map_mutex, cut_through, clientList, tip, *fanouts[CUT_THROUGH_COMPRESSOR]));
 		};
 
 	std::thread([&](void) {
-		while (true) {
-			std::this_thread::sleep_for(std::chrono::seconds(10)); // Implicit new-connection rate-limit
+		for (unsigned ticks = 1; ; ticks++) {
+			// Culled quickly, as a client can't reconnect until its old connection is gone
+			std::this_thread::sleep_for(std::chrono::seconds(1));
 			{
 				std::lock_guard<std::mutex> lock(map_mutex);
+				size_t count = clientMap.size();
 				for (auto it = clientMap.begin(); it != clientMap.end();) {
 					if (it->second->getDisconnectFlags() & DISCONNECT_COMPLETE) {
 						fprintf(stderr, "%lld: Culled %s, have %lu relay clients\n", (long long) time(NULL), it->first.c_str(), clientMap.size() - 1);
-						delete it->second;
 						clientMap.erase(it++);
 					} else
 						it++;
 				}
+				if (clientMap.size() != count)
+					update_client_list();
 			}
-			mempoolClient.keep_alive_ping();
+			if (ticks % 10 == 0)
+				mempoolClient.keep_alive_ping();
 		}
 	}).detach();
 
@@ -510,38 +1124,69 @@ int main(const int argc, const char** argv) {
 	std::vector<std::string> whitelistprefix;
 	for (int i = 5; i < argc; i++)
 		whitelistprefix.push_back(argv[i]);
-	socklen_t addr_size = sizeof(addr);
+
+	AcceptQueue accepted;
+	for (int i = 0; i < ACCEPT_THREADS; i++) {
+		std::thread([&](void) {
+			while (true) {
+				AcceptQueue::Accepted conn = accepted.pop();
+				std::string host = gethostname(&conn.addr);
+				std::lock_guard<std::mutex> lock(map_mutex);
+
+				if ((clientMap.count(host) && !conn.whitelist) ||
+						(host.length() > droppostfix.length() && !host.compare(host.length() - droppostfix.length(), droppostfix.length(), droppostfix))) {
+					if (clientMap.count(host)) {
+						const auto& client = clientMap[host];
+						if (client->lastDupConnect < (time(NULL) - 60)) {
+							client->lastDupConnect = time(NULL);
+							fprintf(stderr, "%lld: Got duplicate connection from %s (original's disconnect status: %d)\n", (long long) time(NULL), host.c_str(), client->getDisconnectFlags());
+						}
+					}
+					close(conn.fd);
+				} else {
+					if (conn.whitelist)
+						host += ":" + std::to_string(conn.addr.sin6_port);
+					assert(clientMap.count(host) == 0);
+					clientMap[host] = std::make_shared<RelayNetworkClient>(conn.fd, host, relayBlock, relayTx, connected, startBlockStream);
+					update_client_list();
+					fprintf(stderr, "%lld: New connection from %s, have %lu relay clients\n", (long long) time(NULL), host.c_str(), clientMap.size());
+				}
+			}
+		}).detach();
+	}
+
+	// Only touched here
+	ConnectBucket default_bucket(CONNECT_BURST, CONNECT_RATE);
+	std::vector<ConnectBucket> whitelist_buckets(whitelistprefix.size(), ConnectBucket(WHITELIST_CONNECT_BURST, WHITELIST_CONNECT_RATE));
+	time_t last_refused = 0;
+
 	while (true) {
-		int new_fd;
-		if ((new_fd = accept(listen_fd, (struct sockaddr *) &addr, &addr_size)) < 0) {
-			printf("Failed to select (%d: %s)\n", new_fd, strerror(errno));
+		AcceptQueue::Accepted conn;
+		socklen_t addr_size = sizeof(conn.addr);
+		if ((conn.fd = accept(listen_fd, (struct sockaddr *) &conn.addr, &addr_size)) < 0) {
+			printf("Failed to select (%d: %s)\n", conn.fd, strerror(errno));
 			return -1;
 		}
 
-		std::string host = gethostname(&addr);
-		std::lock_guard<std::mutex> lock(map_mutex);
+		// Whitelist prefixes are of the address, so can be checked without waiting on DNS
+		std::string address = gethostname(&conn.addr, false);
+		ConnectBucket* bucket = &default_bucket;
+		conn.whitelist = false;
+		for (size_t i = 0; i < whitelistprefix.size(); i++) {
+			if (address.compare(0, whitelistprefix[i].length(), whitelistprefix[i]) == 0) {
+				conn.whitelist = true;
+				bucket = &whitelist_buckets[i];
+				break;
+			}
+		}
 
-		bool whitelist = false;
-		for (const std::string& s : whitelistprefix)
-			if (host.compare(0, s.length(), s) == 0)
-				whitelist = true;
-
-		if ((clientMap.count(host) && !whitelist) ||
-				(host.length() > droppostfix.length() && !host.compare(host.length() - droppostfix.length(), droppostfix.length(), droppostfix))) {
-			if (clientMap.count(host)) {
-				const auto& client = clientMap[host];
-				if (client->lastDupConnect < (time(NULL) - 60)) {
-					client->lastDupConnect = time(NULL);
-					fprintf(stderr, "%lld: Got duplicate connection from %s (original's disconnect status: %d)\n", (long long) time(NULL), host.c_str(), client->getDisconnectFlags());
-				}
+		const char* refused = !bucket->take() ? "over connection rate" : (!accepted.push(conn) ? "too many pending connections" : NULL);
+		if (refused) {
+			if (last_refused != time(NULL)) {
+				last_refused = time(NULL);
+				fprintf(stderr, "%lld: Refused connection from %s (%s)\n", (long long) time(NULL), address.c_str(), refused);
 			}
-			close(new_fd);
-		} else {
-			if (whitelist)
-				host += ":" + std::to_string(addr.sin6_port);
-			assert(clientMap.count(host) == 0);
-			clientMap[host] = new RelayNetworkClient(new_fd, host, relayBlock, relayTx, connected);
-			fprintf(stderr, "%lld: New connection from %s, have %lu relay clients\n", (long long) time(NULL), host.c_str(), clientMap.size());
+			close(conn.fd);
 		}
 	}
 }
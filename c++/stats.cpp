@@ -0,0 +1,231 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifdef WIN32
+	#include <winsock2.h>
+	#include <ws2tcpip.h>
+#else // WIN32
+	#include <sys/socket.h>
+	#include <sys/time.h>
+	#include <sys/un.h>
+	#include <netinet/in.h>
+	#include <arpa/inet.h>
+#endif // !WIN32
+
+#include "utils.h"
+
+namespace {
+struct StatGauge {
+	const char* name;
+	const char* help;
+	StatGaugeCollector collect;
+};
+
+// Histograms register themselves during static init, so these can't be plain globals
+std::mutex& registry_mutex() {
+	static std::mutex mutex;
+	return mutex;
+}
+std::vector<const StatHistogram*>& histograms() {
+	static std::vector<const StatHistogram*> list;
+	return list;
+}
+std::vector<StatGauge>& gauges() {
+	static std::vector<StatGauge> list;
+	return list;
+}
+}
+
+StatHistogram::StatHistogram(const char* nameIn, const char* helpIn, const std::string& labelsIn)
+		: total_micros(0), name(nameIn), help(helpIn), labels(labelsIn) {
+	for (unsigned i = 0; i < BUCKETS; i++)
+		counts[i].store(0, std::memory_order_relaxed);
+	std::lock_guard<std::mutex> lock(registry_mutex());
+	histograms().push_back(this);
+}
+
+uint64_t StatHistogram::bucket_of(uint64_t micros) {
+	if (micros < SUB_BUCKETS)
+		return micros;
+	unsigned exponent = 63 - __builtin_clzll(micros);
+	if (exponent >= MAX_EXPONENT + 1)
+		return BUCKETS - 1;
+	return SUB_BUCKETS * (exponent - 1) + ((micros >> (exponent - 2)) & (SUB_BUCKETS - 1));
+}
+
+uint64_t StatHistogram::bucket_limit(uint64_t bucket) {
+	if (bucket < SUB_BUCKETS)
+		return bucket + 1;
+	return (SUB_BUCKETS + bucket % SUB_BUCKETS + 1) << (bucket / SUB_BUCKETS - 1);
+}
+
+void StatHistogram::record_micros(uint64_t micros) {
+	counts[bucket_of(micros)].fetch_add(1, std::memory_order_relaxed);
+	total_micros.fetch_add(micros, std::memory_order_relaxed);
+}
+
+// Buckets under this many micros aren't worth a line each
+#define STAT_MIN_EXPORTED_LIMIT 32
+
+void StatHistogram::write_to(std::string& out) const {
+	std::string prefix = labels.empty() ? "" : labels + ",";
+	std::string suffix = labels.empty() ? "" : "{" + labels + "}";
+	char buf[64];
+
+	uint64_t total = 0;
+	for (unsigned i = 0; i < BUCKETS - 1; i++) {
+		total += counts[i].load(std::memory_order_relaxed);
+		uint64_t limit = bucket_limit(i);
+		if (limit < STAT_MIN_EXPORTED_LIMIT)
+			continue;
+		snprintf(buf, sizeof(buf), "%.6f\"} %lu\n", limit / 1000000.0, (unsigned long)total);
+		out += std::string(name) + "_bucket{" + prefix + "le=\"" + buf;
+	}
+	total += counts[BUCKETS - 1].load(std::memory_order_relaxed);
+	out += std::string(name) + "_bucket{" + prefix + "le=\"+Inf\"} " + std::to_string(total) + "\n";
+
+	snprintf(buf, sizeof(buf), " %.6f\n", total_micros.load(std::memory_order_relaxed) / 1000000.0);
+	out += std::string(name) + "_sum" + suffix + buf;
+	out += std::string(name) + "_count" + suffix + " " + std::to_string(total) + "\n";
+}
+
+void register_stat_gauge(const char* name, const char* help, const StatGaugeCollector& collect) {
+	std::lock_guard<std::mutex> lock(registry_mutex());
+	gauges().push_back({name, help, collect});
+}
+
+std::string stat_label(const char* key, const std::string& value) {
+	std::string res = std::string(key) + "=\"";
+	for (char c : value) {
+		if (c == '"' || c == '\\')
+			res += '\\';
+		if (c == '\n')
+			res += "\\n";
+		else
+			res += c;
+	}
+	return res + "\"";
+}
+
+std::string format_stats() {
+	std::lock_guard<std::mutex> lock(registry_mutex());
+	std::string out;
+
+	// Every series of a metric has to be listed together, under one HELP/TYPE
+	std::multimap<std::string, const StatHistogram*> by_name;
+	for (const StatHistogram* hist : histograms())
+		by_name.insert(std::make_pair(std::string(hist->name), hist));
+	for (auto it = by_name.begin(); it != by_name.end(); it++) {
+		if (it == by_name.begin() || std::prev(it)->first != it->first)
+			out += "# HELP " + it->first + " " + it->second->help + "\n# TYPE " + it->first + " histogram\n";
+		it->second->write_to(out);
+	}
+
+	for (const StatGauge& gauge : gauges()) {
+		out += std::string("# HELP ") + gauge.name + " " + gauge.help + "\n# TYPE " + gauge.name + " gauge\n";
+		gauge.collect([&](const std::string& labels, int64_t value) {
+			out += std::string(gauge.name) + (labels.empty() ? "" : "{" + labels + "}") + " " + std::to_string(value) + "\n";
+		});
+	}
+	return out;
+}
+
+static void serve_stats(int listen_fd) {
+	while (true) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			printf("Failed to accept stats connection (%s)\n", strerror(errno));
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+			continue;
+		}
+
+		// Scrapes are served one at a time, so don't let one hang around
+#ifdef WIN32
+		DWORD timeout = 1000;
+#else
+		struct timeval timeout = { 1, 0 };
+#endif
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
+
+		// Whatever was asked for, it gets everything, once we've seen the end of the request
+		char request[4096];
+		size_t request_size = 0;
+		while (request_size < sizeof(request) - 1) {
+			ssize_t count = recv(fd, request + request_size, sizeof(request) - 1 - request_size, 0);
+			if (count <= 0)
+				break;
+			request_size += count;
+			request[request_size] = 0;
+			if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+				break;
+		}
+
+		std::string body = format_stats();
+		std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+				std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+		for (size_t sent = 0; sent < response.size(); ) {
+			ssize_t count = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+			if (count <= 0)
+				break;
+			sent += count;
+		}
+		close(fd);
+	}
+}
+
+void start_stats_server() {
+	const char* addr = getenv("RELAY_STATS_ADDR");
+	if (!addr || !*addr)
+		return;
+
+	int listen_fd;
+#ifndef WIN32
+	if (addr[0] == '/') {
+		struct sockaddr_un sun;
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(addr) >= sizeof(sun.sun_path)) {
+			printf("RELAY_STATS_ADDR path too long\n");
+			return;
+		}
+		strcpy(sun.sun_path, addr);
+		unlink(addr);
+		if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+				bind(listen_fd, (struct sockaddr*) &sun, sizeof(sun)) < 0 ||
+				listen(listen_fd, 3) < 0) {
+			printf("Failed to bind stats socket %s: %s\n", addr, strerror(errno));
+			return;
+		}
+	} else
+#endif
+	{
+		struct sockaddr_in sin;
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sin.sin_port = htons(atoi(addr));
+
+		int reuse = 1;
+		if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+				setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, (char*)&reuse, sizeof(reuse)) ||
+				bind(listen_fd, (struct sockaddr*) &sin, sizeof(sin)) < 0 ||
+				listen(listen_fd, 3) < 0) {
+			printf("Failed to bind stats port %s: %s\n", addr, strerror(errno));
+			return;
+		}
+	}
+
+	std::thread(serve_stats, listen_fd).detach();
+}
@@ -0,0 +1,55 @@
+#ifndef _RELAY_STATS_H
+#define _RELAY_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <stdint.h>
+
+// Process-wide latency histograms and gauges, exported in the Prometheus text format by
+// start_stats_server(). Histograms are file-scope statics which register themselves on
+// construction and are then only touched with relaxed atomic adds, so recording is lock-free.
+class StatHistogram {
+public:
+	// Log-linear (HDR-style) buckets over microseconds: 4 per power of two, up to ~4.7 hours
+	static const unsigned SUB_BUCKETS = 4, MAX_EXPONENT = 34;
+	static const unsigned BUCKETS = SUB_BUCKETS * MAX_EXPONENT;
+
+private:
+	std::atomic<uint64_t> counts[BUCKETS];
+	std::atomic<uint64_t> total_micros;
+
+public:
+	const char* const name;
+	const char* const help;
+	const std::string labels; // eg compressor="1", or empty
+
+	StatHistogram(const char* nameIn, const char* helpIn, const std::string& labelsIn="");
+	StatHistogram(const StatHistogram&) = delete;
+
+	void record_micros(uint64_t micros);
+	template<typename Rep, typename Period> void record(const std::chrono::duration<Rep, Period>& d) {
+		int64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+		record_micros(micros < 0 ? 0 : micros);
+	}
+
+	static uint64_t bucket_of(uint64_t micros);
+	static uint64_t bucket_limit(uint64_t bucket); // Smallest value in the next bucket
+	void write_to(std::string& out) const; // Without the HELP/TYPE lines
+};
+
+// Gauges are read when we're scraped, collect() calls its argument once per labels/value
+typedef std::function<void (const std::function<void (const std::string& labels, int64_t value)>&)> StatGaugeCollector;
+void register_stat_gauge(const char* name, const char* help, const StatGaugeCollector& collect);
+
+// Formats a label for StatHistogram::labels/gauges (escaping value)
+std::string stat_label(const char* key, const std::string& value);
+
+std::string format_stats();
+
+// If RELAY_STATS_ADDR is set, serves format_stats() over HTTP on it (a port number, to listen on
+// localhost only, or on POSIX a path for a Unix socket). Each request gets the full set.
+void start_stats_server();
+
+#endif
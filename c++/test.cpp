@@ -2,6 +2,11 @@
 #include "crypto/sha2.h"
 #include "flaggedarrayset.h"
 #include "relayprocess.h"
+#include "stats.h"
+#include "crypto/sha256_lanes.h"
+#include "connection.h"
+#include "rpcclient.h"
+#include "mruset.h"
 
 #include <stdio.h>
 #include <sys/time.h>
@@ -9,6 +14,15 @@
 #include <random>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <atomic>
+#include <map>
+#include <set>
 
 void do_nothing(...) {}
 
@@ -60,6 +74,7 @@ int pipefd[2];
 uint32_t block_tx_count;
 
 RelayNodeCompressor global_sender(false), global_receiver(false);
+RelayNodeCompressor stale_receiver(false); // A copy of global_receiver from a few blocks ago
 std::set<std::vector<unsigned char> > globalSeenSet;
 
 static unsigned int compress_runs = 0, decompress_runs = 0;
@@ -77,7 +92,8 @@ std::shared_ptr<std::vector<unsigned char> > __attribute__((noinline)) recv_bloc
 		assert(readpos <= data->size());
 		return count;
 	};
-	auto res = receiver->decompress_relay_block(do_read, block_tx_count, true);
+	ParsedBlock parsed;
+	auto res = receiver->decompress_relay_block(do_read, block_tx_count, true, BlockProgressCallback(), &parsed);
 	auto decompressed = std::chrono::steady_clock::now();
 	if (time) {
 		total_decompress_time += decompressed - start; decompress_runs++;
@@ -90,6 +106,12 @@ std::shared_ptr<std::vector<unsigned char> > __attribute__((noinline)) recv_bloc
 		exit(2);
 	} else if (time)
 		PRINT_TIME("Decompressed block in %lf ms\n", to_millis_double(decompressed - start));
+
+	ParsedBlock reparsed;
+	if (parse_block(*std::get<3>(res), *std::get<1>(res), true, reparsed) || reparsed.txn != parsed.txn || reparsed.txids != parsed.txids) {
+		printf("ERROR Decompressed block's parse did not match parse_block\n");
+		exit(2);
+	}
 	return std::get<1>(res);
 }
 
@@ -110,14 +132,17 @@ void test_compress_block(std::vector<unsigned char>& data, std::vector<std::shar
 	getblockhash(fullhash, data, sizeof(struct bitcoin_msg_header));
 
 	RelayNodeCompressor sender(false), tester(false), tester2(false), receiver(false);
+	RelayNodeCompressor compact_sender(false, true), compact_receiver(false, true);
 
 	for (auto v : txVectors) {
 		unsigned int made = sender.get_relay_transaction(v).use_count();
 #ifndef PRECISE_BENCH
-		v = std::make_shared<std::vector<unsigned char> >(*v); // Copy the vector to give the deduper something to do
+		v = std::make_shared<std::vector<unsigned char> >(*v); // Copy the vector so it has to be interned
 #endif
 		if (made)
 			receiver.recv_tx(v);
+		if (compact_sender.get_relay_transaction(v).use_count())
+			compact_receiver.recv_tx(v);
 #ifndef PRECISE_BENCH
 		v = std::make_shared<std::vector<unsigned char> >(*v);
 #endif
@@ -136,7 +161,17 @@ void test_compress_block(std::vector<unsigned char>& data, std::vector<std::shar
 			global_receiver.recv_tx(v);
 	}
 
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > sender_txn;
+	sender.for_each_sent_tx([&](std::shared_ptr<std::vector<unsigned char> > tx) { sender_txn.push_back(tx); });
 	unsigned int i = 0;
+	tester.for_each_sent_tx([&](std::shared_ptr<std::vector<unsigned char> > tx) {
+		if (i >= sender_txn.size() || tx != sender_txn[i++]) {
+			printf("Identical txn were not shared between caches\n");
+			exit(10);
+		}
+	});
+
+	i = 0;
 	sender.for_each_sent_tx([&](std::shared_ptr<std::vector<unsigned char> > tx) {
 		if (*tx != *txVectors[i]) {
 			printf("for_each_sent_tx was not in order!\n");
@@ -155,7 +190,6 @@ void test_compress_block(std::vector<unsigned char>& data, std::vector<std::shar
 		printf("Failed to compress block %s\n", std::get<1>(res));
 		exit(8);
 	}
-	std::this_thread::sleep_for(std::chrono::milliseconds(10)); // Let the deduper thread run...
 	if (*std::get<0>(tester2.maybe_compress_block(fullhash, data, true)) != *std::get<0>(res)) {
 		printf("maybe_compress_block not consistent???\n");
 		exit(9);
@@ -165,6 +199,19 @@ void test_compress_block(std::vector<unsigned char>& data, std::vector<std::shar
 	memcpy(&header, &(*std::get<0>(res))[0], sizeof(header));
 	block_tx_count = ntohl(header.length);
 
+	// A client sent the block uncached (as it would have to wait for its cache otherwise) decodes it
+	// without touching its cache, which still has everything the ordered copy which follows refers to
+	ParsedBlock parsed;
+	if (parse_block(fullhash, data, true, parsed)) {
+		printf("Failed to parse block\n");
+		exit(23);
+	}
+	auto uncached = sender.uncached_block_msg(data, parsed), compact_uncached = compact_sender.uncached_block_msg(data, parsed);
+	if (*recv_block(uncached, &receiver, false) != data || *recv_block(compact_uncached, &compact_receiver, false) != data) {
+		printf("Re-constructed uncached block did not match!\n");
+		exit(23);
+	}
+
 	auto decompressed_block = recv_block(std::get<0>(res), &receiver, true);
 
 	if (*decompressed_block != data) {
@@ -172,6 +219,17 @@ void test_compress_block(std::vector<unsigned char>& data, std::vector<std::shar
 		exit(4);
 	}
 
+	auto compact_res = compact_sender.maybe_compress_block(fullhash, data, true);
+	if (std::get<1>(compact_res)) {
+		printf("Failed to compress compact block %s\n", std::get<1>(compact_res));
+		exit(8);
+	}
+	PRINT_TIME("Compact encoding took %lu bytes\n", (unsigned long)std::get<0>(compact_res)->size());
+	if (*recv_block(std::get<0>(compact_res), &compact_receiver, false) != data) {
+		printf("Re-constructed compact block did not match!\n");
+		exit(4);
+	}
+
 	if (globalSeenSet.insert(fullhash).second) {
 		res = global_sender.maybe_compress_block(fullhash, data, true);
 		if (std::get<1>(res)) {
@@ -187,7 +245,759 @@ void test_compress_block(std::vector<unsigned char>& data, std::vector<std::shar
 	}
 }
 
+// Decodes a BLOCK message (including its relay header) with receiver, as a client would
+static std::tuple<uint32_t, std::shared_ptr<std::vector<unsigned char> >, const char*, std::shared_ptr<std::vector<unsigned char> > >
+		recv_stream(const std::vector<unsigned char>& msg, RelayNodeCompressor& receiver) {
+	struct relay_msg_header header;
+	memcpy(&header, &msg[0], sizeof(header));
+	size_t readpos = sizeof(header);
+	std::function<ssize_t(char*, size_t)> do_read = [&](char* buf, size_t count) -> ssize_t {
+		if (readpos + count > msg.size())
+			return -1;
+		memcpy(buf, &msg[readpos], count);
+		readpos += count;
+		return count;
+	};
+	return receiver.decompress_relay_block(do_read, ntohl(header.length), true);
+}
+
+// 8 bytes of each txid in sender's send_tx_cache, in the get_resync_summary() format of its recv_tx_cache
+static std::vector<unsigned char> sent_summary(RelayNodeCompressor& sender) {
+	std::vector<unsigned char> summary;
+	sender.for_each_sent_tx([&](const std::shared_ptr<std::vector<unsigned char> >& tx) {
+		unsigned char hash[32];
+		double_sha256(&(*tx)[0], hash, tx->size());
+		summary.insert(summary.end(), hash, hash + 8);
+	});
+	return summary;
+}
+
+// A block streamed with BlockEncoder has to be sent exactly as maybe_compress_block() would send it,
+// and one which is aborted half way must leave the sender's and receiver's caches in agreement, and
+// the block free to be sent again, in both the legacy and compact encodings
+void test_stream_block(std::vector<unsigned char>& data, const std::vector<std::shared_ptr<std::vector<unsigned char> > >& txVectors) {
+	std::vector<unsigned char> fullhash(32);
+	getblockhash(fullhash, data, sizeof(struct bitcoin_msg_header));
+	ParsedBlock parsed;
+	if (parse_block(fullhash, data, true, parsed)) {
+		printf("Failed to parse block\n");
+		exit(27);
+	}
+
+	for (bool compact : {false, true}) {
+		RelayNodeCompressor sender(false, compact), tester(false, compact), receiver(false, compact);
+		RelayNodeCompressor abort_sender(false, compact), abort_receiver(false, compact);
+		for (const auto& v : txVectors) {
+			if (sender.get_relay_transaction(v).use_count())
+				receiver.recv_tx(v);
+			tester.get_relay_transaction(v);
+			if (abort_sender.get_relay_transaction(v).use_count())
+				abort_receiver.recv_tx(v);
+		}
+
+		std::vector<unsigned char> streamed;
+		RelayNodeCompressor::BlockEncoder encoder(sender);
+		if (encoder.begin(fullhash, &data[sizeof(struct bitcoin_msg_header)], parsed.txn.size(), streamed)) {
+			printf("Failed to begin streaming block\n");
+			exit(27);
+		}
+		for (const auto& tx : parsed.txn)
+			encoder.add_tx(data, tx.first, tx.second, streamed);
+		encoder.done();
+
+		auto compressed = tester.maybe_compress_block(fullhash, data, parsed);
+		auto res = recv_stream(streamed, receiver);
+		if (std::get<1>(compressed) || streamed != *std::get<0>(compressed) || std::get<2>(res) || *std::get<1>(res) != data) {
+			printf("Streamed %s block did not match maybe_compress_block or didn't decode: %s\n", compact ? "compact" : "legacy", std::get<2>(res));
+			exit(27);
+		}
+
+		std::vector<unsigned char> aborted;
+		RelayNodeCompressor::BlockEncoder abort_encoder(abort_sender);
+		if (abort_encoder.begin(fullhash, &data[sizeof(struct bitcoin_msg_header)], parsed.txn.size(), aborted)) {
+			printf("Failed to begin streaming block\n");
+			exit(27);
+		}
+		for (size_t i = 0; i < parsed.txn.size() / 2; i++)
+			abort_encoder.add_tx(data, parsed.txn[i].first, parsed.txn[i].second, aborted);
+		abort_encoder.abort(aborted);
+
+		res = recv_stream(aborted, abort_receiver);
+		std::vector<unsigned char> summary;
+		abort_receiver.get_resync_summary(summary);
+		if (std::get<2>(res) != BLOCK_ABORTED || summary != sent_summary(abort_sender)) {
+			printf("Aborted %s block gave %s, caches %s\n", compact ? "compact" : "legacy",
+					std::get<2>(res) ? std::get<2>(res) : "a block", summary == sent_summary(abort_sender) ? "agreed" : "differed");
+			exit(27);
+		}
+
+		compressed = abort_sender.maybe_compress_block(fullhash, data, parsed);
+		if (std::get<1>(compressed) || std::get<2>(res = recv_stream(*std::get<0>(compressed), abort_receiver)) || *std::get<1>(res) != data) {
+			printf("Block could not be sent again after it was aborted: %s\n", std::get<1>(compressed) ? std::get<1>(compressed) : std::get<2>(res));
+			exit(27);
+		}
+	}
+}
+
+// Brings stale_receiver up to date as a reconnecting client would, it should match global_receiver
+void test_resync() {
+	std::vector<unsigned char> summary, reply;
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > missing;
+	stale_receiver.get_resync_summary(summary);
+	uint64_t position = global_sender.resync_sent_txn(summary, reply, missing);
+	// Which the next tx or block is after, so that a client's fanout skips only what it was resynced with
+	auto next_tx = std::make_shared<std::vector<unsigned char> >(120, 0xfe);
+	memcpy(&(*next_tx)[0], &position, sizeof(position));
+	uint64_t next_position = 0;
+	if (position != global_sender.for_each_sent_tx([](const std::shared_ptr<std::vector<unsigned char> >&) {}) ||
+			!global_sender.get_relay_transaction(next_tx, NULL, &next_position).use_count() || next_position != position + 1) {
+		printf("Resync position %lu not before the next tx's (%lu)\n", (unsigned long)position, (unsigned long)next_position);
+		exit(22);
+	}
+	global_receiver.recv_tx(next_tx);
+	const char* err = stale_receiver.apply_resync(reply, summary.size() / 8);
+	if (err) {
+		printf("Failed to resync: %s\n", err);
+		exit(11);
+	}
+	for (const auto& tx : missing)
+		stale_receiver.recv_tx(tx);
+	stale_receiver.recv_tx(next_tx);
+
+	std::vector<unsigned char> resynced, expected;
+	stale_receiver.get_resync_summary(resynced);
+	global_receiver.get_resync_summary(expected);
+	if (resynced != expected) {
+		printf("Resynced cache did not match\n");
+		exit(12);
+	}
+	PRINT_TIME("Resync kept %lu of %lu txn and sent %lu\n", (unsigned long)(expected.size() / 8 - missing.size()), (unsigned long)(summary.size() / 8), (unsigned long)missing.size());
+}
+
+// Restoring global_sender and global_receiver from a snapshot should give back the same caches
+void test_snapshot() {
+	const char* path = "relaynetworktest.snapshot";
+	RelayNodeCompressor sender(false), receiver(false);
+	const char* err = save_snapshot(path, {&global_sender, &global_receiver});
+	if (!err)
+		err = load_snapshot(path, {&sender, &receiver});
+	remove(path);
+	if (err) {
+		printf("Failed to round-trip snapshot: %s\n", err);
+		exit(15);
+	}
+
+	std::vector<unsigned char> summary, expected, reply, expected_reply;
+	std::vector<std::shared_ptr<std::vector<unsigned char> > > missing, expected_missing;
+	receiver.get_resync_summary(summary);
+	global_receiver.get_resync_summary(expected);
+	sender.resync_sent_txn(summary, reply, missing);
+	global_sender.resync_sent_txn(summary, expected_reply, expected_missing);
+	if (summary != expected || reply != expected_reply || !missing.empty() || !expected_missing.empty() ||
+			sender.blocks_sent() != global_sender.blocks_sent()) {
+		printf("Snapshot did not restore the same caches\n");
+		exit(16);
+	}
+}
+
+// Bucket boundaries have to line up, and the merkle checks we did have to show up in the export
+void test_stats() {
+	for (uint64_t micros = 0; micros < (1ULL << 36); micros = micros * 9 / 8 + 1) {
+		uint64_t bucket = StatHistogram::bucket_of(micros);
+		if (bucket < StatHistogram::BUCKETS - 1 && (micros >= StatHistogram::bucket_limit(bucket) ||
+				(bucket && micros < StatHistogram::bucket_limit(bucket - 1)))) {
+			printf("%lu us put in bucket %lu\n", (unsigned long)micros, (unsigned long)bucket);
+			exit(13);
+		}
+	}
+
+	std::string stats = format_stats();
+	const char* count = strstr(stats.c_str(), "relay_block_merkle_seconds_count{path=\"decompress\"} ");
+	if (!count || strtoul(count + strlen("relay_block_merkle_seconds_count{path=\"decompress\"} "), NULL, 10) < decompress_runs) {
+		printf("Stats didn't count our merkle checks:\n%s", stats.c_str());
+		exit(14);
+	}
+}
+
+// A real header meets its own target, but (barring a 1/256 chance) not one 256 times harder
+void test_header_pow(const std::vector<unsigned char>& data) {
+	std::vector<unsigned char> hash(32);
+	getblockhash(hash, data, sizeof(struct bitcoin_msg_header));
+	std::vector<unsigned char> header(data.begin() + sizeof(struct bitcoin_msg_header), data.begin() + sizeof(struct bitcoin_msg_header) + 80);
+	bool meets = check_header_pow(&header[0], &hash[0]);
+	header[75]--;
+	if (!meets || check_header_pow(&header[0], &hash[0])) {
+		printf("check_header_pow got a header's PoW wrong\n");
+		exit(17);
+	}
+}
+
+// Every lane width this CPU has must agree with plain double_sha256, on messages of lengths either
+// side of block boundaries (so each lane ends up mid-message when others finish) and on in-place
+// 64-byte batches, as the merkle tree does them
+void test_sha256_lanes() {
+	std::uniform_int_distribution<size_t> lengths(0, 5000);
+	std::vector<std::vector<unsigned char> > msgs;
+	for (size_t len : {0, 1, 55, 56, 63, 64, 65, 119, 120, 127, 128})
+		msgs.emplace_back(len);
+	for (int i = 0; i < 60; i++)
+		msgs.emplace_back(lengths(engine));
+	std::vector<unsigned char> pairs(64 * 37);
+	for (auto& msg : msgs)
+		for (unsigned char& c : msg)
+			c = engine();
+	for (unsigned char& c : pairs)
+		c = engine();
+
+	std::vector<unsigned char> expected(32 * msgs.size()), expected_pairs(32 * 37);
+	for (size_t i = 0; i < msgs.size(); i++)
+		double_sha256(msgs[i].data(), &expected[i * 32], msgs[i].size());
+	for (size_t i = 0; i < 37; i++)
+		double_sha256(&pairs[i * 64], &expected_pairs[i * 32], 64);
+
+	const size_t default_lanes = sha256_lanes();
+	for (size_t max_lanes = 1; max_lanes <= SHA256_MAX_LANES; max_lanes *= 2) {
+		size_t lanes = sha256_set_max_lanes(max_lanes);
+		if (lanes != max_lanes)
+			continue;
+
+		std::vector<const unsigned char*> inputs;
+		std::vector<uint64_t> sizes;
+		std::vector<unsigned char> results(32 * msgs.size());
+		std::vector<unsigned char*> result_ptrs;
+		for (size_t i = 0; i < msgs.size(); i++) {
+			inputs.push_back(msgs[i].data());
+			sizes.push_back(msgs[i].size());
+			result_ptrs.push_back(&results[i * 32]);
+		}
+		double_sha256_batch(&inputs[0], &sizes[0], &result_ptrs[0], msgs.size());
+
+		std::vector<unsigned char> in_place(pairs);
+		double_sha256_64byte_batch(&in_place[0], &in_place[0], 37);
+		in_place.resize(32 * 37);
+
+		if (results != expected || in_place != expected_pairs) {
+			printf("SHA-256 with %lu lanes didn't match double_sha256\n", (unsigned long)lanes);
+			exit(18);
+		}
+	}
+	sha256_set_max_lanes(default_lanes);
+}
+
+static bool send_relay_msg(int sock, uint32_t type, const std::string& data) {
+	struct relay_msg_header header = { RELAY_MAGIC_BYTES, htonl(type), htonl(data.size()) };
+	return send_all(sock, (char*)&header, sizeof(header)) == sizeof(header) &&
+			send_all(sock, data.data(), data.size()) == ssize_t(data.size());
+}
+
+// Reads (and skips) messages until a PONG
+static bool read_until_pong(int sock) {
+	while (true) {
+		struct relay_msg_header header;
+		if (read_all(sock, (char*)&header, sizeof(header)) != sizeof(header) || header.magic != RELAY_MAGIC_BYTES)
+			return false;
+		std::vector<char> data(ntohl(header.length));
+		if (!data.empty() && read_all(sock, &data[0], data.size()) != ssize_t(data.size()))
+			return false;
+		if (ntohl(header.type) == 8)
+			return true;
+	}
+}
+
+// A relaynetworkserver built alongside us has to survive messages as large as it accepts from relay
+// peers, which are read on its fibers' small stacks: an unknown VERSION and (once connected) a
+// SPONSOR of most of a megabyte each, after which it must still answer a ping
+void test_server_large_messages() {
+	const char* server = "./relaynetworkserver";
+	if (access(server, X_OK)) {
+		printf("No %s, skipping its large message test\n", server);
+		return;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	pid_t pid = fork();
+	if (!pid) {
+		int fd = open("/dev/null", O_WRONLY);
+		dup2(fd, 1);
+		dup2(fd, 2);
+		// Nothing listens on port 2, so its bitcoind connections just keep failing, and we're
+		// whitelisted so that we can reconnect straight away
+		execl(server, server, "127.0.0.1", "2", "2", "relaynetworktest", "::ffff:127.0.0.1", (char*)NULL);
+		_exit(1);
+	}
+
+	const auto connect_to_server = [&]() {
+		for (int i = 0; i < 100; i++) {
+			std::string error;
+			int sock = create_connect_socket("127.0.0.1", 8336, error);
+			if (sock > 0) {
+				struct timeval timeout = { 10, 0 };
+				setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+				return sock;
+			}
+			usleep(50000);
+		}
+		return -1;
+	};
+
+	const char* failure = NULL;
+	for (size_t size : {300000, 900000}) {
+		int sock = connect_to_server();
+		if (sock < 0) {
+			failure = "couldn't connect (is something else on port 8336?)";
+			break;
+		}
+		// Disconnected for it, but only once it has been read
+		send_relay_msg(sock, 0, std::string(size, 'a'));
+		char byte;
+		while (read_all(sock, &byte, 1) == 1) {}
+		close(sock);
+
+		sock = connect_to_server();
+		if (sock < 0 || !send_relay_msg(sock, 0, VERSION_STRING) || !send_relay_msg(sock, 6, std::string(size, 'a')) ||
+				!send_relay_msg(sock, 7, std::string(8, 'p')) || !read_until_pong(sock))
+			failure = "didn't answer a ping after a large SPONSOR";
+		if (sock >= 0)
+			close(sock);
+		if (failure)
+			break;
+	}
+
+	int status;
+	if (waitpid(pid, &status, WNOHANG) == pid)
+		failure = "died";
+	else {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+	}
+	if (failure) {
+		printf("relaynetworkserver %s after large messages from a relay peer\n", failure);
+		exit(19);
+	}
+}
+
+// Held by one thread and released by another (as fibers do when they resume on another worker),
+// the mutex still has to go to its waiters one at a time
+void test_fiber_mutex() {
+	FiberMutex mutex;
+	mutex.lock();
+	if (mutex.try_lock()) {
+		printf("FiberMutex try_lock succeeded while locked\n");
+		exit(20);
+	}
+
+	uint64_t count = 0;
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 4; i++)
+		threads.emplace_back([&]() {
+			for (int j = 0; j < 10000; j++) {
+				std::lock_guard<FiberMutex> lock(mutex);
+				count++;
+			}
+		});
+	std::thread([&]() { mutex.unlock(); }).join();
+	for (std::thread& t : threads)
+		t.join();
+
+	if (count != 40000 || !mutex.try_lock()) {
+		printf("FiberMutex let %lu of 40000 increments through\n", (unsigned long)count);
+		exit(20);
+	}
+	mutex.unlock();
+}
+
+class OrderTestConnection : public Connection {
+public:
+	OrderTestConnection(int sock, std::function<void(void)> on_disconnect) : Connection(sock, "order test", on_disconnect) { construction_done(); }
+	void send(char c, OutboundClass cls, int flags, uint64_t seq) { do_send_bytes(&c, 1, 0, cls, flags, seq); }
+	void send(const std::vector<char>& bytes) { do_send_bytes(std::make_shared<std::vector<unsigned char> >(bytes.begin(), bytes.end())); }
+	void backlog(uint64_t seq, size_t& bytes, size_t& rate_limited_bytes) { ordered_backlog(seq, bytes, rate_limited_bytes); }
+private:
+	void net_process(const std::function<void(std::string)>& disconnect) {
+		char c;
+		while (read_all(&c, 1) == 1) {}
+		disconnect("order test done");
+	}
+};
+
+// With the peer not reading (behind a message which fills the socket buffers), a block has to wait
+// only for the txn it depends on, and nothing may overtake a higher class
+void test_outbound_order() {
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addrlen = sizeof(addr);
+	int reader = socket(AF_INET, SOCK_STREAM, 0), writer = -1, bufsize = 65536;
+	setsockopt(reader, SOL_SOCKET, SO_RCVBUF, (char*)&bufsize, sizeof(bufsize));
+	if (!bind(listener, (struct sockaddr*)&addr, sizeof(addr)) && !listen(listener, 1) &&
+			!getsockname(listener, (struct sockaddr*)&addr, &addrlen) &&
+			!connect(reader, (struct sockaddr*)&addr, sizeof(addr)))
+		writer = accept(listener, NULL, NULL);
+	close(listener);
+	if (writer < 0) {
+		printf("Couldn't connect to ourselves for the outbound order test\n");
+		exit(21);
+	}
+	setsockopt(writer, SOL_SOCKET, SO_SNDBUF, (char*)&bufsize, sizeof(bufsize));
+	struct timeval timeout = { 10, 0 };
+	setsockopt(reader, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+
+	std::atomic_bool disconnected(false);
+	OrderTestConnection* conn = new OrderTestConnection(writer, [&]() { disconnected = true; });
+	const size_t filler_size = 4000000;
+	std::vector<char> filler(filler_size, 'f');
+	conn->send(filler);
+	conn->send('A', OUTBOUND_TX, OUTBOUND_ORDERED, 1);
+	conn->send('B', OUTBOUND_TX, OUTBOUND_ORDERED, 2);
+	conn->send('C', OUTBOUND_TX, OUTBOUND_ORDERED, 3);
+	conn->send('X', OUTBOUND_BLOCK, OUTBOUND_ORDERED, 2);
+	conn->send('P', OUTBOUND_PING, 0, 0);
+
+	std::vector<char> read(filler_size + 5);
+	bool complete = read_all(reader, &read[0], read.size()) == ssize_t(read.size());
+	std::string order(read.end() - 5, read.end());
+
+	// Once the header of a message has been written, nothing (here an R queued before it) may be
+	// written until the rest of it is queued and written
+	std::string split_order;
+	if (complete) {
+		conn->send(filler);
+		conn->send('R', OUTBOUND_REPLAY, 0, 0);
+		conn->send('H', OUTBOUND_TX, OUTBOUND_MORE, 0);
+		complete = read_all(reader, &read[0], filler_size + 1) == ssize_t(filler_size + 1);
+		usleep(100000);
+		conn->send('b', OUTBOUND_TX, 0, 0);
+		if (complete)
+			complete = read_all(reader, &read[filler_size + 1], 2) == 2;
+		split_order = std::string(read.begin() + filler_size, read.begin() + filler_size + 3);
+	}
+
+	// An uncached block goes ahead of an ordered block waiting on the (rate-limited) replay, which
+	// is all the ordered block's backlog
+	std::string uncached_order;
+	size_t backlog = 0, replay_backlog = 0;
+	if (complete) {
+		conn->send(filler);
+		conn->send('T', OUTBOUND_REPLAY, OUTBOUND_ORDERED, 0);
+		conn->send('Y', OUTBOUND_BLOCK, OUTBOUND_ORDERED, 5);
+		conn->backlog(5, backlog, replay_backlog);
+		conn->send('U', OUTBOUND_UNCACHED_BLOCK, 0, 0);
+		complete = read_all(reader, &read[0], filler_size + 3) == ssize_t(filler_size + 3);
+		uncached_order = std::string(read.begin() + filler_size, read.begin() + filler_size + 3);
+	}
+
+	close(reader);
+	while (!disconnected)
+		usleep(1000);
+	delete conn;
+
+	if (!complete || !std::equal(filler.begin(), filler.end(), read.begin()) || order != "PABXC" || split_order != "HbR" || uncached_order != "UTY") {
+		printf("Outbound messages were written out of order (%s, not PABXC, then %s, not HbR, then %s, not UTY)\n", complete ? order.c_str() : "incomplete", split_order.c_str(), uncached_order.c_str());
+		exit(21);
+	}
+	if (backlog != 1 || replay_backlog != 1) {
+		printf("Ordered backlog was %lu bytes (%lu rate-limited), not 1 (1)\n", (unsigned long)backlog, (unsigned long)replay_backlog);
+		exit(21);
+	}
+}
+
+// Hashes in getrawmempool responses are hex in reversed byte order, this is 0..0id's
+static std::string mempool_hash(char id) {
+	char hex[3];
+	sprintf(hex, "%02x", id);
+	return "\"" + std::string(62, '0') + hex + "\"";
+}
+
+static std::string mempool_tx(char id, const std::string& fields) {
+	return mempool_hash(id) + ":{" + fields + "}";
+}
+
+// Feeds response through RPCMempool::read_response a few bytes at a time, and returns the first
+// byte of each selected hash, or the error
+static std::string mempool_select(RPCMempool& mempool, const std::string& txn) {
+	std::string response = "{\"result\":{" + txn + "},\"error\":null,\"id\":1}";
+	size_t readpos = 0;
+	std::function<ssize_t(char*, size_t)> read = [&](char* buf, size_t max) -> ssize_t {
+		size_t len = std::min(max, size_t(engine() % 7 + 1));
+		memcpy(buf, &response[readpos], len);
+		readpos += len;
+		return len;
+	};
+	const char* err = mempool.read_response(read, response.size());
+	if (err)
+		return err;
+
+	std::vector<std::pair<std::vector<unsigned char>, size_t> > selected;
+	mempool.select(selected, 1);
+	std::string ids;
+	for (const auto& tx : selected)
+		ids += char('A' + tx.first[0] - 10);
+	return ids;
+}
+
+// Fees have to be parsed exactly (G pays one satoshi more than F, which has higher priority), txn
+// wait for their deps (B on A) until those are gone from the mempool or after a reorg puts them
+// back, and fields we don't know (however nested, escaped or long their names) are skipped
+void test_rpc_mempool() {
+	RPCMempool mempool;
+	const std::string A = mempool_tx(10, "\"size\":250,\"fee\":0.00010000,\"time\":1449000000,\"height\":1,\"startingpriority\":0,\"currentpriority\":5.5,\"depends\":[]");
+	const std::string B = mempool_tx(11, "\"size\":500,\"fee\":0.0005,\"currentpriority\":1,\"depends\":[" + mempool_hash(10) + "]");
+	const std::string C = mempool_tx(12, "\"size\":200,\"fee\":1e-4,\"odd\":{\"a\":[1,{\"b\":\"x\\\"}]\"}],\"c\":\"\"},\"currentpriority\":0.5,\"depends\":[]");
+	const std::string D = mempool_tx(13, "\"fee_with_a_name_longer_than_our_key_buffer\":\"5\",\"size\":100,\"fee\":0.00000001,\"currentpriority\":0,\"depends\":[]");
+	const std::string F = mempool_tx(15, "\"size\":1000,\"fee\":0.28999999,\"currentpriority\":1000,\"depends\":[]");
+	const std::string G = mempool_tx(16, "\"size\":1000,\"fee\":0.29,\"currentpriority\":1,\"depends\":[]");
+	const std::string E = mempool_tx(14, "\"size\":100,\"fee\":0.000001,\"currentpriority\":0,\"depends\":[" + mempool_hash(13) + "]");
+	const std::string H = mempool_tx(17, "\"size\":100,\"fee\":0.001,\"currentpriority\":0,\"depends\":[" + mempool_hash(32) + "]");
+	const std::string B_mined_A = mempool_tx(11, "\"size\":500,\"fee\":0.0005,\"currentpriority\":2,\"depends\":[]");
+
+	std::string first = mempool_select(mempool, B + "," + A + ",\n " + C + "," + D + "," + F + "," + G);
+	std::string second = mempool_select(mempool, B_mined_A + "," + C + "," + E + "," + D);
+	std::string reorg = mempool_select(mempool, C + "," + B + "," + A);
+	std::string missing = mempool_select(mempool, C + "," + H);
+	size_t size_after_missing = mempool.size();
+	std::string again = mempool_select(mempool, A + "," + B + "," + C + "," + D + "," + F + "," + G);
+
+	if (first != "GFCABD" || second != "BCDE" || reorg != "CAB" || missing != "Tx depended on another one which did not exist" || size_after_missing || again != "GFCABD") {
+		printf("RPCMempool selected %s, %s, %s, %s (%lu left), %s, not GFCABD, BCDE, CAB, a missing dep, GFCABD\n",
+				first.c_str(), second.c_str(), reorg.c_str(), missing.c_str(), (unsigned long)size_after_missing, again.c_str());
+		exit(24);
+	}
+}
+
+// The id'th test hash. Keys (the first 8 bytes, which the hash tables probe from) start at one of
+// only positions table positions, 33 apart, so probe runs are long and wrap around the end of the
+// table. With shared_prefixes pairs of hashes share a key.
+static std::vector<unsigned char> test_hash(uint32_t id, uint32_t positions, bool shared_prefixes) {
+	std::vector<unsigned char> hash(32, 0);
+	uint32_t prefix = shared_prefixes ? id / 2 : id;
+	uint64_t key = (uint64_t(prefix) << 32) | ((prefix % positions) * 33);
+	memcpy(&hash[0], &key, sizeof(key));
+	hash[31] = id;
+	return hash;
+}
+
+// What hash_mruset should hold: a ring of the last max_size inserts, of which the ones not erase()d
+// (or inserted again since) are live
+class MruModel {
+private:
+	std::vector<std::vector<unsigned char> > ring;
+	size_t next, max_size;
+	std::map<std::vector<unsigned char>, size_t> live; // -> position in ring
+
+public:
+	MruModel(size_t max_size_in) : next(0), max_size(max_size_in) {}
+
+	size_t size() const { return live.size(); }
+	size_t count(const std::vector<unsigned char>& hash) const { return live.count(hash); }
+	void clear() { ring.clear(); next = 0; live.clear(); }
+	size_t erase(const std::vector<unsigned char>& hash) { return live.erase(hash); }
+
+	const std::vector<unsigned char>* next_evicted() const {
+		if (ring.size() < max_size)
+			return NULL;
+		auto it = live.find(ring[next]);
+		return it != live.end() && it->second == next ? &ring[next] : NULL;
+	}
+
+	bool insert(const std::vector<unsigned char>& hash) {
+		if (live.count(hash))
+			return false;
+		size_t pos;
+		if (ring.size() < max_size) {
+			pos = ring.size();
+			ring.push_back(hash);
+		} else {
+			if (next_evicted())
+				live.erase(ring[next]);
+			pos = next;
+			next = (next + 1) % max_size;
+			ring[pos] = hash;
+		}
+		live[hash] = pos;
+		return true;
+	}
+
+	// Live hashes, oldest first
+	std::vector<std::vector<unsigned char> > ordered() const {
+		std::vector<std::vector<unsigned char> > res;
+		size_t start = ring.size() < max_size ? 0 : next;
+		for (size_t i = 0; i < ring.size(); i++) {
+			size_t pos = (start + i) % ring.size();
+			auto it = live.find(ring[pos]);
+			if (it != live.end() && it->second == pos)
+				res.push_back(ring[pos]);
+		}
+		return res;
+	}
+};
+
+// hash_mruset and concurrentmruset against MruModel under random insert/erase/clear (and the
+// eviction of erase()d and re-inserted hashes), then hash_mruset against the old mruset (which it
+// matches as long as nothing is erased)
+void test_hash_mruset() {
+	for (size_t max_size : {50, 700}) {
+		const uint32_t pool = max_size * 3;
+		hash_mruset<32> set(max_size);
+		concurrentmruset concurrent(max_size);
+		MruModel model(max_size), concurrent_model(max_size);
+
+		auto check = [&](bool ok, const char* what, size_t op) {
+			if (!ok) {
+				printf("hash_mruset(%lu) %s differed from the model after %lu ops\n", (unsigned long)max_size, what, (unsigned long)op);
+				exit(25);
+			}
+		};
+
+		for (size_t op = 0; op < 20000; op++) {
+			uint32_t id = engine() % pool, action = engine() % 1000;
+			std::vector<unsigned char> hash = test_hash(id, 61, true), concurrent_hash = test_hash(id, 61, false);
+			if (action < 650) {
+				check(set.insert(hash) == model.insert(hash), "insert", op);
+				check(concurrent.insert(concurrent_hash) == concurrent_model.insert(concurrent_hash), "concurrent insert", op);
+			} else if (action < 999) {
+				check(set.erase(hash) == model.erase(hash), "erase", op);
+				check(concurrent.erase(concurrent_hash) == concurrent_model.erase(concurrent_hash), "concurrent erase", op);
+			} else {
+				set.clear(); model.clear();
+				concurrent.clear(); concurrent_model.clear();
+			}
+
+			const unsigned char* evicted = set.next_evicted();
+			const std::vector<unsigned char>* model_evicted = model.next_evicted();
+			check(set.size() == model.size() && concurrent.size() == concurrent_model.size() &&
+					concurrent.concurrent_size() == concurrent_model.size(), "size", op);
+			check(!evicted == !model_evicted && (!evicted || !memcmp(evicted, &(*model_evicted)[0], 32)), "next_evicted", op);
+
+			if (op % 64 == 0) {
+				for (uint32_t i = 0; i < pool; i++) {
+					std::vector<unsigned char> h = test_hash(i, 61, true), concurrent_h = test_hash(i, 61, false);
+					check(set.count(h) == model.count(h), "count", op);
+					check(concurrent.count(concurrent_h) == concurrent_model.count(concurrent_h) &&
+							concurrent.contains_concurrent(concurrent_h) == !!concurrent_model.count(concurrent_h), "concurrent count", op);
+				}
+				std::vector<std::vector<unsigned char> > ordered;
+				set.for_each([&](const unsigned char* h) { ordered.emplace_back(h, h + 32); });
+				check(ordered == model.ordered(), "for_each", op);
+			}
+		}
+
+		hash_mruset<32> hashes(max_size);
+		mruset<std::vector<unsigned char> > old(max_size);
+		for (size_t op = 0; op < 5000; op++) {
+			std::vector<unsigned char> hash = test_hash(engine() % pool, 61, true);
+			check(hashes.insert(hash) == old.insert(hash).second && hashes.size() == old.size(), "insert vs mruset", op);
+			if (op % 64 == 0) {
+				std::set<std::vector<unsigned char> > contents;
+				hashes.for_each([&](const unsigned char* h) { contents.emplace(h, h + 32); });
+				check(old == contents, "contents vs mruset", op);
+			}
+		}
+	}
+}
+
+// SeqlockHashSet against a std::multiset while it grows, is rebuilt in place (once removed entries
+// fill it) and shrinks, then contains() from another thread while grow() moves everything around
+void test_seqlock_hash_set() {
+	SeqlockHashSet set;
+	std::multiset<std::vector<unsigned char> > model;
+	std::vector<uint32_t> ids; // In set, with repeats
+
+	auto check = [&](bool ok, const char* what, size_t op) {
+		if (!ok) {
+			printf("SeqlockHashSet %s differed from std::multiset after %lu ops\n", what, (unsigned long)op);
+			exit(26);
+		}
+	};
+
+	size_t op = 0;
+	for (uint32_t insert_permille : {700, 500, 300}) {
+		for (size_t i = 0; i < 30000; i++, op++) {
+			uint32_t action = engine() % 1000, id = engine() % (1 << 20);
+			if (action < insert_permille) {
+				// Mostly new hashes, sometimes another copy of one we have
+				if (!ids.empty() && action % 10 == 0)
+					id = ids[engine() % ids.size()];
+				std::vector<unsigned char> hash = test_hash(id, 1 << 20, false);
+				set.insert(&hash[0]);
+				model.insert(hash);
+				ids.push_back(id);
+			} else if (action < 999) {
+				// Mostly hashes we have, sometimes one we (probably) don't
+				size_t index = engine() % (ids.size() + 1);
+				if (index < ids.size()) {
+					id = ids[index];
+					ids[index] = ids.back();
+					ids.pop_back();
+				}
+				std::vector<unsigned char> hash = test_hash(id, 1 << 20, false);
+				auto it = model.find(hash);
+				check(set.erase(&hash[0]) == (it != model.end()), "erase", op);
+				if (it != model.end())
+					model.erase(it);
+			} else {
+				SeqlockHashSet copy;
+				copy = set;
+				set.clear();
+				check(!set.size(), "clear", op);
+				set = copy;
+			}
+			check(set.size() == model.size(), "size", op);
+
+			if (op % 256 == 0) {
+				for (uint32_t id : ids) {
+					std::vector<unsigned char> hash = test_hash(id, 1 << 20, false);
+					check(set.contains(&hash[0]), "contains", op);
+				}
+				for (uint32_t j = 0; j < 1000; j++) {
+					std::vector<unsigned char> hash = test_hash(engine() % (1 << 20), 1 << 20, false);
+					check(set.contains(&hash[0]) == !!model.count(hash), "contains", op);
+				}
+			}
+		}
+	}
+
+	SeqlockHashSet concurrent;
+	const uint32_t stable = 500;
+	for (uint32_t i = 0; i < stable; i++)
+		concurrent.insert(&test_hash(i, 1 << 20, false)[0]);
+
+	std::atomic<bool> done(false);
+	std::atomic<uint64_t> wrong(0);
+	std::thread reader([&]() {
+		std::linear_congruential_engine<std::uint_fast32_t, 48271, 0, 2147483647> reader_engine(42);
+		while (!done.load()) {
+			std::vector<unsigned char> present = test_hash(reader_engine() % stable, 1 << 20, false);
+			std::vector<unsigned char> absent = test_hash((1 << 20) + reader_engine() % 1000, 1 << 20, false);
+			if (!concurrent.contains(&present[0]) || concurrent.contains(&absent[0]))
+				wrong++;
+		}
+	});
+
+	// A window of 2000 hashes sliding over 400000 leaves removed entries behind, which forces
+	// in-place rebuilds, then 100000 more grow the table a few times
+	const uint32_t window = 2000, churn = 400000, grown = 500000;
+	for (uint32_t i = 0; i < grown; i++) {
+		concurrent.insert(&test_hash(stable + i, 1 << 20, false)[0]);
+		if (i >= window && i - window < churn)
+			concurrent.erase(&test_hash(stable + i - window, 1 << 20, false)[0]);
+	}
+	for (uint32_t i = churn; i < grown; i++)
+		concurrent.erase(&test_hash(stable + i, 1 << 20, false)[0]);
+	done = true;
+	reader.join();
+
+	if (wrong || concurrent.size() != stable) {
+		printf("SeqlockHashSet gave %lu wrong concurrent answers, ended with %lu of %u hashes\n",
+				(unsigned long)wrong.load(), (unsigned long)concurrent.size(), stable);
+		exit(26);
+	}
+}
+
 void run_test(std::vector<unsigned char>& data) {
+	test_header_pow(data);
+
 	std::vector<std::shared_ptr<std::vector<unsigned char> > > txVectors;
 	test_compress_block(data, txVectors);
 
@@ -197,6 +1007,7 @@ void run_test(std::vector<unsigned char>& data) {
 	txVectors.clear();
 	fill_txv(data, txVectors, 0.5);
 	test_compress_block(data, txVectors);
+	test_stream_block(data, txVectors);
 
 	txVectors.clear();
 	fill_txv(data, txVectors, 0.9);
@@ -204,12 +1015,15 @@ void run_test(std::vector<unsigned char>& data) {
 }
 
 int main() {
+	test_sha256_lanes(); // Before anything else relies on it
+
 	std::vector<unsigned char> data(sizeof(struct bitcoin_msg_header));
 	std::vector<unsigned char> lastBlock;
 
 	std::vector<std::shared_ptr<std::vector<unsigned char> > > allTxn;
 
 	FILE* f = fopen("block.txt", "r");
+	unsigned blocks = 0;
 	while (true) {
 		char hex[2];
 		if (fread(hex, 1, 1, f) != 1)
@@ -222,6 +1036,13 @@ int main() {
 					run_test(data);
 				fill_txv(data, allTxn, 0.9);
 				lastBlock = data;
+				if (++blocks % 2 == 1) {
+					if (blocks > 1)
+						test_resync();
+					stale_receiver = global_receiver;
+					// Which the sender never had, so resync has to drop it
+					stale_receiver.recv_tx(std::make_shared<std::vector<unsigned char> >(100, blocks));
+				}
 			}
 			data = std::vector<unsigned char>(sizeof(struct bitcoin_msg_header));
 		} else if (fread(hex + 1, 1, 1, f) != 1)
@@ -240,6 +1061,15 @@ int main() {
 #endif
 		test_compress_block(lastBlock, allTxn);
 
+	test_snapshot();
+	test_stats();
+	test_server_large_messages();
+	test_fiber_mutex();
+	test_outbound_order();
+	test_rpc_mempool();
+	test_hash_mruset();
+	test_seqlock_hash_set();
+
 	printf("Total time spent compressing %u blocks: %lf ms (avg %lf, min %lf, max %lf)\n", compress_runs, to_millis_double(total_compress_time), to_millis_double(total_compress_time / compress_runs), to_millis_double(min_compress_time), to_millis_double(max_compress_time));
 	printf("Total time spent decompressing %u blocks: %lf ms (avg %lf, min %lf, max %lf)\n", decompress_runs, to_millis_double(total_decompress_time), to_millis_double(total_decompress_time / decompress_runs), to_millis_double(min_decompress_time), to_millis_double(max_decompress_time));
 	return 0;
@@ -1,9 +1,11 @@
 #include "utils.h"
 #include "crypto/sha2.h"
+#include "crypto/sha256_lanes.h"
 
 #include <vector>
 #include <string.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <stdio.h>
 
 #ifdef WIN32
@@ -113,14 +115,14 @@ ssize_t send_all(int filedes, const char *buf, size_t nbyte) {
 		return total;
 }
 
-std::string gethostname(struct sockaddr_in6 *addr) {
+std::string gethostname(struct sockaddr_in6 *addr, bool reverse_lookup) {
 	char hbuf[NI_MAXHOST];
 	if (getnameinfo((struct sockaddr*) addr, sizeof(*addr), hbuf, sizeof(hbuf), NULL, 0, NI_NUMERICHOST))
 		return "Unknown host";
 
 	std::string res(hbuf);
 	res += "/";
-	if (getnameinfo((struct sockaddr*) addr, sizeof(*addr), hbuf, sizeof(hbuf), NULL, 0, NI_NAMEREQD))
+	if (!reverse_lookup || getnameinfo((struct sockaddr*) addr, sizeof(*addr), hbuf, sizeof(hbuf), NULL, 0, NI_NAMEREQD))
 		return res;
 	else
 		return res + std::string(hbuf);
@@ -259,8 +261,71 @@ int create_connect_socket(const std::string& serverHost, const uint16_t serverPo
 /********************
  *** Random stuff ***
  ********************/
-#ifdef SHA256
-extern "C" void SHA256(void *, uint32_t[8], uint64_t);
+#ifdef SHA256_ASM
+// All of the asm implementations are linked in, and the best one for the CPU we're on is picked
+// the first time we hash something
+extern "C" void sha256_sse4(void *, uint32_t[8], uint64_t);
+extern "C" void sha256_avx(void *, uint32_t[8], uint64_t);
+extern "C" void sha256_rorx(void *, uint32_t[8], uint64_t);
+extern "C" void sha256_rorx_x8ms(void *, uint32_t[8], uint64_t);
+
+static void sha256_rorx_any(void *input, uint32_t state[8], uint64_t blocks) {
+	// x8ms schedules 8 blocks at once, which only pays off for longer inputs
+	if (blocks >= 8)
+		sha256_rorx_x8ms(input, state, blocks);
+	else
+		sha256_rorx(input, state, blocks);
+}
+
+static void sha256_generic(void *input, uint32_t state[8], uint64_t blocks) {
+	CSHA256 hash;
+	for (uint8_t i = 0; i < 8; i++)
+		hash.s[i] = state[i];
+	hash.Write((const unsigned char*)input, blocks * 64);
+	for (uint8_t i = 0; i < 8; i++)
+		state[i] = hash.s[i];
+}
+
+typedef void (*sha256_fn)(void *, uint32_t[8], uint64_t);
+struct sha256_impl_entry {
+	const char* name;
+	sha256_fn fn;
+	bool supported;
+};
+
+static const sha256_impl_entry& select_sha256() {
+	__builtin_cpu_init();
+	// Best first
+	static const sha256_impl_entry impls[] = {
+		{"rorx", sha256_rorx_any, __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")},
+		{"avx", sha256_avx, __builtin_cpu_supports("avx") != 0},
+		{"sse4", sha256_sse4, __builtin_cpu_supports("sse4.1") != 0},
+		{"generic", sha256_generic, true},
+	};
+	// RELAY_SHA256_IMPL can force a (slower) one, eg to compare them
+	const char* forced = getenv("RELAY_SHA256_IMPL");
+	for (const sha256_impl_entry& impl : impls)
+		if (impl.supported && (!forced || !strcmp(forced, impl.name)))
+			return impl;
+	printf("RELAY_SHA256_IMPL=%s isn't supported here, using the default\n", forced);
+	for (const sha256_impl_entry& impl : impls)
+		if (impl.supported)
+			return impl;
+	return impls[3];
+}
+
+static inline void SHA256(void *input, uint32_t state[8], uint64_t blocks) {
+	static const sha256_fn selected = select_sha256().fn;
+	selected(input, state, blocks);
+}
+
+const char* sha256_impl() {
+	return select_sha256().name;
+}
+#else
+const char* sha256_impl() {
+	return "generic";
+}
 #endif
 
 void static inline WriteBE64(unsigned char *ptr, uint64_t x) {
@@ -295,7 +360,7 @@ void static inline sha256_done(unsigned char* res, uint32_t state[8]) {
 }
 
 void double_sha256(const unsigned char* input, unsigned char* res, uint64_t byte_count) {
-#ifndef SHA256
+#ifndef SHA256_ASM
 	CSHA256 hash;
 	if (byte_count)
 		hash.Write(input, byte_count);
@@ -328,7 +393,7 @@ void double_sha256(const unsigned char* input, unsigned char* res, uint64_t byte
 }
 
 void double_sha256_two_32_inputs(const unsigned char* input, const unsigned char* input2, unsigned char* res) {
-#ifndef SHA256
+#ifndef SHA256_ASM
 	CSHA256 hash;
 	hash.Write(input, 32).Write(input2, 32).Finalize(res);
 	hash.Reset().Write(res, 32).Finalize(res);
@@ -358,7 +423,7 @@ void double_sha256_two_32_inputs(const unsigned char* input, const unsigned char
 }
 
 void double_sha256_init(uint32_t state[8]) {
-#ifndef SHA256
+#ifndef SHA256_ASM
 	CSHA256 hash;
 	for (uint8_t i = 0; i < 8; i++)
 		state[i] = hash.s[i];
@@ -369,7 +434,7 @@ void double_sha256_init(uint32_t state[8]) {
 
 void double_sha256_step(const unsigned char* input, uint64_t byte_count, uint32_t state[8]) {
 	assert(byte_count % 64 == 0);
-#ifndef SHA256
+#ifndef SHA256_ASM
 	if (byte_count) {
 		CSHA256 hash;
 		for (uint8_t i = 0; i < 8; i++)
@@ -385,7 +450,7 @@ void double_sha256_step(const unsigned char* input, uint64_t byte_count, uint32_
 
 void double_sha256_done(const unsigned char* input, uint64_t byte_count, uint64_t total_byte_count, uint32_t state[8]) {
 	assert((total_byte_count - byte_count) % 64 == 0);
-#ifndef SHA256
+#ifndef SHA256_ASM
 	CSHA256 hash;
 	if ((total_byte_count - byte_count) != 0) {
 		for (uint8_t i = 0; i < 8; i++)
@@ -399,7 +464,8 @@ void double_sha256_done(const unsigned char* input, uint64_t byte_count, uint64_
 #else
 	uint64_t pad_count = 1 + ((119 - (total_byte_count % 64)) % 64);
 	assert(1 + ((119 - (byte_count % 64)) % 64) == pad_count);
-	unsigned char data[byte_count + pad_count + 8];
+	assert(byte_count < 64); // Everything before the last partial block went through double_sha256_step
+	unsigned char data[128];
 
 	memcpy(data, input, byte_count);
 	data[byte_count] = 0x80;
@@ -420,11 +486,167 @@ void double_sha256_done(const unsigned char* input, uint64_t byte_count, uint64_
 #endif
 }
 
+static const uint32_t sha256_iv[8] = { 0x6a09e667ul, 0xbb67ae85ul, 0x3c6ef372ul, 0xa54ff53aul, 0x510e527ful, 0x9b05688cul, 0x1f83d9abul, 0x5be0cd19ul };
+
+// Double-SHA256s messages 0..n-1 over sha256_lanes() lanes at once. Each lane takes the next
+// message as soon as it finishes its last one, so messages of different lengths don't hold each
+// other up.
+template<typename Messages>
+static void double_sha256_lanes(const Messages& msgs, size_t n) {
+	struct Lane {
+		size_t msg;
+		const unsigned char* data;
+		uint64_t full_blocks, blocks, next_block; // blocks includes the one block of the second hash
+		unsigned char tail[128]; // The padded end of the message
+		unsigned char second[64]; // The second hash's input
+	};
+
+	const size_t lanes = sha256_lanes();
+	Lane lane[SHA256_MAX_LANES];
+	uint32_t state[8][SHA256_MAX_LANES];
+	const unsigned char* blocks[SHA256_MAX_LANES];
+
+	size_t next_msg = 0, active = 0;
+	const auto fill = [&](size_t l) {
+		Lane& L = lane[l];
+		L.msg = next_msg++;
+		L.data = msgs.data(L.msg);
+		uint64_t len = msgs.size(L.msg);
+		L.full_blocks = len / 64;
+
+		uint64_t rem = len % 64, tail_size = rem + 9 <= 64 ? 64 : 128;
+		memcpy(L.tail, L.data + L.full_blocks * 64, rem);
+		L.tail[rem] = 0x80;
+		memset(L.tail + rem + 1, 0, tail_size - rem - 1 - 8);
+		WriteBE64(L.tail + tail_size - 8, len << 3);
+
+		L.blocks = L.full_blocks + tail_size / 64 + 1;
+		L.next_block = 0;
+		for (uint8_t i = 0; i < 8; i++)
+			state[i][l] = sha256_iv[i];
+	};
+
+	for (size_t l = 0; l < lanes; l++) {
+		if (next_msg < n) {
+			fill(l);
+			active++;
+		} else
+			lane[l].msg = n;
+	}
+
+	while (active) {
+		for (size_t l = 0; l < lanes; l++) {
+			Lane& L = lane[l];
+			if (L.msg == n) {
+				blocks[l] = L.tail; // Idle lane, result ignored
+				continue;
+			}
+
+			if (L.next_block < L.full_blocks)
+				blocks[l] = L.data + L.next_block * 64;
+			else if (L.next_block < L.blocks - 1)
+				blocks[l] = L.tail + (L.next_block - L.full_blocks) * 64;
+			else {
+				for (uint8_t i = 0; i < 8; i++) {
+					WriteBE32(L.second + i*4, state[i][l]);
+					state[i][l] = sha256_iv[i];
+				}
+				L.second[32] = 0x80;
+				memset(L.second + 33, 0, 64 - 33 - 8);
+				WriteBE64(L.second + 64 - 8, 32 << 3);
+				blocks[l] = L.second;
+			}
+			L.next_block++;
+		}
+
+		sha256_transform_lanes(state, blocks);
+
+		for (size_t l = 0; l < lanes; l++) {
+			Lane& L = lane[l];
+			if (L.msg == n || L.next_block != L.blocks)
+				continue;
+
+			unsigned char* res = msgs.result(L.msg);
+			for (uint8_t i = 0; i < 8; i++)
+				WriteBE32(res + i*4, state[i][l]);
+
+			if (next_msg < n)
+				fill(l);
+			else {
+				L.msg = n;
+				active--;
+			}
+		}
+	}
+}
+
+void double_sha256_64byte_batch(const unsigned char* inputs, unsigned char* outputs, size_t n) {
+	if (sha256_lanes() == 1) {
+		for (size_t i = 0; i < n; i++)
+			double_sha256_two_32_inputs(inputs + i*64, inputs + i*64 + 32, outputs + i*32);
+		return;
+	}
+
+	// Every message takes the same number of blocks and lanes are filled in order, so each input
+	// is read (in its first block) before the result of any later message is written
+	struct {
+		const unsigned char* inputs;
+		unsigned char* outputs;
+		const unsigned char* data(size_t i) const { return inputs + i*64; }
+		uint64_t size(size_t i) const { return 64; }
+		unsigned char* result(size_t i) const { return outputs + i*32; }
+	} msgs = { inputs, outputs };
+	double_sha256_lanes(msgs, n);
+}
+
+void double_sha256_batch(const unsigned char* const* inputs, const uint64_t* byte_counts, unsigned char* const* results, size_t n) {
+	if (sha256_lanes() == 1) {
+		for (size_t i = 0; i < n; i++)
+			double_sha256(inputs[i], results[i], byte_counts[i]);
+		return;
+	}
+
+	struct {
+		const unsigned char* const* inputs;
+		const uint64_t* byte_counts;
+		unsigned char* const* results;
+		const unsigned char* data(size_t i) const { return inputs[i]; }
+		uint64_t size(size_t i) const { return byte_counts[i]; }
+		unsigned char* result(size_t i) const { return results[i]; }
+	} msgs = { inputs, byte_counts, results };
+	double_sha256_lanes(msgs, n);
+}
+
 void getblockhash(std::vector<unsigned char>& hashRes, const std::vector<unsigned char>& block, size_t offset) {
 	assert(hashRes.size() == 32);
 	return double_sha256(&block[offset], &hashRes[0], 80);
 }
 
+bool check_header_pow(const unsigned char* header, const unsigned char* hash) {
+	for (int i = 25; i < 32; i++)
+		if (hash[i])
+			return false;
+
+	uint32_t bits = header[72] | (header[73] << 8) | (header[74] << 16) | (uint32_t(header[75]) << 24);
+	uint32_t exponent = bits >> 24, mantissa = bits & 0x007fffff;
+	if ((bits & 0x00800000) || !mantissa || exponent < 3 || exponent > 32)
+		return false; // Negative, zero, a fraction of a byte or overflowing
+
+	// The target is mantissa * 256^(exponent - 3), and hash is little-endian
+	unsigned char target[35];
+	memset(target, 0, sizeof(target));
+	target[exponent - 3] = mantissa;
+	target[exponent - 2] = mantissa >> 8;
+	target[exponent - 1] = mantissa >> 16;
+	for (int i = 34; i >= 32; i--)
+		if (target[i])
+			return true; // Anything under the minimum meets it
+	for (int i = 31; i >= 0; i--)
+		if (hash[i] != target[i])
+			return hash[i] < target[i];
+	return true;
+}
+
 class not_hex : public std::exception {};
 static inline unsigned char h2c(char c) {
 	if (c >= '0' && c <= '9') return c - '0';
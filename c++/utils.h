@@ -62,6 +62,11 @@ struct relay_msg_header {
 
 #define RELAY_MAGIC_BYTES htonl(0xF2BEEF42)
 #define VERSION_STRING "spammy memeater"
+#define CUT_THROUGH_VERSION_STRING "spammy cutthrough"
+// VERSION_STRING with blocks' tx indexes delta-encoded, see RelayNodeCompressor::encode_tx()
+#define COMPACT_VERSION_STRING "spammy compact"
+// Appended to the version string by clients which kept their tx cache and want it resynced
+#define RESYNC_VERSION_SUFFIX " resync"
 #define MAX_RELAY_TRANSACTION_BYTES 100000
 #define MAX_FAS_TOTAL_SIZE 5000000
 
@@ -73,6 +78,16 @@ struct relay_msg_header {
 // Limit outbound to avg 2Mbps worst-case (2Mb / 1000 ms)
 #define OUTBOUND_THROTTLE_BYTES_PER_MS 250
 
+// mempoolserver sends its clients a stream of 32-byte txids, and reads 42-byte records from them.
+// A client which knows where it got up to starts with a record of MEMPOOL_RESUME_MAGIC, the
+// server's epoch and the position of the next txid it wants (8 bytes each, little-endian), and
+// zeros. The server answers with a 32-byte record of MEMPOOL_SYNC_MAGIC, its epoch, the position of
+// the txid which follows and zeros, then only the txids the client is missing (or all of them if it
+// can't tell). Old servers ignore the resume record and send all of their txids, with no sync record.
+#define MEMPOOL_RESUME_MAGIC "mpresume"
+#define MEMPOOL_SYNC_MAGIC "mpsync!!"
+#define MEMPOOL_RECORD_SIZE 42
+
 
 
 #define BITCOIN_MAGIC htonl(0xf9beb4d9)
@@ -126,7 +141,7 @@ static_assert(sizeof(struct bitcoin_version_start) == 4 + 8 + 8 + 26 + 26 + 8 +
  ***************************/
 class read_exception : std::exception {};
 inline void move_forward(std::vector<unsigned char>::const_iterator& it, size_t i, const std::vector<unsigned char>::const_iterator& end) {
-	if (unlikely(it > end-i))
+	if (unlikely(size_t(end - it) < i))
 		throw read_exception();
 	std::advance(it, i);
 }
@@ -138,7 +153,8 @@ std::vector<unsigned char> varint(uint32_t size);
  ***********************/
 ssize_t read_all(int filedes, char *buf, size_t nbyte);
 ssize_t send_all(int filedes, const char *buf, size_t nbyte);
-std::string gethostname(struct sockaddr_in6 *addr);
+// "address/reverse DNS name", without the name if the lookup fails or reverse_lookup isn't set
+std::string gethostname(struct sockaddr_in6 *addr, bool reverse_lookup=true);
 bool lookup_address(const char* addr, struct sockaddr_in6* res);
 bool lookup_cname(const char* host, std::string& cname);
 void prepare_message(const char* command, unsigned char* headerAndData, size_t datalen);
@@ -149,11 +165,22 @@ int create_connect_socket(const std::string& serverHost, const uint16_t serverPo
  *********************/
 void double_sha256(const unsigned char* input, unsigned char* res, uint64_t byte_count);
 void double_sha256_two_32_inputs(const unsigned char* input, const unsigned char* input2, unsigned char* res);
+// Hash many independent messages at once, using SIMD lanes where the CPU has them.
+// 64byte_batch hashes inputs[64*i..64*i+63] into outputs[32*i..32*i+31], and outputs may overlap
+// inputs as long as outputs <= inputs (eg to hash a merkle tree row in place)
+void double_sha256_64byte_batch(const unsigned char* inputs, unsigned char* outputs, size_t n);
+void double_sha256_batch(const unsigned char* const* inputs, const uint64_t* byte_counts, unsigned char* const* results, size_t n);
 void getblockhash(std::vector<unsigned char>& hashRes, const std::vector<unsigned char>& block, size_t offset);
+// Whether hash (of the 80-byte header) meets both the target in header's nBits and our own minimum
+// of 2^200 (so that a header can't just pick a trivial target)
+bool check_header_pow(const unsigned char* header, const unsigned char* hash);
 
 void double_sha256_init(uint32_t state[8]);
 void double_sha256_step(const unsigned char* input, uint64_t byte_count, uint32_t state[8]);
 void double_sha256_done(const unsigned char* input, uint64_t byte_count, uint64_t total_byte_count, uint32_t state[8]);
+// The SHA-256 implementation double_sha256 and friends use (picked for this CPU at runtime, unless
+// overridden with RELAY_SHA256_IMPL=rorx|avx|sse4|generic)
+const char* sha256_impl();
 
 /********************
  *** Random stuff ***
@@ -196,37 +223,4 @@ void do_assert(bool flag, const char* file, unsigned long line);
 			ms); \
 	} while(0)
 
-/****************************************************************
- *** A mutex that gives acess to the count of waiting threads ***
- ****************************************************************/
-class WaitCountMutex {
-private:
-	std::mutex mutex;
-	std::atomic_int waitCount;
-
-	friend class WaitCountHint;
-public:
-	WaitCountMutex() { waitCount = 0; }
-	void lock() {
-		if (unlikely(!mutex.try_lock())) {
-			waitCount.fetch_add(1, std::memory_order_release);
-			mutex.lock();
-			waitCount.fetch_sub(1, std::memory_order_relaxed);
-		}
-	}
-	bool try_lock() { return mutex.try_lock(); }
-	void unlock() { return mutex.unlock(); }
-	int wait_count() { return waitCount.load(std::memory_order_acquire); }
-};
-
-class WaitCountHint {
-private:
-	WaitCountMutex* mutex;
-public:
-	WaitCountHint(WaitCountMutex& mutexIn)
-		: mutex(&mutexIn)
-		{ mutex->waitCount.fetch_add(1, std::memory_order_release); }
-	~WaitCountHint() { mutex->waitCount.fetch_sub(1, std::memory_order_relaxed); }
-};
-
 #endif